@@ -1,39 +1,369 @@
 // avwrapper.c
 #include "avwrapper.h"
+#include "avwrapper_interrupt.h"
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#include <libavutil/avstring.h>
+#include <libavutil/dict.h>
+#include <libavutil/time.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-// Returns a pointer to AVCodecParameters of the first video stream.
-// Returns NULL on error. You must NOT free the returned pointer.
+static int find_video_stream(const AVFormatContext *fmt_ctx) {
+    for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
+        if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+            return i;
+    }
+    return -1;
+}
+
+static int stream_header_is_complete(const AVCodecParameters *par) {
+    if (par->codec_id == AV_CODEC_ID_NONE)
+        return 0;
+    switch (par->codec_type) {
+    case AVMEDIA_TYPE_VIDEO:
+        return par->width > 0 && par->height > 0;
+    case AVMEDIA_TYPE_AUDIO:
+        return par->sample_rate > 0 && par->channels > 0;
+    default:
+        return 1;
+    }
+}
+
+// True when the container header alone describes the first video stream,
+// or every stream if all_streams is set. Demuxers flagged AVFMTCTX_NOHEADER
+// (e.g. MPEG-TS) only create streams while reading packets, so they always
+// need the full find_stream_info pass.
+static int header_is_complete(const AVFormatContext *fmt_ctx, int all_streams) {
+    if (fmt_ctx->ctx_flags & AVFMTCTX_NOHEADER)
+        return 0;
+    if (all_streams) {
+        for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
+            if (!stream_header_is_complete(fmt_ctx->streams[i]->codecpar))
+                return 0;
+        }
+        return fmt_ctx->nb_streams > 0;
+    }
+    int index = find_video_stream(fmt_ctx);
+    return index >= 0 && stream_header_is_complete(fmt_ctx->streams[index]->codecpar);
+}
+
+typedef struct {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t total_us;
+    atomic_uint_fast64_t max_us;
+    atomic_uint_fast64_t buckets[PROBE_LATENCY_BUCKETS];
+} AtomicHistogram;
+
+// Shared by every probing thread, so updates are lock-free.
+static AtomicHistogram open_latency, find_stream_info_latency;
+
+static void histogram_add(AtomicHistogram *h, int64_t us) {
+    uint64_t v = us > 0 ? (uint64_t)us : 0;
+    int bucket = 0;
+    while (bucket < PROBE_LATENCY_BUCKETS - 1 && v >> (bucket + 1))
+        bucket++;
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total_us, v, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&h->max_us, memory_order_relaxed);
+    while (v > max && !atomic_compare_exchange_weak_explicit(&h->max_us, &max, v,
+                                                             memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+static void histogram_read(AtomicHistogram *h, LatencyHistogram *dst) {
+    dst->count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    dst->total_us = atomic_load_explicit(&h->total_us, memory_order_relaxed);
+    dst->max_us = atomic_load_explicit(&h->max_us, memory_order_relaxed);
+    for (int i = 0; i < PROBE_LATENCY_BUCKETS; i++)
+        dst->buckets[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+}
+
+static void histogram_clear(AtomicHistogram *h) {
+    atomic_store_explicit(&h->count, 0, memory_order_relaxed);
+    atomic_store_explicit(&h->total_us, 0, memory_order_relaxed);
+    atomic_store_explicit(&h->max_us, 0, memory_order_relaxed);
+    for (int i = 0; i < PROBE_LATENCY_BUCKETS; i++)
+        atomic_store_explicit(&h->buckets[i], 0, memory_order_relaxed);
+}
+
+// Copies the probe latency histograms. Probes running concurrently may be
+// partially included.
+void probe_metrics_get(ProbeMetrics *metrics) {
+    histogram_read(&open_latency, &metrics->open);
+    histogram_read(&find_stream_info_latency, &metrics->find_stream_info);
+}
+
+void probe_metrics_reset(void) {
+    histogram_clear(&open_latency);
+    histogram_clear(&find_stream_info_latency);
+}
+
+// Opens filename, or pb if it is not NULL, within the budget given by opts
+// (NULL = libav defaults). The deadline and cancel token of opts are armed in
+// mi, which must outlive *fmt_ctx. On failure *fmt_ctx is left NULL or open,
+// close it with close_probe_input. A custom pb stays owned by the caller.
+static int open_probe_input(AVFormatContext **fmt_ctx, const char *filename, AVIOContext *pb,
+                            const ProbeOptions *opts, int all_streams, MediaInterrupt *mi, ProbeStats *stats) {
+    media_interrupt_init(mi, opts ? opts->timeout_us : 0, opts ? opts->cancel : NULL, NULL);
+    AVFormatContext *ctx = media_interrupt_alloc_context(mi);
+    if (!ctx)
+        return AVERROR(ENOMEM);
+    if (pb) {
+        ctx->pb = pb;
+        ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+        filename = "";
+    }
+    if (opts && opts->probesize > 0)
+        ctx->probesize = opts->probesize;
+    if (opts && opts->analyzeduration > 0)
+        ctx->max_analyze_duration = opts->analyzeduration;
+
+    // avformat_open_input frees ctx on failure
+    int64_t start = av_gettime_relative();
+    int ret = media_interrupt_result(mi, avformat_open_input(&ctx, filename, NULL, NULL));
+    int64_t elapsed = av_gettime_relative() - start;
+    histogram_add(&open_latency, elapsed);
+    if (stats)
+        stats->open_us = elapsed;
+    if (ret < 0) {
+        fprintf(stderr, "Could not open input file '%s'\n", pb ? "<custom io>" : filename);
+        return ret;
+    }
+    *fmt_ctx = ctx;
+
+    if (opts && opts->header_only && header_is_complete(ctx, all_streams))
+        return 0;
+
+    if (stats)
+        stats->found_stream_info = 1;
+    start = av_gettime_relative();
+    ret = media_interrupt_result(mi, avformat_find_stream_info(ctx, NULL));
+    elapsed = av_gettime_relative() - start;
+    histogram_add(&find_stream_info_latency, elapsed);
+    if (stats)
+        stats->find_stream_info_us = elapsed;
+    if (ret < 0) {
+        fprintf(stderr, "Could not find stream information\n");
+        return ret;
+    }
+    return 0;
+}
+
+static void close_probe_input(AVFormatContext **fmt_ctx, ProbeStats *stats) {
+    if (!*fmt_ctx)
+        return;
+    if (stats && (*fmt_ctx)->pb)
+        stats->bytes_read = (*fmt_ctx)->pb->bytes_read;
+    avformat_close_input(fmt_ctx);
+}
+
+// Opens filename and locates its first video stream.
+// Returns the stream index, or a negative AVERROR with *fmt_ctx possibly open.
+static int probe_open_video(AVFormatContext **fmt_ctx, const char *filename, AVIOContext *pb,
+                            const ProbeOptions *opts, MediaInterrupt *mi, ProbeStats *stats) {
+    int ret = open_probe_input(fmt_ctx, filename, pb, opts, 0, mi, stats);
+    if (ret < 0)
+        return ret;
+
+    int index = find_video_stream(*fmt_ctx);
+    if (index < 0) {
+        fprintf(stderr, "No video stream found in file '%s'\n", pb ? "<custom io>" : filename);
+        return AVERROR_STREAM_NOT_FOUND;
+    }
+    return index;
+}
+
+// Returns a copy of the AVCodecParameters of the first video stream, running
+// the full avformat_find_stream_info pass. Returns NULL on error.
+// Release the result with free_codec_parameters.
 AVCodecParameters* get_video_codec_parameters(const char *filename) {
+    return get_video_codec_parameters_ex(filename, NULL, NULL);
+}
+
+// Like get_video_codec_parameters, but bounded by opts and optionally
+// reporting bytes read and wall time in stats. Both may be NULL.
+AVCodecParameters* get_video_codec_parameters_ex(const char *filename, const ProbeOptions *opts, ProbeStats *stats) {
     AVFormatContext *fmt_ctx = NULL;
+    AVCodecParameters *result = NULL;
+    MediaInterrupt mi;
+    int64_t start = av_gettime_relative();
+
+    if (stats)
+        memset(stats, 0, sizeof(*stats));
 
-    if (avformat_open_input(&fmt_ctx, filename, NULL, NULL) != 0) {
-        fprintf(stderr, "Could not open input file '%s'\n", filename);
-        return NULL;
+    int index = probe_open_video(&fmt_ctx, filename, NULL, opts, &mi, stats);
+    if (index >= 0) {
+        // codecpar is owned by fmt_ctx and freed with it, hand out a copy
+        result = avcodec_parameters_alloc();
+        if (result && avcodec_parameters_copy(result, fmt_ctx->streams[index]->codecpar) < 0)
+            avcodec_parameters_free(&result);
     }
 
-    if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
-        fprintf(stderr, "Could not find stream information\n");
-        avformat_close_input(&fmt_ctx);
-        return NULL;
+    close_probe_input(&fmt_ctx, stats);
+    if (stats)
+        stats->wall_time_us = av_gettime_relative() - start;
+    return result;
+}
+
+static void snapshot_from_stream(CodecSnapshot *dst, const AVStream *st) {
+    const AVCodecParameters *par = st->codecpar;
+
+    memset(dst, 0, sizeof(*dst));
+    dst->bit_rate = par->bit_rate;
+    dst->channel_layout = par->channel_layout;
+    dst->codec_type = par->codec_type;
+    dst->codec_id = par->codec_id;
+    dst->codec_tag = par->codec_tag;
+    dst->format = par->format;
+    dst->bits_per_coded_sample = par->bits_per_coded_sample;
+    dst->bits_per_raw_sample = par->bits_per_raw_sample;
+    dst->profile = par->profile;
+    dst->level = par->level;
+    dst->width = par->width;
+    dst->height = par->height;
+    dst->sample_aspect_ratio_num = par->sample_aspect_ratio.num;
+    dst->sample_aspect_ratio_den = par->sample_aspect_ratio.den;
+    dst->frame_rate_num = st->avg_frame_rate.num;
+    dst->frame_rate_den = st->avg_frame_rate.den;
+    dst->field_order = par->field_order;
+    dst->color_range = par->color_range;
+    dst->color_primaries = par->color_primaries;
+    dst->color_trc = par->color_trc;
+    dst->color_space = par->color_space;
+    dst->chroma_location = par->chroma_location;
+    dst->video_delay = par->video_delay;
+    dst->channels = par->channels;
+    dst->sample_rate = par->sample_rate;
+    dst->block_align = par->block_align;
+    dst->frame_size = par->frame_size;
+    dst->initial_padding = par->initial_padding;
+    dst->trailing_padding = par->trailing_padding;
+    dst->seek_preroll = par->seek_preroll;
+}
+
+static int probe_snapshot(const char *filename, AVIOContext *pb, const ProbeOptions *opts,
+                          CodecSnapshot *snapshot, ProbeStats *stats) {
+    AVFormatContext *fmt_ctx = NULL;
+    MediaInterrupt mi;
+    int64_t start = av_gettime_relative();
+
+    if (stats)
+        memset(stats, 0, sizeof(*stats));
+
+    int ret = probe_open_video(&fmt_ctx, filename, pb, opts, &mi, stats);
+    if (ret >= 0) {
+        snapshot_from_stream(snapshot, fmt_ctx->streams[ret]);
+        ret = 0;
     }
 
+    close_probe_input(&fmt_ctx, stats);
+    if (stats)
+        stats->wall_time_us = av_gettime_relative() - start;
+    return ret;
+}
+
+// Probes the first video stream into a caller-provided snapshot, so nothing
+// is allocated for the result. Returns 0 on success or a negative AVERROR.
+int probe_video_snapshot(const char *filename, const ProbeOptions *opts, CodecSnapshot *snapshot, ProbeStats *stats) {
+    return probe_snapshot(filename, NULL, opts, snapshot, stats);
+}
+
+// Same as probe_video_snapshot, reading from a context opened with one of
+// the media_io_open_* functions. pb is not closed.
+int probe_video_snapshot_io(AVIOContext *pb, const ProbeOptions *opts, CodecSnapshot *snapshot, ProbeStats *stats) {
+    return probe_snapshot(NULL, pb, opts, snapshot, stats);
+}
+
+// Returns the static libav name of codec_id, e.g. "h264".
+const char* get_codec_name(int32_t codec_id) {
+    return avcodec_get_name((enum AVCodecID)codec_id);
+}
+
+static int64_t rescale_to_us(int64_t ts, AVRational time_base) {
+    return ts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : av_rescale_q(ts, time_base, AV_TIME_BASE_Q);
+}
+
+static void copy_tag(char *dst, size_t size, AVDictionary *metadata, const char *key) {
+    AVDictionaryEntry *tag = av_dict_get(metadata, key, NULL, 0);
+    av_strlcpy(dst, tag ? tag->value : "", size);
+}
+
+static MediaInfo* read_media_info(const char *filename, AVIOContext *pb,
+                                  const ProbeOptions *opts, ProbeStats *stats) {
+    AVFormatContext *fmt_ctx = NULL;
+    MediaInfo *info = NULL;
+    MediaInterrupt mi;
+    int64_t start = av_gettime_relative();
+
+    if (stats)
+        memset(stats, 0, sizeof(*stats));
+
+    if (open_probe_input(&fmt_ctx, filename, pb, opts, 1, &mi, stats) < 0)
+        goto end;
+
+    info = calloc(1, sizeof(*info) + fmt_ctx->nb_streams * sizeof(MediaStreamInfo));
+    if (!info)
+        goto end;
+
+    info->duration_us = fmt_ctx->duration;
+    info->start_time_us = fmt_ctx->start_time;
+    info->bit_rate = fmt_ctx->bit_rate;
+    info->nb_streams = fmt_ctx->nb_streams;
+    av_strlcpy(info->format_name, fmt_ctx->iformat->name, sizeof(info->format_name));
+    copy_tag(info->title, sizeof(info->title), fmt_ctx->metadata, "title");
+    copy_tag(info->artist, sizeof(info->artist), fmt_ctx->metadata, "artist");
+    copy_tag(info->album, sizeof(info->album), fmt_ctx->metadata, "album");
+    copy_tag(info->genre, sizeof(info->genre), fmt_ctx->metadata, "genre");
+    copy_tag(info->date, sizeof(info->date), fmt_ctx->metadata, "date");
+    copy_tag(info->comment, sizeof(info->comment), fmt_ctx->metadata, "comment");
+    copy_tag(info->encoder, sizeof(info->encoder), fmt_ctx->metadata, "encoder");
+    copy_tag(info->creation_time, sizeof(info->creation_time), fmt_ctx->metadata, "creation_time");
+
     for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
-        AVCodecParameters *codecpar = fmt_ctx->streams[i]->codecpar;
-        if (codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-            // Do NOT free codecpar — it's owned by fmt_ctx
-            avformat_close_input(&fmt_ctx); // Optional: remove to use fmt_ctx elsewhere
-            return codecpar;
-        }
+        const AVStream *st = fmt_ctx->streams[i];
+        MediaStreamInfo *si = &info->streams[i];
+
+        snapshot_from_stream(&si->codec, st);
+        si->start_time_us = rescale_to_us(st->start_time, st->time_base);
+        si->duration_us = rescale_to_us(st->duration, st->time_base);
+        si->nb_frames = st->nb_frames;
+        si->index = st->index;
+        si->disposition = st->disposition;
+        si->time_base_num = st->time_base.num;
+        si->time_base_den = st->time_base.den;
+        av_strlcpy(si->codec_name, avcodec_get_name(st->codecpar->codec_id), sizeof(si->codec_name));
+        copy_tag(si->language, sizeof(si->language), st->metadata, "language");
     }
 
-    fprintf(stderr, "No video stream found in file '%s'\n", filename);
-    avformat_close_input(&fmt_ctx);
-    return NULL;
+end:
+    close_probe_input(&fmt_ctx, stats);
+    if (stats)
+        stats->wall_time_us = av_gettime_relative() - start;
+    return info;
+}
+
+// Opens filename once and returns format-level information and every
+// stream in one allocation. With opts->header_only, find_stream_info is
+// skipped only if the header describes all streams. Returns NULL on error.
+// Release the result with free_media_info.
+MediaInfo* get_media_info(const char *filename, const ProbeOptions *opts, ProbeStats *stats) {
+    return read_media_info(filename, NULL, opts, stats);
+}
+
+// Same as get_media_info, reading from a context opened with one of the
+// media_io_open_* functions. pb is not closed.
+MediaInfo* get_media_info_io(AVIOContext *pb, const ProbeOptions *opts, ProbeStats *stats) {
+    return read_media_info(NULL, pb, opts, stats);
 }
 
 void free_codec_parameters(AVCodecParameters* params) {
     avcodec_parameters_free(&params);
 }
+
+void free_media_info(MediaInfo *info) {
+    free(info);
+}
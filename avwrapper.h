@@ -2,9 +2,196 @@
 #ifndef AVWRAPPER_H
 #define AVWRAPPER_H
 
+#include <stdint.h>
 #include <libavcodec/avcodec.h>
+#include <libavformat/avio.h>
+#include <libavutil/error.h>
+
+// Cancellation token for probes and conversions, see avwrapper_interrupt.c.
+// media_cancel may be called from any thread while calls using the token
+// run; they stop at the next read or write and fail with AVERROR_EXIT
+// (CONVERT_CANCELLED for conversions). Free it once no call uses it.
+typedef struct MediaCancel MediaCancel;
+
+MediaCancel* media_cancel_create(void);
+void media_cancel(MediaCancel *cancel);
+void media_cancel_free(MediaCancel *cancel);
+
+// Returned by a probe that ran past ProbeOptions.timeout_us.
+#define MEDIA_TIMEOUT AVERROR(ETIMEDOUT)
+
+// Probe budget. A zeroed struct keeps the libav defaults and always runs
+// avformat_find_stream_info, which is what get_video_codec_parameters does.
+typedef struct {
+    int64_t probesize;       // max bytes read while probing, 0 = libav default
+    int64_t analyzeduration; // max stream time analyzed in microseconds, 0 = libav default
+    int header_only;         // skip avformat_find_stream_info if the header has codec, width and height
+    int64_t timeout_us;      // wall clock limit of the whole probe, 0 = none; past it the probe fails with MEDIA_TIMEOUT
+    MediaCancel *cancel;     // fails the probe with AVERROR_EXIT once cancelled, may be NULL
+} ProbeOptions;
+
+// Cost of a single probe, filled when a ProbeStats pointer is passed.
+typedef struct {
+    int64_t bytes_read;      // bytes the demuxer pulled from the input
+    int64_t wall_time_us;    // open to close, in microseconds
+    int found_stream_info;   // 1 if avformat_find_stream_info was run
+    int cache_hit;           // 1 if served by a ProbeCache without opening the file
+    int64_t open_us;         // time spent in avformat_open_input
+    int64_t find_stream_info_us; // time spent in avformat_find_stream_info, 0 if skipped
+} ProbeStats;
+
+#define PROBE_LATENCY_BUCKETS 32
+
+// Log2 latency histogram: buckets[i] counts calls that took 2^i to
+// 2^(i+1)-1 microseconds, bucket 0 includes 0 and the last one everything
+// longer.
+typedef struct {
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t buckets[PROBE_LATENCY_BUCKETS];
+} LatencyHistogram;
+
+// Process-wide latency of the probe phases, over every probe since start
+// or the last probe_metrics_reset. Cache hits are not counted.
+typedef struct {
+    LatencyHistogram open;             // avformat_open_input
+    LatencyHistogram find_stream_info; // avformat_find_stream_info
+} ProbeMetrics;
+
+// Scalar fields of AVCodecParameters in a fixed layout without pointers, so
+// it can be stored in the probe cache file and mirrored by other languages.
+// frame_rate comes from the stream, as AVCodecParameters has none.
+typedef struct {
+    int64_t bit_rate;
+    uint64_t channel_layout;
+    int32_t codec_type;
+    int32_t codec_id;
+    uint32_t codec_tag;
+    int32_t format;
+    int32_t bits_per_coded_sample;
+    int32_t bits_per_raw_sample;
+    int32_t profile;
+    int32_t level;
+    int32_t width;
+    int32_t height;
+    int32_t sample_aspect_ratio_num;
+    int32_t sample_aspect_ratio_den;
+    int32_t frame_rate_num;
+    int32_t frame_rate_den;
+    int32_t field_order;
+    int32_t color_range;
+    int32_t color_primaries;
+    int32_t color_trc;
+    int32_t color_space;
+    int32_t chroma_location;
+    int32_t video_delay;
+    int32_t channels;
+    int32_t sample_rate;
+    int32_t block_align;
+    int32_t frame_size;
+    int32_t initial_padding;
+    int32_t trailing_padding;
+    int32_t seek_preroll;
+} CodecSnapshot;
+
+#define MEDIAINFO_TAG_SIZE 128
+
+// One stream of a MediaInfo. Timestamps are in microseconds,
+// AV_NOPTS_VALUE when unknown.
+typedef struct {
+    CodecSnapshot codec;
+    int64_t start_time_us;
+    int64_t duration_us;
+    int64_t nb_frames;        // 0 if unknown
+    int32_t index;
+    int32_t disposition;      // AV_DISPOSITION_* flags
+    int32_t time_base_num;
+    int32_t time_base_den;
+    char codec_name[32];
+    char language[16];
+} MediaStreamInfo;
+
+// Format-level information plus every stream, in a single allocation
+// released with free_media_info. Tags are empty strings when absent.
+typedef struct {
+    int64_t duration_us;      // AV_NOPTS_VALUE if unknown
+    int64_t start_time_us;    // AV_NOPTS_VALUE if unknown
+    int64_t bit_rate;         // container bitrate, 0 if unknown
+    int32_t nb_streams;
+    int32_t reserved;
+    char format_name[64];
+    char title[MEDIAINFO_TAG_SIZE];
+    char artist[MEDIAINFO_TAG_SIZE];
+    char album[MEDIAINFO_TAG_SIZE];
+    char genre[MEDIAINFO_TAG_SIZE];
+    char date[MEDIAINFO_TAG_SIZE];
+    char comment[MEDIAINFO_TAG_SIZE];
+    char encoder[MEDIAINFO_TAG_SIZE];
+    char creation_time[MEDIAINFO_TAG_SIZE];
+    MediaStreamInfo streams[];
+} MediaInfo;
+
+// Caller-provided input, see avwrapper_io.c. read returns the number of
+// bytes read, 0 at end of stream or a negative error. seek follows lseek()
+// and must also answer AVSEEK_SIZE, or be NULL for non-seekable input.
+typedef struct {
+    void *opaque;
+    int (*read)(void *opaque, uint8_t *buf, int size);
+    int64_t (*seek)(void *opaque, int64_t offset, int whence);
+} MediaReader;
+
+// Caller-provided output, see avwrapper_io.c. write consumes all size bytes
+// and returns a negative error on failure. The stream is not seekable, so
+// MP4 written to it must be fragmented.
+typedef struct {
+    void *opaque;
+    int (*write)(void *opaque, const uint8_t *buf, int size);
+} MediaWriter;
+
+AVIOContext* media_io_open_reader(const MediaReader *reader);
+AVIOContext* media_io_open_writer(const MediaWriter *writer);
+AVIOContext* media_io_open_memory(const uint8_t *data, size_t size);
+AVIOContext* media_io_open_mmap(const char *filename);
+void media_io_close(AVIOContext **pb);
 
 AVCodecParameters* get_video_codec_parameters(const char *filename);
+AVCodecParameters* get_video_codec_parameters_ex(const char *filename, const ProbeOptions *opts, ProbeStats *stats);
+int probe_video_snapshot(const char *filename, const ProbeOptions *opts, CodecSnapshot *snapshot, ProbeStats *stats);
+int probe_video_snapshot_io(AVIOContext *pb, const ProbeOptions *opts, CodecSnapshot *snapshot, ProbeStats *stats);
+const char* get_codec_name(int32_t codec_id);
+MediaInfo* get_media_info(const char *filename, const ProbeOptions *opts, ProbeStats *stats);
+MediaInfo* get_media_info_io(AVIOContext *pb, const ProbeOptions *opts, ProbeStats *stats);
 void free_codec_parameters(AVCodecParameters* params);
+void free_media_info(MediaInfo *info);
+void probe_metrics_get(ProbeMetrics *metrics);
+void probe_metrics_reset(void);
+
+// Fixed-size pool of probe threads with a bounded completion queue, see avwrapper_pool.c.
+typedef struct ProbePool ProbePool;
+
+typedef struct {
+    uint64_t id;                 // id passed to probe_pool_submit
+    int status;                  // 0, or the AVERROR of a failed probe
+    CodecSnapshot snapshot;      // valid if status is 0
+    ProbeStats stats;
+} ProbeResult;
+
+ProbePool* probe_pool_create(int nb_threads, int queue_size, const ProbeOptions *opts);
+int probe_pool_submit(ProbePool *pool, const char *filename, uint64_t id);
+int probe_pool_next(ProbePool *pool, ProbeResult *result);
+void probe_pool_close(ProbePool *pool);
+void probe_pool_cancel(ProbePool *pool);
+void probe_pool_destroy(ProbePool *pool);
+
+// Memory-mapped probe result cache keyed by (device, inode, size, mtime), see avwrapper_cache.c.
+typedef struct ProbeCache ProbeCache;
+
+ProbeCache* probe_cache_open(const char *path, uint32_t capacity);
+int probe_cache_lookup(ProbeCache *cache, const char *filename, CodecSnapshot *snapshot);
+int probe_cache_probe(ProbeCache *cache, const char *filename, const ProbeOptions *opts,
+                      CodecSnapshot *snapshot, ProbeStats *stats);
+int probe_cache_compact(ProbeCache *cache, uint32_t max_age_seconds);
+void probe_cache_close(ProbeCache *cache);
 
 #endif
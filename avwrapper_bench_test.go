@@ -0,0 +1,46 @@
+//go:build mediabench
+
+package avwrapper
+
+import (
+    "os"
+    "testing"
+)
+
+// benchInput returns the file the probe benchmarks read, from
+// AVWRAPPER_BENCH_INPUT or else the generated h264_aac.mp4.
+func benchInput(b *testing.B) string {
+    if name := os.Getenv("AVWRAPPER_BENCH_INPUT"); name != "" {
+        return name
+    }
+    return benchMedia(b, "h264_aac.mp4")
+}
+
+// BenchmarkProbeVideo is the current path: one cgo call fills a
+// CodecParameters value, the codec name is interned.
+func BenchmarkProbeVideo(b *testing.B) {
+    name := benchInput(b)
+    opts := &ProbeOptions{HeaderOnly: true}
+    b.ReportAllocs()
+    for i := 0; i < b.N; i++ {
+        p, _, err := ProbeVideo(name, opts)
+        if err != nil {
+            b.Fatal(err)
+        }
+        _ = p.CodecName()
+    }
+}
+
+// BenchmarkProbeVideoPerField is the path before CodecParameters: a C
+// AVCodecParameters per file, read through the pointer and freed by a
+// finalizer, with a cgo call for the codec name.
+func BenchmarkProbeVideoPerField(b *testing.B) {
+    name := benchInput(b)
+    opts := &ProbeOptions{HeaderOnly: true}
+    b.ReportAllocs()
+    for i := 0; i < b.N; i++ {
+        if _, _, err := probeVideoPerField(name, opts); err != nil {
+            b.Fatal(err)
+        }
+    }
+}
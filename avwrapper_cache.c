@@ -0,0 +1,527 @@
+// avwrapper_cache.c
+//
+// Persistent probe result cache. CodecSnapshot records live in an
+// open-addressed hash table inside a memory-mapped file, keyed by
+// (device, inode, size, mtime_ns). A warm lookup is one stat() plus a few
+// loads from the mapping, the media file itself is never opened.
+//
+// A modified file keeps its (device, inode) slot but no longer matches size
+// or mtime, so it misses and the next store overwrites that slot. Files that
+// fail to probe as invalid or without video are cached as well, so they are
+// not re-opened on every rescan.
+//
+// Readers are lock-free: each slot carries a seqlock they retry on, a
+// bounded number of times. Writers serialize with a process-local mutex plus
+// flock() on the file, so several processes can share one cache. A slot left
+// mid-update by a writer that died reads as a miss until a writer holding
+// the lock repairs it. Compaction writes a fresh table to a
+// temporary file, renames it over the cache and flags the old mapping as
+// retired, which makes every process remap on its next access. Creating
+// the file, or replacing one of another version, locks path.lock instead.
+#include "avwrapper.h"
+#include <libavutil/error.h>
+#include <libavutil/time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "AVWPCACH"
+#define CACHE_VERSION 1
+#define CACHE_DEFAULT_CAPACITY 65536
+#define CACHE_MIN_CAPACITY 1024
+#define READ_SLOT_ATTEMPTS 1000
+
+enum { SLOT_EMPTY = 0, SLOT_USED = 1 };
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t capacity;          // slots, power of two
+    uint64_t count;             // used slots, only touched by writers
+    _Atomic uint32_t retired;   // set once a compaction replaced this file
+    uint32_t reserved[7];
+} CacheHeader;
+
+typedef struct {
+    _Atomic uint32_t seq;       // odd while a writer updates the slot
+    uint32_t state;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_ns;
+    int32_t status;             // 0, or the AVERROR of a failed probe
+    _Atomic uint32_t last_seen; // unix seconds of the last hit or store
+    CodecSnapshot snapshot;
+} CacheEntry;
+
+struct ProbeCache {
+    char *path;
+    int fd;
+    CacheHeader *header;
+    CacheEntry *entries;
+    size_t map_size;
+    uint64_t mask;
+    pthread_rwlock_t map_lock;   // shared by every access, exclusive while remapping
+    pthread_mutex_t write_lock;  // serializes writers of this process, flock does the rest
+};
+
+static uint64_t hash_key(uint64_t dev, uint64_t ino) {
+    uint64_t h = ino ^ (dev * 0x9E3779B97F4A7C15ULL);
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static int64_t stat_mtime_ns(const struct stat *st) {
+#if defined(__APPLE__)
+    return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+static size_t table_size(uint64_t capacity) {
+    return sizeof(CacheHeader) + capacity * sizeof(CacheEntry);
+}
+
+static uint64_t round_capacity(uint64_t n) {
+    uint64_t capacity = CACHE_MIN_CAPACITY;
+    while (capacity < n)
+        capacity <<= 1;
+    return capacity;
+}
+
+// Consistent copy of a slot that may be written concurrently by another
+// process. Returns 0 if the slot stays mid-update, e.g. because its writer
+// died between the two stores of write_slot.
+static int read_slot(const CacheEntry *e, CacheEntry *copy) {
+    for (int n = 0; n < READ_SLOT_ATTEMPTS; n++) {
+        uint32_t seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(copy, e, sizeof(*copy));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&e->seq, memory_order_relaxed) == seq)
+            return 1;
+    }
+    return 0;
+}
+
+// Under the writer locks an odd seq can only be left by a writer that died.
+// Its fields may be torn, so a used slot is kept as a stale entry that never
+// matches (the probe chains stay intact) and the next store of its file
+// overwrites it.
+static void repair_slot(CacheEntry *e) {
+    uint32_t seq = atomic_load_explicit(&e->seq, memory_order_relaxed);
+    if (!(seq & 1))
+        return;
+    if (e->state != SLOT_EMPTY) {
+        e->state = SLOT_USED;
+        e->size = -1;
+    }
+    atomic_store_explicit(&e->seq, seq + 1, memory_order_release);
+}
+
+static void write_slot(CacheEntry *e, const CacheEntry *src) {
+    // Odd while writing and even afterwards, even if the slot was left odd
+    uint32_t seq = atomic_load_explicit(&e->seq, memory_order_relaxed) | 1;
+    atomic_store_explicit(&e->seq, seq, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    e->state = src->state;
+    e->dev = src->dev;
+    e->ino = src->ino;
+    e->size = src->size;
+    e->mtime_ns = src->mtime_ns;
+    e->status = src->status;
+    atomic_store_explicit(&e->last_seen, atomic_load_explicit(&src->last_seen, memory_order_relaxed),
+                          memory_order_relaxed);
+    e->snapshot = src->snapshot;
+    atomic_store_explicit(&e->seq, seq + 1, memory_order_release);
+}
+
+// Writes a new table holding the live entries of src (may be NULL) to a
+// temporary file and renames it over path. Entries last seen before
+// min_seen are dropped, and so are slots left mid-update, which the caller
+// holding the writer locks repairs first.
+static int write_table(const char *path, uint64_t capacity,
+                       CacheEntry *src, uint64_t src_capacity, uint32_t min_seen) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid()) >= (int)sizeof(tmp))
+        return AVERROR(ENAMETOOLONG);
+
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return AVERROR(errno);
+    size_t size = table_size(capacity);
+    if (ftruncate(fd, size) < 0) {
+        int ret = AVERROR(errno);
+        close(fd);
+        unlink(tmp);
+        return ret;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        unlink(tmp);
+        return AVERROR(errno);
+    }
+
+    CacheHeader *header = map;
+    CacheEntry *entries = (CacheEntry *)(header + 1);
+    memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+    header->version = CACHE_VERSION;
+    header->entry_size = sizeof(CacheEntry);
+    header->capacity = capacity;
+
+    for (uint64_t i = 0; src && i < src_capacity; i++) {
+        CacheEntry e;
+        repair_slot(&src[i]);
+        if (!read_slot(&src[i], &e) || e.state != SLOT_USED || e.size < 0 ||
+            atomic_load_explicit(&e.last_seen, memory_order_relaxed) < min_seen)
+            continue;
+        uint64_t j = hash_key(e.dev, e.ino) & (capacity - 1);
+        while (entries[j].state != SLOT_EMPTY)
+            j = (j + 1) & (capacity - 1);
+        write_slot(&entries[j], &e);
+        header->count++;
+    }
+    munmap(map, size);
+
+    if (rename(tmp, path) < 0) {
+        int ret = AVERROR(errno);
+        unlink(tmp);
+        return ret;
+    }
+    return 0;
+}
+
+static void unmap_cache(ProbeCache *cache) {
+    if (cache->header)
+        munmap(cache->header, cache->map_size);
+    if (cache->fd >= 0)
+        close(cache->fd);
+    cache->header = NULL;
+    cache->entries = NULL;
+    cache->fd = -1;
+}
+
+static int header_is_valid(const CacheHeader *header, size_t size) {
+    return size >= sizeof(CacheHeader) &&
+           !memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) &&
+           header->version == CACHE_VERSION &&
+           header->entry_size == sizeof(CacheEntry) &&
+           header->capacity && !(header->capacity & (header->capacity - 1)) &&
+           table_size(header->capacity) == size;
+}
+
+// Creates the table, or replaces the incompatible file `found`, under an
+// exclusive flock on path.lock. The table's own flock cannot serialize
+// this, as there is no table yet or it is about to be replaced. A process
+// that waited for the lock finds the file another one wrote and keeps it.
+static int create_table(const char *path, uint64_t capacity, const struct stat *found) {
+    char lock_path[PATH_MAX];
+    if (snprintf(lock_path, sizeof(lock_path), "%s.lock", path) >= (int)sizeof(lock_path))
+        return AVERROR(ENAMETOOLONG);
+    int lock = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock < 0)
+        return AVERROR(errno);
+    flock(lock, LOCK_EX);
+
+    struct stat st;
+    int ret = 0;
+    int exists = stat(path, &st) == 0;
+    if (!exists || (found && st.st_dev == found->st_dev && st.st_ino == found->st_ino))
+        ret = write_table(path, capacity, NULL, 0, 0);
+    flock(lock, LOCK_UN);
+    close(lock);
+    return ret;
+}
+
+// Maps the cache file, creating it (or replacing an incompatible one) with
+// `capacity` slots. Callers hold map_lock exclusively or own the cache.
+static int map_cache(ProbeCache *cache, uint64_t capacity) {
+    for (int attempt = 0; attempt < 3; attempt++) {
+        int fd = open(cache->path, O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            if (errno != ENOENT)
+                return AVERROR(errno);
+            int ret = create_table(cache->path, capacity, NULL);
+            if (ret < 0)
+                return ret;
+            continue;
+        }
+
+        struct stat st = {0}, current;
+        void *map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(CacheHeader))
+            map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED && header_is_valid(map, st.st_size)) {
+            // A file renamed over the path after our open would never be
+            // retired in this mapping, so map the current one instead
+            if (stat(cache->path, &current) < 0 || current.st_dev != st.st_dev || current.st_ino != st.st_ino) {
+                munmap(map, st.st_size);
+                close(fd);
+                continue;
+            }
+            cache->fd = fd;
+            cache->header = map;
+            cache->entries = (CacheEntry *)(cache->header + 1);
+            cache->map_size = st.st_size;
+            cache->mask = cache->header->capacity - 1;
+            return 0;
+        }
+
+        // Unknown layout, e.g. written by another version: start over
+        fprintf(stderr, "Probe cache '%s' is incompatible, recreating it\n", cache->path);
+        if (map != MAP_FAILED)
+            munmap(map, st.st_size);
+        close(fd);
+        int ret = create_table(cache->path, capacity, &st);
+        if (ret < 0)
+            return ret;
+    }
+    return AVERROR(EAGAIN);
+}
+
+// Takes map_lock shared, remapping first if another writer retired the mapping.
+static int acquire_mapping(ProbeCache *cache) {
+    pthread_rwlock_rdlock(&cache->map_lock);
+    if (cache->header && !atomic_load_explicit(&cache->header->retired, memory_order_acquire))
+        return 0;
+    pthread_rwlock_unlock(&cache->map_lock);
+
+    pthread_rwlock_wrlock(&cache->map_lock);
+    int ret = 0;
+    if (!cache->header || atomic_load_explicit(&cache->header->retired, memory_order_acquire)) {
+        uint64_t capacity = cache->header ? cache->header->capacity : CACHE_DEFAULT_CAPACITY;
+        unmap_cache(cache);
+        ret = map_cache(cache, capacity);
+    }
+    pthread_rwlock_unlock(&cache->map_lock);
+    if (ret < 0)
+        return ret;
+    return acquire_mapping(cache);
+}
+
+static void release_mapping(ProbeCache *cache) {
+    pthread_rwlock_unlock(&cache->map_lock);
+}
+
+// Opens or creates the cache at path with room for `capacity` files
+// (0 = 65536, grown on demand). Returns NULL on error.
+ProbeCache* probe_cache_open(const char *path, uint32_t capacity) {
+    ProbeCache *cache = calloc(1, sizeof(*cache));
+    if (!cache)
+        return NULL;
+    cache->fd = -1;
+    cache->path = strdup(path);
+    pthread_rwlock_init(&cache->map_lock, NULL);
+    pthread_mutex_init(&cache->write_lock, NULL);
+
+    // Start at a load factor of 1/2 for the requested size, store_entry
+    // doubles the table once it passes 3/4
+    uint64_t slots = round_capacity(2 * (uint64_t)(capacity ? capacity : CACHE_DEFAULT_CAPACITY / 2));
+    if (!cache->path || map_cache(cache, slots) < 0) {
+        probe_cache_close(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+// Looks up st in the current mapping. Returns 1 on a hit, 0 on a miss or
+// stale entry, or the cached negative AVERROR of a failed probe.
+static int lookup_locked(ProbeCache *cache, const struct stat *st, CodecSnapshot *snapshot) {
+    uint64_t dev = st->st_dev, ino = st->st_ino;
+    uint64_t i = hash_key(dev, ino) & cache->mask;
+
+    for (uint64_t n = 0; n <= cache->mask; n++, i = (i + 1) & cache->mask) {
+        CacheEntry e;
+        // A slot stuck mid-update could hide the entry behind it, so it is a miss
+        if (!read_slot(&cache->entries[i], &e) || e.state == SLOT_EMPTY)
+            return 0;
+        if (e.dev != dev || e.ino != ino)
+            continue;
+        if (e.size != st->st_size || e.mtime_ns != stat_mtime_ns(st))
+            return 0;
+
+        // Coarse recency for compaction, only written when it moved on
+        uint32_t now = (uint32_t)time(NULL);
+        if (now - atomic_load_explicit(&e.last_seen, memory_order_relaxed) > 3600)
+            atomic_store_explicit(&cache->entries[i].last_seen, now, memory_order_relaxed);
+        if (e.status < 0)
+            return e.status;
+        *snapshot = e.snapshot;
+        return 1;
+    }
+    return 0;
+}
+
+// Returns 1 and fills snapshot if filename is cached and unchanged, 0 if it
+// is not, or a negative AVERROR (stat failure or a cached failed probe).
+// The media file is only stat()ed, never opened.
+int probe_cache_lookup(ProbeCache *cache, const char *filename, CodecSnapshot *snapshot) {
+    struct stat st;
+    if (stat(filename, &st) < 0)
+        return AVERROR(errno);
+
+    int ret = acquire_mapping(cache);
+    if (ret < 0)
+        return ret;
+    ret = lookup_locked(cache, &st, snapshot);
+    release_mapping(cache);
+    return ret;
+}
+
+static void lock_writer(ProbeCache *cache) {
+    pthread_mutex_lock(&cache->write_lock);
+    flock(cache->fd, LOCK_EX);
+}
+
+static void unlock_writer(ProbeCache *cache) {
+    flock(cache->fd, LOCK_UN);
+    pthread_mutex_unlock(&cache->write_lock);
+}
+
+// Rewrites the table with `capacity` slots, dropping entries not seen since
+// min_seen. Callers hold the mapping and the writer locks; the mapping is
+// retired afterwards and must be released.
+static int rebuild_locked(ProbeCache *cache, uint64_t capacity, uint32_t min_seen) {
+    int ret = write_table(cache->path, capacity, cache->entries, cache->mask + 1, min_seen);
+    if (ret >= 0)
+        atomic_store_explicit(&cache->header->retired, 1, memory_order_release);
+    return ret;
+}
+
+static int store_entry(ProbeCache *cache, const struct stat *st, int status, const CodecSnapshot *snapshot) {
+    CacheEntry e = {
+        .state = SLOT_USED,
+        .dev = st->st_dev,
+        .ino = st->st_ino,
+        .size = st->st_size,
+        .mtime_ns = stat_mtime_ns(st),
+        .status = status < 0 ? status : 0,
+    };
+    atomic_init(&e.last_seen, (uint32_t)time(NULL));
+    if (status >= 0)
+        e.snapshot = *snapshot;
+
+    for (;;) {
+        int ret = acquire_mapping(cache);
+        if (ret < 0)
+            return ret;
+        lock_writer(cache);
+        if (atomic_load_explicit(&cache->header->retired, memory_order_acquire)) {
+            // Another process compacted while we waited for the lock
+            unlock_writer(cache);
+            release_mapping(cache);
+            continue;
+        }
+
+        // Reuse the slot of this (dev, ino) if present, so a changed file
+        // replaces its stale entry instead of adding a second one
+        uint64_t i = hash_key(e.dev, e.ino) & cache->mask;
+        uint64_t n;
+        for (n = 0; n <= cache->mask; n++, i = (i + 1) & cache->mask) {
+            CacheEntry *slot = &cache->entries[i];
+            repair_slot(slot);
+            if (slot->state == SLOT_EMPTY || (slot->dev == e.dev && slot->ino == e.ino))
+                break;
+        }
+
+        int is_new = n > cache->mask || cache->entries[i].state == SLOT_EMPTY;
+        if (is_new && (cache->header->count + 1) * 4 > (cache->mask + 1) * 3) {
+            ret = rebuild_locked(cache, (cache->mask + 1) * 2, 0);
+            unlock_writer(cache);
+            release_mapping(cache);
+            if (ret < 0)
+                return ret;
+            continue;
+        }
+
+        write_slot(&cache->entries[i], &e);
+        if (is_new)
+            cache->header->count++;
+        unlock_writer(cache);
+        release_mapping(cache);
+        return 0;
+    }
+}
+
+// Returns the cached snapshot of filename, probing with opts and storing the
+// result on a miss. Only definitive failures (invalid data, no video stream)
+// are cached; I/O errors are retried on the next call.
+// Returns 0 on success or a negative AVERROR.
+int probe_cache_probe(ProbeCache *cache, const char *filename, const ProbeOptions *opts,
+                      CodecSnapshot *snapshot, ProbeStats *stats) {
+    int64_t start = av_gettime_relative();
+    struct stat st;
+    if (stat(filename, &st) < 0)
+        return AVERROR(errno);
+
+    // A cache that cannot be mapped is treated as a miss, the probe itself still works
+    int mapped = acquire_mapping(cache);
+    int ret = 0;
+    if (mapped >= 0) {
+        ret = lookup_locked(cache, &st, snapshot);
+        release_mapping(cache);
+    } else {
+        fprintf(stderr, "Probe cache '%s' is unavailable: %s\n", cache->path, av_err2str(mapped));
+    }
+    if (ret != 0) {
+        if (stats) {
+            memset(stats, 0, sizeof(*stats));
+            stats->cache_hit = 1;
+            stats->wall_time_us = av_gettime_relative() - start;
+        }
+        return ret < 0 ? ret : 0;
+    }
+
+    ret = probe_video_snapshot(filename, opts, snapshot, stats);
+    if (mapped >= 0 && (ret >= 0 || ret == AVERROR_INVALIDDATA || ret == AVERROR_STREAM_NOT_FOUND))
+        store_entry(cache, &st, ret, snapshot);
+    return ret;
+}
+
+// Rewrites the cache without entries not seen (looked up or stored) for
+// max_age_seconds (0 = keep all), sized for a load factor of 1/2.
+// Returns 0 on success or a negative AVERROR.
+int probe_cache_compact(ProbeCache *cache, uint32_t max_age_seconds) {
+    int ret = acquire_mapping(cache);
+    if (ret < 0)
+        return ret;
+    lock_writer(cache);
+
+    uint32_t now = (uint32_t)time(NULL);
+    uint32_t min_seen = max_age_seconds && max_age_seconds < now ? now - max_age_seconds : 0;
+    ret = rebuild_locked(cache, round_capacity(2 * cache->header->count), min_seen);
+
+    unlock_writer(cache);
+    release_mapping(cache);
+    return ret;
+}
+
+void probe_cache_close(ProbeCache *cache) {
+    if (!cache)
+        return;
+    unmap_cache(cache);
+    pthread_mutex_destroy(&cache->write_lock);
+    pthread_rwlock_destroy(&cache->map_lock);
+    free(cache->path);
+    free(cache);
+}
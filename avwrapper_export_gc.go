@@ -0,0 +1,98 @@
+package avwrapper
+
+/*
+#include <errno.h>
+#include <stdint.h>
+#include <libavformat/avio.h>
+#include "ff_video_converter.h"
+*/
+import "C"
+import (
+    "io"
+    "runtime/cgo"
+    "unsafe"
+)
+
+// Callbacks invoked by libav through the MediaReader of open_go_reader.
+// opaque is the cgo.Handle of a *goReader.
+
+//export goMediaRead
+func goMediaRead(opaque unsafe.Pointer, buf *C.uint8_t, size C.int) C.int {
+    r := cgo.Handle(uintptr(opaque)).Value().(*goReader)
+    p := unsafe.Slice((*byte)(unsafe.Pointer(buf)), int(size))
+    for {
+        n, err := r.r.Read(p)
+        if n > 0 {
+            return C.int(n)
+        }
+        if err == io.EOF {
+            return 0
+        }
+        if err != nil {
+            r.err = err
+            return -C.EIO
+        }
+        // io.Reader allows (0, nil), ask again
+    }
+}
+
+//export goMediaSeek
+func goMediaSeek(opaque unsafe.Pointer, offset C.int64_t, whence C.int) C.int64_t {
+    r := cgo.Handle(uintptr(opaque)).Value().(*goReader)
+    s := r.r.(io.Seeker)
+    if whence == C.AVSEEK_SIZE {
+        if r.size < 0 {
+            cur, err := s.Seek(0, io.SeekCurrent)
+            if err != nil {
+                return -C.ENOSYS
+            }
+            end, err := s.Seek(0, io.SeekEnd)
+            if _, err2 := s.Seek(cur, io.SeekStart); err != nil || err2 != nil {
+                return -C.ENOSYS
+            }
+            r.size = end
+        }
+        return C.int64_t(r.size)
+    }
+    pos, err := s.Seek(int64(offset), int(whence))
+    if err != nil {
+        r.err = err
+        return -C.EIO
+    }
+    return C.int64_t(pos)
+}
+
+// goMediaWrite is the MediaWriter of open_go_writer, called from a mux
+// thread. opaque is the cgo.Handle of a *goWriter.
+//
+//export goMediaWrite
+func goMediaWrite(opaque unsafe.Pointer, buf *C.uint8_t, size C.int) C.int {
+    w := cgo.Handle(uintptr(opaque)).Value().(*goWriter)
+    if w.err != nil {
+        return -C.EIO
+    }
+    // io.Writer reports a short write as an error, so one call suffices
+    if _, err := w.w.Write(unsafe.Slice((*byte)(unsafe.Pointer(buf)), int(size))); err != nil {
+        w.err = err
+        return -C.EIO
+    }
+    return size
+}
+
+// Callbacks of the converter, set by ConvertParams.toC. opaque is the
+// cgo.Handle of the *ConvertParams.
+
+//export goConvertProgress
+func goConvertProgress(opaque unsafe.Pointer, progress *C.ConvertProgress) C.int {
+    p := cgo.Handle(uintptr(opaque)).Value().(*ConvertParams)
+    if p.Progress(newConvertProgress(progress)) {
+        return 0
+    }
+    return 1
+}
+
+//export goConvertStats
+func goConvertStats(opaque unsafe.Pointer, stages *C.ConvertStageStats, nbStages C.int) {
+    p := cgo.Handle(uintptr(opaque)).Value().(*ConvertParams)
+    p.Stats(newStageStats(stages, int(nbStages)))
+}
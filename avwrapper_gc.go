@@ -1,116 +1,225 @@
 package avwrapper
 
 /*
-#cgo pkg-config: libavcodec
+#cgo pkg-config: libavformat libavcodec libavutil
+#include <stddef.h>
+#include <stdlib.h>
+#include <libavutil/error.h>
 #include "avwrapper.h"
+
+static size_t snapshot_seek_preroll_offset(void) {
+    return offsetof(CodecSnapshot, seek_preroll);
+}
 */
 import "C"
 import (
-    "runtime"
+    "context"
+    "sync"
+    "time"
     "unsafe"
 )
 
-type SmartAVCodecParameters struct {
-    ptr *C.struct_AVCodecParameters
+// CodecParameters is a value copy of the scalar AVCodecParameters fields of
+// a stream. Its layout matches the C CodecSnapshot, so a probe fills it in
+// place with a single cgo call and nothing needs to be freed.
+type CodecParameters struct {
+    BitRate              int64
+    ChannelLayout        uint64
+    CodecType            int32
+    CodecID              int32
+    CodecTag             uint32
+    Format               int32
+    BitsPerCodedSample   int32
+    BitsPerRawSample     int32
+    Profile              int32
+    Level                int32
+    Width                int32
+    Height               int32
+    SampleAspectRatioNum int32
+    SampleAspectRatioDen int32
+    FrameRateNum         int32
+    FrameRateDen         int32
+    FieldOrder           int32
+    ColorRange           int32
+    ColorPrimaries       int32
+    ColorTrc             int32
+    ColorSpace           int32
+    ChromaLocation       int32
+    VideoDelay           int32
+    Channels             int32
+    SampleRate           int32
+    BlockAlign           int32
+    FrameSize            int32
+    InitialPadding       int32
+    TrailingPadding      int32
+    SeekPreroll          int32
 }
 
-func NewSmartAVCodecParameters() *SmartAVCodecParameters {
-    p := C.create_codec_parameters()
-    if p == nil {
-        return nil
+func init() {
+    var p CodecParameters
+    if unsafe.Sizeof(p) != C.sizeof_CodecSnapshot ||
+        unsafe.Offsetof(p.SeekPreroll) != uintptr(C.snapshot_seek_preroll_offset()) {
+        panic("avwrapper: CodecParameters does not match C CodecSnapshot")
     }
-    w := &SmartAVCodecParameters{ptr: p}
-    runtime.SetFinalizer(w, func(w *SmartAVCodecParameters) {
-        C.free_codec_parameters(w.ptr)
-    })
-    return w
 }
 
-// Access to fields of c-struct
-
-func (w *SmartAVCodecParameters) CodecTag() uint32 {
-    return uint32(w.ptr.codec_tag)
-}
-func (w *SmartAVCodecParameters) Extradata() unsafe.Pointer {
-    return unsafe.Pointer(w.ptr.extradata)
-}
-func (w *SmartAVCodecParameters) ExtradataSize() int {
-    return int(w.ptr.extradata_size)
-}
-func (w *SmartAVCodecParameters) Format() int {
-    return int(w.ptr.format)
-}
-func (w *SmartAVCodecParameters) BitsPerCodedSample() int {
-    return int(w.ptr.bits_per_coded_sample)
-}
-func (w *SmartAVCodecParameters) BitsPerRawSample() int {
-    return int(w.ptr.bits_per_raw_sample)
-}
-func (w *SmartAVCodecParameters) Profile() int {
-    return int(w.ptr.profile)
+func (p *CodecParameters) snapshot() *C.CodecSnapshot {
+    return (*C.CodecSnapshot)(unsafe.Pointer(p))
 }
-func (w *SmartAVCodecParameters) Level() int {
-    return int(w.ptr.level)
-}
-func (w *SmartAVCodecParameters) SampleAspectRatioNum() int {
-    return int(w.ptr.sample_aspect_ratio_num)
-}
-func (w *SmartAVCodecParameters) SampleAspectRatioDen() int {
-    return int(w.ptr.sample_aspect_ratio_den)
-}
-func (w *SmartAVCodecParameters) FieldOrder() int {
-    return int(w.ptr.field_order)
-}
-func (w *SmartAVCodecParameters) ColorRange() int {
-    return int(w.ptr.color_range)
-}
-func (w *SmartAVCodecParameters) ColorPrimaries() int {
-    return int(w.ptr.color_primaries)
+
+// codecNames interns codec names by id, so CodecName costs one cgo call per
+// codec for the lifetime of the process instead of one per file.
+var codecNames sync.Map
+
+// CodecName returns the libav name of the codec, e.g. "h264".
+func (p CodecParameters) CodecName() string {
+    if name, ok := codecNames.Load(p.CodecID); ok {
+        return name.(string)
+    }
+    name := C.GoString(C.get_codec_name(C.int32_t(p.CodecID)))
+    codecNames.Store(p.CodecID, name)
+    return name
 }
-func (w *SmartAVCodecParameters) ColorTrc() int {
-    return int(w.ptr.color_trc)
+
+// ProbeOptions bounds a probe. The zero value runs the full
+// avformat_find_stream_info pass.
+type ProbeOptions struct {
+    ProbeSize       int64 // max bytes read, 0 = libav default
+    AnalyzeDuration int64 // max stream time analyzed in microseconds, 0 = libav default
+    HeaderOnly      bool  // skip find_stream_info when the header is complete
+    // Timeout bounds the whole probe, 0 = none. Past it the probe fails
+    // with ErrTimeout.
+    Timeout time.Duration
 }
-func (w *SmartAVCodecParameters) ColorSpace() int {
-    return int(w.ptr.color_space)
+
+func (o *ProbeOptions) toC() C.ProbeOptions {
+    var c C.ProbeOptions
+    if o != nil {
+        c.probesize = C.int64_t(o.ProbeSize)
+        c.analyzeduration = C.int64_t(o.AnalyzeDuration)
+        if o.HeaderOnly {
+            c.header_only = 1
+        }
+        c.timeout_us = timeoutUs(o.Timeout)
+    }
+    return c
 }
-func (w *SmartAVCodecParameters) ChromaLocation() int {
-    return int(w.ptr.chroma_location)
+
+// ProbeStats is the measured cost of one probe.
+type ProbeStats struct {
+    BytesRead        int64
+    WallTimeUs       int64
+    FoundStreamInfo  bool
+    CacheHit         bool
+    OpenUs           int64 // avformat_open_input
+    FindStreamInfoUs int64 // avformat_find_stream_info, 0 if skipped
 }
-func (w *SmartAVCodecParameters) VideoDelay() int {
-    return int(w.ptr.video_delay)
+
+func newProbeStats(s *C.ProbeStats) ProbeStats {
+    return ProbeStats{
+        BytesRead:        int64(s.bytes_read),
+        WallTimeUs:       int64(s.wall_time_us),
+        FoundStreamInfo:  s.found_stream_info != 0,
+        CacheHit:         s.cache_hit != 0,
+        OpenUs:           int64(s.open_us),
+        FindStreamInfoUs: int64(s.find_stream_info_us),
+    }
 }
-func (w *SmartAVCodecParameters) ChannelLayout() uint64 {
-    return uint64(w.ptr.channel_layout)
+
+// LatencyHistogram counts calls by duration: Buckets[i] holds those that
+// took 2^i to 2^(i+1)-1 microseconds, the last bucket everything longer.
+type LatencyHistogram struct {
+    Count   uint64
+    TotalUs uint64
+    MaxUs   uint64
+    Buckets [C.PROBE_LATENCY_BUCKETS]uint64
 }
-func (w *SmartAVCodecParameters) Channels() int {
-    return int(w.ptr.channels)
+
+// Percentile returns the upper bound in microseconds of the bucket holding
+// the p-th percentile (0 < p <= 100), 0 if nothing was recorded.
+func (h *LatencyHistogram) Percentile(p float64) uint64 {
+    rank := uint64(p / 100 * float64(h.Count))
+    var seen uint64
+    for i, n := range h.Buckets {
+        seen += n
+        if n > 0 && seen >= rank {
+            return 1<<uint(i+1) - 1
+        }
+    }
+    return 0
 }
-func (w *SmartAVCodecParameters) SampleRate() int {
-    return int(w.ptr.sample_rate)
+
+func newLatencyHistogram(h *C.LatencyHistogram) LatencyHistogram {
+    r := LatencyHistogram{
+        Count:   uint64(h.count),
+        TotalUs: uint64(h.total_us),
+        MaxUs:   uint64(h.max_us),
+    }
+    for i := range r.Buckets {
+        r.Buckets[i] = uint64(h.buckets[i])
+    }
+    return r
 }
-func (w *SmartAVCodecParameters) BlockAlign() int {
-    return int(w.ptr.block_align)
+
+// ProbeMetrics is the latency of the probe phases across all probes of the
+// process since start or the last ResetProbeMetrics.
+type ProbeMetrics struct {
+    Open           LatencyHistogram
+    FindStreamInfo LatencyHistogram
 }
-func (w *SmartAVCodecParameters) FrameSize() int {
-    return int(w.ptr.frame_size)
+
+// GetProbeMetrics returns the process-wide probe latency histograms.
+func GetProbeMetrics() ProbeMetrics {
+    var m C.ProbeMetrics
+    C.probe_metrics_get(&m)
+    return ProbeMetrics{
+        Open:           newLatencyHistogram(&m.open),
+        FindStreamInfo: newLatencyHistogram(&m.find_stream_info),
+    }
 }
-func (w *SmartAVCodecParameters) InitialPadding() int {
-    return int(w.ptr.initial_padding)
+
+// ResetProbeMetrics clears the probe latency histograms.
+func ResetProbeMetrics() {
+    C.probe_metrics_reset()
 }
-func (w *SmartAVCodecParameters) TrailingPadding() int {
-    return int(w.ptr.trailing_padding)
+
+// AVError is a negative libav error code.
+type AVError int
+
+func (e AVError) Error() string {
+    var buf [C.AV_ERROR_MAX_STRING_SIZE]C.char
+    C.av_strerror(C.int(e), &buf[0], C.size_t(len(buf)))
+    return "avwrapper: " + C.GoString(&buf[0])
 }
-func (w *SmartAVCodecParameters) SeekPreroll() int {
-    return int(w.ptr.seek_preroll)
+
+func avError(ret C.int) error {
+    switch {
+    case ret >= 0:
+        return nil
+    case ret == C.MEDIA_TIMEOUT:
+        return ErrTimeout
+    }
+    return AVError(ret)
 }
 
-// CodecName gets codec name via C-Helper
-func (w *SmartAVCodecParameters) CodecName() string {
-    cstr := C.get_codec_name(w.ptr.codec_id)
-    return C.GoString(cstr)
+// ProbeVideo returns the parameters of the first video stream of filename.
+// opts may be nil for a full probe.
+func ProbeVideo(filename string, opts *ProbeOptions) (CodecParameters, ProbeStats, error) {
+    return ProbeVideoContext(context.Background(), filename, opts)
 }
 
-// Ptr expose raw pointer when needed
-func (w *SmartAVCodecParameters) Ptr() *C.struct_AVCodecParameters {
-    return w.ptr
+// ProbeVideoContext is ProbeVideo bounded by ctx: its deadline applies as
+// a timeout and cancelling it stops the probe at the next read. It then
+// returns ctx.Err().
+func ProbeVideoContext(ctx context.Context, filename string, opts *ProbeOptions) (CodecParameters, ProbeStats, error) {
+    cFilename := C.CString(filename)
+    defer C.free(unsafe.Pointer(cFilename))
+
+    var p CodecParameters
+    var stats C.ProbeStats
+    copts := opts.toC()
+    stop := bindContext(ctx, &copts.timeout_us, &copts.cancel)
+    ret := C.probe_video_snapshot(cFilename, &copts, p.snapshot(), &stats)
+    stop()
+    return p, newProbeStats(&stats), contextError(ctx, avError(ret))
 }
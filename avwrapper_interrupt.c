@@ -0,0 +1,71 @@
+// avwrapper_interrupt.c
+//
+// Per-call deadlines and cancellation through AVIOInterruptCB. libav calls
+// the callback before every blocking read or write and in its own retry
+// loops, so a stalled NFS/FUSE read or a truncated file that makes the
+// demuxer wait gives up within one read of the deadline instead of blocking
+// the worker. A single read() that the kernel itself does not return from
+// cannot be interrupted this way.
+#include "avwrapper_interrupt.h"
+#include <libavutil/time.h>
+#include <stdlib.h>
+
+struct MediaCancel {
+    atomic_int cancelled;
+};
+
+MediaCancel* media_cancel_create(void) {
+    return calloc(1, sizeof(MediaCancel));
+}
+
+void media_cancel(MediaCancel *cancel) {
+    atomic_store_explicit(&cancel->cancelled, 1, memory_order_relaxed);
+}
+
+void media_cancel_free(MediaCancel *cancel) {
+    free(cancel);
+}
+
+void media_interrupt_init(MediaInterrupt *mi, int64_t timeout_us, const MediaCancel *cancel, atomic_int *abort) {
+    mi->deadline = timeout_us > 0 ? av_gettime_relative() + timeout_us : 0;
+    mi->cancel = cancel;
+    mi->abort = abort;
+    atomic_init(&mi->reason, 0);
+}
+
+int media_interrupt_active(const MediaInterrupt *mi) {
+    return mi->deadline || mi->cancel;
+}
+
+int media_interrupt_check(void *opaque) {
+    MediaInterrupt *mi = opaque;
+    if (atomic_load_explicit(&mi->reason, memory_order_relaxed))
+        return 1;
+    int reason = 0;
+    if (mi->cancel && atomic_load_explicit(&mi->cancel->cancelled, memory_order_relaxed))
+        reason = AVERROR_EXIT;
+    else if (mi->deadline && av_gettime_relative() >= mi->deadline)
+        reason = MEDIA_TIMEOUT;
+    if (reason) {
+        int expected = 0;
+        atomic_compare_exchange_strong(&mi->reason, &expected, reason);
+        if (mi->abort)
+            atomic_store(mi->abort, 1);
+        return 1;
+    }
+    return mi->abort && atomic_load_explicit(mi->abort, memory_order_relaxed);
+}
+
+AVFormatContext* media_interrupt_alloc_context(MediaInterrupt *mi) {
+    AVFormatContext *ctx = avformat_alloc_context();
+    if (ctx) {
+        ctx->interrupt_callback.callback = media_interrupt_check;
+        ctx->interrupt_callback.opaque = mi;
+    }
+    return ctx;
+}
+
+int media_interrupt_result(const MediaInterrupt *mi, int ret) {
+    int reason = atomic_load(&mi->reason);
+    return reason ? reason : ret;
+}
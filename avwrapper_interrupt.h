@@ -0,0 +1,41 @@
+// avwrapper_interrupt.h
+//
+// Deadline and cancellation of one probe or conversion, shared by
+// avwrapper.c and ff_video_converter.c. Not part of the public interface.
+#ifndef AVWRAPPER_INTERRUPT_H
+#define AVWRAPPER_INTERRUPT_H
+
+#include "avwrapper.h"
+#include <stdatomic.h>
+#include <libavformat/avformat.h>
+
+// Installed as the AVIOInterruptCB of every AVFormatContext and AVIOContext
+// a call opens, so libav gives up between reads once it fires. The first
+// check past the deadline or after media_cancel records why in reason.
+typedef struct {
+    int64_t deadline;           // av_gettime_relative() limit, 0 = none
+    const MediaCancel *cancel;  // may be NULL
+    atomic_int *abort;          // set when the interrupt fires and checked too, may be NULL
+    atomic_int reason;          // 0, MEDIA_TIMEOUT or AVERROR_EXIT
+} MediaInterrupt;
+
+// timeout_us <= 0 = no deadline. The deadline counts from this call.
+void media_interrupt_init(MediaInterrupt *mi, int64_t timeout_us, const MediaCancel *cancel, atomic_int *abort);
+
+// Nonzero if a deadline or a cancel token is set, i.e. the callback can fire.
+int media_interrupt_active(const MediaInterrupt *mi);
+
+// The AVIOInterruptCB callback, opaque is the MediaInterrupt. Returns 1
+// once the call must stop.
+int media_interrupt_check(void *opaque);
+
+// Allocates a format context with mi as its interrupt callback, for
+// avformat_open_input. Returns NULL when out of memory.
+AVFormatContext* media_interrupt_alloc_context(MediaInterrupt *mi);
+
+// MEDIA_TIMEOUT or AVERROR_EXIT if the interrupt fired, else ret. libav
+// reports an interrupted read as whatever error it ran into, so this gives
+// the caller the real reason.
+int media_interrupt_result(const MediaInterrupt *mi, int ret);
+
+#endif // AVWRAPPER_INTERRUPT_H
@@ -0,0 +1,77 @@
+package avwrapper
+
+/*
+#include <stdint.h>
+#include "avwrapper.h"
+*/
+import "C"
+import (
+    "context"
+    "errors"
+    "time"
+)
+
+// ErrTimeout is returned when a probe or conversion ran past its Timeout.
+// Calls bounded by a context return ctx.Err() instead.
+var ErrTimeout = errors.New("avwrapper: timed out")
+
+// timeoutUs converts d to the timeout_us of the C options, 0 = none.
+func timeoutUs(d time.Duration) C.int64_t {
+    if d <= 0 {
+        return 0
+    }
+    if d < time.Microsecond {
+        return 1
+    }
+    return C.int64_t(d / time.Microsecond)
+}
+
+// bindContext ties a C call to ctx: the deadline of ctx tightens *timeout
+// and ctx.Done cancels the call through a MediaCancel stored in *cancel.
+// The returned function must be called once the C call has returned.
+func bindContext(ctx context.Context, timeout *C.int64_t, cancel **C.MediaCancel) func() {
+    if ctx.Done() == nil {
+        return func() {}
+    }
+    if d, ok := ctx.Deadline(); ok {
+        if t := timeoutUs(time.Until(d)); t > 0 && (*timeout == 0 || t < *timeout) {
+            *timeout = t
+        } else if t == 0 {
+            *timeout = 1 // already expired, fail on the first check
+        }
+    }
+    c := C.media_cancel_create()
+    if c == nil {
+        return func() {}
+    }
+    *cancel = c
+    done := make(chan struct{})
+    exited := make(chan struct{})
+    go func() {
+        defer close(exited)
+        select {
+        case <-ctx.Done():
+            C.media_cancel(c)
+        case <-done:
+        }
+    }()
+    return func() {
+        close(done)
+        <-exited
+        C.media_cancel_free(c)
+    }
+}
+
+// contextError reports ctx.Err() for calls that stopped because ctx ended.
+func contextError(ctx context.Context, err error) error {
+    if err == nil {
+        return nil
+    }
+    if ctxErr := ctx.Err(); ctxErr != nil {
+        var averr AVError
+        if err == ErrTimeout || err == ErrCanceled || (errors.As(err, &averr) && averr == AVError(C.AVERROR_EXIT)) {
+            return ctxErr
+        }
+    }
+    return err
+}
@@ -0,0 +1,216 @@
+// avwrapper_io.c
+//
+// Custom AVIOContext backends, so probing and conversion can run without a
+// filename: from caller callbacks (e.g. a Go io.Reader), from a memory
+// buffer, or from a local file read through mmap instead of read() calls.
+// The converter can also write through caller callbacks (e.g. a Go io.Writer).
+// Every context returned here is released with media_io_close.
+#include "avwrapper.h"
+#include <libavformat/avio.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MEDIA_IO_BUFFER_SIZE (64 * 1024)
+// madvise(MADV_WILLNEED) window kept ahead of the read position
+#define MEDIA_IO_READAHEAD (4 * 1024 * 1024)
+
+typedef struct {
+    MediaReader reader;   // used when reader.read is set
+    MediaWriter writer;   // used when writer.write is set
+    const uint8_t *data;  // memory and mmap sources
+    size_t size;
+    size_t pos;
+    size_t advised_end;   // end of the range already passed to MADV_WILLNEED
+    int mapped;           // data is an mmap() of size bytes
+} MediaSource;
+
+static int reader_read(void *opaque, uint8_t *buf, int buf_size) {
+    MediaSource *src = opaque;
+    int ret = src->reader.read(src->reader.opaque, buf, buf_size);
+    return ret == 0 ? AVERROR_EOF : ret;
+}
+
+static int writer_write(void *opaque, uint8_t *buf, int buf_size) {
+    MediaSource *src = opaque;
+    int ret = src->writer.write(src->writer.opaque, buf, buf_size);
+    return ret < 0 ? ret : buf_size;
+}
+
+static int64_t reader_seek(void *opaque, int64_t offset, int whence) {
+    MediaSource *src = opaque;
+    return src->reader.seek(src->reader.opaque, offset, whence & ~AVSEEK_FORCE);
+}
+
+// Asks the kernel to start reading the window after pos, page aligned.
+static void advise_readahead(MediaSource *src) {
+    if (!src->mapped || src->pos + MEDIA_IO_READAHEAD / 2 < src->advised_end)
+        return;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = src->pos & ~(page - 1);
+    size_t end = src->pos + MEDIA_IO_READAHEAD;
+    if (end > src->size)
+        end = src->size;
+    if (end > start)
+        madvise((void *)(src->data + start), end - start, MADV_WILLNEED);
+    src->advised_end = end;
+}
+
+static int buffer_read(void *opaque, uint8_t *buf, int buf_size) {
+    MediaSource *src = opaque;
+    if (src->pos >= src->size)
+        return AVERROR_EOF;
+    size_t n = src->size - src->pos;
+    if (n > (size_t)buf_size)
+        n = buf_size;
+    advise_readahead(src);
+    memcpy(buf, src->data + src->pos, n);
+    src->pos += n;
+    return (int)n;
+}
+
+static int64_t buffer_seek(void *opaque, int64_t offset, int whence) {
+    MediaSource *src = opaque;
+    int64_t pos;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return src->size;
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = src->pos + offset;
+        break;
+    case SEEK_END:
+        pos = src->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (pos < 0 || pos > (int64_t)src->size)
+        return AVERROR(EINVAL);
+
+    // A jump (e.g. to the moov atom at the end) restarts the readahead window
+    if ((size_t)pos < src->pos || (size_t)pos > src->advised_end)
+        src->advised_end = 0;
+    src->pos = pos;
+    return pos;
+}
+
+static AVIOContext* open_source(MediaSource *src) {
+    uint8_t *buffer = av_malloc(MEDIA_IO_BUFFER_SIZE);
+    if (!buffer)
+        return NULL;
+
+    AVIOContext *pb;
+    if (src->writer.write) {
+        pb = avio_alloc_context(buffer, MEDIA_IO_BUFFER_SIZE, 1, src, NULL, writer_write, NULL);
+    } else if (src->reader.read) {
+        pb = avio_alloc_context(buffer, MEDIA_IO_BUFFER_SIZE, 0, src, reader_read, NULL,
+                                src->reader.seek ? reader_seek : NULL);
+    } else {
+        pb = avio_alloc_context(buffer, MEDIA_IO_BUFFER_SIZE, 0, src, buffer_read, NULL, buffer_seek);
+    }
+    if (!pb)
+        av_free(buffer);
+    return pb;
+}
+
+// Input driven by caller callbacks. reader is copied. A NULL seek callback
+// makes the stream non-seekable. Returns NULL on error.
+AVIOContext* media_io_open_reader(const MediaReader *reader) {
+    MediaSource *src = calloc(1, sizeof(*src));
+    if (!src)
+        return NULL;
+    src->reader = *reader;
+    AVIOContext *pb = open_source(src);
+    if (!pb)
+        free(src);
+    return pb;
+}
+
+// Non-seekable output driven by caller callbacks. writer is copied. Bytes
+// are handed over in chunks of up to 64 KiB, so memory stays bounded.
+// Returns NULL on error.
+AVIOContext* media_io_open_writer(const MediaWriter *writer) {
+    MediaSource *src = calloc(1, sizeof(*src));
+    if (!src)
+        return NULL;
+    src->writer = *writer;
+    AVIOContext *pb = open_source(src);
+    if (!pb)
+        free(src);
+    return pb;
+}
+
+// Input reading from data, which must stay valid until media_io_close.
+// Returns NULL on error.
+AVIOContext* media_io_open_memory(const uint8_t *data, size_t size) {
+    MediaSource *src = calloc(1, sizeof(*src));
+    if (!src)
+        return NULL;
+    src->data = data;
+    src->size = size;
+    AVIOContext *pb = open_source(src);
+    if (!pb)
+        free(src);
+    return pb;
+}
+
+// Input reading filename through a read-only mapping. Sequential access is
+// advised up front and a MADV_WILLNEED window follows the read position, so
+// data arrives by readahead instead of one read() per buffer refill.
+// Returns NULL on error.
+AVIOContext* media_io_open_mmap(const char *filename) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open input file '%s'\n", filename);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Could not map input file '%s'\n", filename);
+        return NULL;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    MediaSource *src = calloc(1, sizeof(*src));
+    if (!src) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    src->data = data;
+    src->size = st.st_size;
+    src->mapped = 1;
+    AVIOContext *pb = open_source(src);
+    if (!pb) {
+        munmap(data, st.st_size);
+        free(src);
+    }
+    return pb;
+}
+
+// Releases a context from one of the media_io_open_* functions and sets *pb to NULL.
+void media_io_close(AVIOContext **pb) {
+    if (!*pb)
+        return;
+    MediaSource *src = (*pb)->opaque;
+    if (src->mapped)
+        munmap((void *)src->data, src->size);
+    free(src);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
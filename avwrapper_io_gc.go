@@ -0,0 +1,210 @@
+package avwrapper
+
+/*
+#include <stdint.h>
+#include <stdlib.h>
+#include "avwrapper.h"
+
+extern int goMediaRead(void *opaque, uint8_t *buf, int size);
+extern int64_t goMediaSeek(void *opaque, int64_t offset, int whence);
+
+static AVIOContext *open_go_reader(uintptr_t handle, int seekable) {
+    MediaReader reader = {
+        .opaque = (void *)handle,
+        .read = goMediaRead,
+        .seek = seekable ? goMediaSeek : NULL,
+    };
+    return media_io_open_reader(&reader);
+}
+
+extern int goMediaWrite(void *opaque, uint8_t *buf, int size);
+
+static int media_write(void *opaque, const uint8_t *buf, int size) {
+    return goMediaWrite(opaque, (uint8_t *)buf, size);
+}
+
+static AVIOContext *open_go_writer(uintptr_t handle) {
+    MediaWriter writer = {
+        .opaque = (void *)handle,
+        .write = media_write,
+    };
+    return media_io_open_writer(&writer);
+}
+*/
+import "C"
+import (
+    "context"
+    "errors"
+    "io"
+    "runtime"
+    "runtime/cgo"
+    "unsafe"
+)
+
+var (
+    errOpenSource = errors.New("avwrapper: could not open input")
+    errOpenSink   = errors.New("avwrapper: could not open output")
+)
+
+type goReader struct {
+    r    io.Reader
+    err  error // first error from r, reported instead of the libav one
+    size int64 // cached AVSEEK_SIZE answer, -1 until asked
+}
+
+// mediaSource is a custom AVIOContext plus whatever keeps its Go side alive
+// until close: the reader handle, or the pinned memory buffer.
+type mediaSource struct {
+    pb     *C.AVIOContext
+    reader *goReader
+    handle cgo.Handle
+    pinner runtime.Pinner
+}
+
+// newReaderSource reads from r through callbacks, without a temporary file.
+// The input is seekable if r implements io.Seeker.
+func newReaderSource(r io.Reader) (*mediaSource, error) {
+    s := &mediaSource{reader: &goReader{r: r, size: -1}}
+    s.handle = cgo.NewHandle(s.reader)
+    seekable := 0
+    if _, ok := r.(io.Seeker); ok {
+        seekable = 1
+    }
+    s.pb = C.open_go_reader(C.uintptr_t(s.handle), C.int(seekable))
+    if s.pb == nil {
+        s.handle.Delete()
+        return nil, errOpenSource
+    }
+    return s, nil
+}
+
+// newBytesSource reads data in place. It stays pinned until close.
+func newBytesSource(data []byte) (*mediaSource, error) {
+    if len(data) == 0 {
+        return nil, errOpenSource
+    }
+    s := &mediaSource{}
+    s.pinner.Pin(&data[0])
+    s.pb = C.media_io_open_memory((*C.uint8_t)(unsafe.Pointer(&data[0])), C.size_t(len(data)))
+    if s.pb == nil {
+        s.pinner.Unpin()
+        return nil, errOpenSource
+    }
+    return s, nil
+}
+
+// newMmapSource reads filename through mmap with readahead advice.
+func newMmapSource(filename string) (*mediaSource, error) {
+    cFilename := C.CString(filename)
+    defer C.free(unsafe.Pointer(cFilename))
+
+    s := &mediaSource{pb: C.media_io_open_mmap(cFilename)}
+    if s.pb == nil {
+        return nil, errOpenSource
+    }
+    return s, nil
+}
+
+// result prefers the reader's own error over the libav code it caused.
+func (s *mediaSource) result(err error) error {
+    if err != nil && s.reader != nil && s.reader.err != nil {
+        return s.reader.err
+    }
+    return err
+}
+
+func (s *mediaSource) close() {
+    C.media_io_close(&s.pb)
+    s.pinner.Unpin()
+    if s.reader != nil {
+        s.handle.Delete()
+    }
+}
+
+type goWriter struct {
+    w   io.Writer
+    err error // first error from w, reported instead of the libav one
+}
+
+// mediaSink is a custom output AVIOContext writing to an io.Writer.
+type mediaSink struct {
+    pb     *C.AVIOContext
+    writer *goWriter
+    handle cgo.Handle
+}
+
+// newWriterSink writes to w through callbacks. The output is not seekable.
+func newWriterSink(w io.Writer) (*mediaSink, error) {
+    s := &mediaSink{writer: &goWriter{w: w}}
+    s.handle = cgo.NewHandle(s.writer)
+    s.pb = C.open_go_writer(C.uintptr_t(s.handle))
+    if s.pb == nil {
+        s.handle.Delete()
+        return nil, errOpenSink
+    }
+    return s, nil
+}
+
+// result prefers the writer's own error over the libav code it caused.
+func (s *mediaSink) result(err error) error {
+    if err != nil && s.writer.err != nil {
+        return s.writer.err
+    }
+    return err
+}
+
+func (s *mediaSink) close() {
+    C.media_io_close(&s.pb)
+    s.handle.Delete()
+}
+
+func probeSource(ctx context.Context, s *mediaSource, err error, opts *ProbeOptions) (CodecParameters, ProbeStats, error) {
+    var p CodecParameters
+    if err != nil {
+        return p, ProbeStats{}, err
+    }
+    defer s.close()
+
+    var stats C.ProbeStats
+    copts := opts.toC()
+    stop := bindContext(ctx, &copts.timeout_us, &copts.cancel)
+    ret := C.probe_video_snapshot_io(s.pb, &copts, p.snapshot(), &stats)
+    stop()
+    return p, newProbeStats(&stats), contextError(ctx, s.result(avError(ret)))
+}
+
+// ProbeVideoReader probes the first video stream read from r.
+// If r is an io.Seeker the demuxer may seek, otherwise r is read as a stream.
+func ProbeVideoReader(r io.Reader, opts *ProbeOptions) (CodecParameters, ProbeStats, error) {
+    return ProbeVideoReaderContext(context.Background(), r, opts)
+}
+
+// ProbeVideoReaderContext is ProbeVideoReader bounded by ctx, see
+// ProbeVideoContext. A Read already blocked in r is not interrupted.
+func ProbeVideoReaderContext(ctx context.Context, r io.Reader, opts *ProbeOptions) (CodecParameters, ProbeStats, error) {
+    s, err := newReaderSource(r)
+    return probeSource(ctx, s, err, opts)
+}
+
+// ProbeVideoBytes probes the first video stream of a file held in memory,
+// without copying it.
+func ProbeVideoBytes(data []byte, opts *ProbeOptions) (CodecParameters, ProbeStats, error) {
+    return ProbeVideoBytesContext(context.Background(), data, opts)
+}
+
+// ProbeVideoBytesContext is ProbeVideoBytes bounded by ctx, see ProbeVideoContext.
+func ProbeVideoBytesContext(ctx context.Context, data []byte, opts *ProbeOptions) (CodecParameters, ProbeStats, error) {
+    s, err := newBytesSource(data)
+    return probeSource(ctx, s, err, opts)
+}
+
+// ProbeVideoMmap probes a local file read through mmap instead of read().
+func ProbeVideoMmap(filename string, opts *ProbeOptions) (CodecParameters, ProbeStats, error) {
+    return ProbeVideoMmapContext(context.Background(), filename, opts)
+}
+
+// ProbeVideoMmapContext is ProbeVideoMmap bounded by ctx, see ProbeVideoContext.
+func ProbeVideoMmapContext(ctx context.Context, filename string, opts *ProbeOptions) (CodecParameters, ProbeStats, error) {
+    s, err := newMmapSource(filename)
+    return probeSource(ctx, s, err, opts)
+}
@@ -0,0 +1,197 @@
+// avwrapper_pool.c
+//
+// Probe worker pool. Callers submit filenames and collect results from a
+// completion queue, so a single thread (or goroutine) can keep many probes
+// in flight while only nb_threads threads ever block inside libav.
+//
+// Back-pressure: at most queue_size jobs may be outstanding, counting queued,
+// running and finished-but-not-collected ones. probe_pool_submit blocks until
+// probe_pool_next frees a slot.
+#include "avwrapper.h"
+#include <libavutil/error.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    char *filename;
+    uint64_t id;
+} ProbeJob;
+
+struct ProbePool {
+    pthread_mutex_t lock;
+    pthread_cond_t job_ready;    // workers wait here for jobs
+    pthread_cond_t result_ready; // probe_pool_next waits here for results
+    pthread_cond_t slot_free;    // probe_pool_submit waits here for room
+
+    // Both rings hold at most `outstanding` entries, so `capacity` slots suffice.
+    ProbeJob *jobs;
+    int job_head, job_count;
+    ProbeResult *results;
+    int result_head, result_count;
+    int capacity;
+    int outstanding;
+    int closed;
+
+    ProbeOptions opts;
+    pthread_t *threads;
+    int nb_threads;
+};
+
+static void *probe_worker(void *arg) {
+    ProbePool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->job_count && !pool->closed)
+            pthread_cond_wait(&pool->job_ready, &pool->lock);
+        if (!pool->job_count)
+            break; // closed and drained
+
+        ProbeJob job = pool->jobs[pool->job_head];
+        pool->job_head = (pool->job_head + 1) % pool->capacity;
+        pool->job_count--;
+        pthread_mutex_unlock(&pool->lock);
+
+        ProbeResult result = { .id = job.id };
+        result.status = probe_video_snapshot(job.filename, &pool->opts, &result.snapshot, &result.stats);
+        free(job.filename);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->results[(pool->result_head + pool->result_count) % pool->capacity] = result;
+        pool->result_count++;
+        pthread_cond_signal(&pool->result_ready);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Creates a pool of nb_threads workers (<= 0 = number of online CPUs) that
+// allows queue_size outstanding jobs (<= 0 = 4 per thread). opts is copied
+// and applied to every probe, it may be NULL. Returns NULL on error.
+ProbePool* probe_pool_create(int nb_threads, int queue_size, const ProbeOptions *opts) {
+    if (nb_threads <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        nb_threads = n > 0 ? (int)n : 1;
+    }
+    if (queue_size <= 0)
+        queue_size = 4 * nb_threads;
+
+    ProbePool *pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+    pool->capacity = queue_size;
+    pool->jobs = calloc(queue_size, sizeof(*pool->jobs));
+    pool->results = calloc(queue_size, sizeof(*pool->results));
+    pool->threads = calloc(nb_threads, sizeof(*pool->threads));
+    if (opts)
+        pool->opts = *opts;
+    if (!pool->jobs || !pool->results || !pool->threads) {
+        free(pool->jobs);
+        free(pool->results);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_ready, NULL);
+    pthread_cond_init(&pool->result_ready, NULL);
+    pthread_cond_init(&pool->slot_free, NULL);
+
+    for (int i = 0; i < nb_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, probe_worker, pool) != 0)
+            break;
+        pool->nb_threads++;
+    }
+    if (!pool->nb_threads) {
+        probe_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+// Queues filename for probing. Blocks while queue_size jobs are outstanding.
+// Returns 0 on success, AVERROR_EOF once the pool is closed.
+int probe_pool_submit(ProbePool *pool, const char *filename, uint64_t id) {
+    char *copy = strdup(filename);
+    if (!copy)
+        return AVERROR(ENOMEM);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->outstanding == pool->capacity && !pool->closed)
+        pthread_cond_wait(&pool->slot_free, &pool->lock);
+    if (pool->closed) {
+        pthread_mutex_unlock(&pool->lock);
+        free(copy);
+        return AVERROR_EOF;
+    }
+    pool->jobs[(pool->job_head + pool->job_count) % pool->capacity] = (ProbeJob){ copy, id };
+    pool->job_count++;
+    pool->outstanding++;
+    pthread_cond_signal(&pool->job_ready);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+// Waits for the next finished probe, in completion order.
+// Returns 1 with *result filled, 0 once the pool is closed and drained.
+int probe_pool_next(ProbePool *pool, ProbeResult *result) {
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->result_count && !(pool->closed && !pool->outstanding))
+        pthread_cond_wait(&pool->result_ready, &pool->lock);
+    int got = pool->result_count > 0;
+    if (got) {
+        *result = pool->results[pool->result_head];
+        pool->result_head = (pool->result_head + 1) % pool->capacity;
+        pool->result_count--;
+        pool->outstanding--;
+        pthread_cond_signal(&pool->slot_free);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return got;
+}
+
+// Refuses further submissions. Queued jobs still run and are delivered by
+// probe_pool_next, which returns 0 after the last one.
+void probe_pool_close(ProbePool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->closed = 1;
+    pthread_cond_broadcast(&pool->job_ready);
+    pthread_cond_broadcast(&pool->result_ready);
+    pthread_cond_broadcast(&pool->slot_free);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Like probe_pool_close, but also drops jobs that have not started yet.
+// Probes already running finish and are still delivered.
+void probe_pool_cancel(ProbePool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->job_count) {
+        free(pool->jobs[pool->job_head].filename);
+        pool->job_head = (pool->job_head + 1) % pool->capacity;
+        pool->job_count--;
+        pool->outstanding--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    probe_pool_close(pool);
+}
+
+// Cancels the pool, joins the workers and drops undelivered results.
+// No other thread may be inside a probe_pool_* call.
+void probe_pool_destroy(ProbePool *pool) {
+    if (!pool)
+        return;
+    probe_pool_cancel(pool);
+    for (int i = 0; i < pool->nb_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->slot_free);
+    pthread_cond_destroy(&pool->result_ready);
+    pthread_cond_destroy(&pool->job_ready);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool->results);
+    free(pool->jobs);
+    free(pool);
+}
@@ -0,0 +1,127 @@
+package avwrapper
+
+/*
+#include <stdlib.h>
+#include "avwrapper.h"
+*/
+import "C"
+import (
+    "context"
+    "errors"
+    "sync"
+    "unsafe"
+)
+
+// ErrPoolClosed is returned by Submit after Close or Destroy.
+var ErrPoolClosed = errors.New("avwrapper: probe pool closed")
+
+// ProbeResult is delivered once per submitted file, in completion order.
+type ProbeResult struct {
+    ID     uint64
+    Params CodecParameters // valid if Err is nil
+    Stats  ProbeStats
+    Err    error
+}
+
+// ProbePool runs probes on a fixed set of C threads. Submitting blocks once
+// queueSize probes are outstanding, so a single goroutine can drive any
+// number of files without pinning an OS thread per probe.
+type ProbePool struct {
+    pool    *C.ProbePool
+    ctx     context.Context
+    stop    func() // releases the cancel token of ctx once no probe runs
+    once    sync.Once
+    results chan ProbeResult
+}
+
+// NewProbePool starts threads workers (<= 0 = one per CPU) allowing
+// queueSize outstanding probes (<= 0 = 4 per worker). opts may be nil.
+func NewProbePool(threads, queueSize int, opts *ProbeOptions) *ProbePool {
+    return NewProbePoolContext(context.Background(), threads, queueSize, opts)
+}
+
+// NewProbePoolContext is NewProbePool bounded by ctx: once ctx ends the
+// running probes stop at their next read and the queued ones fail as they
+// start, each with ctx.Err(). The deadline of ctx applies to the whole
+// pool, opts.Timeout still to each probe.
+func NewProbePoolContext(ctx context.Context, threads, queueSize int, opts *ProbeOptions) *ProbePool {
+    copts := opts.toC()
+    // The deadline is the pool's, ctx.Done reaches every probe through the token
+    timeout := copts.timeout_us
+    stop := bindContext(ctx, &timeout, &copts.cancel)
+    p := C.probe_pool_create(C.int(threads), C.int(queueSize), &copts)
+    if p == nil {
+        stop()
+        return nil
+    }
+    return &ProbePool{pool: p, ctx: ctx, stop: stop}
+}
+
+// Submit queues filename, blocking while the pool is full. Results must be
+// consumed from another goroutine, otherwise a full pool never drains.
+func (p *ProbePool) Submit(filename string, id uint64) error {
+    cFilename := C.CString(filename)
+    defer C.free(unsafe.Pointer(cFilename))
+
+    if C.probe_pool_submit(p.pool, cFilename, C.uint64_t(id)) < 0 {
+        return ErrPoolClosed
+    }
+    return nil
+}
+
+// Results returns the completion channel. It is closed after Close once
+// every submitted probe has been delivered.
+func (p *ProbePool) Results() <-chan ProbeResult {
+    p.once.Do(func() {
+        p.results = make(chan ProbeResult, 64)
+        go func() {
+            var r C.ProbeResult
+            for C.probe_pool_next(p.pool, &r) != 0 {
+                p.results <- ProbeResult{
+                    ID:     uint64(r.id),
+                    Params: *(*CodecParameters)(unsafe.Pointer(&r.snapshot)),
+                    Stats:  newProbeStats(&r.stats),
+                    Err:    contextError(p.ctx, avError(r.status)),
+                }
+            }
+            close(p.results)
+        }()
+    })
+    return p.results
+}
+
+// ProbeAll submits filenames from a background goroutine, using the slice
+// index as ID, then closes the pool.
+func (p *ProbePool) ProbeAll(filenames []string) <-chan ProbeResult {
+    results := p.Results()
+    go func() {
+        for i, filename := range filenames {
+            if p.Submit(filename, uint64(i)) != nil {
+                break
+            }
+        }
+        p.Close()
+    }()
+    return results
+}
+
+// Close refuses further submissions. Already queued probes still complete.
+func (p *ProbePool) Close() {
+    C.probe_pool_close(p.pool)
+}
+
+// Destroy drops queued probes, drains the results channel if it was started
+// and frees the pool. The pool must not be used afterwards.
+func (p *ProbePool) Destroy() {
+    C.probe_pool_cancel(p.pool)
+    // Waits for a concurrent first Results call, or keeps a later one from
+    // starting, so p.results is settled before it is read
+    p.once.Do(func() {})
+    if p.results != nil {
+        for range p.results {
+        }
+    }
+    C.probe_pool_destroy(p.pool)
+    p.pool = nil
+    p.stop()
+}
@@ -0,0 +1,26 @@
+package main
+
+import (
+	"fmt"
+	"os"
+
+	"avwrapper"
+)
+
+func main() {
+	if len(os.Args) < 2 {
+		fmt.Println("Usage: mediafileinfo <file>")
+		os.Exit(1)
+	}
+
+	p, stats, err := avwrapper.ProbeVideo(os.Args[1], &avwrapper.ProbeOptions{HeaderOnly: true})
+	if err != nil {
+		panic(err)
+	}
+
+	// Werte sind eine Kopie, kein Freigeben nötig
+	fmt.Println("Codec:", p.CodecName())
+	fmt.Println("Bitrate:", p.BitRate)
+	fmt.Println("Resolution:", p.Width, "x", p.Height)
+	fmt.Println("Probe:", stats.BytesRead, "bytes in", stats.WallTimeUs, "us")
+}
@@ -0,0 +1,277 @@
+// exif_thumbnail.c
+//
+// Embedded preview lookup without decoding: the first EXIF_HEAD_SIZE bytes
+// of the file are read once, the TIFF IFDs (EXIF APP1 of a JPEG, or the
+// whole header of a TIFF based RAW) are walked for JPEG previews, and only
+// the chosen preview is read in addition. Anything outside the head, such as
+// IFDs near the end of a RAW file, is fetched with pread.
+#include "exif_thumbnail.h"
+#include "thumbnail_scale.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define EXIF_HEAD_SIZE (64 * 1024)
+#define EXIF_MAX_CANDIDATES 16
+#define EXIF_MAX_ENTRIES 512
+#define EXIF_MAX_DEPTH 4
+
+// TIFF tags locating previews
+#define TAG_COMPRESSION 0x0103
+#define TAG_STRIP_OFFSETS 0x0111
+#define TAG_STRIP_BYTE_COUNTS 0x0117
+#define TAG_SUB_IFDS 0x014A
+#define TAG_JPEG_OFFSET 0x0201
+#define TAG_JPEG_LENGTH 0x0202
+
+typedef struct {
+    int fd;
+    uint8_t head[EXIF_HEAD_SIZE];
+    size_t head_len;
+    int64_t size;  // file size
+    int64_t base;  // file offset of the TIFF header, IFD offsets are relative to it
+    int le;        // little endian TIFF
+} ExifSource;
+
+typedef struct {
+    int64_t offset; // absolute file offset of the JPEG
+    int64_t length;
+    int width;
+    int height;
+} Candidate;
+
+typedef struct {
+    Candidate list[EXIF_MAX_CANDIDATES];
+    int count;
+} Candidates;
+
+// Reads len bytes at absolute offset, from the head when it is covered.
+static int read_at(const ExifSource* s, int64_t offset, void* buf, size_t len) {
+    if (offset < 0 || offset + (int64_t)len > s->size)
+        return 0;
+    if (offset + (int64_t)len <= (int64_t)s->head_len) {
+        memcpy(buf, s->head + offset, len);
+        return 1;
+    }
+    return pread(s->fd, buf, len, offset) == (ssize_t)len;
+}
+
+static uint16_t get16(const ExifSource* s, const uint8_t* p) {
+    return s->le ? (uint16_t)(p[0] | p[1] << 8) : (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get32(const ExifSource* s, const uint8_t* p) {
+    return s->le ? (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24
+                 : (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+// Value of a SHORT or LONG entry with a count of 1.
+static uint32_t entry_value(const ExifSource* s, const uint8_t* entry) {
+    return get16(s, entry + 2) == 3 ? get16(s, entry + 8) : get32(s, entry + 8);
+}
+
+// Reads the frame size from the SOF marker of the JPEG at offset. Only
+// baseline and progressive Huffman JPEGs count, the lossless JPEG used for
+// raw sensor data in DNG and CR2 does not.
+static int jpeg_size(const ExifSource* s, int64_t offset, int64_t length, int* width, int* height) {
+    uint8_t b[9];
+    if (length < 4 || !read_at(s, offset, b, 2) || b[0] != 0xFF || b[1] != 0xD8)
+        return 0;
+    int64_t pos = offset + 2, end = offset + length;
+    for (int i = 0; i < 64 && pos + 4 <= end; i++) {
+        if (!read_at(s, pos, b, 4) || b[0] != 0xFF)
+            return 0;
+        int marker = b[1];
+        int seglen = b[2] << 8 | b[3];
+        if (marker == 0xC0 || marker == 0xC1 || marker == 0xC2) {
+            if (!read_at(s, pos + 4, b, 5))
+                return 0;
+            *height = b[1] << 8 | b[2];
+            *width = b[3] << 8 | b[4];
+            return *width > 0 && *height > 0;
+        }
+        if ((marker >= 0xC3 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) ||
+            marker == 0xDA || seglen < 2)
+            return 0;
+        pos += 2 + seglen;
+    }
+    return 0;
+}
+
+static void add_candidate(const ExifSource* s, Candidates* c, int64_t offset, int64_t length) {
+    if (c->count == EXIF_MAX_CANDIDATES || length <= 0 || offset + length > s->size)
+        return;
+    for (int i = 0; i < c->count; i++) {
+        if (c->list[i].offset == offset)
+            return;
+    }
+    Candidate* cand = &c->list[c->count];
+    if (jpeg_size(s, offset, length, &cand->width, &cand->height)) {
+        cand->offset = offset;
+        cand->length = length;
+        c->count++;
+    }
+}
+
+// Collects the previews of the IFD at offset (relative to the TIFF header)
+// and of its SubIFDs. Returns the offset of the next IFD, 0 at the end.
+static uint32_t scan_ifd(const ExifSource* s, uint32_t ifd, int depth, Candidates* c) {
+    uint8_t b[4];
+    if (depth > EXIF_MAX_DEPTH || !read_at(s, s->base + ifd, b, 2))
+        return 0;
+    int count = get16(s, b);
+    if (count == 0 || count > EXIF_MAX_ENTRIES)
+        return 0;
+    uint8_t* entries = malloc((size_t)count * 12 + 4);
+    if (!entries || !read_at(s, s->base + ifd + 2, entries, (size_t)count * 12 + 4)) {
+        free(entries);
+        return 0;
+    }
+
+    uint32_t jpeg_offset = 0, jpeg_length = 0, strip_offset = 0, strip_length = 0, compression = 0;
+    for (int i = 0; i < count; i++) {
+        const uint8_t* e = entries + i * 12;
+        uint16_t tag = get16(s, e);
+        uint32_t n = get32(s, e + 4);
+        switch (tag) {
+        case TAG_COMPRESSION:
+            compression = entry_value(s, e);
+            break;
+        case TAG_JPEG_OFFSET:
+            jpeg_offset = entry_value(s, e);
+            break;
+        case TAG_JPEG_LENGTH:
+            jpeg_length = entry_value(s, e);
+            break;
+        // Previews are stored as a single strip, multi-strip images are raw data
+        case TAG_STRIP_OFFSETS:
+            if (n == 1)
+                strip_offset = entry_value(s, e);
+            break;
+        case TAG_STRIP_BYTE_COUNTS:
+            if (n == 1)
+                strip_length = entry_value(s, e);
+            break;
+        case TAG_SUB_IFDS:
+            if (n == 1) {
+                scan_ifd(s, get32(s, e + 8), depth + 1, c);
+            } else {
+                for (uint32_t k = 0; k < n && k < EXIF_MAX_CANDIDATES; k++) {
+                    if (read_at(s, s->base + get32(s, e + 8) + k * 4, b, 4))
+                        scan_ifd(s, get32(s, b), depth + 1, c);
+                }
+            }
+            break;
+        }
+    }
+    uint32_t next = get32(s, entries + count * 12);
+    free(entries);
+
+    if (jpeg_offset && jpeg_length)
+        add_candidate(s, c, s->base + jpeg_offset, jpeg_length);
+    // Old-style (6) or new-style (7) JPEG compression
+    if ((compression == 6 || compression == 7) && strip_offset && strip_length)
+        add_candidate(s, c, s->base + strip_offset, strip_length);
+    return next;
+}
+
+static int parse_tiff(ExifSource* s, int64_t base, Candidates* c) {
+    uint8_t b[8];
+    if (!read_at(s, base, b, 8))
+        return 0;
+    if (b[0] == 'I' && b[1] == 'I')
+        s->le = 1;
+    else if (b[0] == 'M' && b[1] == 'M')
+        s->le = 0;
+    else
+        return 0;
+    // 42 for TIFF, DNG and most RAW formats, ORF and RW2 use their own magic
+    uint16_t magic = get16(s, b + 2);
+    if (magic != 42 && magic != 0x4F52 && magic != 0x5352 && magic != 0x55)
+        return 0;
+    s->base = base;
+
+    uint32_t ifd = get32(s, b + 4);
+    for (int i = 0; ifd && i < 8; i++)
+        ifd = scan_ifd(s, ifd, 0, c);
+    return 1;
+}
+
+// Walks the JPEG markers before the image data for the EXIF APP1 segment.
+static int parse_jpeg(ExifSource* s, Candidates* c) {
+    size_t pos = 2;
+    while (pos + 4 <= s->head_len && s->head[pos] == 0xFF) {
+        int marker = s->head[pos + 1];
+        size_t seglen = (size_t)s->head[pos + 2] << 8 | s->head[pos + 3];
+        if (marker == 0xDA || seglen < 2)
+            break;
+        if (marker == 0xE1 && seglen >= 16 && pos + 10 <= s->head_len && !memcmp(s->head + pos + 4, "Exif\0\0", 6))
+            return parse_tiff(s, pos + 10, c);
+        pos += 2 + seglen;
+    }
+    return 0;
+}
+
+// RAF: a fixed header pointing at a JPEG preview, followed by TIFF data.
+static int parse_raf(ExifSource* s, Candidates* c) {
+    if (s->head_len < 92)
+        return 0;
+    s->le = 0;
+    add_candidate(s, c, get32(s, s->head + 84), get32(s, s->head + 88));
+    return 1;
+}
+
+int GetEmbeddedThumbnail(const char* filePath, int thumbWidth, int thumbHeight, EmbeddedThumbnail* thumb) {
+    memset(thumb, 0, sizeof(*thumb));
+    // Without a box any preview would be smaller than asked for
+    if (thumbWidth <= 0 && thumbHeight <= 0)
+        return 0;
+
+    ExifSource* s = malloc(sizeof(*s));
+    if (!s)
+        return 0;
+    s->fd = open(filePath, O_RDONLY | O_CLOEXEC);
+    if (s->fd < 0) {
+        free(s);
+        return 0;
+    }
+    s->size = lseek(s->fd, 0, SEEK_END);
+    ssize_t n = pread(s->fd, s->head, EXIF_HEAD_SIZE, 0);
+    s->head_len = n > 0 ? n : 0;
+    s->base = 0;
+    s->le = 0;
+
+    Candidates c = {.count = 0};
+    if (s->head_len >= 4 && s->head[0] == 0xFF && s->head[1] == 0xD8)
+        parse_jpeg(s, &c);
+    else if (s->head_len >= 16 && !memcmp(s->head, "FUJIFILMCCD-RAW", 15))
+        parse_raf(s, &c);
+    else
+        parse_tiff(s, 0, &c);
+
+    // The smallest preview that still has to be scaled down to the box
+    const Candidate* best = NULL;
+    for (int i = 0; i < c.count; i++) {
+        const Candidate* cand = &c.list[i];
+        int tw, th;
+        thumbnail_fit(cand->width, cand->height, thumbWidth, thumbHeight, &tw, &th);
+        int fills = (thumbWidth > 0 && tw >= thumbWidth) || (thumbHeight > 0 && th >= thumbHeight);
+        if (fills && (!best || (int64_t)cand->width * cand->height < (int64_t)best->width * best->height))
+            best = cand;
+    }
+    if (best && (thumb->data = malloc(best->length))) {
+        if (read_at(s, best->offset, thumb->data, best->length)) {
+            thumb->size = best->length;
+            thumb->width = best->width;
+            thumb->height = best->height;
+        } else {
+            free(thumb->data);
+            thumb->data = NULL;
+        }
+    }
+    close(s->fd);
+    free(s);
+    return thumb->data != NULL;
+}
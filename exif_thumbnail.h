@@ -0,0 +1,24 @@
+// exif_thumbnail.h
+#ifndef EXIF_THUMBNAIL_H
+#define EXIF_THUMBNAIL_H
+
+#include <stddef.h>
+
+// A JPEG preview stored in the file itself, e.g. the EXIF IFD1 thumbnail of
+// a camera JPEG or the previews in the IFDs of a TIFF based RAW file.
+typedef struct {
+    unsigned char* data; // the embedded JPEG, malloc'd (use free to release)
+    size_t size;
+    int width;
+    int height;
+} EmbeddedThumbnail;
+
+// Finds the smallest embedded JPEG that still fills thumbWidth x thumbHeight
+// (fitted with the aspect ratio kept, a side <= 0 is unconstrained) and
+// reads it without decoding anything. Only the header region and the
+// preview itself are read. Supports JPEG/EXIF, TIFF based RAW (DNG, CR2,
+// NEF, ARW, ORF, RW2, PEF...) and RAF. Returns 1 on success, 0 if there is
+// none large enough.
+int GetEmbeddedThumbnail(const char* filePath, int thumbWidth, int thumbHeight, EmbeddedThumbnail* thumb);
+
+#endif // EXIF_THUMBNAIL_H
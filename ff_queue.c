@@ -0,0 +1,136 @@
+/**
+ * @file ff_queue.c
+ * @brief Bounded lock-free SPSC queue used between the converter pipeline stages.
+ */
+
+#include "ff_queue.h"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <libavutil/error.h>
+#include <libavutil/time.h>
+
+#define SPIN_ATTEMPTS 64
+#define YIELD_ATTEMPTS 16
+#define MIN_SLEEP_US 50
+#define MAX_SLEEP_US 1000
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+void ff_queue_backoff(unsigned *attempt)
+{
+    unsigned n = (*attempt)++;
+    if (n < SPIN_ATTEMPTS) {
+        cpu_relax();
+    } else if (n < SPIN_ATTEMPTS + YIELD_ATTEMPTS) {
+        sched_yield();
+    } else {
+        unsigned shift = n - SPIN_ATTEMPTS - YIELD_ATTEMPTS;
+        long us = shift < 5 ? MIN_SLEEP_US << shift : MAX_SLEEP_US;
+        if (us > MAX_SLEEP_US)
+            us = MAX_SLEEP_US;
+        struct timespec ts = {0, us * 1000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+int ff_queue_init(FFQueue *q, uint32_t capacity, void (*free_item)(void *item), const atomic_int *abort)
+{
+    uint32_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    q->items = calloc(size, sizeof(*q->items));
+    if (!q->items)
+        return AVERROR(ENOMEM);
+    q->mask = size - 1;
+    q->free_item = free_item;
+    q->abort = abort;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return 0;
+}
+
+void ff_queue_uninit(FFQueue *q)
+{
+    if (!q->items)
+        return;
+    void *item;
+    while (ff_queue_peek(q, &item)) {
+        if (item && q->free_item)
+            q->free_item(item);
+        atomic_store_explicit(&q->head, atomic_load_explicit(&q->head, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+    }
+    free(q->items);
+    q->items = NULL;
+}
+
+static int aborted(const FFQueue *q)
+{
+    return q->abort && atomic_load_explicit(q->abort, memory_order_relaxed);
+}
+
+int ff_queue_push(FFQueue *q, void *item, int64_t *wait_us)
+{
+    uint64_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    int64_t start = 0;
+    unsigned attempt = 0;
+
+    while (tail - atomic_load_explicit(&q->head, memory_order_acquire) > q->mask) {
+        if (aborted(q))
+            return AVERROR_EXIT;
+        if (!start)
+            start = av_gettime_relative();
+        ff_queue_backoff(&attempt);
+    }
+    if (start && wait_us)
+        *wait_us += av_gettime_relative() - start;
+
+    q->items[tail & q->mask] = item;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+int ff_queue_peek(FFQueue *q, void **item)
+{
+    uint64_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&q->tail, memory_order_acquire))
+        return 0;
+    *item = q->items[head & q->mask];
+    return 1;
+}
+
+int ff_queue_pop(FFQueue *q, void **item, int64_t *wait_us)
+{
+    int64_t start = 0;
+    unsigned attempt = 0;
+
+    while (!ff_queue_peek(q, item)) {
+        if (aborted(q))
+            return AVERROR_EXIT;
+        if (!start)
+            start = av_gettime_relative();
+        ff_queue_backoff(&attempt);
+    }
+    if (start && wait_us)
+        *wait_us += av_gettime_relative() - start;
+
+    uint64_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return 0;
+}
+
+uint32_t ff_queue_size(FFQueue *q)
+{
+    return (uint32_t)(atomic_load_explicit(&q->tail, memory_order_acquire) -
+                      atomic_load_explicit(&q->head, memory_order_acquire));
+}
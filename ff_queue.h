@@ -0,0 +1,99 @@
+#ifndef FF_QUEUE_H
+#define FF_QUEUE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @file ff_queue.h
+ * @brief Bounded lock-free single-producer/single-consumer queue connecting converter stages.
+ *
+ * Items are pointers (AVPacket*, AVFrame*) handed over by reference, so no payload is copied.
+ * A NULL item is a valid element and is used by the converter to mark end of stream. A blocked
+ * side spins briefly, then yields, then sleeps with exponential backoff, so idle stages cost
+ * little CPU (one wakeup per maximum sleep) and busy ones hand over without a system call.
+ */
+
+/**
+ * @struct FFQueue
+ * @brief Ring of `capacity` pointers. Head and tail live on separate cache lines.
+ */
+typedef struct {
+    void **items;
+    uint32_t mask;                          /**< capacity - 1, capacity is a power of two. */
+    void (*free_item)(void *item);          /**< Releases items left over on teardown, may be NULL. */
+    const atomic_int *abort;                /**< Waits give up once this is set, may be NULL. */
+    _Alignas(64) atomic_uint_fast64_t head; /**< Next slot to pop, written by the consumer. */
+    _Alignas(64) atomic_uint_fast64_t tail; /**< Next slot to push, written by the producer. */
+} FFQueue;
+
+/**
+ * @brief Initializes a queue.
+ *
+ * @param q         Queue to initialize.
+ * @param capacity  Minimum number of items, rounded up to a power of two.
+ * @param free_item Called for every item still queued by ff_queue_uninit.
+ * @param abort     Flag ending all waits with AVERROR_EXIT when nonzero, or NULL.
+ * @return 0 on success, a negative AVERROR on failure.
+ */
+int ff_queue_init(FFQueue *q, uint32_t capacity, void (*free_item)(void *item), const atomic_int *abort);
+
+/**
+ * @brief Releases the queue and every item still in it.
+ */
+void ff_queue_uninit(FFQueue *q);
+
+/**
+ * @brief Appends item, waiting while the queue is full. Producer side only.
+ *
+ * @param wait_us Incremented by the time spent waiting, may be NULL.
+ * @return 0 on success, AVERROR_EXIT if the abort flag was raised. The item is not queued then.
+ */
+int ff_queue_push(FFQueue *q, void *item, int64_t *wait_us);
+
+/**
+ * @brief Removes the oldest item, waiting while the queue is empty. Consumer side only.
+ *
+ * @param wait_us Incremented by the time spent waiting, may be NULL.
+ * @return 0 on success, AVERROR_EXIT if the abort flag was raised.
+ */
+int ff_queue_pop(FFQueue *q, void **item, int64_t *wait_us);
+
+/**
+ * @brief Returns the oldest item without removing it. Consumer side only.
+ *
+ * @return 1 if an item was stored in *item, 0 if the queue is empty.
+ */
+int ff_queue_peek(FFQueue *q, void **item);
+
+/**
+ * @brief Number of queued items. Exact on the consumer side, a lower bound elsewhere.
+ */
+uint32_t ff_queue_size(FFQueue *q);
+
+/**
+ * @brief Capacity of the queue.
+ */
+static inline uint32_t ff_queue_capacity(const FFQueue *q)
+{
+    return q->mask + 1;
+}
+
+/**
+ * @brief Waits before the next attempt of a retry loop.
+ *
+ * Spins for the first attempts, then yields, then sleeps from 50 us doubling up to 1 ms.
+ *
+ * @param attempt Number of failed attempts so far, incremented by the call.
+ */
+void ff_queue_backoff(unsigned *attempt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FF_QUEUE_H
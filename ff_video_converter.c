@@ -5,298 +5,3183 @@
  * This file contains the implementation of the convert_avi_to_h264_aac function,
  * which supports conversion of AVI files with flexible codec and bitrate configuration,
  * including support for H.264 CRF mode and preset selection based on CRF value.
+ * The conversion runs as a pipeline of threads connected by bounded queues (ff_queue.h),
+ * so demuxing, decoding, scaling, encoding and muxing overlap.
  */
 
-#include "ffmpeg_avi_to_h264_aac.h"
+#include "ff_video_converter.h"
+#include "ff_queue.h"
+#include "avwrapper_interrupt.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/avstring.h>
+#include <libavutil/common.h>
+#include <libavutil/cpu.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/intreadwrite.h>
 #include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
 #include <libswscale/swscale.h>
 #include <libswresample/swresample.h>
 
+/** Bands are multiples of this many rows, which covers every chroma subsampling. */
+#define SCALE_BAND_ALIGN 16
+/** Frames shorter than this per thread are not worth splitting further. */
+#define SCALE_MIN_BAND_ROWS 64
+
+struct ScalePool;
+
+/**
+ * @brief One horizontal band of the frame, converted by its own SwsContext.
+ */
+typedef struct {
+    struct ScalePool *pool;
+    struct SwsContext *sws;
+    int y;      /**< First row of the band. */
+    int height; /**< Rows in the band. */
+} ScaleBand;
+
+/**
+ * @brief Row-banded parallel pixel format conversion.
+ *
+ * swscale has no internal threading in the FFmpeg versions this file targets, so a frame is split
+ * into horizontal bands that are converted concurrently. The caller converts band 0 itself while
+ * one worker per remaining band does the others. Bands need rows that map one to one, so a pool
+ * that also resizes (a rendition smaller than the source) converts the frame as a single band.
+ */
+typedef struct ScalePool {
+    ScaleBand *bands;
+    int nb_bands;
+    pthread_t *threads; /**< Workers for bands 1 .. nb_bands-1. */
+    int nb_threads;     /**< Workers actually started. */
+    const AVPixFmtDescriptor *src_desc, *dst_desc;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    const AVFrame *src;
+    AVFrame *dst;
+    unsigned generation; /**< Bumped for every frame handed to the workers. */
+    int pending;         /**< Worker bands not yet converted for this generation. */
+    int quit;
+} ScalePool;
+
+/**
+ * @brief Resolves a thread count where 0 (or less) means one per CPU.
+ */
+static int resolve_threads(int threads)
+{
+    return threads > 0 ? threads : av_cpu_count();
+}
+
+/**
+ * @brief Computes the plane pointers of `frame` starting at row `y`.
+ */
+static void band_planes(const AVFrame *frame, const AVPixFmtDescriptor *desc, int y, uint8_t *planes[4])
+{
+    for (int p = 0; p < 4; p++) {
+        int shift = (p == 1 || p == 2) ? desc->log2_chroma_h : 0;
+        planes[p] = frame->data[p] ? frame->data[p] + (y >> shift) * frame->linesize[p] : NULL;
+    }
+}
+
+static void scale_band(const ScalePool *pool, const ScaleBand *band)
+{
+    uint8_t *src[4], *dst[4];
+    band_planes(pool->src, pool->src_desc, band->y, src);
+    band_planes(pool->dst, pool->dst_desc, band->y, dst);
+    sws_scale(band->sws, (const uint8_t * const *)src, pool->src->linesize, 0, band->height, dst, pool->dst->linesize);
+}
+
+static void *scale_worker(void *arg)
+{
+    ScaleBand *band = arg;
+    ScalePool *pool = band->pool;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->generation == seen && !pool->quit)
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        if (pool->quit)
+            break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        scale_band(pool, band);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+            pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void scale_pool_free(ScalePool **ppool)
+{
+    ScalePool *pool = *ppool;
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nb_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+    for (int i = 0; i < pool->nb_bands; i++)
+        sws_freeContext(pool->bands[i].sws);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    av_free(pool->threads);
+    av_free(pool->bands);
+    av_freep(ppool);
+}
+
+/**
+ * @brief Creates a pool converting src_w x src_h frames in src_fmt to dst_w x dst_h in dst_fmt.
+ *
+ * @param threads Number of bands, 0 = one per CPU. Capped so that bands keep at least
+ *                SCALE_MIN_BAND_ROWS rows. Palette and bitstream formats always use one band,
+ *                their rows cannot be addressed independently, and so does resizing.
+ * @return The pool, or NULL on error.
+ */
+static ScalePool *scale_pool_create(int src_w, int src_h, enum AVPixelFormat src_fmt,
+                                    int dst_w, int dst_h, enum AVPixelFormat dst_fmt, int threads)
+{
+    const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get(src_fmt);
+    const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get(dst_fmt);
+    if (!src_desc || !dst_desc)
+        return NULL;
+
+    threads = FFMIN(resolve_threads(threads), src_h / SCALE_MIN_BAND_ROWS);
+    if ((src_desc->flags | dst_desc->flags) & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM) ||
+        src_w != dst_w || src_h != dst_h)
+        threads = 1;
+    threads = FFMAX(threads, 1);
+
+    ScalePool *pool = av_mallocz(sizeof(*pool));
+    if (!pool)
+        return NULL;
+    pool->src_desc = src_desc;
+    pool->dst_desc = dst_desc;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->bands = av_calloc(threads, sizeof(*pool->bands));
+    pool->threads = av_calloc(threads, sizeof(*pool->threads));
+    if (!pool->bands || !pool->threads)
+        goto fail;
+
+    int rows = FFALIGN((src_h + threads - 1) / threads, SCALE_BAND_ALIGN);
+    for (int y = 0; y < src_h; y += rows) {
+        ScaleBand *band = &pool->bands[pool->nb_bands];
+        band->pool = pool;
+        band->y = y;
+        band->height = FFMIN(rows, src_h - y);
+        // A single band is the whole frame, the only case where the sizes may differ
+        band->sws = sws_getContext(src_w, band->height, src_fmt, dst_w, threads > 1 ? band->height : dst_h, dst_fmt,
+                                   SWS_BICUBIC, NULL, NULL, NULL);
+        if (!band->sws)
+            goto fail;
+        pool->nb_bands++;
+    }
+    for (int i = 1; i < pool->nb_bands; i++) {
+        if (pthread_create(&pool->threads[pool->nb_threads], NULL, scale_worker, &pool->bands[i]) != 0)
+            goto fail;
+        pool->nb_threads++;
+    }
+    return pool;
+
+fail:
+    scale_pool_free(&pool);
+    return NULL;
+}
+
+/**
+ * @brief Converts src into dst, which must be writable, using every band of the pool.
+ */
+static void scale_pool_run(ScalePool *pool, const AVFrame *src, AVFrame *dst)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->src = src;
+    pool->dst = dst;
+    pool->pending = pool->nb_bands - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    scale_band(pool, &pool->bands[0]);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * @brief Applies the thread settings of params to a codec context before it is opened.
+ *
+ * @param threads Requested thread count. 0 keeps the libav default of auto detection.
+ */
+static void set_codec_threads(AVCodecContext *ctx, int threads, const Params *params)
+{
+    ctx->thread_count = threads;
+    ctx->thread_type = params && params->thread_type ? params->thread_type : FF_THREAD_FRAME | FF_THREAD_SLICE;
+}
+
+/** Packets buffered between the demuxer and each decoder, and between the encoders and the muxer. */
+#define PACKET_QUEUE_SIZE 64
+/** Raw frames buffered between decode, scale and encode. Kept small, a 1080p frame is 3 MB. */
+#define FRAME_QUEUE_SIZE 8
+/** Packets read ahead at most to find the extradata of copied streams. */
+#define PREREAD_MAX_PACKETS 512
+/** Interval at which the calling thread checks Params.timeout_us and Params.cancel while the stages run. */
+#define INTERRUPT_POLL_US (50 * 1000)
+
+enum {
+    STAGE_DEMUX,
+    STAGE_VIDEO_DECODE,
+    STAGE_VIDEO_SEGMENTS,
+    STAGE_AUDIO_DECODE,
+    STAGE_AUDIO_ENCODE,
+    STAGE_NB
+};
+
+/** Stages running once per output. */
+enum {
+    OUTPUT_STAGE_SCALE,
+    OUTPUT_STAGE_VIDEO_ENCODE,
+    OUTPUT_STAGE_MUX,
+    OUTPUT_STAGE_NB
+};
+
+static const char *const stage_names[STAGE_NB] = {
+    "demux", "video_decode", "video_segments", "audio_decode", "audio_encode",
+};
+
+static const char *const output_stage_names[OUTPUT_STAGE_NB] = {
+    "scale", "video_encode", "mux",
+};
+
+struct Pipeline;
+struct Output;
+struct SegmentJob;
+
+/**
+ * @brief One pipeline thread with its codec and queues.
+ */
+typedef struct {
+    struct Pipeline *pipe;
+    struct Output *output;  /**< Output served by scale, video_encode and mux, NULL for shared stages. */
+    AVCodecContext *codec;  /**< Decoder or encoder of the stage, NULL for demux, scale and mux. */
+    FFQueue *in;
+    FFQueue *outs[CONVERT_MAX_RENDITIONS]; /**< Every queue receives each item, see push_frame. */
+    int nb_outs;
+    ConvertStageStats stats;
+    pthread_t thread;
+    int used;               /**< The stage is part of this conversion. */
+    int started;
+} Stage;
+
+/**
+ * @brief A stream passed through without decoding.
+ */
+typedef struct {
+    int enabled;
+    AVStream *in;
+    AVBSFContext *bsf;       /**< Converts the bitstream for the output container, may be NULL. */
+    AVCodecParameters *par;  /**< Parameters of the output streams, completed by find_extradata. */
+    AVRational time_base;    /**< Time base of the packets sent to the muxers. */
+    FFQueue *queues[CONVERT_MAX_RENDITIONS]; /**< Mux queues the demuxer sends the packets to. */
+    int nb_queues;
+} CopyStream;
+
+/**
+ * @brief One output file and the stages working for it alone.
+ *
+ * Packets are queued for the muxer in the time base they were produced in (src_time_base) and
+ * converted by the muxer, so one encoded or copied packet can be shared by every output.
+ */
+typedef struct Output {
+    const Rendition *spec;
+    AVFormatContext *fmt_ctx;
+    AVStream *streams[2];         /**< Video and audio stream, [1] is NULL without audio. */
+    AVRational src_time_base[2];  /**< Time base of the packets in video_out and audio_out. */
+    AVCodecContext *video_enc;    /**< NULL when the video is copied. */
+    ScalePool *scaler;
+    AVBufferPool *scaled_pool;    /**< Buffers of converted frames, reused once the encoder releases them. */
+    FFQueue decoded_frames, scaled_frames;
+    FFQueue video_out, audio_out;
+    Stage stages[OUTPUT_STAGE_NB];
+} Output;
+
+/**
+ * @brief State shared by the stages of one conversion.
+ *
+ * demux -> video_packets -> video_decode => decoded_frames -> scale -> scaled_frames -> video_encode -> video_out -> mux
+ * demux -> audio_packets -> audio_decode -> audio_frames -> audio_encode => audio_out -> mux
+ *
+ * Stages after a `=>` exist once per output: video_decode hands every frame to the scaler (or,
+ * without pixel format conversion and resizing, directly to the encoder) of each output, and the
+ * audio is encoded once for all of them. A copied stream skips decoding and encoding: demux
+ * filters its packets and sends them to video_out or audio_out. In segmented mode
+ * (Params.segments) the video_segments stage replaces the video path and feeds video_out from its
+ * own workers, see SegmentJob.
+ * Every queue has one producer and one consumer. A NULL item marks the end of a stream.
+ */
+typedef struct Pipeline {
+    AVFormatContext *input_fmt_ctx;
+    int video_stream_index, audio_stream_index;
+    Output outputs[CONVERT_MAX_RENDITIONS];
+    int nb_outputs;
+    CopyStream copy[2];          /**< Video and audio stream copy state. */
+    AVPacket **preread;          /**< Packets read by find_extradata, demuxed first. */
+    int nb_preread;
+    AVRational audio_in_time_base;
+    struct SegmentJob *segments; /**< Set when the video is transcoded in parallel segments. */
+    struct SwrContext *swr_ctx;
+    ConvertStageStats resample;  /**< swresample time, measured by audio_encode. */
+    FFQueue video_packets, audio_packets, audio_frames;
+    Stage stages[STAGE_NB];
+    atomic_int abort;
+    atomic_int error;            /**< First failure, 0 if none. */
+    atomic_int_fast64_t bytes_read, bytes_written, frames, position_us; /**< Live ConvertProgress counters. */
+    pthread_mutex_t lock;
+    pthread_cond_t stage_done;   /**< Signalled whenever a stage finishes. */
+    int running;                 /**< Stages started and not yet finished, guarded by lock. */
+    int cancelled;               /**< progress_callback asked to stop. */
+    MediaInterrupt interrupt;    /**< Params.timeout_us and Params.cancel, the interrupt callback of every context. */
+} Pipeline;
+
+static void packet_free(void *item)
+{
+    AVPacket *pkt = item;
+    av_packet_free(&pkt);
+}
+
+static void frame_free(void *item)
+{
+    AVFrame *frame = item;
+    av_frame_free(&frame);
+}
+
+/**
+ * @brief Records the first error and stops every stage.
+ */
+static void pipeline_fail(Pipeline *pipe, int err)
+{
+    int expected = 0;
+    atomic_compare_exchange_strong(&pipe->error, &expected, err);
+    atomic_store(&pipe->abort, 1);
+}
+
+/**
+ * @brief Finishes the stats of a stage and reports a failure to the pipeline.
+ */
+static void *stage_end(Stage *s, int64_t start, int ret)
+{
+    Pipeline *pipe = s->pipe;
+    s->stats.busy_us = av_gettime_relative() - start - s->stats.wait_in_us - s->stats.wait_out_us;
+    if (ret < 0 && ret != AVERROR_EXIT)
+        pipeline_fail(pipe, ret);
+    pthread_mutex_lock(&pipe->lock);
+    pipe->running--;
+    pthread_cond_signal(&pipe->stage_done);
+    pthread_mutex_unlock(&pipe->lock);
+    return NULL;
+}
+
+/**
+ * @brief Computes the CLOCK_REALTIME deadline `us` microseconds from now, for pthread_cond_timedwait.
+ */
+static void deadline_after(struct timespec *deadline, int64_t us)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += us / 1000000;
+    deadline->tv_nsec += us % 1000000 * 1000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/**
+ * @brief Maps an input stream index to 0 for video, 1 for audio and -1 for ignored streams.
+ */
+static int stream_slot(const Pipeline *pipe, int stream_index)
+{
+    if (stream_index == pipe->video_stream_index)
+        return 0;
+    if (stream_index == pipe->audio_stream_index)
+        return 1;
+    return -1;
+}
+
+/**
+ * @brief Nonzero if the demux stage feeds stream slot i (0 video, 1 audio).
+ */
+static int demuxed(const Pipeline *pipe, int i)
+{
+    return i == 0 ? !pipe->segments : pipe->audio_stream_index >= 0;
+}
+
+/**
+ * @brief Queues frame on every queue, a new reference on all but the last. Takes ownership of frame.
+ *
+ * A NULL frame marks the end of the stream on every queue.
+ */
+static int push_frame(FFQueue *const *queues, int nb_queues, AVFrame *frame, int64_t *wait_us)
+{
+    for (int i = 0; i < nb_queues; i++) {
+        AVFrame *item = frame;
+        if (frame && i < nb_queues - 1 && !(item = av_frame_clone(frame))) {
+            av_frame_free(&frame);
+            return AVERROR(ENOMEM);
+        }
+        int ret = ff_queue_push(queues[i], item, wait_us);
+        if (ret < 0) {
+            if (item != frame)
+                av_frame_free(&item);
+            av_frame_free(&frame);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Same as push_frame for packets.
+ */
+static int push_packet(FFQueue *const *queues, int nb_queues, AVPacket *pkt, int64_t *wait_us)
+{
+    for (int i = 0; i < nb_queues; i++) {
+        AVPacket *item = pkt;
+        if (pkt && i < nb_queues - 1 && !(item = av_packet_clone(pkt))) {
+            av_packet_free(&pkt);
+            return AVERROR(ENOMEM);
+        }
+        int ret = ff_queue_push(queues[i], item, wait_us);
+        if (ret < 0) {
+            if (item != pkt)
+                av_packet_free(&item);
+            av_packet_free(&pkt);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Queues a packet of a copied stream for the muxers.
+ */
+static int push_copied(Stage *s, CopyStream *cs, AVPacket *pkt)
+{
+    pkt->pos = -1;
+    return push_packet(cs->queues, cs->nb_queues, pkt, &s->stats.wait_out_us);
+}
+
+/**
+ * @brief Sends pkt of a copied stream through its bitstream filter to the muxers.
+ *
+ * A NULL pkt drains the filter and marks the end of the stream.
+ */
+static int copy_packet(Stage *s, CopyStream *cs, AVPacket *pkt)
+{
+    int eof = !pkt;
+    int ret = 0;
+
+    if (cs->bsf) {
+        ret = av_bsf_send_packet(cs->bsf, pkt);
+        av_packet_free(&pkt);
+        if (ret < 0)
+            return ret == AVERROR_INVALIDDATA ? 0 : ret; // skipped like a corrupt packet on decode
+        for (;;) {
+            if (!(pkt = av_packet_alloc()))
+                return AVERROR(ENOMEM);
+            if ((ret = av_bsf_receive_packet(cs->bsf, pkt)) < 0) {
+                av_packet_free(&pkt);
+                break;
+            }
+            if ((ret = push_copied(s, cs, pkt)) < 0)
+                return ret;
+        }
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            return ret;
+        ret = 0;
+    } else if (pkt) {
+        ret = push_copied(s, cs, pkt);
+    }
+    if (ret == 0 && eof)
+        ret = push_packet(cs->queues, cs->nb_queues, NULL, &s->stats.wait_out_us);
+    return ret;
+}
+
+static void *demux_thread(void *arg)
+{
+    Stage *s = arg;
+    Pipeline *pipe = s->pipe;
+    FFQueue *packet_queues[2] = {&pipe->video_packets, &pipe->audio_packets};
+    int next_preread = 0;
+    int64_t start = av_gettime_relative();
+    int ret = 0;
+
+    for (;;) {
+        AVPacket *pkt;
+        if (next_preread < pipe->nb_preread) {
+            pkt = pipe->preread[next_preread];
+            pipe->preread[next_preread++] = NULL;
+        } else {
+            if (!(pkt = av_packet_alloc())) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            // As before, any read error ends the input so truncated files still convert
+            if (av_read_frame(pipe->input_fmt_ctx, pkt) < 0) {
+                av_packet_free(&pkt);
+                break;
+            }
+        }
+        int i = stream_slot(pipe, pkt->stream_index);
+        if (i < 0 || !demuxed(pipe, i)) {
+            av_packet_free(&pkt);
+            continue;
+        }
+        s->stats.items++;
+        s->stats.bytes += pkt->size;
+        atomic_fetch_add_explicit(&pipe->bytes_read, pkt->size, memory_order_relaxed);
+        if (pipe->copy[i].enabled) {
+            ret = copy_packet(s, &pipe->copy[i], pkt);
+        } else if ((ret = ff_queue_push(packet_queues[i], pkt, &s->stats.wait_out_us)) < 0) {
+            av_packet_free(&pkt);
+        }
+        if (ret < 0)
+            break;
+    }
+    for (int i = 0; i < 2 && ret == 0; i++) {
+        if (!demuxed(pipe, i))
+            continue;
+        if (pipe->copy[i].enabled)
+            ret = copy_packet(s, &pipe->copy[i], NULL);
+        else
+            ret = ff_queue_push(packet_queues[i], NULL, &s->stats.wait_out_us);
+    }
+    return stage_end(s, start, ret);
+}
+
+static void *decode_thread(void *arg)
+{
+    Stage *s = arg;
+    int64_t start = av_gettime_relative();
+    int ret;
+
+    for (;;) {
+        AVPacket *pkt;
+        if ((ret = ff_queue_pop(s->in, (void **)&pkt, &s->stats.wait_in_us)) < 0)
+            break;
+        int eof = !pkt;
+        if (pkt)
+            s->stats.bytes += pkt->size;
+        // Corrupt packets are skipped, a NULL packet drains the decoder
+        avcodec_send_packet(s->codec, pkt);
+        av_packet_free(&pkt);
+
+        for (;;) {
+            AVFrame *frame = av_frame_alloc();
+            if (!frame) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+            if ((ret = avcodec_receive_frame(s->codec, frame)) < 0) {
+                av_frame_free(&frame);
+                if (ret == AVERROR(ENOMEM))
+                    goto end;
+                break;
+            }
+            frame->pts = frame->best_effort_timestamp;
+            s->stats.items++;
+            if ((ret = push_frame(s->outs, s->nb_outs, frame, &s->stats.wait_out_us)) < 0)
+                goto end;
+        }
+        if (eof) {
+            ret = push_frame(s->outs, s->nb_outs, NULL, &s->stats.wait_out_us);
+            break;
+        }
+    }
+end:
+    return stage_end(s, start, ret);
+}
+
+static void *scale_thread(void *arg)
+{
+    Stage *s = arg;
+    Output *o = s->output;
+    AVCodecContext *enc = o->video_enc;
+    int64_t start = av_gettime_relative();
+    int ret;
+
+    for (;;) {
+        AVFrame *in, *out;
+        if ((ret = ff_queue_pop(s->in, (void **)&in, &s->stats.wait_in_us)) < 0)
+            break;
+        if (!in) {
+            ret = ff_queue_push(s->outs[0], NULL, &s->stats.wait_out_us);
+            break;
+        }
+        if (!(out = av_frame_alloc()) || !(out->buf[0] = av_buffer_pool_get(o->scaled_pool))) {
+            av_frame_free(&in);
+            av_frame_free(&out);
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        out->format = enc->pix_fmt;
+        out->width = enc->width;
+        out->height = enc->height;
+        av_image_fill_arrays(out->data, out->linesize, out->buf[0]->data, enc->pix_fmt, enc->width, enc->height, 32);
+        av_frame_copy_props(out, in);
+        scale_pool_run(o->scaler, in, out);
+        av_frame_free(&in);
+
+        s->stats.items++;
+        if ((ret = ff_queue_push(s->outs[0], out, &s->stats.wait_out_us)) < 0) {
+            av_frame_free(&out);
+            break;
+        }
+    }
+    return stage_end(s, start, ret);
+}
+
+/**
+ * @brief Sends frame (NULL to flush) to the encoder of s and queues every packet it returns.
+ *
+ * Packets keep the encoder time base, the muxers convert them.
+ */
+static int encode_frame(Stage *s, AVFrame *frame)
+{
+    int ret = avcodec_send_frame(s->codec, frame);
+    if (ret < 0 && ret != AVERROR_EOF)
+        return ret;
+
+    for (;;) {
+        AVPacket *pkt = av_packet_alloc();
+        if (!pkt)
+            return AVERROR(ENOMEM);
+        if ((ret = avcodec_receive_packet(s->codec, pkt)) < 0) {
+            av_packet_free(&pkt);
+            return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+        }
+        s->stats.items++;
+        s->stats.bytes += pkt->size;
+        if ((ret = push_packet(s->outs, s->nb_outs, pkt, &s->stats.wait_out_us)) < 0)
+            return ret;
+    }
+}
+
+static void *video_encode_thread(void *arg)
+{
+    Stage *s = arg;
+    int64_t start = av_gettime_relative();
+    int ret;
+
+    for (;;) {
+        AVFrame *frame;
+        if ((ret = ff_queue_pop(s->in, (void **)&frame, &s->stats.wait_in_us)) < 0)
+            break;
+        int eof = !frame;
+        if (frame) {
+            // The decoder's picture types would otherwise force the source GOP structure
+            frame->pict_type = AV_PICTURE_TYPE_NONE;
+        }
+        ret = encode_frame(s, frame);
+        av_frame_free(&frame);
+        if (ret < 0 || eof)
+            break;
+    }
+    if (ret == 0)
+        ret = push_packet(s->outs, s->nb_outs, NULL, &s->stats.wait_out_us);
+    return stage_end(s, start, ret);
+}
+
+/**
+ * @brief Feeds the resampled audio into frames of the encoder frame size.
+ *
+ * Decoded audio frames rarely match the encoder frame size (AAC needs exactly 1024 samples), so
+ * samples are collected in a FIFO and cut into encoder sized frames. Timestamps are counted in
+ * samples from the first input frame, which keeps the track continuous.
+ */
+static void *audio_encode_thread(void *arg)
+{
+    Stage *s = arg;
+    Pipeline *pipe = s->pipe;
+    AVCodecContext *enc = s->codec;
+    int frame_size = enc->frame_size ? enc->frame_size : 1024;
+    AVAudioFifo *fifo = av_audio_fifo_alloc(enc->sample_fmt, enc->channels, 2 * frame_size);
+    uint8_t **converted = NULL;
+    int converted_size = 0;
+    int64_t next_pts = AV_NOPTS_VALUE;
+    int64_t start = av_gettime_relative();
+    int ret = fifo ? 0 : AVERROR(ENOMEM);
+
+    while (ret == 0) {
+        AVFrame *frame;
+        if ((ret = ff_queue_pop(s->in, (void **)&frame, &s->stats.wait_in_us)) < 0)
+            break;
+        if (frame && next_pts == AV_NOPTS_VALUE)
+            next_pts = frame->pts == AV_NOPTS_VALUE ? 0 : av_rescale_q(frame->pts, pipe->audio_in_time_base, enc->time_base);
+
+        if (pipe->swr_ctx) {
+            // Resample, or drain the resampler once the input ended
+            int samples = swr_get_out_samples(pipe->swr_ctx, frame ? frame->nb_samples : 0);
+            if (samples > converted_size) {
+                if (converted)
+                    av_freep(&converted[0]);
+                av_freep(&converted);
+                if ((ret = av_samples_alloc_array_and_samples(&converted, NULL, enc->channels, samples, enc->sample_fmt, 0)) < 0) {
+                    av_frame_free(&frame);
+                    break;
+                }
+                converted_size = samples;
+            }
+            int64_t resample_start = av_gettime_relative();
+            samples = swr_convert(pipe->swr_ctx, converted, converted_size,
+                                  frame ? (const uint8_t **)frame->extended_data : NULL, frame ? frame->nb_samples : 0);
+            pipe->resample.busy_us += av_gettime_relative() - resample_start;
+            pipe->resample.items++;
+            if (samples < 0)
+                ret = samples;
+            else if (samples > 0)
+                ret = av_audio_fifo_write(fifo, (void **)converted, samples);
+        } else if (frame) {
+            ret = av_audio_fifo_write(fifo, (void **)frame->extended_data, frame->nb_samples);
+        }
+        int eof = !frame;
+        av_frame_free(&frame);
+        if (ret < 0)
+            break;
+        ret = 0;
+
+        // The last frame may be shorter than frame_size
+        while (ret == 0 && (av_audio_fifo_size(fifo) >= frame_size || (eof && av_audio_fifo_size(fifo) > 0))) {
+            AVFrame *out = av_frame_alloc();
+            if (!out) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            out->nb_samples = FFMIN(frame_size, av_audio_fifo_size(fifo));
+            out->format = enc->sample_fmt;
+            out->channel_layout = enc->channel_layout;
+            out->channels = enc->channels;
+            out->sample_rate = enc->sample_rate;
+            if ((ret = av_frame_get_buffer(out, 0)) == 0) {
+                av_audio_fifo_read(fifo, (void **)out->data, out->nb_samples);
+                out->pts = next_pts;
+                next_pts += out->nb_samples;
+                ret = encode_frame(s, out);
+            }
+            av_frame_free(&out);
+        }
+        if (eof) {
+            if (ret == 0 && (ret = encode_frame(s, NULL)) == 0)
+                ret = push_packet(s->outs, s->nb_outs, NULL, &s->stats.wait_out_us);
+            break;
+        }
+    }
+    if (converted)
+        av_freep(&converted[0]);
+    av_freep(&converted);
+    if (fifo)
+        av_audio_fifo_free(fifo);
+    stage_end(s, start, ret);
+    s->stats.busy_us -= pipe->resample.busy_us; // reported as the swresample stage
+    return NULL;
+}
+
+/**
+ * @brief Timestamp used to order packets of different streams in the muxer.
+ */
+static int packet_before(const AVPacket *a, AVRational tb_a, const AVPacket *b, AVRational tb_b)
+{
+    int64_t ta = a->dts != AV_NOPTS_VALUE ? a->dts : a->pts;
+    int64_t tb = b->dts != AV_NOPTS_VALUE ? b->dts : b->pts;
+    if (ta == AV_NOPTS_VALUE || tb == AV_NOPTS_VALUE)
+        return ta == AV_NOPTS_VALUE;
+    return av_compare_ts(ta, tb_a, tb, tb_b) <= 0;
+}
+
+/**
+ * @brief Writes the encoded packets of both streams of an output in dts order.
+ *
+ * The muxer takes the earlier of the two queue heads. When only one stream has packets it waits
+ * for the other, unless the waiting queue is at least half full: a short audio track, or a long
+ * encoder delay, must not stall the video path until the demuxer deadlocks.
+ */
+static void *mux_thread(void *arg)
+{
+    Stage *s = arg;
+    Pipeline *pipe = s->pipe;
+    Output *o = s->output;
+    FFQueue *queues[2] = {&o->video_out, &o->audio_out};
+    const AVRational *src_tb = o->src_time_base;
+    int done[2] = {0, !o->streams[1]};
+    int progress = o == &pipe->outputs[0]; // ConvertProgress follows the first output
+    int64_t position = AV_NOPTS_VALUE;
+    int64_t start = av_gettime_relative();
+    int64_t wait_start = 0;
+    unsigned attempt = 0;
+    int ret = 0;
+
+    while (!done[0] || !done[1]) {
+        AVPacket *heads[2] = {NULL, NULL};
+        int have[2] = {0, 0};
+        int pick = -1;
+
+        for (int i = 0; i < 2; i++) {
+            if (done[i] || !(have[i] = ff_queue_peek(queues[i], (void **)&heads[i])))
+                continue;
+            if (!heads[i]) {
+                ff_queue_pop(queues[i], (void **)&heads[i], NULL);
+                done[i] = 1;
+                have[i] = 0;
+            }
+        }
+        if (have[0] && have[1])
+            pick = packet_before(heads[0], src_tb[0], heads[1], src_tb[1]) ? 0 : 1;
+        for (int i = 0; i < 2 && pick < 0; i++) {
+            if (have[i] && (done[!i] || ff_queue_size(queues[i]) >= ff_queue_capacity(queues[i]) / 2))
+                pick = i;
+        }
+        if (pick < 0) {
+            if (done[0] && done[1])
+                break;
+            if (atomic_load(&pipe->abort)) {
+                ret = AVERROR_EXIT;
+                break;
+            }
+            if (!wait_start)
+                wait_start = av_gettime_relative();
+            ff_queue_backoff(&attempt);
+            continue;
+        }
+        if (wait_start) {
+            s->stats.wait_in_us += av_gettime_relative() - wait_start;
+            wait_start = 0;
+        }
+        attempt = 0;
+
+        AVPacket *pkt;
+        ff_queue_pop(queues[pick], (void **)&pkt, NULL);
+        av_packet_rescale_ts(pkt, src_tb[pick], o->streams[pick]->time_base);
+        pkt->stream_index = o->streams[pick]->index;
+        int size = pkt->size;
+        int64_t pts = pkt->pts;
+        ret = av_interleaved_write_frame(o->fmt_ctx, pkt);
+        av_packet_free(&pkt);
+        if (ret < 0)
+            break;
+        s->stats.items++;
+        s->stats.bytes += size;
+        atomic_fetch_add_explicit(&pipe->bytes_written, size, memory_order_relaxed);
+        if (progress && pick == 0) {
+            atomic_fetch_add_explicit(&pipe->frames, 1, memory_order_relaxed);
+            if (pts != AV_NOPTS_VALUE && (position == AV_NOPTS_VALUE || pts > position)) {
+                position = pts;
+                atomic_store_explicit(&pipe->position_us, av_rescale_q(pts, o->streams[0]->time_base, AV_TIME_BASE_Q),
+                                      memory_order_relaxed);
+            }
+        }
+    }
+    return stage_end(s, start, ret);
+}
+
+/**
+ * @brief Opens a decoder for stream st.
+ */
+static AVCodecContext *open_decoder(AVStream *st, int threads, const Params *params)
+{
+    AVCodec *decoder = avcodec_find_decoder(st->codecpar->codec_id);
+    AVCodecContext *ctx = decoder ? avcodec_alloc_context3(decoder) : NULL;
+    if (!ctx)
+        return NULL;
+    avcodec_parameters_to_context(ctx, st->codecpar);
+    ctx->pkt_timebase = st->time_base;
+    set_codec_threads(ctx, threads, params);
+    if (avcodec_open2(ctx, decoder, NULL) < 0)
+        avcodec_free_context(&ctx);
+    return ctx;
+}
+
+/**
+ * @brief Name of a rendition's output for messages.
+ */
+static const char *output_name(const Rendition *r)
+{
+    return r->output_filename ? r->output_filename : "<custom output>";
+}
+
+/**
+ * @brief Resolves the frame size of a rendition, see Rendition.width and Rendition.height.
+ */
+static void rendition_size(const Rendition *r, const AVCodecContext *dec_ctx, int *width, int *height)
+{
+    *width = r->width > 0 ? r->width : 0;
+    *height = r->height > 0 ? r->height : 0;
+    if (!*width && !*height) {
+        *width = dec_ctx->width;
+        *height = dec_ctx->height;
+    } else if (!*width) {
+        // Derived sides are rounded down to even, 4:2:0 needs it
+        *width = FFMAX(2, (int)av_rescale(*height, dec_ctx->width, dec_ctx->height) & ~1);
+    } else if (!*height) {
+        *height = FFMAX(2, (int)av_rescale(*width, dec_ctx->height, dec_ctx->width) & ~1);
+    }
+}
+
+/**
+ * @brief Opens a video encoder for the rendition `target`, configured from params where it leaves a field 0.
+ *
+ * @param global_header Nonzero if the output container stores the codec configuration in its header.
+ */
+static int open_video_encoder(AVFormatContext *input_fmt_ctx, AVStream *in_stream, AVCodecContext *dec_ctx,
+                              const Rendition *target, int global_header, const Params *params, int threads,
+                              AVCodecContext **penc)
+{
+    enum AVCodecID video_codec_id = target->video_codec_id ? target->video_codec_id :
+                                    params && params->video_codec_id ? params->video_codec_id : AV_CODEC_ID_H264;
+    int video_bitrate = target->video_bitrate > 0 ? target->video_bitrate : params ? params->video_bitrate : 0;
+    AVCodec *encoder_video = avcodec_find_encoder(video_codec_id);
+    if (!encoder_video) {
+        fprintf(stderr, "Could not find video encoder for id %d\n", video_codec_id);
+        return -1;
+    }
+    AVCodecContext *enc_ctx = *penc = avcodec_alloc_context3(encoder_video);
+    if (!enc_ctx)
+        return AVERROR(ENOMEM);
+    rendition_size(target, dec_ctx, &enc_ctx->width, &enc_ctx->height);
+    enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
+    if (enc_ctx->sample_aspect_ratio.num && (enc_ctx->width != dec_ctx->width || enc_ctx->height != dec_ctx->height)) {
+        // Keep the display aspect ratio when the rendition changes the storage one
+        av_reduce(&enc_ctx->sample_aspect_ratio.num, &enc_ctx->sample_aspect_ratio.den,
+                  (int64_t)dec_ctx->sample_aspect_ratio.num * dec_ctx->width * enc_ctx->height,
+                  (int64_t)dec_ctx->sample_aspect_ratio.den * dec_ctx->height * enc_ctx->width, INT_MAX);
+    }
+    enc_ctx->pix_fmt = encoder_video->pix_fmts ? encoder_video->pix_fmts[0] : dec_ctx->pix_fmt;
+    enc_ctx->time_base = in_stream->time_base;
+    enc_ctx->framerate = av_guess_frame_rate(input_fmt_ctx, in_stream, NULL);
+
+    // Set bitrate or CRF mode for H.264 if required
+    if (video_bitrate > 0) {
+        if (video_codec_id == AV_CODEC_ID_H264 && video_bitrate < 60) {
+            int crf = video_bitrate;
+            av_opt_set_double(enc_ctx->priv_data, "crf", crf, 0);
+            // Set preset depending on CRF value
+            if (crf < 18) {
+                av_opt_set(enc_ctx->priv_data, "preset", "slower", 0);
+            } else if (crf > 30) {
+                av_opt_set(enc_ctx->priv_data, "preset", "faster", 0);
+            } else {
+                av_opt_set(enc_ctx->priv_data, "preset", "medium", 0);
+            }
+            enc_ctx->bit_rate = 0; // Avoid CBR mode
+        } else {
+            enc_ctx->bit_rate = video_bitrate;
+        }
+    }
+    if (global_header)
+        enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    set_codec_threads(enc_ctx, threads, params);
+    int ret = avcodec_open2(enc_ctx, encoder_video, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open video encoder\n");
+        return ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief Opens the audio encoder, configured from params.
+ *
+ * @param global_header Nonzero if an output container stores the codec configuration in its header.
+ */
+static int open_audio_encoder(AVCodecContext *dec_ctx, int global_header, const Params *params, int threads,
+                              AVCodecContext **penc)
+{
+    enum AVCodecID audio_codec_id = params && params->audio_codec_id ? params->audio_codec_id : AV_CODEC_ID_AAC;
+    AVCodec *encoder_audio = avcodec_find_encoder(audio_codec_id);
+    if (!encoder_audio) {
+        fprintf(stderr, "Could not find audio encoder for id %d\n", audio_codec_id);
+        return -1;
+    }
+    if (!dec_ctx->channel_layout)
+        dec_ctx->channel_layout = av_get_default_channel_layout(dec_ctx->channels);
+    AVCodecContext *enc_ctx = *penc = avcodec_alloc_context3(encoder_audio);
+    if (!enc_ctx)
+        return AVERROR(ENOMEM);
+    enc_ctx->sample_rate = dec_ctx->sample_rate;
+    enc_ctx->channel_layout = dec_ctx->channel_layout;
+    enc_ctx->channels = av_get_channel_layout_nb_channels(enc_ctx->channel_layout);
+    enc_ctx->sample_fmt = encoder_audio->sample_fmts ? encoder_audio->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
+    enc_ctx->bit_rate = (params && params->audio_bitrate > 0) ? params->audio_bitrate : 128000;
+    enc_ctx->time_base = (AVRational){1, enc_ctx->sample_rate};
+    if (global_header)
+        enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    set_codec_threads(enc_ctx, threads, params);
+    int ret = avcodec_open2(enc_ctx, encoder_audio, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open audio encoder\n");
+        return ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief Adds an output stream carrying the packets of encoder enc.
+ */
+static AVStream *add_encoder_stream(AVFormatContext *fmt_ctx, const AVCodecContext *enc)
+{
+    AVStream *st = avformat_new_stream(fmt_ctx, NULL);
+    if (!st || avcodec_parameters_from_context(st->codecpar, enc) < 0)
+        return NULL;
+    st->time_base = enc->time_base;
+    return st;
+}
+
+/**
+ * @brief Header of an encoded packet in a segment spill file, followed by `size` bytes of data.
+ */
+typedef struct {
+    int64_t pts, dts, duration;
+    int32_t flags, size;
+} SpillRecord;
+
+/**
+ * @brief A keyframe-aligned part of the video, transcoded by one worker.
+ */
+typedef struct {
+    int64_t start;   /**< Timestamp of the first key packet, INT64_MIN for the first segment. */
+    int64_t end;     /**< Timestamp of the key packet starting the next segment, INT64_MAX for the last. */
+    int64_t seek_ts; /**< dts of the first key packet, AV_NOPTS_VALUE for the first segment. */
+    FILE *spill;     /**< Encoded packets, an already unlinked file next to the output. */
+    int64_t *pts;    /**< pts of the spilled packets, sorted by segments_thread. */
+    int nb_pts, pts_capacity;
+    int pts_unset;   /**< A spilled packet has no pts, its dts are passed on as encoded. */
+    int done;
+    int status;      /**< Result of encode_segment, valid once done. */
+} Segment;
+
+/**
+ * @brief GOP-segmented transcoding of the video stream.
+ *
+ * The video is split at keyframes into segments that workers decode, scale and encode
+ * independently, each with its own input context and codecs, writing the packets to spill files.
+ * The video_segments stage hands the segments to the muxer in order while later ones are still
+ * being encoded. Audio takes the normal pipeline path, so it stays one continuous track.
+ */
+typedef struct SegmentJob {
+    Pipeline *pipe;
+    const char *input_filename;
+    const Rendition *target;  /**< The single output, segments are not combined with renditions. */
+    int global_header;        /**< The output stores the codec configuration in its header. */
+    const Params *params;
+    AVRational time_base;  /**< Time base of the spilled packets, the input stream's. */
+    int reorder;           /**< Reorder delay of the encoders in frames, see segments_thread. */
+    Segment *segments;
+    int nb_segments;
+    int next;              /**< Next segment a worker picks up. */
+    int threads;           /**< Codec threads per worker. */
+    pthread_t *workers;
+    int nb_workers;
+    int nb_workers_started;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;   /**< Signalled when a segment is done. */
+} SegmentJob;
+
+/**
+ * @brief Timestamp defining segment boundaries: pts of a key packet, or dts when pts is unknown.
+ */
+static int64_t key_time(const AVPacket *pkt)
+{
+    return pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Creates an anonymous spill file in the directory of the output, which is sized for it,
+ * or in TMPDIR when the output is a custom I/O context.
+ */
+static FILE *spill_open(const char *output_filename)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    char *path = output_filename ? av_asprintf("%s.seg-XXXXXX", output_filename)
+                                 : av_asprintf("%s/convert.seg-XXXXXX", tmpdir ? tmpdir : "/tmp");
+    if (!path)
+        return NULL;
+    int fd = mkstemp(path);
+    if (fd >= 0)
+        unlink(path);
+    av_free(path);
+    return fd >= 0 ? fdopen(fd, "w+b") : NULL;
+}
+
+static int spill_write(FILE *spill, const AVPacket *pkt)
+{
+    SpillRecord rec = {pkt->pts, pkt->dts, pkt->duration, pkt->flags, pkt->size};
+    if (fwrite(&rec, sizeof(rec), 1, spill) != 1 || fwrite(pkt->data, 1, pkt->size, spill) != (size_t)pkt->size)
+        return AVERROR(EIO);
+    return 0;
+}
+
+/**
+ * @return 0 with the next packet in pkt, AVERROR_EOF after the last one.
+ */
+static int spill_read(FILE *spill, AVPacket *pkt)
+{
+    SpillRecord rec;
+    int ret;
+    if (fread(&rec, sizeof(rec), 1, spill) != 1)
+        return feof(spill) ? AVERROR_EOF : AVERROR(EIO);
+    if ((ret = av_new_packet(pkt, rec.size)) < 0)
+        return ret;
+    if (fread(pkt->data, 1, rec.size, spill) != (size_t)rec.size)
+        return AVERROR(EIO);
+    pkt->pts = rec.pts;
+    pkt->dts = rec.dts;
+    pkt->duration = rec.duration;
+    pkt->flags = rec.flags;
+    return 0;
+}
+
+/**
+ * @brief Sends frame (NULL to flush) to enc and spills every packet it returns, noting its pts.
+ */
+static int encode_to_spill(AVCodecContext *enc, AVFrame *frame, Segment *seg)
+{
+    AVPacket pkt;
+    int ret = avcodec_send_frame(enc, frame);
+    if (ret < 0 && ret != AVERROR_EOF)
+        return ret;
+    av_init_packet(&pkt);
+    while ((ret = avcodec_receive_packet(enc, &pkt)) == 0) {
+        if (seg->nb_pts == seg->pts_capacity) {
+            int capacity = seg->pts_capacity ? 2 * seg->pts_capacity : 256;
+            int64_t *pts = av_realloc_array(seg->pts, capacity, sizeof(*pts));
+            if (!pts) {
+                av_packet_unref(&pkt);
+                return AVERROR(ENOMEM);
+            }
+            seg->pts = pts;
+            seg->pts_capacity = capacity;
+        }
+        seg->pts[seg->nb_pts++] = pkt.pts;
+        seg->pts_unset |= pkt.pts == AV_NOPTS_VALUE;
+        ret = spill_write(seg->spill, &pkt);
+        av_packet_unref(&pkt);
+        if (ret < 0)
+            return ret;
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+/**
+ * @brief Picks up to nb_segments boundaries at the key packets before equal divisions of the video.
+ *
+ * Each division is found with a backward seek and the first key packet read after it, so only a
+ * few packets per segment are demuxed rather than the whole file.
+ *
+ * @return Number of segments, 0 if the video cannot be split.
+ */
+static int plan_segments(SegmentJob *job, int stream_index, int nb_segments)
+{
+    AVFormatContext *probe = job->pipe->input_fmt_ctx, *fmt_ctx = NULL;
+    AVStream *st = probe->streams[stream_index];
+    int64_t first = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0, span = st->duration;
+    AVPacket *pkt = NULL;
+    int ret;
+
+    if (span == AV_NOPTS_VALUE && probe->duration != AV_NOPTS_VALUE)
+        span = av_rescale_q(probe->duration, AV_TIME_BASE_Q, st->time_base);
+    if (span == AV_NOPTS_VALUE || span <= 0)
+        return 0;
+    if (!(pkt = av_packet_alloc()))
+        return AVERROR(ENOMEM);
+    if (!(fmt_ctx = media_interrupt_alloc_context(&job->pipe->interrupt))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = avformat_open_input(&fmt_ctx, job->input_filename, NULL, NULL)) < 0)
+        goto end;
+    if (!(job->segments = av_calloc(nb_segments, sizeof(*job->segments)))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    Segment *seg = &job->segments[0];
+    seg->start = INT64_MIN;
+    seg->seek_ts = AV_NOPTS_VALUE;
+    job->nb_segments = 1;
+    for (int i = 1; i < nb_segments; i++) {
+        int64_t target = first + av_rescale(span, i, nb_segments);
+        int64_t next_target = first + av_rescale(span, i + 1, nb_segments);
+        int64_t key = AV_NOPTS_VALUE, key_dts = AV_NOPTS_VALUE;
+        if (avformat_seek_file(fmt_ctx, stream_index, INT64_MIN, target, target, 0) < 0)
+            break;
+        // The seek lands on the key packet at or before target; a GOP longer than a division has none
+        while (key == AV_NOPTS_VALUE && av_read_frame(fmt_ctx, pkt) >= 0) {
+            if (pkt->stream_index == stream_index && key_time(pkt) != AV_NOPTS_VALUE) {
+                if (key_time(pkt) >= next_target) {
+                    av_packet_unref(pkt);
+                    break;
+                }
+                if (pkt->flags & AV_PKT_FLAG_KEY) {
+                    key = key_time(pkt);
+                    key_dts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+                }
+            }
+            av_packet_unref(pkt);
+        }
+        if (key == AV_NOPTS_VALUE || key <= first || key <= seg->start)
+            continue;
+        seg->end = key;
+        seg = &job->segments[job->nb_segments++];
+        seg->start = key;
+        seg->seek_ts = key_dts;
+    }
+    seg->end = INT64_MAX;
+    ret = job->nb_segments;
+
+end:
+    av_packet_free(&pkt);
+    avformat_close_input(&fmt_ctx);
+    return ret;
+}
+
+/**
+ * @brief Transcodes one segment into its spill file.
+ *
+ * Frames are kept if their timestamp lies in [start, end). Leading B-frames of an open GOP follow
+ * their keyframe in decode order but are shown before it, so reading goes on past the key packet
+ * of the next segment until the decoder returns a frame at or after end: by then every frame
+ * before end has come out. The next segment, which cannot decode them, drops them as before its
+ * start. At most one GOP past end is read.
+ */
+static int encode_segment(SegmentJob *job, Segment *seg)
+{
+    Pipeline *pipe = job->pipe;
+    AVFormatContext *fmt_ctx = NULL;
+    AVCodecContext *dec = NULL, *enc = NULL;
+    ScalePool *scaler = NULL;
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    int eof = 0, past_keys = 0, ret;
+
+    if (!pkt || !frame || !(fmt_ctx = media_interrupt_alloc_context(&pipe->interrupt))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = avformat_open_input(&fmt_ctx, job->input_filename, NULL, NULL)) < 0 ||
+        (ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0)
+        goto end;
+    AVStream *st = fmt_ctx->streams[pipe->video_stream_index];
+    if (!(dec = open_decoder(st, job->threads, job->params))) {
+        ret = -1;
+        goto end;
+    }
+    if ((ret = open_video_encoder(fmt_ctx, st, dec, job->target, job->global_header, job->params, job->threads, &enc)) < 0)
+        goto end;
+    if ((dec->pix_fmt != enc->pix_fmt || dec->width != enc->width || dec->height != enc->height) &&
+        !(scaler = scale_pool_create(dec->width, dec->height, dec->pix_fmt, enc->width, enc->height, enc->pix_fmt, 1))) {
+        ret = -1;
+        goto end;
+    }
+    if (seg->seek_ts != AV_NOPTS_VALUE && (ret = av_seek_frame(fmt_ctx, st->index, seg->seek_ts, AVSEEK_FLAG_BACKWARD)) < 0)
+        goto end;
+    if (!(seg->spill = spill_open(job->target->output_filename))) {
+        ret = AVERROR(errno);
+        goto end;
+    }
+
+    while (!eof) {
+        if (atomic_load(&pipe->abort)) {
+            ret = AVERROR_EXIT;
+            goto end;
+        }
+        if (av_read_frame(fmt_ctx, pkt) < 0) {
+            eof = 1;
+        } else if (pkt->stream_index != st->index) {
+            av_packet_unref(pkt);
+            continue;
+        } else if ((pkt->flags & AV_PKT_FLAG_KEY) && key_time(pkt) != AV_NOPTS_VALUE && key_time(pkt) >= seg->end &&
+                   ++past_keys == 2) {
+            eof = 1;
+            av_packet_unref(pkt);
+        }
+        avcodec_send_packet(dec, eof ? NULL : pkt);
+        av_packet_unref(pkt);
+
+        while ((ret = avcodec_receive_frame(dec, frame)) == 0) {
+            int64_t pts = frame->best_effort_timestamp;
+            AVFrame *enc_frame = frame, *scaled = NULL;
+            if (pts != AV_NOPTS_VALUE && pts >= seg->end)
+                eof = 1;
+            if (pts == AV_NOPTS_VALUE ? past_keys > 0 : pts < seg->start || pts >= seg->end) {
+                av_frame_unref(frame);
+                continue;
+            }
+            frame->pts = pts;
+            frame->pict_type = AV_PICTURE_TYPE_NONE;
+            if (scaler) {
+                if (!(scaled = av_frame_alloc())) {
+                    ret = AVERROR(ENOMEM);
+                    goto end;
+                }
+                scaled->format = enc->pix_fmt;
+                scaled->width = enc->width;
+                scaled->height = enc->height;
+                if ((ret = av_frame_get_buffer(scaled, 32)) < 0) {
+                    av_frame_free(&scaled);
+                    goto end;
+                }
+                av_frame_copy_props(scaled, frame);
+                scale_pool_run(scaler, frame, scaled);
+                enc_frame = scaled;
+            }
+            ret = encode_to_spill(enc, enc_frame, seg);
+            av_frame_free(&scaled);
+            av_frame_unref(frame);
+            if (ret < 0)
+                goto end;
+        }
+        if (ret == AVERROR(ENOMEM))
+            goto end;
+    }
+    ret = encode_to_spill(enc, NULL, seg);
+
+end:
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+    scale_pool_free(&scaler);
+    avcodec_free_context(&dec);
+    avcodec_free_context(&enc);
+    avformat_close_input(&fmt_ctx);
+    return ret;
+}
+
+static void *segment_worker(void *arg)
+{
+    SegmentJob *job = arg;
+
+    pthread_mutex_lock(&job->lock);
+    while (job->next < job->nb_segments && !atomic_load(&job->pipe->abort)) {
+        Segment *seg = &job->segments[job->next++];
+        pthread_mutex_unlock(&job->lock);
+        int status = encode_segment(job, seg);
+        if (status < 0 && status != AVERROR_EXIT)
+            pipeline_fail(job->pipe, status);
+        pthread_mutex_lock(&job->lock);
+        seg->status = status;
+        seg->done = 1;
+        pthread_cond_broadcast(&job->cond);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+/**
+ * @brief Waits until seg is done, or returns early once the pipeline aborts.
+ */
+static int wait_segment(SegmentJob *job, Segment *seg, Stage *s)
+{
+    int64_t start = av_gettime_relative();
+    int ret;
+
+    pthread_mutex_lock(&job->lock);
+    while (!seg->done && !atomic_load(&job->pipe->abort)) {
+        // Other stages abort without signalling this condition, so look again periodically
+        struct timespec deadline;
+        deadline_after(&deadline, 100 * 1000);
+        pthread_cond_timedwait(&job->cond, &job->lock, &deadline);
+    }
+    ret = seg->done ? seg->status : AVERROR_EXIT;
+    pthread_mutex_unlock(&job->lock);
+    s->stats.wait_in_us += av_gettime_relative() - start;
+    return ret;
+}
+
+/**
+ * @brief The video_segments stage: starts the workers and passes their segments on in order.
+ *
+ * Segments are concatenated on the output timeline with their pts unchanged. Each one starts with
+ * a new encoder, which puts its first dts before its first pts by its own estimate of the reorder
+ * delay, so dts may step back at a join. Instead the dts of packet j is the (j - reorder)-th
+ * smallest pts, counting on into the previous segment; reorder is the number of frames the
+ * encoders delay, so this never passes the packet's own pts and always rises. The first packets
+ * of the first segment keep their encoded dts.
+ */
+static void *segments_thread(void *arg)
+{
+    Stage *s = arg;
+    Pipeline *pipe = s->pipe;
+    SegmentJob *job = pipe->segments;
+    AVStream *out = pipe->outputs[0].streams[0];
+    const Segment *prev = NULL;
+    int64_t start = av_gettime_relative();
+    int ret = 0;
+
+    for (int i = 0; i < job->nb_workers; i++) {
+        if (pthread_create(&job->workers[i], NULL, segment_worker, job) != 0) {
+            ret = AVERROR(EAGAIN);
+            break;
+        }
+        job->nb_workers_started++;
+    }
+
+    for (int i = 0; i < job->nb_segments && ret == 0; i++) {
+        Segment *seg = &job->segments[i];
+        if ((ret = wait_segment(job, seg, s)) < 0)
+            break;
+        if (!seg->pts_unset)
+            qsort(seg->pts, seg->nb_pts, sizeof(*seg->pts), compare_int64);
+        rewind(seg->spill);
+        for (int j = 0;; j++) {
+            AVPacket *pkt = av_packet_alloc();
+            if (!pkt) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            if ((ret = spill_read(seg->spill, pkt)) < 0) {
+                av_packet_free(&pkt);
+                break;
+            }
+            int back = j - job->reorder;
+            if (!seg->pts_unset && back >= 0)
+                pkt->dts = seg->pts[back];
+            else if (!seg->pts_unset && prev && !prev->pts_unset && prev->nb_pts + back >= 0)
+                pkt->dts = prev->pts[prev->nb_pts + back];
+            av_packet_rescale_ts(pkt, job->time_base, out->time_base);
+            s->stats.items++;
+            s->stats.bytes += pkt->size;
+            if ((ret = ff_queue_push(s->outs[0], pkt, &s->stats.wait_out_us)) < 0) {
+                av_packet_free(&pkt);
+                break;
+            }
+        }
+        if (ret == AVERROR_EOF)
+            ret = 0;
+        fclose(seg->spill);
+        seg->spill = NULL;
+        prev = seg;
+    }
+    if (ret == 0)
+        ret = ff_queue_push(s->outs[0], NULL, &s->stats.wait_out_us);
+    else if (ret != AVERROR_EXIT)
+        pipeline_fail(pipe, ret); // stop the workers before joining them
+
+    for (int i = 0; i < job->nb_workers_started; i++)
+        pthread_join(job->workers[i], NULL);
+    return stage_end(s, start, ret);
+}
+
+/**
+ * @brief Frees a job created by segment_job_create, closing leftover spill files.
+ */
+static void segment_job_free(SegmentJob **pjob)
+{
+    SegmentJob *job = *pjob;
+    if (!job)
+        return;
+    for (int i = 0; i < job->nb_segments; i++) {
+        if (job->segments[i].spill)
+            fclose(job->segments[i].spill);
+        av_free(job->segments[i].pts);
+    }
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->cond);
+    av_free(job->segments);
+    av_free(job->workers);
+    av_freep(pjob);
+}
+
+/**
+ * @brief Plans the segments for Params.segments.
+ *
+ * @return 0 with *pjob set, or with *pjob NULL when the video is too short to split.
+ */
+static int segment_job_create(Pipeline *pipe, const char *input_filename, const Output *output,
+                              const Params *params, SegmentJob **pjob)
+{
+    int cpus = av_cpu_count();
+    int nb_segments = params->segments < 0 ? cpus : params->segments;
+    SegmentJob *job = av_mallocz(sizeof(*job));
+    int ret;
+
+    *pjob = NULL;
+    if (!job)
+        return AVERROR(ENOMEM);
+    job->pipe = pipe;
+    job->input_filename = input_filename;
+    job->target = output->spec;
+    job->global_header = !!(output->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER);
+    job->params = params;
+    job->time_base = pipe->input_fmt_ctx->streams[pipe->video_stream_index]->time_base;
+    // The workers' encoders have the settings of this one
+    job->reorder = output->video_enc->has_b_frames;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+
+    if ((ret = plan_segments(job, pipe->video_stream_index, nb_segments)) < 2) {
+        segment_job_free(&job);
+        return ret < 0 ? ret : 0;
+    }
+    job->nb_workers = FFMIN(job->nb_segments, cpus);
+    // Parallelism comes from the segments, the codecs of a worker share what is left
+    job->threads = FFMAX(1, cpus / job->nb_workers);
+    if (!(job->workers = av_calloc(job->nb_workers, sizeof(*job->workers)))) {
+        segment_job_free(&job);
+        return AVERROR(ENOMEM);
+    }
+    *pjob = job;
+    return 0;
+}
+
+/**
+ * @brief Decides whether stream st is copied instead of transcoded.
+ *
+ * @param target  Codec the stream would be encoded to.
+ * @param bitrate Bitrate requested for the stream, > 0 forces a re-encode in CONVERT_COPY_AUTO.
+ */
+static int can_copy(const AVStream *st, enum AVCodecID target, int bitrate, const AVOutputFormat *ofmt, int mode)
+{
+    enum AVCodecID codec_id = st->codecpar->codec_id;
+    if (mode == CONVERT_COPY_NEVER)
+        return 0;
+    // 1: the container stores the codec, 0: it does not, < 0: the muxer cannot tell
+    int supported = avformat_query_codec(ofmt, codec_id, FF_COMPLIANCE_NORMAL);
+    if (supported == 0)
+        return 0;
+    if (mode == CONVERT_COPY_ALWAYS)
+        return supported == 1 || codec_id == target;
+    return codec_id == target && bitrate <= 0;
+}
+
+/**
+ * @brief Returns nonzero if the H.264/HEVC extradata holds Annex B start codes instead of avcC/hvcC.
+ */
+static int is_annexb(const AVCodecParameters *par)
+{
+    const uint8_t *p = par->extradata;
+    return par->extradata_size >= 4 && p[0] == 0 && p[1] == 0 && (p[2] == 1 || (p[2] == 0 && p[3] == 1));
+}
+
+/**
+ * @brief Bitstream filter a copied stream needs for the output container, or NULL.
+ *
+ * MPEG-TS and raw H.264/HEVC need Annex B, so length-prefixed input (MP4, MKV) is converted.
+ * Containers with global headers need AAC without ADTS headers; aac_adtstoasc passes raw
+ * AAC through, so it is applied whenever the input might be ADTS. Annex B H.264 in MP4 needs
+ * no filter, the MP4 muxer converts it, but see find_extradata for the missing extradata.
+ */
+static const char *copy_bsf_name(const AVCodecParameters *par, const AVOutputFormat *ofmt)
+{
+    int annexb_output = av_match_name(ofmt->name, "mpegts,h264,hevc");
+    switch (par->codec_id) {
+    case AV_CODEC_ID_H264:
+        return annexb_output && par->extradata_size > 0 && !is_annexb(par) ? "h264_mp4toannexb" : NULL;
+    case AV_CODEC_ID_HEVC:
+        return annexb_output && par->extradata_size > 0 && !is_annexb(par) ? "hevc_mp4toannexb" : NULL;
+    case AV_CODEC_ID_AAC:
+        return av_match_name(ofmt->name, "mpegts,adts") ? NULL : "aac_adtstoasc";
+    default:
+        return NULL;
+    }
+}
+
+static int open_bsf(const char *name, const AVStream *in, AVBSFContext **pbsf)
+{
+    const AVBitStreamFilter *filter = av_bsf_get_by_name(name);
+    int ret;
+    if (!filter) {
+        fprintf(stderr, "Bitstream filter %s is not available\n", name);
+        return AVERROR_BSF_NOT_FOUND;
+    }
+    if ((ret = av_bsf_alloc(filter, pbsf)) < 0)
+        return ret;
+    if ((ret = avcodec_parameters_copy((*pbsf)->par_in, in->codecpar)) < 0)
+        return ret;
+    (*pbsf)->time_base_in = in->time_base;
+    return av_bsf_init(*pbsf);
+}
+
+/**
+ * @brief Prepares passing `in` through unchanged to outputs in ofmt, apart from the bitstream filter.
+ */
+static int open_copy_stream(CopyStream *cs, AVStream *in, const AVOutputFormat *ofmt)
+{
+    const char *bsf_name = copy_bsf_name(in->codecpar, ofmt);
+    int ret;
+
+    cs->enabled = 1;
+    cs->in = in;
+    if (!(cs->par = avcodec_parameters_alloc()))
+        return AVERROR(ENOMEM);
+    if (bsf_name && (ret = open_bsf(bsf_name, in, &cs->bsf)) < 0)
+        return ret;
+    if ((ret = avcodec_parameters_copy(cs->par, cs->bsf ? cs->bsf->par_out : in->codecpar)) < 0)
+        return ret;
+    // Input fourccs (e.g. AVI's H264) are not valid in other containers, let the muxer pick
+    cs->par->codec_tag = 0;
+    cs->time_base = cs->bsf ? cs->bsf->time_base_out : in->time_base;
+    return 0;
+}
+
+/**
+ * @brief Adds an output stream for the copied stream cs.
+ */
+static AVStream *add_copy_stream(AVFormatContext *fmt_ctx, const CopyStream *cs)
+{
+    AVStream *st = avformat_new_stream(fmt_ctx, NULL);
+    if (!st || avcodec_parameters_copy(st->codecpar, cs->par) < 0)
+        return NULL;
+    st->time_base = cs->time_base;
+    st->sample_aspect_ratio = cs->in->sample_aspect_ratio;
+    st->avg_frame_rate = cs->in->avg_frame_rate;
+    return st;
+}
+
+/**
+ * @brief Nonzero if any output stores the codec configuration in its header.
+ */
+static int any_global_header(const Pipeline *pipe)
+{
+    for (int i = 0; i < pipe->nb_outputs; i++) {
+        if (pipe->outputs[i].fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Stores the extradata found by the probe filter of a copied stream, if any.
+ *
+ * @return 1 once the output parameters have extradata.
+ */
+static int take_extradata(CopyStream *cs, AVBSFContext *probe, AVPacket *pkt)
+{
+    AVCodecParameters *par = cs->par;
+    int size = 0;
+    const uint8_t *data = av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, &size);
+    if (!data || size <= 0) {
+        data = probe->par_out->extradata;
+        size = probe->par_out->extradata_size;
+    }
+    if (!data || size <= 0)
+        return 0;
+    if (!(par->extradata = av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE)))
+        return AVERROR(ENOMEM);
+    memcpy(par->extradata, data, size);
+    par->extradata_size = size;
+    return 1;
+}
+
+/**
+ * @brief Reads ahead until every copied stream has the extradata a global header needs.
+ *
+ * Annex B H.264/HEVC (common in AVI and MPEG-TS) and ADTS AAC carry their decoder configuration
+ * in band, but MP4 and MKV write it into the header. Packets are read until extract_extradata
+ * or aac_adtstoasc reveal it, and kept in pipe->preread for the demux stage to send first. After
+ * PREREAD_MAX_PACKETS the header is written without it, as a plain remux would.
+ */
+static int find_extradata(Pipeline *pipe)
+{
+    static const char *const probe_names[2] = {"extract_extradata", "aac_adtstoasc"};
+    AVBSFContext *probes[2] = {NULL, NULL};
+    int missing = 0, ret = 0;
+
+    if (!any_global_header(pipe))
+        return 0;
+    for (int i = 0; i < 2; i++) {
+        CopyStream *cs = &pipe->copy[i];
+        enum AVCodecID id = cs->enabled ? cs->in->codecpar->codec_id : AV_CODEC_ID_NONE;
+        int kind = id == AV_CODEC_ID_H264 || id == AV_CODEC_ID_HEVC ? 0 : id == AV_CODEC_ID_AAC ? 1 : -1;
+        if (kind < 0 || cs->par->extradata_size > 0)
+            continue;
+        if ((ret = open_bsf(probe_names[kind], cs->in, &probes[i])) < 0)
+            goto end;
+        missing++;
+    }
+    if (missing && !(pipe->preread = av_calloc(PREREAD_MAX_PACKETS, sizeof(*pipe->preread)))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    while (missing && pipe->nb_preread < PREREAD_MAX_PACKETS) {
+        AVPacket *pkt = av_packet_alloc();
+        if (!pkt) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        if (av_read_frame(pipe->input_fmt_ctx, pkt) < 0) {
+            av_packet_free(&pkt);
+            break;
+        }
+        pipe->preread[pipe->nb_preread++] = pkt;
+
+        int i = stream_slot(pipe, pkt->stream_index);
+        if (i < 0 || !probes[i])
+            continue;
+        // The probe works on its own reference, the packet itself is demuxed later
+        AVPacket *probe_pkt = av_packet_clone(pkt);
+        if (!probe_pkt || (ret = av_bsf_send_packet(probes[i], probe_pkt)) < 0) {
+            av_packet_free(&probe_pkt);
+            if (ret == AVERROR_INVALIDDATA) {
+                ret = 0;
+                continue;
+            }
+            ret = ret < 0 ? ret : AVERROR(ENOMEM);
+            break;
+        }
+        while (probes[i] && av_bsf_receive_packet(probes[i], probe_pkt) == 0) {
+            if ((ret = take_extradata(&pipe->copy[i], probes[i], probe_pkt)) > 0) {
+                av_bsf_free(&probes[i]);
+                missing--;
+            }
+            av_packet_unref(probe_pkt);
+            if (ret < 0)
+                break;
+        }
+        av_packet_free(&probe_pkt);
+        if (ret < 0)
+            break;
+        ret = 0;
+    }
+
+end:
+    av_bsf_free(&probes[0]);
+    av_bsf_free(&probes[1]);
+    return ret;
+}
+
+/**
+ * @brief Calls Params.progress_callback until every stage has finished, cancelling on request.
+ *
+ * With a timeout or a cancel token it also wakes up at the deadline and every
+ * INTERRUPT_POLL_US, since stages busy encoding or waiting on a queue do no I/O and
+ * would not see the interrupt callback fire.
+ */
+static void monitor_pipeline(Pipeline *pipe, const Params *params, int64_t start)
+{
+    int64_t interval_us = (params->progress_interval_ms > 0 ? params->progress_interval_ms : 500) * INT64_C(1000);
+    int64_t duration = pipe->input_fmt_ctx->duration;
+    int64_t last_time = start, last_frames = 0;
+    int64_t next_report = params->progress_callback ? start + interval_us : INT64_MAX;
+    int finished = 0;
+
+    while (!finished) {
+        int64_t wake = next_report, now = av_gettime_relative();
+        if (media_interrupt_active(&pipe->interrupt)) {
+            wake = FFMIN(wake, now + INTERRUPT_POLL_US);
+            if (pipe->interrupt.deadline > now)
+                wake = FFMIN(wake, pipe->interrupt.deadline);
+        }
+        struct timespec deadline;
+        deadline_after(&deadline, FFMAX(wake - now, 0));
+        pthread_mutex_lock(&pipe->lock);
+        while (pipe->running > 0 && pthread_cond_timedwait(&pipe->stage_done, &pipe->lock, &deadline) != ETIMEDOUT)
+            ;
+        finished = pipe->running == 0;
+        pthread_mutex_unlock(&pipe->lock);
+
+        now = av_gettime_relative();
+        if (!finished && media_interrupt_active(&pipe->interrupt))
+            media_interrupt_check(&pipe->interrupt);
+        if (!params->progress_callback || (!finished && now < next_report))
+            continue;
+        next_report = now + interval_us;
+        ConvertProgress progress = {
+            .elapsed_us = now - start,
+            .frames = atomic_load_explicit(&pipe->frames, memory_order_relaxed),
+            .position_us = atomic_load_explicit(&pipe->position_us, memory_order_relaxed),
+            .duration_us = duration != AV_NOPTS_VALUE && duration > 0 ? duration : 0,
+            .bytes_read = atomic_load_explicit(&pipe->bytes_read, memory_order_relaxed),
+            .bytes_written = atomic_load_explicit(&pipe->bytes_written, memory_order_relaxed),
+        };
+        if (now > last_time)
+            progress.fps = (progress.frames - last_frames) * 1e6 / (now - last_time);
+        last_time = now;
+        last_frames = progress.frames;
+
+        if (params->progress_callback(params->progress_opaque, &progress) && !finished && !atomic_load(&pipe->abort)) {
+            pipe->cancelled = 1;
+            pipeline_fail(pipe, AVERROR_EXIT);
+        }
+    }
+}
+
+/**
+ * @brief Starts every used stage, waits for all of them and reports progress and stats.
+ */
+static int run_pipeline(Pipeline *pipe, const Params *params)
+{
+    static void *(*const entry[STAGE_NB])(void *) = {
+        demux_thread, decode_thread, segments_thread, decode_thread, audio_encode_thread,
+    };
+    static void *(*const output_entry[OUTPUT_STAGE_NB])(void *) = {
+        scale_thread, video_encode_thread, mux_thread,
+    };
+    Stage *stages[STAGE_NB + CONVERT_MAX_RENDITIONS * OUTPUT_STAGE_NB];
+    int64_t start = av_gettime_relative();
+    void *(*entries[FF_ARRAY_ELEMS(stages)])(void *);
+    int nb_stages = 0;
+
+    // Shared stages first, then those of each output in order
+    for (int i = 0; i < STAGE_NB; i++) {
+        Stage *s = stages[nb_stages] = &pipe->stages[i];
+        s->stats.name = stage_names[i];
+        s->stats.output = -1;
+        entries[nb_stages++] = entry[i];
+    }
+    for (int k = 0; k < pipe->nb_outputs; k++) {
+        for (int i = 0; i < OUTPUT_STAGE_NB; i++) {
+            Stage *s = stages[nb_stages] = &pipe->outputs[k].stages[i];
+            s->output = &pipe->outputs[k];
+            s->stats.name = output_stage_names[i];
+            s->stats.output = k;
+            entries[nb_stages++] = output_entry[i];
+        }
+    }
+
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->stage_done, NULL);
+    for (int i = 0; i < nb_stages; i++) {
+        Stage *s = stages[i];
+        s->pipe = pipe;
+        if (!s->used)
+            continue;
+        pthread_mutex_lock(&pipe->lock);
+        pipe->running++;
+        pthread_mutex_unlock(&pipe->lock);
+        if (pthread_create(&s->thread, NULL, entries[i], s) != 0) {
+            pthread_mutex_lock(&pipe->lock);
+            pipe->running--;
+            pthread_mutex_unlock(&pipe->lock);
+            pipeline_fail(pipe, AVERROR(EAGAIN));
+            break;
+        }
+        s->started = 1;
+    }
+    if (params && (params->progress_callback || media_interrupt_active(&pipe->interrupt)))
+        monitor_pipeline(pipe, params, start);
+    for (int i = 0; i < nb_stages; i++) {
+        if (stages[i]->started)
+            pthread_join(stages[i]->thread, NULL);
+    }
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->stage_done);
+
+    if (params && params->stats_callback) {
+        ConvertStageStats stats[FF_ARRAY_ELEMS(stages) + 1];
+        int nb_stats = 0;
+        for (int i = 0; i < nb_stages; i++) {
+            if (stages[i]->used)
+                stats[nb_stats++] = stages[i]->stats;
+        }
+        if (pipe->swr_ctx && pipe->stages[STAGE_AUDIO_ENCODE].used) {
+            pipe->resample.name = "swresample";
+            pipe->resample.output = -1;
+            stats[nb_stats++] = pipe->resample;
+        }
+        params->stats_callback(params->stats_opaque, stats, nb_stats);
+    }
+    return atomic_load(&pipe->error);
+}
+
+/**
+ * @brief Shared implementation of the conversion entry points.
+ *
+ * Reads from `input_pb` when it is not NULL, otherwise opens `input_filename`, and writes one
+ * output per rendition. Each stream is either copied or transcoded, see Params.copy_mode; the video
+ * is only copied into a single output of the source size. The codecs and the outputs are set up
+ * on the calling thread, then the stages run concurrently, see Pipeline.
+ */
+static int convert(const char *input_filename, AVIOContext *input_pb, const Rendition *renditions, int nb_renditions,
+                   const Params *params)
+{
+    Pipeline pipe = {.video_stream_index = -1, .audio_stream_index = -1};
+    AVCodecContext *dec_ctx_video = NULL, *dec_ctx_audio = NULL, *enc_ctx_audio = NULL;
+    AVStream *in_stream_video = NULL, *in_stream_audio = NULL;
+    int decode_threads = resolve_threads(params ? params->decode_threads : 0);
+    int encode_threads = params && params->encode_threads > 0 ? params->encode_threads : 0;
+    int copy_mode = params ? params->copy_mode : CONVERT_COPY_AUTO;
+    int same_format = 1;
+    int ret = 0;
+
+    if (nb_renditions < 1 || nb_renditions > CONVERT_MAX_RENDITIONS) {
+        fprintf(stderr, "Unsupported number of outputs: %d\n", nb_renditions);
+        return 1;
+    }
+    for (int k = 0; k < nb_renditions; k++) {
+        if (!renditions[k].output_filename && !renditions[k].output_pb) {
+            fprintf(stderr, "Output %d has neither a filename nor an I/O context\n", k);
+            return 1;
+        }
+    }
+
+    av_register_all();
+    // Any interrupt also aborts the stages, so CPU-bound ones stop as well
+    media_interrupt_init(&pipe.interrupt, params ? params->timeout_us : 0, params ? params->cancel : NULL, &pipe.abort);
+
+    // Open input file, or the caller's I/O context
+    if (!(pipe.input_fmt_ctx = media_interrupt_alloc_context(&pipe.interrupt))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if (input_pb) {
+        pipe.input_fmt_ctx->pb = input_pb;
+        pipe.input_fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+        input_filename = "<custom io>";
+    }
+    if ((ret = avformat_open_input(&pipe.input_fmt_ctx, input_pb ? "" : input_filename, NULL, NULL)) < 0) {
+        fprintf(stderr, "Could not open input file '%s'\n", input_filename);
+        goto end;
+    }
+
+    if ((ret = avformat_find_stream_info(pipe.input_fmt_ctx, NULL)) < 0) {
+        fprintf(stderr, "Failed to retrieve input stream information\n");
+        goto end;
+    }
+
+    // Find the video and audio streams
+    for (unsigned int i = 0; i < pipe.input_fmt_ctx->nb_streams; i++) {
+        if (pipe.input_fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && pipe.video_stream_index < 0)
+            pipe.video_stream_index = i;
+        else if (pipe.input_fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && pipe.audio_stream_index < 0)
+            pipe.audio_stream_index = i;
+    }
+    if (pipe.video_stream_index == -1) {
+        fprintf(stderr, "Did not find a video stream in the input file\n");
+        ret = -1;
+        goto end;
+    }
+    in_stream_video = pipe.input_fmt_ctx->streams[pipe.video_stream_index];
+    if (pipe.audio_stream_index != -1)
+        in_stream_audio = pipe.input_fmt_ctx->streams[pipe.audio_stream_index];
+
+    // Prepare output files, and the queues the stages read from and write to
+    if ((ret = ff_queue_init(&pipe.video_packets, PACKET_QUEUE_SIZE, packet_free, &pipe.abort)) < 0 ||
+        (ret = ff_queue_init(&pipe.audio_packets, PACKET_QUEUE_SIZE, packet_free, &pipe.abort)) < 0 ||
+        (ret = ff_queue_init(&pipe.audio_frames, FRAME_QUEUE_SIZE, frame_free, &pipe.abort)) < 0)
+        goto end;
+    for (int k = 0; k < nb_renditions; k++) {
+        Output *o = &pipe.outputs[pipe.nb_outputs++];
+        o->spec = &renditions[k];
+        const char *format = o->spec->format;
+        if (!format && !o->spec->output_filename)
+            format = "mp4";
+        avformat_alloc_output_context2(&o->fmt_ctx, NULL, format, o->spec->output_filename);
+        if (!o->fmt_ctx) {
+            fprintf(stderr, "Could not create output context for '%s'\n", output_name(o->spec));
+            ret = -1;
+            goto end;
+        }
+        if (o->fmt_ctx->oformat != pipe.outputs[0].fmt_ctx->oformat)
+            same_format = 0;
+        o->fmt_ctx->interrupt_callback = pipe.input_fmt_ctx->interrupt_callback;
+        if ((ret = ff_queue_init(&o->decoded_frames, FRAME_QUEUE_SIZE, frame_free, &pipe.abort)) < 0 ||
+            (ret = ff_queue_init(&o->scaled_frames, FRAME_QUEUE_SIZE, frame_free, &pipe.abort)) < 0 ||
+            (ret = ff_queue_init(&o->video_out, PACKET_QUEUE_SIZE, packet_free, &pipe.abort)) < 0 ||
+            (ret = ff_queue_init(&o->audio_out, PACKET_QUEUE_SIZE, packet_free, &pipe.abort)) < 0)
+            goto end;
+    }
+    const AVOutputFormat *ofmt = pipe.outputs[0].fmt_ctx->oformat;
+
+    // Video: copied into a single output of the source size, otherwise decoded once for all outputs
+    const Rendition *first = &renditions[0];
+    enum AVCodecID video_codec_id = first->video_codec_id ? first->video_codec_id :
+                                    params && params->video_codec_id ? params->video_codec_id : AV_CODEC_ID_H264;
+    int video_bitrate = first->video_bitrate > 0 ? first->video_bitrate : params ? params->video_bitrate : 0;
+    if (nb_renditions == 1 && first->width <= 0 && first->height <= 0 &&
+        can_copy(in_stream_video, video_codec_id, video_bitrate, ofmt, copy_mode)) {
+        if ((ret = open_copy_stream(&pipe.copy[0], in_stream_video, ofmt)) < 0)
+            goto end;
+    } else if (!(dec_ctx_video = open_decoder(in_stream_video, decode_threads, params))) {
+        fprintf(stderr, "Could not open video decoder\n");
+        ret = -1;
+        goto end;
+    }
+
+    // Audio is the same in every output: copy, or one decoder and one encoder
+    enum AVCodecID audio_codec_id = params && params->audio_codec_id ? params->audio_codec_id : AV_CODEC_ID_AAC;
+    if (in_stream_audio && same_format &&
+        can_copy(in_stream_audio, audio_codec_id, params ? params->audio_bitrate : 0, ofmt, copy_mode)) {
+        if ((ret = open_copy_stream(&pipe.copy[1], in_stream_audio, ofmt)) < 0)
+            goto end;
+    } else if (in_stream_audio) {
+        if (!(dec_ctx_audio = open_decoder(in_stream_audio, decode_threads, params))) {
+            fprintf(stderr, "Could not open audio decoder\n");
+            ret = -1;
+            goto end;
+        }
+        if ((ret = open_audio_encoder(dec_ctx_audio, any_global_header(&pipe), params, encode_threads, &enc_ctx_audio)) < 0)
+            goto end;
+        pipe.audio_in_time_base = in_stream_audio->time_base;
+    }
+
+    if ((ret = find_extradata(&pipe)) < 0)
+        goto end;
+
+    // Output streams, with a video encoder per output
+    for (int k = 0; k < pipe.nb_outputs; k++) {
+        Output *o = &pipe.outputs[k];
+        if (pipe.copy[0].enabled) {
+            o->streams[0] = add_copy_stream(o->fmt_ctx, &pipe.copy[0]);
+            o->src_time_base[0] = pipe.copy[0].time_base;
+            pipe.copy[0].queues[pipe.copy[0].nb_queues++] = &o->video_out;
+        } else {
+            if ((ret = open_video_encoder(pipe.input_fmt_ctx, in_stream_video, dec_ctx_video, o->spec,
+                                          !!(o->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER),
+                                          params, encode_threads, &o->video_enc)) < 0)
+                goto end;
+            o->streams[0] = add_encoder_stream(o->fmt_ctx, o->video_enc);
+            o->src_time_base[0] = o->video_enc->time_base;
+        }
+        if (pipe.copy[1].enabled) {
+            o->streams[1] = add_copy_stream(o->fmt_ctx, &pipe.copy[1]);
+            o->src_time_base[1] = pipe.copy[1].time_base;
+            pipe.copy[1].queues[pipe.copy[1].nb_queues++] = &o->audio_out;
+        } else if (enc_ctx_audio) {
+            o->streams[1] = add_encoder_stream(o->fmt_ctx, enc_ctx_audio);
+            o->src_time_base[1] = enc_ctx_audio->time_base;
+        }
+        if (!o->streams[0] || (in_stream_audio && !o->streams[1])) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+    }
+
+    // Segmenting seeks in separate contexts, so it needs a file. The encoder above still
+    // provides the output stream parameters, the workers use identical settings.
+    if (params && params->segments && !input_pb && pipe.nb_outputs == 1 && pipe.outputs[0].video_enc &&
+        (ret = segment_job_create(&pipe, input_filename, &pipe.outputs[0], params, &pipe.segments)) < 0)
+        goto end;
+
+    // Open output files for writing
+    for (int k = 0; k < pipe.nb_outputs; k++) {
+        Output *o = &pipe.outputs[k];
+        if (o->spec->output_pb) {
+            o->fmt_ctx->pb = o->spec->output_pb;
+            o->fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+        } else if (!(o->fmt_ctx->oformat->flags & AVFMT_NOFILE) &&
+                   (ret = avio_open2(&o->fmt_ctx->pb, o->spec->output_filename, AVIO_FLAG_WRITE,
+                                     &o->fmt_ctx->interrupt_callback, NULL)) < 0) {
+            fprintf(stderr, "Could not open output file '%s'\n", output_name(o->spec));
+            goto end;
+        }
+        AVDictionary *opts = NULL;
+        if (o->spec->fragmented) {
+            av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+            if (o->spec->fragment_ms > 0)
+                av_dict_set_int(&opts, "frag_duration", (int64_t)o->spec->fragment_ms * 1000, 0);
+            // Hand every finished fragment to the output instead of waiting for a full I/O buffer
+            o->fmt_ctx->flush_packets = 1;
+        }
+        ret = avformat_write_header(o->fmt_ctx, &opts);
+        av_dict_free(&opts);
+        if (ret < 0) {
+            fprintf(stderr, "Could not write output header for '%s'\n", output_name(o->spec));
+            goto end;
+        }
+    }
+    // The segments are renumbered in the stream time base, which the header may have changed
+    if (pipe.segments)
+        pipe.outputs[0].src_time_base[0] = pipe.outputs[0].streams[0]->time_base;
+
+    // Setup video pixel format conversion and resizing where needed. The outputs scale
+    // concurrently, so they share the scale threads.
+    int scale_threads = FFMAX(1, resolve_threads(params ? params->scale_threads : 0) / pipe.nb_outputs);
+    for (int k = 0; k < pipe.nb_outputs && !pipe.segments; k++) {
+        Output *o = &pipe.outputs[k];
+        AVCodecContext *enc = o->video_enc;
+        if (!enc || (dec_ctx_video->pix_fmt == enc->pix_fmt && dec_ctx_video->width == enc->width &&
+                     dec_ctx_video->height == enc->height))
+            continue;
+        o->scaler = scale_pool_create(dec_ctx_video->width, dec_ctx_video->height, dec_ctx_video->pix_fmt,
+                                      enc->width, enc->height, enc->pix_fmt, scale_threads);
+        int scaled_size = av_image_get_buffer_size(enc->pix_fmt, enc->width, enc->height, 32);
+        if (!o->scaler || scaled_size < 0 || !(o->scaled_pool = av_buffer_pool_init(scaled_size, NULL))) {
+            fprintf(stderr, "Could not create the pixel format converter\n");
+            ret = -1;
+            goto end;
+        }
+    }
+
+    // Setup audio sample format conversion if needed
+    if (enc_ctx_audio && (dec_ctx_audio->sample_fmt != enc_ctx_audio->sample_fmt ||
+        dec_ctx_audio->sample_rate != enc_ctx_audio->sample_rate ||
+        dec_ctx_audio->channel_layout != enc_ctx_audio->channel_layout)) {
+        pipe.swr_ctx = swr_alloc_set_opts(NULL,
+            enc_ctx_audio->channel_layout, enc_ctx_audio->sample_fmt, enc_ctx_audio->sample_rate,
+            dec_ctx_audio->channel_layout, dec_ctx_audio->sample_fmt, dec_ctx_audio->sample_rate,
+            0, NULL);
+        if (!pipe.swr_ctx || (ret = swr_init(pipe.swr_ctx)) < 0) {
+            fprintf(stderr, "Could not create the audio resampler\n");
+            ret = -1;
+            goto end;
+        }
+    }
+
+    // Connect the stages
+    int video_stages = dec_ctx_video && !pipe.segments;
+    pipe.stages[STAGE_DEMUX] = (Stage){.used = 1};
+    pipe.stages[STAGE_VIDEO_DECODE] = (Stage){.used = video_stages, .codec = dec_ctx_video, .in = &pipe.video_packets};
+    pipe.stages[STAGE_VIDEO_SEGMENTS] = (Stage){.used = !!pipe.segments, .outs = {&pipe.outputs[0].video_out}, .nb_outs = 1};
+    pipe.stages[STAGE_AUDIO_DECODE] = (Stage){.used = !!enc_ctx_audio, .codec = dec_ctx_audio, .in = &pipe.audio_packets,
+                                              .outs = {&pipe.audio_frames}, .nb_outs = 1};
+    pipe.stages[STAGE_AUDIO_ENCODE] = (Stage){.used = !!enc_ctx_audio, .codec = enc_ctx_audio, .in = &pipe.audio_frames};
+    for (int k = 0; k < pipe.nb_outputs; k++) {
+        Output *o = &pipe.outputs[k];
+        Stage *decode = &pipe.stages[STAGE_VIDEO_DECODE], *audio_encode = &pipe.stages[STAGE_AUDIO_ENCODE];
+        decode->outs[decode->nb_outs++] = o->scaler ? &o->decoded_frames : &o->scaled_frames;
+        audio_encode->outs[audio_encode->nb_outs++] = &o->audio_out;
+        o->stages[OUTPUT_STAGE_SCALE] = (Stage){.used = !!o->scaler, .in = &o->decoded_frames,
+                                                .outs = {&o->scaled_frames}, .nb_outs = 1};
+        o->stages[OUTPUT_STAGE_VIDEO_ENCODE] = (Stage){.used = video_stages, .codec = o->video_enc, .in = &o->scaled_frames,
+                                                       .outs = {&o->video_out}, .nb_outs = 1};
+        o->stages[OUTPUT_STAGE_MUX] = (Stage){.used = 1};
+    }
+
+    if ((ret = run_pipeline(&pipe, params)) < 0)
+        goto end;
+
+    for (int k = 0; k < pipe.nb_outputs; k++)
+        av_write_trailer(pipe.outputs[k].fmt_ctx);
+
+end:
+    ff_queue_uninit(&pipe.video_packets);
+    ff_queue_uninit(&pipe.audio_packets);
+    ff_queue_uninit(&pipe.audio_frames);
+    for (int k = 0; k < pipe.nb_outputs; k++) {
+        Output *o = &pipe.outputs[k];
+        ff_queue_uninit(&o->decoded_frames);
+        ff_queue_uninit(&o->scaled_frames);
+        ff_queue_uninit(&o->video_out);
+        ff_queue_uninit(&o->audio_out);
+        if (o->fmt_ctx && !o->spec->output_pb && !(o->fmt_ctx->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&o->fmt_ctx->pb);
+        if (o->fmt_ctx) avformat_free_context(o->fmt_ctx);
+        if (o->video_enc) avcodec_free_context(&o->video_enc);
+        scale_pool_free(&o->scaler);
+        av_buffer_pool_uninit(&o->scaled_pool);
+    }
+    for (int i = 0; i < pipe.nb_preread; i++)
+        av_packet_free(&pipe.preread[i]);
+    av_freep(&pipe.preread);
+    segment_job_free(&pipe.segments);
+    for (int i = 0; i < 2; i++) {
+        av_bsf_free(&pipe.copy[i].bsf);
+        avcodec_parameters_free(&pipe.copy[i].par);
+    }
+    if (pipe.input_fmt_ctx) avformat_close_input(&pipe.input_fmt_ctx);
+    if (dec_ctx_video) avcodec_free_context(&dec_ctx_video);
+    if (dec_ctx_audio) avcodec_free_context(&dec_ctx_audio);
+    if (enc_ctx_audio) avcodec_free_context(&enc_ctx_audio);
+    if (pipe.swr_ctx) swr_free(&pipe.swr_ctx);
+
+    // An interrupted read can look like the end of the input, so the reason decides
+    int reason = media_interrupt_result(&pipe.interrupt, 0);
+    if (pipe.cancelled || reason == AVERROR_EXIT)
+        return CONVERT_CANCELLED;
+    if (reason == MEDIA_TIMEOUT)
+        return CONVERT_TIMEOUT;
+    return ret < 0 ? 1 : 0;
+}
+
+/**
+ * @brief Converts an AVI file to an MP4 file with the specified codecs and bitrates.
+ *
+ * This function opens the input AVI file, finds the video and audio streams,
+ * decodes them, and encodes them into the output MP4 file using the codecs and
+ * bitrates specified in the Params structure. If H.264 is used for video and the
+ * bitrate is less than 60, CRF mode is enabled and the preset is configured according
+ * to the CRF value:
+ *   - CRF < 18: preset "slower"
+ *   - CRF > 30: preset "faster"
+ *   - Otherwise: preset "medium"
+ *
+ * @param input_filename  Path to the input AVI file.
+ * @param output_filename Path to the output MP4 file.
+ * @param params          Pointer to a Params struct specifying codec and bitrate options.
+ * @return 0 on success, CONVERT_CANCELLED if progress_callback or Params.cancel stopped it,
+ *         CONVERT_TIMEOUT past Params.timeout_us, another nonzero value on error.
+ */
+int convert_avi_to_h264_aac(const char *input_filename, const char *output_filename, const Params *params)
+{
+    Rendition output = {.output_filename = output_filename};
+    return convert(input_filename, NULL, &output, 1, params);
+}
+
+/**
+ * @brief Converts from a custom input I/O context, see convert_avi_to_h264_aac.
+ *
+ * @param input           Input I/O context from one of the media_io_open_* functions, not closed here.
+ * @param output_filename Path to the output MP4 file.
+ * @param params          Pointer to a Params struct specifying codec and bitrate options.
+ * @return 0 on success, CONVERT_CANCELLED, CONVERT_TIMEOUT or another nonzero value on error.
+ */
+int convert_avi_to_h264_aac_io(AVIOContext *input, const char *output_filename, const Params *params)
+{
+    Rendition output = {.output_filename = output_filename};
+    return convert(NULL, input, &output, 1, params);
+}
+
+/**
+ * @brief Converts to fragmented MP4 written to a custom output, see convert_avi_to_h264_aac.
+ *
+ * @param input_filename Path to the input file.
+ * @param output         Output I/O context, e.g. from media_io_open_writer, not closed here.
+ * @param params         Pointer to a Params struct specifying codec and bitrate options.
+ * @return 0 on success, CONVERT_CANCELLED, CONVERT_TIMEOUT or another nonzero value on error.
+ */
+int convert_avi_to_h264_aac_stream(const char *input_filename, AVIOContext *output, const Params *params)
+{
+    Rendition rendition = {.output_pb = output, .format = "mp4", .fragmented = 1};
+    return convert(input_filename, NULL, &rendition, 1, params);
+}
+
+/**
+ * @brief Writes several renditions of one input, decoding it once.
+ *
+ * @param input_filename Path to the input file.
+ * @param renditions     Outputs to write, 1 to CONVERT_MAX_RENDITIONS.
+ * @param nb_renditions  Number of renditions.
+ * @param params         Defaults for the renditions, threading and audio options.
+ * @return 0 on success, CONVERT_CANCELLED, CONVERT_TIMEOUT or another nonzero value on error.
+ */
+int convert_renditions(const char *input_filename, const Rendition *renditions, int nb_renditions, const Params *params)
+{
+    return convert(input_filename, NULL, renditions, nb_renditions, params);
+}
+
+/**
+ * @brief Same as convert_renditions, reading the input from a custom I/O context.
+ */
+int convert_renditions_io(AVIOContext *input, const Rendition *renditions, int nb_renditions, const Params *params)
+{
+    return convert(NULL, input, renditions, nb_renditions, params);
+}
+
 /**
- * @brief Converts an AVI file to an MP4 file with the specified codecs and bitrates.
+ * @brief State of one convert_trim call.
  *
- * This function opens the input AVI file, finds the video and audio streams,
- * decodes them, and encodes them into the output MP4 file using the codecs and
- * bitrates specified in the Params structure. If H.264 is used for video and the
- * bitrate is less than 60, CRF mode is enabled and the preset is configured according
- * to the CRF value:
- *   - CRF < 18: preset "slower"
- *   - CRF > 30: preset "faster"
- *   - Otherwise: preset "medium"
+ * Video timestamps are kept in the input stream time base, audio ones in samples. Both are
+ * relative to the start of the clip once they reach the output.
+ */
+typedef struct {
+    MediaInterrupt interrupt;
+    const Params *params;
+    const char *output_filename;
+    AVFormatContext *input_fmt_ctx;
+    AVFormatContext *output_fmt_ctx;
+    AVStream *in_video, *in_audio;
+    AVStream *out_video, *out_audio;
+    CopyStream video;             /**< The source video in Annex B, as the boundary encoder writes it. */
+    AVCodecContext *video_dec;
+    AVCodecContext *audio_dec, *audio_enc;
+    SwrContext *swr_ctx;
+    AVAudioFifo *fifo;            /**< Trimmed audio waiting for the encoder, and for the header. */
+    uint8_t **converted;
+    int converted_size;
+    int64_t start, end;           /**< Cut points in the video time base, end INT64_MAX = to the end. */
+    int64_t audio_start, audio_end; /**< Cut points in samples. */
+    int64_t audio_next_pts;       /**< Encoder timestamp of the next sample in the FIFO. */
+    AVPacket **gop;               /**< Video packets since the last key packet, in decode order. */
+    int nb_gop, gop_capacity;
+    int64_t *part_dts;            /**< Decode times the boundary part takes over, see trim_encode. */
+    int nb_part_dts, next_part_dts;
+    int64_t dts_shift;            /**< pts - dts of the source key packets, for parts without part_dts. */
+    int64_t last_dts;
+    int copying;                  /**< The last GOP written was copied, the next one continues it. */
+    AVFrame *shape;               /**< Size and format the header's boundary parameter sets were made for. */
+    int avcc;                     /**< The header holds an avcC, packets are written length prefixed. */
+    int header_written;
+    int video_done, audio_done;
+} Trim;
+
+/**
+ * @brief Finds the next NAL unit of an Annex B buffer and moves *p past it.
  *
- * @param input_filename  Path to the input AVI file.
- * @param output_filename Path to the output MP4 file.
- * @param params          Pointer to a Params struct specifying codec and bitrate options.
- * @return 0 on success, nonzero on error.
+ * @return Size of the NAL unit at *nal, -1 when there is none left.
  */
-int convert_avi_to_h264_aac(const char *input_filename, const char *output_filename, const Params *params)
+static int next_nal(const uint8_t **p, const uint8_t *end, const uint8_t **nal)
 {
-    AVFormatContext *input_fmt_ctx = NULL;
-    AVFormatContext *output_fmt_ctx = NULL;
-    AVCodecContext *dec_ctx_video = NULL, *dec_ctx_audio = NULL;
-    AVCodecContext *enc_ctx_video = NULL, *enc_ctx_audio = NULL;
-    AVStream *in_stream_video = NULL, *in_stream_audio = NULL;
-    AVStream *out_stream_video = NULL, *out_stream_audio = NULL;
-    int video_stream_index = -1, audio_stream_index = -1;
+    const uint8_t *q = *p;
+    while (end - q >= 3 && (q[0] || q[1] || q[2] != 1))
+        q++;
+    if (end - q < 3)
+        return -1;
+    *nal = q += 3;
+    while (end - q >= 3 && (q[0] || q[1] || q[2] != 1))
+        q++;
+    if (end - q < 3)
+        q = end;
+    *p = q;
+    // The zero opening a four byte start code is not part of the unit
+    if (q < end && q > *nal && q[-1] == 0)
+        q--;
+    return (int)(q - *nal);
+}
+
+/**
+ * @brief Replaces the extradata of par by an avcC listing every SPS and PPS of an Annex B buffer.
+ *
+ * Older muxers keep a single SPS and PPS when they convert Annex B extradata themselves, so the
+ * record is built here. NAL units are given four byte lengths, as annexb_to_length_prefixed writes.
+ */
+static int annexb_to_avcc(const uint8_t *data, int size, AVCodecParameters *par)
+{
+    // The record counts at most 31 SPS
+    const uint8_t *sets[2][31];
+    int set_sizes[2][31], nb_sets[2] = {0, 0};
+    const uint8_t *p = data, *end = data + size, *nal;
+    int nal_size, avcc_size = 7;
+
+    while ((nal_size = next_nal(&p, end, &nal)) >= 0) {
+        int type = nal_size > 0 ? nal[0] & 0x1f : 0;
+        int k = type == 7 ? 0 : type == 8 ? 1 : -1;
+        if (k < 0 || nb_sets[k] == 31 || nal_size > 0xffff || (k == 0 && nal_size < 4))
+            continue;
+        sets[k][nb_sets[k]] = nal;
+        set_sizes[k][nb_sets[k]++] = nal_size;
+        avcc_size += 2 + nal_size;
+    }
+    if (!nb_sets[0] || !nb_sets[1]) {
+        fprintf(stderr, "No H.264 SPS and PPS found for the header\n");
+        return AVERROR_INVALIDDATA;
+    }
+
+    uint8_t *avcc = av_mallocz(avcc_size + AV_INPUT_BUFFER_PADDING_SIZE), *w = avcc;
+    if (!avcc)
+        return AVERROR(ENOMEM);
+    *w++ = 1;
+    // Profile, constraint flags and level of the first SPS
+    memcpy(w, sets[0][0] + 1, 3);
+    w += 3;
+    *w++ = 0xff;
+    for (int k = 0; k < 2; k++) {
+        *w++ = k == 0 ? 0xe0 | nb_sets[0] : nb_sets[1];
+        for (int i = 0; i < nb_sets[k]; i++) {
+            AV_WB16(w, set_sizes[k][i]);
+            memcpy(w + 2, sets[k][i], set_sizes[k][i]);
+            w += 2 + set_sizes[k][i];
+        }
+    }
+    av_freep(&par->extradata);
+    par->extradata = avcc;
+    par->extradata_size = avcc_size;
+    return 0;
+}
+
+/**
+ * @brief Rewrites an Annex B packet as NAL units with four byte length prefixes.
+ */
+static int annexb_to_length_prefixed(AVPacket *pkt)
+{
+    const uint8_t *p = pkt->data, *end = pkt->data + pkt->size, *nal;
+    int nal_size, size = 0;
+
+    while ((nal_size = next_nal(&p, end, &nal)) >= 0)
+        size += nal_size > 0 ? 4 + nal_size : 0;
+    AVBufferRef *buf = av_buffer_alloc(size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!buf)
+        return AVERROR(ENOMEM);
+    uint8_t *w = buf->data;
+    for (p = pkt->data; (nal_size = next_nal(&p, end, &nal)) >= 0;) {
+        if (nal_size == 0)
+            continue;
+        AV_WB32(w, nal_size);
+        memcpy(w + 4, nal, nal_size);
+        w += 4 + nal_size;
+    }
+    memset(w, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    av_buffer_unref(&pkt->buf);
+    pkt->buf = buf;
+    pkt->data = buf->data;
+    pkt->size = size;
+    return 0;
+}
+
+/**
+ * @brief Writes a packet of the clip's video, with timestamps relative to the clip start.
+ *
+ * Timestamps are written as they are: copied GOPs keep the source's and trim_encode places the
+ * boundary parts between them. A packet that would not follow the previous one in decode order,
+ * or would be shown before it is decoded, fails the trim.
+ */
+static int trim_write_video(Trim *t, AVPacket *pkt)
+{
+    int ret;
+
+    if (pkt->dts != AV_NOPTS_VALUE) {
+        if ((t->last_dts != AV_NOPTS_VALUE && pkt->dts <= t->last_dts) ||
+            (pkt->pts != AV_NOPTS_VALUE && pkt->pts < pkt->dts)) {
+            fprintf(stderr, "Video packet with pts %" PRId64 " and dts %" PRId64 " does not follow dts %" PRId64
+                    " at a splice\n", pkt->pts, pkt->dts, t->last_dts);
+            return AVERROR_INVALIDDATA;
+        }
+        t->last_dts = pkt->dts;
+    }
+    if (t->avcc && (ret = annexb_to_length_prefixed(pkt)) < 0)
+        return ret;
+    pkt->stream_index = t->out_video->index;
+    pkt->pos = -1;
+    av_packet_rescale_ts(pkt, t->in_video->time_base, t->out_video->time_base);
+    return av_interleaved_write_frame(t->output_fmt_ctx, pkt);
+}
+
+/**
+ * @brief Sends frame (NULL to flush) to enc and writes every packet it returns to the clip.
+ */
+static int trim_encode(Trim *t, AVCodecContext *enc, AVFrame *frame)
+{
+    AVPacket pkt;
+    int ret = avcodec_send_frame(enc, frame);
+    if (ret < 0 && ret != AVERROR_EOF)
+        return ret;
+    av_init_packet(&pkt);
+    while ((ret = avcodec_receive_packet(enc, &pkt)) == 0) {
+        if (enc == t->audio_enc) {
+            pkt.stream_index = t->out_audio->index;
+            av_packet_rescale_ts(&pkt, enc->time_base, t->out_audio->time_base);
+            ret = av_interleaved_write_frame(t->output_fmt_ctx, &pkt);
+        } else {
+            // The part has no B-frames, any rising dts up to pts fits; see trim_reencode_gop
+            if (pkt.pts != AV_NOPTS_VALUE)
+                pkt.dts = t->next_part_dts < t->nb_part_dts ? t->part_dts[t->next_part_dts++] : pkt.pts - t->dts_shift;
+            ret = trim_write_video(t, &pkt);
+        }
+        av_packet_unref(&pkt);
+        if (ret < 0)
+            return ret;
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+/**
+ * @brief Encodes the trimmed audio collected so far, or all of it with flush.
+ *
+ * Nothing is encoded before the header is written, which waits for the first video GOP.
+ */
+static int trim_encode_audio(Trim *t, int flush)
+{
+    AVCodecContext *enc = t->audio_enc;
+    int frame_size = enc->frame_size ? enc->frame_size : 1024;
     int ret = 0;
 
-    av_register_all();
+    if (!t->header_written)
+        return 0;
+    // The last frame may be shorter than frame_size
+    while (ret == 0 && (av_audio_fifo_size(t->fifo) >= frame_size || (flush && av_audio_fifo_size(t->fifo) > 0))) {
+        AVFrame *out = av_frame_alloc();
+        if (!out)
+            return AVERROR(ENOMEM);
+        out->nb_samples = FFMIN(frame_size, av_audio_fifo_size(t->fifo));
+        out->format = enc->sample_fmt;
+        out->channel_layout = enc->channel_layout;
+        out->channels = enc->channels;
+        out->sample_rate = enc->sample_rate;
+        if ((ret = av_frame_get_buffer(out, 0)) == 0) {
+            av_audio_fifo_read(t->fifo, (void **)out->data, out->nb_samples);
+            out->pts = t->audio_next_pts;
+            t->audio_next_pts += out->nb_samples;
+            ret = trim_encode(t, enc, out);
+        }
+        av_frame_free(&out);
+    }
+    if (flush && ret == 0)
+        ret = trim_encode(t, enc, NULL);
+    return ret;
+}
 
-    // Open input file
-    if ((ret = avformat_open_input(&input_fmt_ctx, input_filename, NULL, NULL)) < 0) {
-        fprintf(stderr, "Could not open input file '%s'\n", input_filename);
-        goto end;
+/**
+ * @brief Keeps the samples of a decoded audio frame that fall inside the clip.
+ *
+ * The cut is made on the decoded samples, so the clip starts and ends on the exact sample
+ * whatever the packet size. The encoder runs at the decoder sample rate, so the resampler only
+ * converts the sample format and adds no delay.
+ */
+static int trim_audio_frame(Trim *t, const AVFrame *frame)
+{
+    AVRational rate = {1, frame->sample_rate};
+    int64_t ts = frame->best_effort_timestamp;
+    if (ts == AV_NOPTS_VALUE)
+        return 0;
+    int64_t first = av_rescale_q(ts, t->in_audio->time_base, rate);
+    if (first >= t->audio_end) {
+        t->audio_done = 1;
+        return 0;
     }
+    int skip = (int)FFMAX(0, FFMIN(t->audio_start - first, frame->nb_samples));
+    int count = (int)FFMIN(frame->nb_samples, t->audio_end - first) - skip;
+    if (count <= 0)
+        return 0;
+    if (t->audio_next_pts == AV_NOPTS_VALUE)
+        t->audio_next_pts = first + skip - t->audio_start;
 
-    if ((ret = avformat_find_stream_info(input_fmt_ctx, NULL)) < 0) {
-        fprintf(stderr, "Failed to retrieve input stream information\n");
-        goto end;
+    // A channel layout has at most 64 channels
+    const uint8_t *data[64];
+    int planar = av_sample_fmt_is_planar(frame->format);
+    int step = av_get_bytes_per_sample(frame->format) * (planar ? 1 : frame->channels);
+    for (int i = 0; i < (planar ? FFMIN(frame->channels, 64) : 1); i++)
+        data[i] = frame->extended_data[i] + (size_t)skip * step;
+
+    if (!t->swr_ctx)
+        return av_audio_fifo_write(t->fifo, (void **)data, count);
+    if (count > t->converted_size) {
+        if (t->converted)
+            av_freep(&t->converted[0]);
+        av_freep(&t->converted);
+        int ret = av_samples_alloc_array_and_samples(&t->converted, NULL, t->audio_enc->channels, count,
+                                                     t->audio_enc->sample_fmt, 0);
+        if (ret < 0)
+            return ret;
+        t->converted_size = count;
     }
+    int samples = swr_convert(t->swr_ctx, t->converted, t->converted_size, data, count);
+    return samples > 0 ? av_audio_fifo_write(t->fifo, (void **)t->converted, samples) : samples;
+}
 
-    // Find the video and audio streams
-    for (unsigned int i = 0; i < input_fmt_ctx->nb_streams; i++) {
-        if (input_fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && video_stream_index < 0)
-            video_stream_index = i;
-        else if (input_fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && audio_stream_index < 0)
-            audio_stream_index = i;
+/**
+ * @brief Decodes an audio packet (NULL to drain) into the FIFO and encodes what is complete.
+ */
+static int trim_decode_audio(Trim *t, const AVPacket *pkt)
+{
+    AVFrame *frame = av_frame_alloc();
+    int ret = 0;
+    if (!frame)
+        return AVERROR(ENOMEM);
+    // Corrupt packets are skipped, a NULL packet drains the decoder
+    avcodec_send_packet(t->audio_dec, pkt);
+    while (ret >= 0 && avcodec_receive_frame(t->audio_dec, frame) == 0) {
+        ret = trim_audio_frame(t, frame);
+        av_frame_unref(frame);
     }
-    if (video_stream_index == -1) {
-        fprintf(stderr, "Did not find a video stream in the input file\n");
-        ret = -1;
+    av_frame_free(&frame);
+    return ret < 0 ? ret : trim_encode_audio(t, 0);
+}
+
+/**
+ * @brief Opens the encoder for the partial GOP at a cut point, matching the source stream.
+ *
+ * The parts it writes sit between stream copied GOPs, so the frame size, pixel format, profile,
+ * level and colour description are taken from the source and the rate from its bitrate. Each
+ * part is a fresh encoder: it starts with an IDR frame and has no B-frames, so it depends on
+ * nothing around it. Its SPS and PPS use id 31, leaving the source's parameter sets valid for
+ * the copied GOPs. They are repeated in band, and with AV_CODEC_FLAG_GLOBAL_HEADER in flags
+ * written to the extradata instead, see trim_global_header.
+ */
+static int open_trim_encoder(Trim *t, const AVFrame *frame, int flags, AVCodecContext **penc)
+{
+    const Params *params = t->params;
+    AVCodec *encoder = avcodec_find_encoder_by_name("libx264");
+    if (!encoder) {
+        fprintf(stderr, "Trimming needs the libx264 encoder\n");
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    AVCodecContext *dec = t->video_dec, *enc = *penc = avcodec_alloc_context3(encoder);
+    if (!enc)
+        return AVERROR(ENOMEM);
+    enc->width = frame->width;
+    enc->height = frame->height;
+    enc->pix_fmt = frame->format;
+    enc->sample_aspect_ratio = frame->sample_aspect_ratio.num ? frame->sample_aspect_ratio : dec->sample_aspect_ratio;
+    enc->time_base = t->in_video->time_base;
+    enc->framerate = av_guess_frame_rate(t->input_fmt_ctx, t->in_video, NULL);
+    enc->profile = dec->profile & ~FF_PROFILE_H264_CONSTRAINED;
+    enc->level = dec->level;
+    enc->color_range = frame->color_range;
+    enc->color_primaries = frame->color_primaries;
+    enc->color_trc = frame->color_trc;
+    enc->colorspace = frame->colorspace;
+    enc->chroma_sample_location = frame->chroma_location;
+    enc->flags |= flags;
+    if (frame->interlaced_frame)
+        enc->flags |= AV_CODEC_FLAG_INTERLACED_DCT;
+    enc->max_b_frames = 0;
+    // One IDR frame at the start, as x264's keyint=infinite
+    enc->gop_size = 1 << 30;
+
+    int bitrate = params ? params->video_bitrate : 0;
+    if (bitrate <= 0)
+        bitrate = (int)FFMIN(t->in_video->codecpar->bit_rate, INT_MAX);
+    if (bitrate > 0 && bitrate < 60)
+        av_opt_set_double(enc->priv_data, "crf", bitrate, 0);
+    else if (bitrate > 0)
+        enc->bit_rate = bitrate;
+    else
+        av_opt_set_double(enc->priv_data, "crf", 18, 0);
+    av_opt_set(enc->priv_data, "x264-params", "sps-id=31:scenecut=0", 0);
+    set_codec_threads(enc, params && params->encode_threads > 0 ? params->encode_threads : 0, params);
+    int ret = avcodec_open2(enc, encoder, NULL);
+    if (ret < 0)
+        fprintf(stderr, "Could not open the boundary encoder for %s\n", av_get_pix_fmt_name(frame->format));
+    return ret;
+}
+
+/**
+ * @brief Declares the boundary parts' parameter sets in the header next to the source's.
+ *
+ * Containers with a global header must list the SPS and PPS of every packet in the avcC, in band
+ * copies are not enough. An encoder opened with the stream's size and format and a global header
+ * writes the id 31 sets once; the avcC built from them and the source's replaces the Annex B
+ * extradata. The boundary parts are then encoded for that same shape. Without libx264 nothing
+ * can be re-encoded and the source sets are listed alone.
+ */
+static int trim_global_header(Trim *t)
+{
+    AVCodecParameters *par = t->video.par;
+    AVCodecContext *enc = NULL;
+    uint8_t *sets = NULL;
+    int size = par->extradata_size;
+    int ret = 0;
+
+    if (!(t->shape = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    t->shape->width = par->width;
+    t->shape->height = par->height;
+    t->shape->format = par->format;
+    t->shape->sample_aspect_ratio = par->sample_aspect_ratio;
+    t->shape->color_range = par->color_range;
+    t->shape->color_primaries = par->color_primaries;
+    t->shape->color_trc = par->color_trc;
+    t->shape->colorspace = par->color_space;
+    t->shape->chroma_location = par->chroma_location;
+    t->shape->interlaced_frame = par->field_order != AV_FIELD_UNKNOWN && par->field_order != AV_FIELD_PROGRESSIVE;
+
+    if (avcodec_find_encoder_by_name("libx264") &&
+        (ret = open_trim_encoder(t, t->shape, AV_CODEC_FLAG_GLOBAL_HEADER, &enc)) < 0)
         goto end;
+    if (!(sets = av_malloc(size + (enc ? enc->extradata_size : 0)))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    memcpy(sets, par->extradata, size);
+    if (enc) {
+        memcpy(sets + size, enc->extradata, enc->extradata_size);
+        size += enc->extradata_size;
     }
-    in_stream_video = input_fmt_ctx->streams[video_stream_index];
-    if (audio_stream_index != -1)
-        in_stream_audio = input_fmt_ctx->streams[audio_stream_index];
+    if ((ret = annexb_to_avcc(sets, size, par)) == 0)
+        t->avcc = 1;
+end:
+    av_free(sets);
+    avcodec_free_context(&enc);
+    return ret;
+}
 
-    // Video decoder
-    AVCodec *decoder_video = avcodec_find_decoder(in_stream_video->codecpar->codec_id);
-    dec_ctx_video = avcodec_alloc_context3(decoder_video);
-    avcodec_parameters_to_context(dec_ctx_video, in_stream_video->codecpar);
-    avcodec_open2(dec_ctx_video, decoder_video, NULL);
+/**
+ * @brief Adds the output streams and writes the header, once the first GOP is known.
+ *
+ * Annex B sources without extradata (MPEG-TS) carry their SPS and PPS in the key packets, so they
+ * are taken from the first one for containers that store them in the header.
+ */
+static int trim_write_header(Trim *t)
+{
+    AVFormatContext *out = t->output_fmt_ctx;
+    int ret;
 
-    // Audio decoder
-    if (in_stream_audio) {
-        AVCodec *decoder_audio = avcodec_find_decoder(in_stream_audio->codecpar->codec_id);
-        dec_ctx_audio = avcodec_alloc_context3(decoder_audio);
-        avcodec_parameters_to_context(dec_ctx_audio, in_stream_audio->codecpar);
-        avcodec_open2(dec_ctx_audio, decoder_audio, NULL);
+    if (t->video.par->extradata_size == 0 && t->nb_gop > 0) {
+        AVBSFContext *probe = NULL;
+        AVPacket *pkt = NULL;
+        if ((ret = open_bsf("extract_extradata", t->in_video, &probe)) == 0 &&
+            (pkt = av_packet_clone(t->gop[0])) && (ret = av_bsf_send_packet(probe, pkt)) == 0) {
+            while (av_bsf_receive_packet(probe, pkt) == 0) {
+                ret = take_extradata(&t->video, probe, pkt);
+                av_packet_unref(pkt);
+                if (ret != 0)
+                    break;
+            }
+        }
+        av_packet_free(&pkt);
+        av_bsf_free(&probe);
+        if (ret < 0)
+            return ret;
     }
+    if ((out->oformat->flags & AVFMT_GLOBALHEADER) && (ret = trim_global_header(t)) < 0)
+        return ret;
 
-    // Prepare output file
-    avformat_alloc_output_context2(&output_fmt_ctx, NULL, NULL, output_filename);
-    if (!output_fmt_ctx) {
-        fprintf(stderr, "Could not create output context\n");
-        ret = -1;
-        goto end;
+    if (!(t->out_video = add_copy_stream(out, &t->video)) ||
+        (t->audio_enc && !(t->out_audio = add_encoder_stream(out, t->audio_enc))))
+        return AVERROR(ENOMEM);
+    if (!(out->oformat->flags & AVFMT_NOFILE) &&
+        (ret = avio_open2(&out->pb, t->output_filename, AVIO_FLAG_WRITE, &out->interrupt_callback, NULL)) < 0) {
+        fprintf(stderr, "Could not open output file '%s'\n", t->output_filename);
+        return ret;
     }
+    if ((ret = avformat_write_header(out, NULL)) < 0) {
+        fprintf(stderr, "Could not write output header for '%s'\n", t->output_filename);
+        return ret;
+    }
+    t->header_written = 1;
+    return 0;
+}
 
-    // Video encoder setup
-    enum AVCodecID video_codec_id = params && params->video_codec_id ? params->video_codec_id : AV_CODEC_ID_H264;
-    AVCodec *encoder_video = avcodec_find_encoder(video_codec_id);
-    if (!encoder_video) {
-        fprintf(stderr, "Could not find video encoder for id %d\n", video_codec_id);
-        ret = -1;
-        goto end;
+/**
+ * @brief Decodes the buffered GOP and re-encodes its frames inside the clip.
+ *
+ * The part takes over the decode times of the packets it replaces, in ascending order. Its
+ * packets come out in presentation order, and the i-th smallest dts of a set of frames is never
+ * after the i-th smallest pts, so every dts stays at or before its pts. All of them lie between
+ * the dts of the GOPs around it, so the splices need no shift.
+ */
+static int trim_reencode_gop(Trim *t)
+{
+    AVCodecContext *enc = NULL;
+    AVFrame *frame = av_frame_alloc();
+    int64_t *dts = av_realloc_array(t->part_dts, FFMAX(t->nb_gop, 1), sizeof(*dts));
+    int ret = frame && dts ? 0 : AVERROR(ENOMEM);
+
+    if (dts)
+        t->part_dts = dts;
+    t->nb_part_dts = t->next_part_dts = 0;
+    for (int i = 0; i < t->nb_gop && ret >= 0; i++) {
+        const AVPacket *pkt = t->gop[i];
+        if (pkt->pts != AV_NOPTS_VALUE && pkt->dts != AV_NOPTS_VALUE && pkt->pts >= t->start && pkt->pts < t->end)
+            dts[t->nb_part_dts++] = pkt->dts - t->start;
     }
-    out_stream_video = avformat_new_stream(output_fmt_ctx, NULL);
-    enc_ctx_video = avcodec_alloc_context3(encoder_video);
-    enc_ctx_video->height = dec_ctx_video->height;
-    enc_ctx_video->width = dec_ctx_video->width;
-    enc_ctx_video->sample_aspect_ratio = dec_ctx_video->sample_aspect_ratio;
-    enc_ctx_video->pix_fmt = encoder_video->pix_fmts ? encoder_video->pix_fmts[0] : dec_ctx_video->pix_fmt;
-    enc_ctx_video->time_base = in_stream_video->time_base;
-    enc_ctx_video->framerate = av_guess_frame_rate(input_fmt_ctx, in_stream_video, NULL);
+    if (ret >= 0)
+        qsort(dts, t->nb_part_dts, sizeof(*dts), compare_int64);
 
-    // Set bitrate or CRF mode for H.264 if required
-    if (params && params->video_bitrate > 0) {
-        if (video_codec_id == AV_CODEC_ID_H264 && params->video_bitrate < 60) {
-            int crf = params->video_bitrate;
-            av_opt_set_double(enc_ctx_video->priv_data, "crf", crf, 0);
-            // Set preset depending on CRF value
-            if (crf < 18) {
-                av_opt_set(enc_ctx_video->priv_data, "preset", "slower", 0);
-            } else if (crf > 30) {
-                av_opt_set(enc_ctx_video->priv_data, "preset", "faster", 0);
-            } else {
-                av_opt_set(enc_ctx_video->priv_data, "preset", "medium", 0);
+    for (int i = 0; i <= t->nb_gop && ret >= 0; i++) {
+        // Corrupt packets are skipped, the NULL packet at the end drains the decoder
+        avcodec_send_packet(t->video_dec, i < t->nb_gop ? t->gop[i] : NULL);
+        while (ret >= 0 && avcodec_receive_frame(t->video_dec, frame) == 0) {
+            int64_t pts = frame->best_effort_timestamp;
+            int inside = pts != AV_NOPTS_VALUE && pts >= t->start && pts < t->end;
+            if (inside && t->shape && (frame->width != t->shape->width || frame->height != t->shape->height ||
+                                       frame->format != t->shape->format)) {
+                fprintf(stderr, "Frame at %" PRId64 " is %dx%d %s, the header was made for %dx%d %s\n", pts,
+                        frame->width, frame->height, av_get_pix_fmt_name(frame->format), t->shape->width,
+                        t->shape->height, av_get_pix_fmt_name(t->shape->format));
+                ret = AVERROR_INVALIDDATA;
+            } else if (inside && (enc || (ret = open_trim_encoder(t, t->shape ? t->shape : frame, 0, &enc)) >= 0)) {
+                frame->pts = pts - t->start;
+                // The decoder's picture types would otherwise force the source GOP structure
+                frame->pict_type = AV_PICTURE_TYPE_NONE;
+                ret = trim_encode(t, enc, frame);
             }
-            enc_ctx_video->bit_rate = 0; // Avoid CBR mode
-        } else {
-            enc_ctx_video->bit_rate = params->video_bitrate;
+            av_frame_unref(frame);
         }
     }
-    if (output_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
-        enc_ctx_video->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-    avcodec_open2(enc_ctx_video, encoder_video, NULL);
-    avcodec_parameters_from_context(out_stream_video->codecpar, enc_ctx_video);
-    out_stream_video->time_base = enc_ctx_video->time_base;
+    if (enc && ret >= 0)
+        ret = trim_encode(t, enc, NULL);
+    // Ready for the next GOP after the drain
+    avcodec_flush_buffers(t->video_dec);
+    avcodec_free_context(&enc);
+    av_frame_free(&frame);
+    return ret;
+}
 
-    // Audio encoder setup
-    if (in_stream_audio) {
-        enum AVCodecID audio_codec_id = params && params->audio_codec_id ? params->audio_codec_id : AV_CODEC_ID_AAC;
-        AVCodec *encoder_audio = avcodec_find_encoder(audio_codec_id);
-        if (!encoder_audio) {
-            fprintf(stderr, "Could not find audio encoder for id %d\n", audio_codec_id);
-            ret = -1;
-            goto end;
+/**
+ * @brief Tells whether a source packet holds an IDR slice, which nothing before it is referenced from.
+ */
+static int has_idr(const Trim *t, const AVPacket *pkt)
+{
+    const AVCodecParameters *par = t->in_video->codecpar;
+    const uint8_t *p = pkt->data, *end = pkt->data + pkt->size, *nal;
+    int nal_size;
+
+    if (par->extradata_size > 0 && !is_annexb(par)) {
+        int length_size = par->extradata_size > 4 ? (par->extradata[4] & 3) + 1 : 4;
+        while (end - p > length_size) {
+            uint32_t size = 0;
+            for (int i = 0; i < length_size; i++)
+                size = size << 8 | p[i];
+            p += length_size;
+            if (size > (uint32_t)(end - p))
+                break;
+            if (size > 0 && (p[0] & 0x1f) == 5)
+                return 1;
+            p += size;
         }
-        out_stream_audio = avformat_new_stream(output_fmt_ctx, NULL);
-        enc_ctx_audio = avcodec_alloc_context3(encoder_audio);
-        enc_ctx_audio->sample_rate = dec_ctx_audio->sample_rate;
-        enc_ctx_audio->channel_layout = dec_ctx_audio->channel_layout
-            ? dec_ctx_audio->channel_layout
-            : av_get_default_channel_layout(dec_ctx_audio->channels);
-        enc_ctx_audio->channels = av_get_channel_layout_nb_channels(enc_ctx_audio->channel_layout);
-        enc_ctx_audio->sample_fmt = encoder_audio->sample_fmts ? encoder_audio->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
-        enc_ctx_audio->bit_rate = (params && params->audio_bitrate > 0) ? params->audio_bitrate : 128000;
-        enc_ctx_audio->time_base = (AVRational){1, enc_ctx_audio->sample_rate};
-        if (output_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
-            enc_ctx_audio->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-        avcodec_open2(enc_ctx_audio, encoder_audio, NULL);
-        avcodec_parameters_from_context(out_stream_audio->codecpar, enc_ctx_audio);
-        out_stream_audio->time_base = enc_ctx_audio->time_base;
-    }
-
-    // Open output file for writing
-    if (!(output_fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
-        avio_open(&output_fmt_ctx->pb, output_filename, AVIO_FLAG_WRITE);
-    }
-
-    avformat_write_header(output_fmt_ctx, NULL);
-
-    AVPacket *packet = av_packet_alloc();
-    AVFrame *frame_video = av_frame_alloc();
-    AVFrame *frame_audio = av_frame_alloc();
-    AVFrame *sws_frame = av_frame_alloc();
-    AVFrame *swr_frame = av_frame_alloc();
-
-    // Setup video pixel format conversion if needed
-    struct SwsContext *sws_ctx = NULL;
-    if (dec_ctx_video->pix_fmt != enc_ctx_video->pix_fmt) {
-        sws_ctx = sws_getContext(
-            dec_ctx_video->width, dec_ctx_video->height, dec_ctx_video->pix_fmt,
-            enc_ctx_video->width, enc_ctx_video->height, enc_ctx_video->pix_fmt,
-            SWS_BICUBIC, NULL, NULL, NULL);
-        sws_frame->format = enc_ctx_video->pix_fmt;
-        sws_frame->width = enc_ctx_video->width;
-        sws_frame->height = enc_ctx_video->height;
-        av_frame_get_buffer(sws_frame, 0);
+        return 0;
     }
+    while ((nal_size = next_nal(&p, end, &nal)) >= 0)
+        if (nal_size > 0 && (nal[0] & 0x1f) == 5)
+            return 1;
+    return 0;
+}
 
-    // Setup audio sample format conversion if needed
-    struct SwrContext *swr_ctx = NULL;
-    if (in_stream_audio && (dec_ctx_audio->sample_fmt != enc_ctx_audio->sample_fmt ||
-        dec_ctx_audio->sample_rate != enc_ctx_audio->sample_rate ||
-        dec_ctx_audio->channel_layout != enc_ctx_audio->channel_layout)) {
-        swr_ctx = swr_alloc_set_opts(NULL,
-            enc_ctx_audio->channel_layout, enc_ctx_audio->sample_fmt, enc_ctx_audio->sample_rate,
-            dec_ctx_audio->channel_layout, dec_ctx_audio->sample_fmt, dec_ctx_audio->sample_rate,
-            0, NULL);
-        swr_init(swr_ctx);
-        swr_frame->channel_layout = enc_ctx_audio->channel_layout;
-        swr_frame->sample_rate = enc_ctx_audio->sample_rate;
-        swr_frame->format = enc_ctx_audio->sample_fmt;
-        swr_frame->nb_samples = enc_ctx_audio->frame_size ? enc_ctx_audio->frame_size : 1024;
-        av_frame_get_buffer(swr_frame, 0);
-    }
-
-    // Main encode loop: read packets, decode, convert, encode, write
-    while (av_read_frame(input_fmt_ctx, packet) >= 0) {
-        if (packet->stream_index == video_stream_index) {
-            avcodec_send_packet(dec_ctx_video, packet);
-            while (avcodec_receive_frame(dec_ctx_video, frame_video) == 0) {
-                AVFrame *enc_frame = frame_video;
-                if (sws_ctx) {
-                    sws_scale(
-                        sws_ctx, (const uint8_t * const*)frame_video->data, frame_video->linesize, 0, frame_video->height,
-                        sws_frame->data, sws_frame->linesize);
-                    sws_frame->pts = frame_video->pts;
-                    enc_frame = sws_frame;
-                }
-                avcodec_send_frame(enc_ctx_video, enc_frame);
-                AVPacket out_pkt;
-                av_init_packet(&out_pkt);
-                while (avcodec_receive_packet(enc_ctx_video, &out_pkt) == 0) {
-                    out_pkt.stream_index = out_stream_video->index;
-                    out_pkt.pts = av_rescale_q(out_pkt.pts, enc_ctx_video->time_base, out_stream_video->time_base);
-                    out_pkt.dts = av_rescale_q(out_pkt.dts, enc_ctx_video->time_base, out_stream_video->time_base);
-                    out_pkt.duration = av_rescale_q(out_pkt.duration, enc_ctx_video->time_base, out_stream_video->time_base);
-                    av_interleaved_write_frame(output_fmt_ctx, &out_pkt);
-                    av_packet_unref(&out_pkt);
-                }
-            }
-        } else if (in_stream_audio && packet->stream_index == audio_stream_index) {
-            avcodec_send_packet(dec_ctx_audio, packet);
-            while (avcodec_receive_frame(dec_ctx_audio, frame_audio) == 0) {
-                AVFrame *enc_frame = frame_audio;
-                if (swr_ctx) {
-                    swr_convert(swr_ctx, swr_frame->data, swr_frame->nb_samples,
-                        (const uint8_t **)frame_audio->data, frame_audio->nb_samples);
-                    swr_frame->pts = frame_audio->pts;
-                    enc_frame = swr_frame;
-                }
-                avcodec_send_frame(enc_ctx_audio, enc_frame);
-                AVPacket out_pkt;
-                av_init_packet(&out_pkt);
-                while (avcodec_receive_packet(enc_ctx_audio, &out_pkt) == 0) {
-                    out_pkt.stream_index = out_stream_audio->index;
-                    out_pkt.pts = av_rescale_q(out_pkt.pts, enc_ctx_audio->time_base, out_stream_audio->time_base);
-                    out_pkt.dts = av_rescale_q(out_pkt.dts, enc_ctx_audio->time_base, out_stream_audio->time_base);
-                    out_pkt.duration = av_rescale_q(out_pkt.duration, enc_ctx_audio->time_base, out_stream_audio->time_base);
-                    av_interleaved_write_frame(output_fmt_ctx, &out_pkt);
-                    av_packet_unref(&out_pkt);
-                }
-            }
+/**
+ * @brief Tells whether the buffered GOP, lying inside the clip, can be copied as it is.
+ *
+ * A GOP right after a re-encoded part or at the start of the output must open with an IDR
+ * frame. Pictures of an open GOP reference the frames before it, which were replaced or cut,
+ * and its first picture would switch back to the source SPS on a non-IDR frame.
+ */
+static int trim_gop_copyable(const Trim *t)
+{
+    return t->copying || has_idr(t, t->gop[0]);
+}
+
+/**
+ * @brief Writes the buffered GOP as it is.
+ */
+static int trim_copy_gop(Trim *t)
+{
+    AVBSFContext *bsf = t->video.bsf;
+    int ret = 0;
+
+    for (int i = 0; i < t->nb_gop && ret >= 0; i++) {
+        AVPacket *pkt = t->gop[i];
+        if (bsf && (ret = av_bsf_send_packet(bsf, pkt)) < 0)
+            break;
+        while (ret >= 0 && (!bsf || av_bsf_receive_packet(bsf, pkt) == 0)) {
+            if (pkt->pts != AV_NOPTS_VALUE)
+                pkt->pts -= t->start;
+            if (pkt->dts != AV_NOPTS_VALUE)
+                pkt->dts -= t->start;
+            ret = trim_write_video(t, pkt);
+            if (!bsf)
+                break;
         }
-        av_packet_unref(packet);
     }
+    return ret;
+}
+
+/**
+ * @brief Handles the buffered GOP once the time of the next key packet is known.
+ *
+ * GOPs entirely inside the clip are copied, GOPs crossing a cut point are re-encoded and the
+ * ones outside are dropped. A clip within a single GOP is re-encoded completely, and so is a
+ * GOP inside the clip that trim_gop_copyable rejects.
+ */
+static int trim_flush_gop(Trim *t, int64_t next_key)
+{
+    int64_t key = t->nb_gop ? key_time(t->gop[0]) : AV_NOPTS_VALUE;
+    int ret = 0;
+
+    if (key != AV_NOPTS_VALUE && next_key > t->start && key < t->end) {
+        if (!t->header_written && (ret = trim_write_header(t)) < 0)
+            return ret;
+        t->copying = key >= t->start && next_key <= t->end && trim_gop_copyable(t);
+        if (t->copying)
+            ret = trim_copy_gop(t);
+        else
+            ret = trim_reencode_gop(t);
+        if (ret >= 0 && t->audio_enc)
+            ret = trim_encode_audio(t, 0);
+    }
+    for (int i = 0; i < t->nb_gop; i++)
+        av_packet_free(&t->gop[i]);
+    t->nb_gop = 0;
+    return ret;
+}
+
+/**
+ * @brief End time of the buffered GOP when no key packet follows it.
+ */
+static int64_t gop_end(const Trim *t)
+{
+    int64_t end = AV_NOPTS_VALUE;
+    for (int i = 0; i < t->nb_gop; i++) {
+        const AVPacket *pkt = t->gop[i];
+        if (pkt->pts != AV_NOPTS_VALUE && (end == AV_NOPTS_VALUE || pkt->pts + pkt->duration > end))
+            end = pkt->pts + pkt->duration;
+    }
+    return end == AV_NOPTS_VALUE ? INT64_MAX : end;
+}
+
+/**
+ * @brief Adds a video packet to the GOP buffer, handling the previous GOP on a key packet.
+ *
+ * A GOP to be re-encoded runs on to the next IDR frame inside the clip, so that the GOP after
+ * the re-encoded part is copyable and the open GOPs in between decode with their references.
+ */
+static int trim_video_packet(Trim *t, AVPacket *pkt)
+{
+    int key = pkt->flags & AV_PKT_FLAG_KEY;
+    int ret;
+
+    // The seek may land before the key packet, nothing before it decodes
+    if (!t->nb_gop && !key)
+        return 0;
+    if (key && t->nb_gop && key_time(pkt) > t->start && key_time(pkt) < t->end && !has_idr(t, pkt)) {
+        int64_t gop_key = key_time(t->gop[0]);
+        if (gop_key != AV_NOPTS_VALUE && (gop_key < t->start || !trim_gop_copyable(t)))
+            key = 0;
+    }
+    if (key && t->nb_gop) {
+        // The reorder delay is fixed before the first packet goes out
+        if (!t->header_written && pkt->pts != AV_NOPTS_VALUE && pkt->dts != AV_NOPTS_VALUE)
+            t->dts_shift = pkt->pts - pkt->dts;
+        if ((ret = trim_flush_gop(t, key_time(pkt))) < 0)
+            return ret;
+    }
+    if (key && key_time(pkt) >= t->end) {
+        t->video_done = 1;
+        return 0;
+    }
+    if (t->nb_gop == t->gop_capacity) {
+        int capacity = t->gop_capacity ? 2 * t->gop_capacity : 64;
+        AVPacket **gop = av_realloc_array(t->gop, capacity, sizeof(*gop));
+        if (!gop)
+            return AVERROR(ENOMEM);
+        t->gop = gop;
+        t->gop_capacity = capacity;
+    }
+    if (!(t->gop[t->nb_gop] = av_packet_clone(pkt)))
+        return AVERROR(ENOMEM);
+    t->nb_gop++;
+    return 0;
+}
+
+/**
+ * @brief Prepares the video: decoder for the cut points, Annex B form for the copied GOPs.
+ */
+static int open_trim_video(Trim *t, int decode_threads)
+{
+    AVCodecParameters *par = t->in_video->codecpar;
+    int ret;
+
+    if (par->codec_id != AV_CODEC_ID_H264) {
+        fprintf(stderr, "Trimming supports H.264 video only, found %s\n", avcodec_get_name(par->codec_id));
+        return -1;
+    }
+    if (!(t->video_dec = open_decoder(t->in_video, decode_threads, t->params))) {
+        fprintf(stderr, "Could not open video decoder\n");
+        return -1;
+    }
+    t->video.enabled = 1;
+    t->video.in = t->in_video;
+    if (!(t->video.par = avcodec_parameters_alloc()))
+        return AVERROR(ENOMEM);
+    // Length prefixed input is converted, MP4 and MKV muxers convert back when writing
+    if (par->extradata_size > 0 && !is_annexb(par) &&
+        (ret = open_bsf("h264_mp4toannexb", t->in_video, &t->video.bsf)) < 0)
+        return ret;
+    if ((ret = avcodec_parameters_copy(t->video.par, t->video.bsf ? t->video.bsf->par_out : par)) < 0)
+        return ret;
+    t->video.par->codec_tag = 0;
+    t->video.time_base = t->in_video->time_base;
+    return 0;
+}
+
+/**
+ * @brief Cuts [start_us, end_us) out of the input, re-encoding only the GOPs at the cut points.
+ *
+ * @return 0 on success, CONVERT_CANCELLED, CONVERT_TIMEOUT or another nonzero value on error.
+ */
+int convert_trim(const char *input_filename, const char *output_filename, int64_t start_us, int64_t end_us,
+                 const Params *params)
+{
+    Trim t = {.params = params, .output_filename = output_filename, .audio_next_pts = AV_NOPTS_VALUE,
+              .last_dts = AV_NOPTS_VALUE};
+    int decode_threads = resolve_threads(params ? params->decode_threads : 0);
+    AVPacket *pkt = NULL;
+    int ret = 0;
+
+    start_us = FFMAX(start_us, 0);
+    if (end_us > 0 && end_us <= start_us) {
+        fprintf(stderr, "Empty clip: end %" PRId64 " us is not after start %" PRId64 " us\n", end_us, start_us);
+        return 1;
+    }
+
+    av_register_all();
+    media_interrupt_init(&t.interrupt, params ? params->timeout_us : 0, params ? params->cancel : NULL, NULL);
+    if (!(t.input_fmt_ctx = media_interrupt_alloc_context(&t.interrupt)) || !(pkt = av_packet_alloc())) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = avformat_open_input(&t.input_fmt_ctx, input_filename, NULL, NULL)) < 0) {
+        fprintf(stderr, "Could not open input file '%s'\n", input_filename);
+        goto end;
+    }
+    if ((ret = avformat_find_stream_info(t.input_fmt_ctx, NULL)) < 0) {
+        fprintf(stderr, "Failed to retrieve input stream information\n");
+        goto end;
+    }
+    int video_index = av_find_best_stream(t.input_fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    int audio_index = av_find_best_stream(t.input_fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, video_index, NULL, 0);
+    if (video_index < 0) {
+        fprintf(stderr, "Did not find a video stream in the input file\n");
+        ret = -1;
+        goto end;
+    }
+    t.in_video = t.input_fmt_ctx->streams[video_index];
+    if ((ret = open_trim_video(&t, decode_threads)) < 0)
+        goto end;
+
+    // The cut points count from the start of the file
+    int64_t origin = t.input_fmt_ctx->start_time != AV_NOPTS_VALUE ? t.input_fmt_ctx->start_time : 0;
+    t.start = av_rescale_q(origin + start_us, AV_TIME_BASE_Q, t.in_video->time_base);
+    t.end = end_us > 0 ? av_rescale_q(origin + end_us, AV_TIME_BASE_Q, t.in_video->time_base) : INT64_MAX;
 
-    // Flush video encoder
-    avcodec_send_frame(enc_ctx_video, NULL);
-    AVPacket out_pkt;
-    av_init_packet(&out_pkt);
-    while (avcodec_receive_packet(enc_ctx_video, &out_pkt) == 0) {
-        out_pkt.stream_index = out_stream_video->index;
-        av_interleaved_write_frame(output_fmt_ctx, &out_pkt);
-        av_packet_unref(&out_pkt);
+    avformat_alloc_output_context2(&t.output_fmt_ctx, NULL, NULL, output_filename);
+    if (!t.output_fmt_ctx) {
+        fprintf(stderr, "Could not create output context for '%s'\n", output_filename);
+        ret = -1;
+        goto end;
     }
+    t.output_fmt_ctx->interrupt_callback = t.input_fmt_ctx->interrupt_callback;
 
-    // Flush audio encoder
-    if (in_stream_audio) {
-        avcodec_send_frame(enc_ctx_audio, NULL);
-        while (avcodec_receive_packet(enc_ctx_audio, &out_pkt) == 0) {
-            out_pkt.stream_index = out_stream_audio->index;
-            av_interleaved_write_frame(output_fmt_ctx, &out_pkt);
-            av_packet_unref(&out_pkt);
+    if (audio_index >= 0) {
+        t.in_audio = t.input_fmt_ctx->streams[audio_index];
+        if (!(t.audio_dec = open_decoder(t.in_audio, decode_threads, params))) {
+            fprintf(stderr, "Could not open audio decoder\n");
+            ret = -1;
+            goto end;
         }
+        if ((ret = open_audio_encoder(t.audio_dec, !!(t.output_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER),
+                                      params, 0, &t.audio_enc)) < 0)
+            goto end;
+        AVCodecContext *dec = t.audio_dec, *enc = t.audio_enc;
+        if (dec->sample_fmt != enc->sample_fmt || dec->channel_layout != enc->channel_layout) {
+            t.swr_ctx = swr_alloc_set_opts(NULL, enc->channel_layout, enc->sample_fmt, enc->sample_rate,
+                                           dec->channel_layout, dec->sample_fmt, dec->sample_rate, 0, NULL);
+            if (!t.swr_ctx || (ret = swr_init(t.swr_ctx)) < 0) {
+                fprintf(stderr, "Could not create the audio resampler\n");
+                ret = -1;
+                goto end;
+            }
+        }
+        if (!(t.fifo = av_audio_fifo_alloc(enc->sample_fmt, enc->channels, enc->sample_rate))) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        AVRational rate = {1, enc->sample_rate};
+        t.audio_start = av_rescale_q(origin + start_us, AV_TIME_BASE_Q, rate);
+        t.audio_end = end_us > 0 ? av_rescale_q(origin + end_us, AV_TIME_BASE_Q, rate) : INT64_MAX;
+    } else {
+        t.audio_done = 1;
     }
 
-    av_write_trailer(output_fmt_ctx);
+    // Land on the key packet before the start; what precedes the start is dropped or re-encoded
+    if (start_us > 0 && avformat_seek_file(t.input_fmt_ctx, -1, INT64_MIN, origin + start_us, origin + start_us, 0) < 0)
+        fprintf(stderr, "Could not seek, reading '%s' from the start\n", input_filename);
+
+    while (!t.video_done || !t.audio_done) {
+        if ((ret = av_read_frame(t.input_fmt_ctx, pkt)) < 0) {
+            ret = ret == AVERROR_EOF ? 0 : ret;
+            break;
+        }
+        if (pkt->stream_index == video_index && !t.video_done)
+            ret = trim_video_packet(&t, pkt);
+        else if (t.in_audio && pkt->stream_index == audio_index && !t.audio_done)
+            ret = trim_decode_audio(&t, pkt);
+        av_packet_unref(pkt);
+        // Encoding a GOP does no I/O, so the interrupt is checked here as well
+        if (ret < 0 || (ret = media_interrupt_check(&t.interrupt) ? AVERROR_EXIT : 0) < 0)
+            goto end;
+    }
+    if (!t.video_done && (ret = trim_flush_gop(&t, gop_end(&t))) < 0)
+        goto end;
+    if (!t.header_written && (ret = trim_write_header(&t)) < 0)
+        goto end;
+    if (t.audio_enc && ((!t.audio_done && (ret = trim_decode_audio(&t, NULL)) < 0) ||
+                        (ret = trim_encode_audio(&t, 1)) < 0))
+        goto end;
+    ret = av_write_trailer(t.output_fmt_ctx);
 
 end:
-    if (input_fmt_ctx) avformat_close_input(&input_fmt_ctx);
-    if (output_fmt_ctx && !(output_fmt_ctx->oformat->flags & AVFMT_NOFILE))
-        avio_closep(&output_fmt_ctx->pb);
-    if (output_fmt_ctx) avformat_free_context(output_fmt_ctx);
-    if (dec_ctx_video) avcodec_free_context(&dec_ctx_video);
-    if (dec_ctx_audio) avcodec_free_context(&dec_ctx_audio);
-    if (enc_ctx_video) avcodec_free_context(&enc_ctx_video);
-    if (enc_ctx_audio) avcodec_free_context(&enc_ctx_audio);
-    if (frame_video) av_frame_free(&frame_video);
-    if (frame_audio) av_frame_free(&frame_audio);
-    if (sws_frame) av_frame_free(&sws_frame);
-    if (swr_frame) av_frame_free(&swr_frame);
-    if (packet) av_packet_free(&packet);
-    if (sws_ctx) sws_freeContext(sws_ctx);
-    if (swr_ctx) swr_free(&swr_ctx);
+    av_packet_free(&pkt);
+    for (int i = 0; i < t.nb_gop; i++)
+        av_packet_free(&t.gop[i]);
+    av_freep(&t.gop);
+    av_freep(&t.part_dts);
+    av_frame_free(&t.shape);
+    if (t.output_fmt_ctx && !(t.output_fmt_ctx->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&t.output_fmt_ctx->pb);
+    if (t.output_fmt_ctx) avformat_free_context(t.output_fmt_ctx);
+    av_bsf_free(&t.video.bsf);
+    avcodec_parameters_free(&t.video.par);
+    if (t.input_fmt_ctx) avformat_close_input(&t.input_fmt_ctx);
+    if (t.video_dec) avcodec_free_context(&t.video_dec);
+    if (t.audio_dec) avcodec_free_context(&t.audio_dec);
+    if (t.audio_enc) avcodec_free_context(&t.audio_enc);
+    if (t.swr_ctx) swr_free(&t.swr_ctx);
+    if (t.fifo) av_audio_fifo_free(t.fifo);
+    if (t.converted)
+        av_freep(&t.converted[0]);
+    av_freep(&t.converted);
 
+    int reason = media_interrupt_result(&t.interrupt, 0);
+    if (reason == AVERROR_EXIT)
+        return CONVERT_CANCELLED;
+    if (reason == MEDIA_TIMEOUT)
+        return CONVERT_TIMEOUT;
     return ret < 0 ? 1 : 0;
 }
+
+#ifdef TEST_FF_VIDEO_CONVERTER
+/*
+ * Threading benchmark: converts the input once per thread count and prints the frame rate.
+ *
+ *   make convert_bench
+ *   ./convert_bench input.avi [threads ...]     (default 1 4 16)
+ */
+/**
+ * @brief Counts the video packets of the converted file.
+ */
+static int64_t count_video_frames(const char *filename)
+{
+    AVFormatContext *fmt_ctx = NULL;
+    AVPacket *pkt = av_packet_alloc();
+    int64_t frames = 0;
+
+    if (avformat_open_input(&fmt_ctx, filename, NULL, NULL) < 0) {
+        av_packet_free(&pkt);
+        return -1;
+    }
+    int video = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    while (video >= 0 && av_read_frame(fmt_ctx, pkt) >= 0) {
+        if (pkt->stream_index == video)
+            frames++;
+        av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    avformat_close_input(&fmt_ctx);
+    return frames;
+}
+
+int main(int argc, char **argv)
+{
+    static const int default_threads[] = {1, 4, 16};
+    const char *output = "convert_bench.mp4";
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s input [threads ...]\n", argv[0]);
+        return 2;
+    }
+    int nb_runs = argc > 2 ? argc - 2 : (int)FF_ARRAY_ELEMS(default_threads);
+    printf("%8s %10s %10s %8s\n", "threads", "frames", "seconds", "fps");
+    for (int i = 0; i < nb_runs; i++) {
+        int threads = argc > 2 ? atoi(argv[i + 2]) : default_threads[i];
+        Params params = {
+            .decode_threads = threads,
+            .encode_threads = threads,
+            .scale_threads = threads,
+        };
+        int64_t start = av_gettime_relative();
+        if (convert_avi_to_h264_aac(argv[1], output, &params) != 0) {
+            fprintf(stderr, "conversion with %d threads failed\n", threads);
+            return 1;
+        }
+        double seconds = (av_gettime_relative() - start) / 1e6;
+        int64_t frames = count_video_frames(output);
+        printf("%8d %10lld %10.2f %8.1f\n", threads, (long long)frames, seconds, frames / seconds);
+    }
+    remove(output);
+    return 0;
+}
+#endif
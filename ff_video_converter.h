@@ -2,6 +2,7 @@
 #define FFMPEG_AVI_TO_H264_AAC_H
 
 #include <libavcodec/avcodec.h>
+#include <libavformat/avio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,6 +16,63 @@ extern "C" {
  * supporting configurable codecs and bitrates, and CRF mode for H.264.
  */
 
+/**
+ * @brief Stream copy modes for Params.copy_mode.
+ *
+ * A copied stream is remuxed packet by packet, with a bitstream filter where the containers
+ * store the codec differently (h264_mp4toannexb for MPEG-TS, aac_adtstoasc for MP4), so it costs
+ * little more than the I/O. Copy and transcode mix per stream, e.g. H.264 video is copied while
+ * MP3 audio is encoded to AAC.
+ */
+enum {
+    CONVERT_COPY_AUTO = 0, /**< Copy a stream already in the target codec when no bitrate is requested for it. */
+    CONVERT_COPY_NEVER,    /**< Always decode and re-encode. */
+    CONVERT_COPY_ALWAYS,   /**< Copy every stream the output container can store, whatever the target codec. */
+};
+
+/**
+ * @struct ConvertStageStats
+ * @brief Activity of one pipeline stage during a conversion.
+ *
+ * The conversion runs as a pipeline of threads: demux, video_decode, scale (only when the pixel
+ * format or size changes), video_encode, audio_decode, audio_encode and mux, with one scale,
+ * video_encode and mux stage per output of convert_renditions. A stage with a large
+ * `wait_in_us` is starved by the stage before it; a large `wait_out_us` means a later stage is
+ * the bottleneck. The stage that is busy all the time limits the conversion speed. Audio
+ * resampling is reported as a separate "swresample" stage although it runs on the audio_encode
+ * thread; its time is not included in audio_encode.
+ */
+typedef struct {
+    const char *name;    /**< Stage name, e.g. "video_encode". */
+    int output;          /**< Rendition index of scale, video_encode and mux, -1 for stages shared by all outputs. */
+    int64_t items;       /**< Packets or frames the stage produced. */
+    int64_t bytes;       /**< Compressed bytes the stage read (decoders) or produced (demux, encoders, mux). */
+    int64_t busy_us;     /**< Time spent working, in microseconds. */
+    int64_t wait_in_us;  /**< Time spent waiting for input. */
+    int64_t wait_out_us; /**< Time spent waiting for room in the next queue. */
+} ConvertStageStats;
+
+/** Returned by the conversion functions when progress_callback or Params.cancel cancelled the conversion. */
+#define CONVERT_CANCELLED 2
+/** Returned by the conversion functions when the conversion ran past Params.timeout_us. */
+#define CONVERT_TIMEOUT 3
+
+/**
+ * @struct ConvertProgress
+ * @brief Snapshot of a running conversion, passed to Params.progress_callback.
+ *
+ * Frames and position refer to the video of the first output.
+ */
+typedef struct {
+    int64_t elapsed_us;    /**< Time since the stages started. */
+    int64_t frames;        /**< Video packets written so far. */
+    double fps;            /**< Video packets written per second since the previous report. */
+    int64_t position_us;   /**< Presentation time of the last video packet written, in microseconds. */
+    int64_t duration_us;   /**< Input duration in microseconds, 0 if unknown. */
+    int64_t bytes_read;    /**< Packet bytes demuxed from the input. */
+    int64_t bytes_written; /**< Packet bytes written to all outputs. */
+} ConvertProgress;
+
 /**
  * @struct Params
  * @brief Parameters for codec and bitrate configuration for conversion.
@@ -24,14 +82,67 @@ extern "C" {
  * - `video_bitrate`: Bitrate in bits per second. If H.264 and < 60, it is interpreted as CRF value.
  * - `audio_codec_id`: The codec to use for the output audio stream (e.g., AV_CODEC_ID_AAC).
  * - `audio_bitrate`: Bitrate in bits per second for the audio stream.
+ * - `decode_threads`, `encode_threads`, `scale_threads`: Thread counts per stage, 0 = one per CPU.
+ * - `thread_type`: FF_THREAD_FRAME and/or FF_THREAD_SLICE for the codecs, 0 = both.
+ * - `copy_mode`: One of the CONVERT_COPY_* modes, 0 = CONVERT_COPY_AUTO.
+ * - `segments`: Splits the video at keyframes into this many parts transcoded in parallel, 0 = off.
+ * - `stats_callback`: Called once with the stats of every stage when the conversion ends, may be NULL.
+ * - `progress_callback`: Called periodically while the conversion runs; returning nonzero cancels it.
+ * - `timeout_us`, `cancel`: Wall clock limit and cancellation token (see media_cancel in avwrapper.h).
+ *   They interrupt blocked reads and writes through AVIOInterruptCB and stop the stages within
+ *   50 ms; the conversion then returns CONVERT_TIMEOUT or CONVERT_CANCELLED.
+ *
+ * A zero-initialized Params gives H.264/AAC using every core.
  */
 typedef struct {
     enum AVCodecID video_codec_id; /**< Output video codec (e.g. AV_CODEC_ID_H264) */
     int video_bitrate; /**< Output video bitrate in bps. If H.264 and < 60, used as CRF. */
     enum AVCodecID audio_codec_id; /**< Output audio codec (e.g. AV_CODEC_ID_AAC) */
     int audio_bitrate; /**< Output audio bitrate in bps. */
+    int decode_threads; /**< Decoder threads, 0 = number of CPUs. */
+    int encode_threads; /**< Encoder threads, 0 = chosen by the encoder (x264: 1.5 per CPU). */
+    int scale_threads; /**< Pixel format conversion threads, 0 = number of CPUs. */
+    int thread_type; /**< FF_THREAD_FRAME | FF_THREAD_SLICE, 0 = both. Frame threading adds latency. */
+    int copy_mode; /**< CONVERT_COPY_AUTO, CONVERT_COPY_NEVER or CONVERT_COPY_ALWAYS. */
+    int segments; /**< Parallel GOP segments for the video, 0 = off, < 0 = one per CPU. File input only. */
+    void (*stats_callback)(void *opaque, const ConvertStageStats *stages, int nb_stages); /**< Pipeline stats hook. */
+    void *stats_opaque; /**< Passed to stats_callback. */
+    /** Called on the calling thread every progress_interval_ms and once at the end, may be NULL.
+     *  A nonzero return stops the conversion, which then returns CONVERT_CANCELLED. */
+    int (*progress_callback)(void *opaque, const ConvertProgress *progress);
+    void *progress_opaque; /**< Passed to progress_callback. */
+    int progress_interval_ms; /**< Interval between progress reports, 0 = 500. */
+    int64_t timeout_us; /**< Wall clock limit of the whole conversion, 0 = none. */
+    struct MediaCancel *cancel; /**< Cancels the conversion once media_cancel is called on it, may be NULL. */
 } Params;
 
+/** Maximum number of outputs of convert_renditions. */
+#define CONVERT_MAX_RENDITIONS 8
+
+/**
+ * @struct Rendition
+ * @brief One output of convert_renditions, e.g. a step of an adaptive bitrate ladder.
+ *
+ * Fields left 0 fall back to the source frame size and to the video codec and bitrate of Params.
+ * Setting only one of width and height derives the other from the source aspect ratio.
+ *
+ * A fragmented MP4 starts with an empty moov and then carries the media in self-contained
+ * moof/mdat fragments, one per keyframe, which are written out as soon as they are complete.
+ * Players and uploads can consume it while the conversion is still running, and it is the only
+ * kind of MP4 that can go to a non-seekable `output_pb` such as media_io_open_writer.
+ */
+typedef struct {
+    const char *output_filename;   /**< Output path, the container is chosen from its extension. May be NULL with output_pb. */
+    int width;                     /**< Output width in pixels, 0 = derived or the source width. */
+    int height;                    /**< Output height in pixels, 0 = derived or the source height. */
+    enum AVCodecID video_codec_id; /**< Output video codec, 0 = Params.video_codec_id. */
+    int video_bitrate;             /**< Video bitrate in bps, or the CRF when H.264 and < 60, 0 = Params.video_bitrate. */
+    AVIOContext *output_pb;        /**< Custom output written instead of output_filename, not closed here, or NULL. */
+    const char *format;            /**< Muxer name, e.g. "mp4", NULL = from output_filename, or "mp4" without one. */
+    int fragmented;                /**< Nonzero writes fragmented MP4 (empty moov, moof per keyframe, CMAF compatible). */
+    int fragment_ms;               /**< With fragmented, also cut fragments longer than this, 0 = at keyframes only. */
+} Rendition;
+
 /**
  * @brief Convert an AVI file to MP4 with configurable codecs and bitrates.
  *
@@ -45,16 +156,105 @@ typedef struct {
  * @param input_filename  Path to the input AVI file.
  * @param output_filename Path to the output MP4 file.
  * @param params          Pointer to a Params struct specifying codec and bitrate options.
- * @return 0 on success, nonzero on error.
+ * @return 0 on success, CONVERT_CANCELLED if progress_callback or Params.cancel stopped it,
+ *         CONVERT_TIMEOUT past Params.timeout_us, another nonzero value on error.
  *
  * @note Requires FFmpeg development libraries (libavformat, libavcodec, libswscale, libswresample, libavutil).
  * @note This function assumes the input AVI file contains a single video stream and optionally an audio stream.
- * @note This function is not thread-safe.
+ * @note Several conversions may run concurrently; each one starts its own scaling threads.
  *
  * @see Params
  */
 int convert_avi_to_h264_aac(const char *input_filename, const char *output_filename, const Params *params);
 
+/**
+ * @brief Same as convert_avi_to_h264_aac, reading the input from a custom I/O context.
+ *
+ * The input is read from `input`, typically opened with media_io_open_reader (callbacks, e.g. a Go
+ * io.Reader), media_io_open_memory or media_io_open_mmap from avwrapper.h, so no temporary file is
+ * needed. The demuxer is probed from the data. Non-seekable inputs work as long as the container
+ * does not need seeking (e.g. MP4 with the moov atom at the end does).
+ *
+ * @param input           Input I/O context. It is not closed by this function.
+ * @param output_filename Path to the output MP4 file.
+ * @param params          Pointer to a Params struct specifying codec and bitrate options.
+ * @return 0 on success, nonzero on error.
+ */
+int convert_avi_to_h264_aac_io(AVIOContext *input, const char *output_filename, const Params *params);
+
+/**
+ * @brief Same as convert_avi_to_h264_aac, streaming fragmented MP4 to a custom output.
+ *
+ * Each fragment is pushed to `output` once it is complete, so with media_io_open_writer (e.g.
+ * backed by a Go io.Writer) an upload or a player can start while the encoding is still running,
+ * without a temporary file and with memory bounded by about one GOP.
+ *
+ * @param input_filename Path to the input file.
+ * @param output         Output I/O context, need not be seekable. It is not closed by this function.
+ * @param params         Pointer to a Params struct specifying codec and bitrate options, may be NULL.
+ * @return 0 on success, CONVERT_CANCELLED, CONVERT_TIMEOUT or another nonzero value on error.
+ */
+int convert_avi_to_h264_aac_stream(const char *input_filename, AVIOContext *output, const Params *params);
+
+/**
+ * @brief Writes several renditions of one input in a single pass, decoding it only once.
+ *
+ * Every decoded video frame is handed to one scaler and encoder per rendition, which run in
+ * parallel, so a ladder of N outputs costs one decode instead of N. The audio is encoded (or
+ * copied) once and muxed into every output. The video is always re-encoded unless there is a
+ * single rendition of the source size, see Params.copy_mode. Params.segments only applies to a
+ * single rendition.
+ *
+ * @param input_filename Path to the input file.
+ * @param renditions     Outputs to write.
+ * @param nb_renditions  Number of renditions, 1 to CONVERT_MAX_RENDITIONS.
+ * @param params         Defaults for the renditions, threading and audio options, may be NULL.
+ * @return 0 on success, CONVERT_CANCELLED, CONVERT_TIMEOUT or another nonzero value on error. Outputs may be
+ *         incomplete after an error.
+ */
+int convert_renditions(const char *input_filename, const Rendition *renditions, int nb_renditions, const Params *params);
+
+/**
+ * @brief Same as convert_renditions, reading the input from a custom I/O context.
+ *
+ * @param input          Input I/O context. It is not closed by this function.
+ * @param renditions     Outputs to write.
+ * @param nb_renditions  Number of renditions, 1 to CONVERT_MAX_RENDITIONS.
+ * @param params         Defaults for the renditions, threading and audio options, may be NULL.
+ * @return 0 on success, nonzero on error.
+ */
+int convert_renditions_io(AVIOContext *input, const Rendition *renditions, int nb_renditions, const Params *params);
+
+/**
+ * @brief Cuts the clip [start_us, end_us) out of an H.264 recording, re-encoding only at the cut points.
+ *
+ * Stream copy alone can only cut at keyframes, and a full conversion re-encodes every frame. Here
+ * each GOP lying entirely inside the clip is copied as it is, and only the two partial GOPs at
+ * the cut points are decoded and re-encoded, so the cost does not grow with the clip length.
+ *
+ * The re-encoded parts use libx264 with the frame size, pixel format, profile, level and colour
+ * description of the source, and Params.video_bitrate or else the source bitrate (CRF 18 when
+ * unknown). They start with an IDR frame, have no B-frames and use their own SPS/PPS (id 31),
+ * so the source parameter sets stay valid for the copied GOPs. Both are listed in the avcC of
+ * containers with a global header (MP4, MOV, MKV) and the id 31 sets are also repeated in band.
+ * Timestamps start at 0. The re-encoded parts take over the decode timestamps of the packets
+ * they replace, so no presentation timestamp is changed; a splice where decode timestamps would
+ * not rise fails the trim. Copied GOPs must be closed, as written by x264 and most cameras.
+ *
+ * The audio is decoded, cut on the exact sample and encoded with Params.audio_codec_id and
+ * audio_bitrate. The container is chosen from the extension of output_filename.
+ * Params.timeout_us, cancel and the thread counts apply; the other fields are not used.
+ *
+ * @param input_filename  Path to the input file, H.264 video.
+ * @param output_filename Path to the output file.
+ * @param start_us        Start of the clip from the start of the file, in microseconds.
+ * @param end_us          End of the clip (exclusive), in microseconds, <= 0 = to the end of the file.
+ * @param params          Bitrates and threading, may be NULL.
+ * @return 0 on success, CONVERT_CANCELLED, CONVERT_TIMEOUT or another nonzero value on error.
+ */
+int convert_trim(const char *input_filename, const char *output_filename, int64_t start_us, int64_t end_us,
+                 const Params *params);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,378 @@
+package avwrapper
+
+/*
+#cgo pkg-config: libswscale libswresample
+#include <stdint.h>
+#include <stdlib.h>
+#include "ff_video_converter.h"
+
+extern int goConvertProgress(void *opaque, ConvertProgress *progress);
+extern void goConvertStats(void *opaque, ConvertStageStats *stages, int nb_stages);
+
+static int convert_progress(void *opaque, const ConvertProgress *progress) {
+    return goConvertProgress(opaque, (ConvertProgress *)progress);
+}
+
+static void convert_stats(void *opaque, const ConvertStageStats *stages, int nb_stages) {
+    goConvertStats(opaque, (ConvertStageStats *)stages, nb_stages);
+}
+
+static void set_go_callbacks(Params *p, uintptr_t handle, int progress, int stats) {
+    if (progress) {
+        p->progress_callback = convert_progress;
+        p->progress_opaque = (void *)handle;
+    }
+    if (stats) {
+        p->stats_callback = convert_stats;
+        p->stats_opaque = (void *)handle;
+    }
+}
+*/
+import "C"
+import (
+    "context"
+    "errors"
+    "io"
+    "runtime/cgo"
+    "time"
+    "unsafe"
+)
+
+// ErrConvert is returned when the C converter reports a failure.
+var ErrConvert = errors.New("avwrapper: conversion failed")
+
+// ErrCanceled is returned when ConvertParams.Progress stopped the conversion.
+var ErrCanceled = errors.New("avwrapper: conversion canceled")
+
+// Codec threading modes for ConvertParams.ThreadType.
+const (
+    ThreadFrame = C.FF_THREAD_FRAME
+    ThreadSlice = C.FF_THREAD_SLICE
+)
+
+// Stream copy modes for ConvertParams.CopyMode.
+const (
+    CopyAuto   = C.CONVERT_COPY_AUTO   // copy streams already in the target codec unless a bitrate is set
+    CopyNever  = C.CONVERT_COPY_NEVER  // always re-encode
+    CopyAlways = C.CONVERT_COPY_ALWAYS // copy every stream the container accepts
+)
+
+// ConvertParams mirrors the C Params. Zero values select H.264 and AAC with
+// the encoder default video bitrate and 128 kb/s audio, using every core.
+type ConvertParams struct {
+    VideoCodecID  int32 // AV_CODEC_ID_*, 0 = H.264
+    VideoBitrate  int   // bps, or the CRF when < 60 with H.264
+    AudioCodecID  int32 // AV_CODEC_ID_*, 0 = AAC
+    AudioBitrate  int   // bps, 0 = 128000
+    DecodeThreads int   // 0 = one per CPU
+    EncodeThreads int   // 0 = chosen by the encoder
+    ScaleThreads  int   // 0 = one per CPU
+    ThreadType    int   // ThreadFrame | ThreadSlice, 0 = both
+    CopyMode      int   // CopyAuto, CopyNever or CopyAlways
+    Segments      int   // parallel GOP segments, 0 = off, < 0 = one per CPU; Convert only, one output
+    // Timeout bounds the whole conversion, 0 = none. Past it the conversion
+    // stops within 50 ms and fails with ErrTimeout.
+    Timeout time.Duration
+
+    // Progress is called every ProgressInterval ms (0 = 500) and once at the
+    // end, on the converting goroutine. Returning false cancels the conversion.
+    Progress         func(ConvertProgress) bool
+    ProgressInterval int
+    // Stats is called once at the end with the activity of every stage.
+    Stats func([]StageStats)
+}
+
+// ConvertProgress is a snapshot of a running conversion. Frames and
+// position refer to the video of the first output.
+type ConvertProgress struct {
+    ElapsedUs    int64
+    Frames       int64   // video packets written
+    FPS          float64 // since the previous report
+    PositionUs   int64   // presentation time of the last video packet written
+    DurationUs   int64   // input duration, 0 if unknown
+    BytesRead    int64   // packet bytes demuxed
+    BytesWritten int64   // packet bytes written to all outputs
+}
+
+// StageStats is the activity of one pipeline stage. A stage with a large
+// WaitInUs is starved by the one before it, the stage that is busy all the
+// time limits the conversion speed.
+type StageStats struct {
+    Name      string // e.g. "demux", "video_decode", "scale", "swresample", "video_encode", "mux"
+    Output    int    // rendition index of per-output stages, -1 for shared ones
+    Items     int64  // packets or frames produced
+    Bytes     int64  // compressed bytes read by decoders, produced by the others
+    BusyUs    int64
+    WaitInUs  int64
+    WaitOutUs int64
+}
+
+func newConvertProgress(p *C.ConvertProgress) ConvertProgress {
+    return ConvertProgress{
+        ElapsedUs:    int64(p.elapsed_us),
+        Frames:       int64(p.frames),
+        FPS:          float64(p.fps),
+        PositionUs:   int64(p.position_us),
+        DurationUs:   int64(p.duration_us),
+        BytesRead:    int64(p.bytes_read),
+        BytesWritten: int64(p.bytes_written),
+    }
+}
+
+func newStageStats(stages *C.ConvertStageStats, n int) []StageStats {
+    list := unsafe.Slice(stages, n)
+    out := make([]StageStats, n)
+    for i := range list {
+        s := &list[i]
+        out[i] = StageStats{
+            Name:      C.GoString(s.name),
+            Output:    int(s.output),
+            Items:     int64(s.items),
+            Bytes:     int64(s.bytes),
+            BusyUs:    int64(s.busy_us),
+            WaitInUs:  int64(s.wait_in_us),
+            WaitOutUs: int64(s.wait_out_us),
+        }
+    }
+    return out
+}
+
+// toC converts p. The returned function releases the callback handle and
+// must be called once the conversion has returned.
+func (p *ConvertParams) toC() (C.Params, func()) {
+    var c C.Params
+    release := func() {}
+    if p != nil {
+        c.video_codec_id = C.enum_AVCodecID(p.VideoCodecID)
+        c.video_bitrate = C.int(p.VideoBitrate)
+        c.audio_codec_id = C.enum_AVCodecID(p.AudioCodecID)
+        c.audio_bitrate = C.int(p.AudioBitrate)
+        c.decode_threads = C.int(p.DecodeThreads)
+        c.encode_threads = C.int(p.EncodeThreads)
+        c.scale_threads = C.int(p.ScaleThreads)
+        c.thread_type = C.int(p.ThreadType)
+        c.copy_mode = C.int(p.CopyMode)
+        c.segments = C.int(p.Segments)
+        c.progress_interval_ms = C.int(p.ProgressInterval)
+        c.timeout_us = timeoutUs(p.Timeout)
+        if p.Progress != nil || p.Stats != nil {
+            h := cgo.NewHandle(p)
+            C.set_go_callbacks(&c, C.uintptr_t(h), cBool(p.Progress != nil), cBool(p.Stats != nil))
+            release = h.Delete
+        }
+    }
+    return c, release
+}
+
+func cBool(b bool) C.int {
+    if b {
+        return 1
+    }
+    return 0
+}
+
+func convertResult(ret C.int) error {
+    switch ret {
+    case 0:
+        return nil
+    case C.CONVERT_CANCELLED:
+        return ErrCanceled
+    case C.CONVERT_TIMEOUT:
+        return ErrTimeout
+    default:
+        return ErrConvert
+    }
+}
+
+// Convert transcodes the file input to the MP4 file output.
+func Convert(input, output string, params *ConvertParams) error {
+    return ConvertContext(context.Background(), input, output, params)
+}
+
+// ConvertContext is Convert bounded by ctx: its deadline applies as a
+// timeout and cancelling it stops the conversion within 50 ms. It then
+// returns ctx.Err().
+func ConvertContext(ctx context.Context, input, output string, params *ConvertParams) error {
+    cInput := C.CString(input)
+    defer C.free(unsafe.Pointer(cInput))
+    cOutput := C.CString(output)
+    defer C.free(unsafe.Pointer(cOutput))
+
+    cparams, release := params.toC()
+    defer release()
+    stop := bindContext(ctx, &cparams.timeout_us, &cparams.cancel)
+    ret := C.convert_avi_to_h264_aac(cInput, cOutput, &cparams)
+    stop()
+    return contextError(ctx, convertResult(ret))
+}
+
+// Trim writes the clip [start, end) of the H.264 file input to output,
+// re-encoding only the partial GOPs at the cut points and copying the whole
+// GOPs between them. The audio is cut on the exact sample. end <= 0 trims to
+// the end of the file. Only the bitrates, threads and Timeout of params apply.
+func Trim(input, output string, start, end time.Duration, params *ConvertParams) error {
+    return TrimContext(context.Background(), input, output, start, end, params)
+}
+
+// TrimContext is Trim bounded by ctx, see ConvertContext.
+func TrimContext(ctx context.Context, input, output string, start, end time.Duration, params *ConvertParams) error {
+    cInput := C.CString(input)
+    defer C.free(unsafe.Pointer(cInput))
+    cOutput := C.CString(output)
+    defer C.free(unsafe.Pointer(cOutput))
+
+    cparams, release := params.toC()
+    defer release()
+    stop := bindContext(ctx, &cparams.timeout_us, &cparams.cancel)
+    ret := C.convert_trim(cInput, cOutput, C.int64_t(start.Microseconds()), C.int64_t(end.Microseconds()), &cparams)
+    stop()
+    return contextError(ctx, convertResult(ret))
+}
+
+// Rendition is one output of ConvertRenditions. Zero fields fall back to the
+// source size and to the video codec and bitrate of the ConvertParams.
+//
+// A rendition with a Writer is streamed to it as fragmented MP4: each
+// fragment is written as soon as it is complete, so an upload or a player
+// can consume it while the conversion runs. Output is ignored then.
+type Rendition struct {
+    Output       string
+    Writer       io.Writer // written from a converter thread instead of Output, implies Fragmented
+    Width        int       // 0 = derived from Height keeping the aspect ratio, or the source width
+    Height       int       // 0 = derived from Width keeping the aspect ratio, or the source height
+    VideoCodecID int32     // AV_CODEC_ID_*, 0 = ConvertParams.VideoCodecID
+    VideoBitrate int       // bps, or the CRF when < 60 with H.264, 0 = ConvertParams.VideoBitrate
+    Fragmented   bool      // fragmented MP4: empty moov, then one moof/mdat per keyframe
+    FragmentMs   int       // with Fragmented, also cut fragments longer than this, 0 = keyframes only
+}
+
+// MaxRenditions is the largest number of outputs of ConvertRenditions.
+const MaxRenditions = C.CONVERT_MAX_RENDITIONS
+
+// ConvertRenditions transcodes the file input into every rendition in one
+// pass, decoding it only once, e.g. to produce an adaptive bitrate ladder.
+func ConvertRenditions(input string, renditions []Rendition, params *ConvertParams) error {
+    return ConvertRenditionsContext(context.Background(), input, renditions, params)
+}
+
+// ConvertRenditionsContext is ConvertRenditions bounded by ctx, see
+// ConvertContext. A Write already blocked in a Writer is not interrupted.
+func ConvertRenditionsContext(ctx context.Context, input string, renditions []Rendition, params *ConvertParams) error {
+    if len(renditions) == 0 || len(renditions) > MaxRenditions {
+        return ErrConvert
+    }
+    cInput := C.CString(input)
+    defer C.free(unsafe.Pointer(cInput))
+
+    // The array holds C strings, so it lives in C memory
+    cRenditions := (*C.Rendition)(C.calloc(C.size_t(len(renditions)), C.size_t(unsafe.Sizeof(C.Rendition{}))))
+    defer C.free(unsafe.Pointer(cRenditions))
+    list := unsafe.Slice(cRenditions, len(renditions))
+    var sinks []*mediaSink
+    defer func() {
+        for _, s := range sinks {
+            s.close()
+        }
+    }()
+    for i, r := range renditions {
+        if r.Writer != nil {
+            s, err := newWriterSink(r.Writer)
+            if err != nil {
+                return err
+            }
+            sinks = append(sinks, s)
+            list[i].output_pb = s.pb
+            list[i].format = cFormatMP4
+            r.Fragmented = true
+        } else {
+            list[i].output_filename = C.CString(r.Output)
+            defer C.free(unsafe.Pointer(list[i].output_filename))
+        }
+        list[i].width = C.int(r.Width)
+        list[i].height = C.int(r.Height)
+        list[i].video_codec_id = C.enum_AVCodecID(r.VideoCodecID)
+        list[i].video_bitrate = C.int(r.VideoBitrate)
+        list[i].fragmented = cBool(r.Fragmented)
+        list[i].fragment_ms = C.int(r.FragmentMs)
+    }
+
+    cparams, release := params.toC()
+    defer release()
+    stop := bindContext(ctx, &cparams.timeout_us, &cparams.cancel)
+    err := convertResult(C.convert_renditions(cInput, cRenditions, C.int(len(renditions)), &cparams))
+    stop()
+    for _, s := range sinks {
+        if werr := s.result(err); werr != err {
+            return contextError(ctx, werr)
+        }
+    }
+    return contextError(ctx, err)
+}
+
+// cFormatMP4 is the muxer of Writer renditions. It is never freed.
+var cFormatMP4 = C.CString("mp4")
+
+// ConvertToWriter transcodes the file input to fragmented MP4 written to w
+// while the conversion runs, without a temporary file. Memory use is bounded
+// by about one GOP, as each fragment is written once complete.
+func ConvertToWriter(input string, w io.Writer, params *ConvertParams) error {
+    return ConvertToWriterContext(context.Background(), input, w, params)
+}
+
+// ConvertToWriterContext is ConvertToWriter bounded by ctx, see
+// ConvertRenditionsContext.
+func ConvertToWriterContext(ctx context.Context, input string, w io.Writer, params *ConvertParams) error {
+    return ConvertRenditionsContext(ctx, input, []Rendition{{Writer: w}}, params)
+}
+
+func convertSource(ctx context.Context, s *mediaSource, err error, output string, params *ConvertParams) error {
+    if err != nil {
+        return err
+    }
+    defer s.close()
+
+    cOutput := C.CString(output)
+    defer C.free(unsafe.Pointer(cOutput))
+
+    cparams, release := params.toC()
+    defer release()
+    stop := bindContext(ctx, &cparams.timeout_us, &cparams.cancel)
+    ret := C.convert_avi_to_h264_aac_io(s.pb, cOutput, &cparams)
+    stop()
+    return contextError(ctx, s.result(convertResult(ret)))
+}
+
+// ConvertReader transcodes input read from r, e.g. an object storage
+// stream, without a temporary file. r may implement io.Seeker.
+func ConvertReader(r io.Reader, output string, params *ConvertParams) error {
+    return ConvertReaderContext(context.Background(), r, output, params)
+}
+
+// ConvertReaderContext is ConvertReader bounded by ctx, see ConvertContext.
+// A Read already blocked in r is not interrupted.
+func ConvertReaderContext(ctx context.Context, r io.Reader, output string, params *ConvertParams) error {
+    s, err := newReaderSource(r)
+    return convertSource(ctx, s, err, output, params)
+}
+
+// ConvertBytes transcodes a file held in memory without copying it.
+func ConvertBytes(data []byte, output string, params *ConvertParams) error {
+    return ConvertBytesContext(context.Background(), data, output, params)
+}
+
+// ConvertBytesContext is ConvertBytes bounded by ctx, see ConvertContext.
+func ConvertBytesContext(ctx context.Context, data []byte, output string, params *ConvertParams) error {
+    s, err := newBytesSource(data)
+    return convertSource(ctx, s, err, output, params)
+}
+
+// ConvertMmap transcodes a local file read through mmap instead of read().
+func ConvertMmap(input, output string, params *ConvertParams) error {
+    return ConvertMmapContext(context.Background(), input, output, params)
+}
+
+// ConvertMmapContext is ConvertMmap bounded by ctx, see ConvertContext.
+func ConvertMmapContext(ctx context.Context, input, output string, params *ConvertParams) error {
+    s, err := newMmapSource(input)
+    return convertSource(ctx, s, err, output, params)
+}
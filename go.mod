@@ -0,0 +1,3 @@
+module avwrapper
+
+go 1.21
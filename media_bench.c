@@ -0,0 +1,548 @@
+// media_bench.c
+//
+// Benchmark of probing, thumbnails and conversion on synthetic media. The
+// inputs are generated with the lavfi sources testsrc2 and sine into a few
+// containers and codecs, bit exact and single threaded, so every machine and
+// every commit measures the same files. They are kept in the media directory
+// and only generated when missing; inputs whose encoder is not built into the
+// local FFmpeg are skipped.
+//
+// Every benchmark runs once to warm up, then the timed runs. Results are the
+// latency percentiles, the throughput in calls and input megabytes per
+// second and the peak RSS of the timed runs (VmHWM, reset before each
+// benchmark). They are printed as a table on stderr and as one JSON object
+// per line on stdout or the -o file. "compare" reads two such files and
+// reports the benchmarks whose median latency grew by more than a threshold.
+//
+// The file compiles to nothing in the Go build unless the mediabench tag
+// sets MEDIA_BENCH_GENERATOR, which builds only the input generator for
+// media_bench_test.go. TEST_MEDIA_BENCH builds the program.
+#if defined(TEST_MEDIA_BENCH) || defined(MEDIA_BENCH_GENERATOR)
+/*
+ *   make media_bench
+ *   ./media_bench [-d media_dir] [-n runs] [-o results.jsonl] [-l label] [filter]
+ *   ./media_bench compare old.jsonl new.jsonl [threshold_percent]
+ *
+ * filter selects the benchmarks whose name contains it, e.g. "thumbnail" or
+ * "h264_aac.mp4". -n overrides the number of timed runs of every benchmark.
+ */
+#include "avwrapper.h"
+#include "ff_video_converter.h"
+#include "thumbnail_video.h"
+#ifdef __linux__
+#include "thumbnail_linux.h"
+#endif
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#define BENCH_FPS 25
+#define BENCH_SAMPLE_RATE 48000
+#define BENCH_THUMB_SIZE 256
+
+// One synthetic input. Images are a single frame, seconds == 0.
+typedef struct {
+    const char* name;         // file name in the media directory
+    const char* format;       // muxer
+    enum AVCodecID video;
+    enum AVCodecID audio;     // AV_CODEC_ID_NONE = no audio
+    int width;
+    int height;
+    int seconds;
+} BenchMedia;
+
+static const BenchMedia media[] = {
+    {"mpeg4_mp2.avi", "avi", AV_CODEC_ID_MPEG4, AV_CODEC_ID_MP2, 640, 360, 10},
+    {"h264_aac.mp4", "mp4", AV_CODEC_ID_H264, AV_CODEC_ID_AAC, 1280, 720, 10},
+    {"mjpeg_pcm.mov", "mov", AV_CODEC_ID_MJPEG, AV_CODEC_ID_PCM_S16LE, 640, 360, 5},
+    {"mpeg2_mp2.ts", "mpegts", AV_CODEC_ID_MPEG2VIDEO, AV_CODEC_ID_MP2, 720, 576, 10},
+    {"photo.jpg", "image2", AV_CODEC_ID_MJPEG, AV_CODEC_ID_NONE, 4000, 3000, 0},
+    {"photo.png", "image2", AV_CODEC_ID_PNG, AV_CODEC_ID_NONE, 2000, 1500, 0},
+};
+
+// An encoder fed by a lavfi source.
+typedef struct {
+    AVFilterGraph* graph;
+    AVFilterContext* sink;
+    AVCodecContext* enc;
+    AVStream* st;
+    int64_t pts;          // of the last frame, in enc->time_base
+    int flushed;          // the encoder got its NULL frame
+    int done;             // and returned its last packet
+} MediaStream;
+
+static void close_stream(MediaStream* ms) {
+    avfilter_graph_free(&ms->graph);
+    avcodec_free_context(&ms->enc);
+}
+
+static int open_stream(AVFormatContext* oc, const BenchMedia* m, int audio, MediaStream* ms) {
+    enum AVCodecID id = audio ? m->audio : m->video;
+    AVCodec* codec = avcodec_find_encoder(id);
+    if (!codec) {
+        fprintf(stderr, "skipping %s: no %s encoder\n", m->name, avcodec_get_name(id));
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    AVCodecContext* enc = ms->enc = avcodec_alloc_context3(codec);
+    if (!enc)
+        return AVERROR(ENOMEM);
+    char desc[256];
+    if (audio) {
+        enc->sample_rate = BENCH_SAMPLE_RATE;
+        enc->channel_layout = AV_CH_LAYOUT_STEREO;
+        enc->channels = 2;
+        enc->sample_fmt = codec->sample_fmts ? codec->sample_fmts[0] : AV_SAMPLE_FMT_S16;
+        enc->bit_rate = 128000;
+        enc->time_base = (AVRational){1, BENCH_SAMPLE_RATE};
+        snprintf(desc, sizeof(desc),
+                 "sine=frequency=440:beep_factor=4:sample_rate=%d:duration=%d,"
+                 "aformat=sample_fmts=%s:channel_layouts=stereo",
+                 BENCH_SAMPLE_RATE, m->seconds, av_get_sample_fmt_name(enc->sample_fmt));
+    } else {
+        enc->width = m->width;
+        enc->height = m->height;
+        enc->pix_fmt = codec->pix_fmts ? codec->pix_fmts[0] : AV_PIX_FMT_YUV420P;
+        enc->time_base = (AVRational){1, m->seconds ? BENCH_FPS : 1};
+        enc->framerate = av_inv_q(enc->time_base);
+        enc->gop_size = BENCH_FPS;
+        enc->bit_rate = (int64_t)m->width * m->height * 4;
+        snprintf(desc, sizeof(desc), "testsrc2=size=%dx%d:rate=%d:duration=%d,format=%s", m->width, m->height,
+                 enc->framerate.num, m->seconds ? m->seconds : 1, av_get_pix_fmt_name(enc->pix_fmt));
+    }
+    enc->thread_count = 1;
+    enc->flags |= AV_CODEC_FLAG_BITEXACT;
+    if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    int ret = avcodec_open2(enc, codec, NULL);
+    if (ret < 0)
+        return ret;
+    if (!(ms->st = avformat_new_stream(oc, NULL)))
+        return AVERROR(ENOMEM);
+    ms->st->time_base = enc->time_base;
+    if ((ret = avcodec_parameters_from_context(ms->st->codecpar, enc)) < 0)
+        return ret;
+
+    // The source is the whole graph, its only open pad is the sink's input
+    if (!(ms->graph = avfilter_graph_alloc()))
+        return AVERROR(ENOMEM);
+    ret = avfilter_graph_create_filter(&ms->sink, avfilter_get_by_name(audio ? "abuffersink" : "buffersink"), "out",
+                                       NULL, NULL, ms->graph);
+    if (ret < 0)
+        return ret;
+    AVFilterInOut* inputs = avfilter_inout_alloc();
+    AVFilterInOut* outputs = NULL;
+    if (!inputs)
+        return AVERROR(ENOMEM);
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = ms->sink;
+    ret = avfilter_graph_parse_ptr(ms->graph, desc, &inputs, &outputs, NULL);
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    if (ret < 0 || (ret = avfilter_graph_config(ms->graph, NULL)) < 0)
+        return ret;
+    if (audio && enc->frame_size && !(codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+        av_buffersink_set_frame_size(ms->sink, enc->frame_size);
+    return 0;
+}
+
+// Pulls one frame from the source into the encoder and writes what comes
+// out, or drains the encoder once the source ends.
+static int encode_step(AVFormatContext* oc, MediaStream* ms, AVFrame* frame, AVPacket* pkt) {
+    int ret = 0;
+    if (!ms->flushed) {
+        ret = av_buffersink_get_frame(ms->sink, frame);
+        if (ret == AVERROR_EOF) {
+            ms->flushed = 1;
+            ret = avcodec_send_frame(ms->enc, NULL);
+        } else if (ret >= 0) {
+            frame->pts = av_rescale_q(frame->pts, av_buffersink_get_time_base(ms->sink), ms->enc->time_base);
+            frame->pict_type = AV_PICTURE_TYPE_NONE;
+            ms->pts = frame->pts;
+            ret = avcodec_send_frame(ms->enc, frame);
+            av_frame_unref(frame);
+        }
+        if (ret < 0)
+            return ret;
+    }
+    while ((ret = avcodec_receive_packet(ms->enc, pkt)) >= 0) {
+        av_packet_rescale_ts(pkt, ms->enc->time_base, ms->st->time_base);
+        pkt->stream_index = ms->st->index;
+        if ((ret = av_interleaved_write_frame(oc, pkt)) < 0)
+            return ret;
+    }
+    if (ret == AVERROR_EOF)
+        ms->done = 1;
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+// Writes m to path through a temporary file. Returns 0, or a negative
+// AVERROR, AVERROR_ENCODER_NOT_FOUND when the local FFmpeg cannot make it.
+static int generate_media(const BenchMedia* m, const char* path) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    AVFormatContext* oc = NULL;
+    MediaStream streams[2] = {{0}};
+    int nb_streams = m->audio != AV_CODEC_ID_NONE ? 2 : 1;
+    AVFrame* frame = av_frame_alloc();
+    AVPacket* pkt = av_packet_alloc();
+    AVDictionary* opts = NULL;
+    int ret = avformat_alloc_output_context2(&oc, NULL, m->format, tmp);
+    if (ret < 0 || !frame || !pkt)
+        goto end;
+    oc->flags |= AVFMT_FLAG_BITEXACT;
+    for (int i = 0; i < nb_streams; i++) {
+        if ((ret = open_stream(oc, m, i, &streams[i])) < 0)
+            goto end;
+    }
+    if (!(oc->oformat->flags & AVFMT_NOFILE) && (ret = avio_open(&oc->pb, tmp, AVIO_FLAG_WRITE)) < 0)
+        goto end;
+    av_dict_set(&opts, "update", "1", 0); // image2: one file without a number pattern
+    if ((ret = avformat_write_header(oc, &opts)) < 0)
+        goto end;
+
+    // Feed the stream that is behind, so the muxer interleaves little
+    for (;;) {
+        MediaStream* next = NULL;
+        for (int i = 0; i < nb_streams; i++) {
+            MediaStream* ms = &streams[i];
+            if (!ms->done && (!next || av_compare_ts(ms->pts, ms->enc->time_base, next->pts, next->enc->time_base) < 0))
+                next = ms;
+        }
+        if (!next)
+            break;
+        if ((ret = encode_step(oc, next, frame, pkt)) < 0)
+            goto end;
+    }
+    ret = av_write_trailer(oc);
+
+end:
+    if (oc && !(oc->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&oc->pb);
+    for (int i = 0; i < nb_streams; i++)
+        close_stream(&streams[i]);
+    avformat_free_context(oc);
+    av_dict_free(&opts);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    if (ret >= 0 && rename(tmp, path) != 0)
+        ret = AVERROR(errno);
+    if (ret < 0) {
+        remove(tmp);
+        if (ret != AVERROR_ENCODER_NOT_FOUND)
+            fprintf(stderr, "Failed to generate %s: %s\n", m->name, av_err2str(ret));
+    }
+    return ret;
+}
+
+// Generates the input called name in dir unless it is there already.
+// Returns 0 once the file exists, AVERROR_ENCODER_NOT_FOUND when the local
+// FFmpeg cannot make it, AVERROR(ENOENT) for an unknown name, or another
+// negative AVERROR.
+int media_bench_generate(const char* dir, const char* name) {
+    for (size_t i = 0; i < FF_ARRAY_ELEMS(media); i++) {
+        if (strcmp(media[i].name, name))
+            continue;
+        char path[4096];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        return stat(path, &st) == 0 ? 0 : generate_media(&media[i], path);
+    }
+    return AVERROR(ENOENT);
+}
+#endif
+
+#ifdef TEST_MEDIA_BENCH
+// Peak RSS tracking. On Linux writing 5 to clear_refs resets VmHWM, so every
+// benchmark gets its own peak; elsewhere it is the peak of the process.
+static void reset_peak_rss(void) {
+    FILE* f = fopen("/proc/self/clear_refs", "w");
+    if (f) {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+static long peak_rss_kb(void) {
+    char line[256];
+    long kb = -1;
+    FILE* f = fopen("/proc/self/status", "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+                break;
+        }
+        fclose(f);
+    }
+    if (kb < 0) {
+        struct rusage ru;
+        if (getrusage(RUSAGE_SELF, &ru) == 0)
+            kb = ru.ru_maxrss;
+    }
+    return kb;
+}
+
+typedef struct {
+    const char* name;                   // benchmark name, the input is appended
+    int runs;                           // timed runs unless -n is given
+    int (*run)(const char* path, const char* work_dir); // 1 on success
+    int video;                          // runs on the videos, else on the images
+    const char* only;                   // NULL = every input of its kind, else this one
+} Benchmark;
+
+static int run_probe(const char* path, const char* work_dir) {
+    AVCodecParameters* par = get_video_codec_parameters(path);
+    free_codec_parameters(par);
+    return par != NULL;
+}
+
+static int run_probe_header(const char* path, const char* work_dir) {
+    ProbeOptions opts = {.header_only = 1};
+    AVCodecParameters* par = get_video_codec_parameters_ex(path, &opts, NULL);
+    free_codec_parameters(par);
+    return par != NULL;
+}
+
+static int run_video_thumbnail(const char* path, const char* work_dir) {
+    VideoThumbnailOptions opts = {.percent = 10, .width = BENCH_THUMB_SIZE, .height = BENCH_THUMB_SIZE};
+    unsigned char* jpeg = NULL;
+    size_t size = 0;
+    int ok = GetVideoThumbnailJPEGBuffer(path, &opts, &jpeg, &size);
+    free(jpeg);
+    return ok;
+}
+
+static int run_storyboard(const char* path, const char* work_dir) {
+    Storyboard sb;
+    if (!GetVideoStoryboard(path, NULL, NULL, &sb))
+        return 0;
+    FreeStoryboard(&sb);
+    return 1;
+}
+
+#ifdef __linux__
+static int run_image_thumbnail(const char* path, const char* work_dir) {
+    unsigned char* jpeg = NULL;
+    gsize size = 0;
+    int ok = GetImageThumbnailJPEGBuffer(path, BENCH_THUMB_SIZE, BENCH_THUMB_SIZE, &jpeg, &size);
+    free(jpeg);
+    return ok;
+}
+#endif
+
+static int run_convert(const char* path, const char* work_dir, int copy_mode) {
+    char output[4096];
+    snprintf(output, sizeof(output), "%s/convert_out.mp4", work_dir);
+    Params params = {.copy_mode = copy_mode};
+    int ok = convert_avi_to_h264_aac(path, output, &params) == 0;
+    remove(output);
+    return ok;
+}
+
+static int run_transcode(const char* path, const char* work_dir) {
+    return run_convert(path, work_dir, CONVERT_COPY_NEVER);
+}
+
+static int run_remux(const char* path, const char* work_dir) {
+    return run_convert(path, work_dir, CONVERT_COPY_AUTO);
+}
+
+static const Benchmark benchmarks[] = {
+    {"probe", 50, run_probe, 1, NULL},
+    {"probe_header", 50, run_probe_header, 1, NULL},
+    {"video_thumbnail", 20, run_video_thumbnail, 1, NULL},
+    {"storyboard", 5, run_storyboard, 1, NULL},
+#ifdef __linux__
+    {"image_thumbnail", 20, run_image_thumbnail, 0, NULL},
+#endif
+    {"transcode", 3, run_transcode, 1, "mpeg4_mp2.avi"},
+    {"remux", 5, run_remux, 1, "h264_aac.mp4"},
+};
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of sorted values.
+static double percentile(const double* sorted, int n, double p) {
+    int rank = (int)(p / 100 * n + 0.999999);
+    return sorted[rank < 1 ? 0 : rank > n ? n - 1 : rank - 1];
+}
+
+// Runs one benchmark on one input and prints its results. Returns 0, or -1
+// if a call failed.
+static int bench_one(const Benchmark* b, const char* input, const char* path, const char* work_dir, int runs,
+                     const char* label, FILE* out) {
+    char name[256];
+    snprintf(name, sizeof(name), "%s/%s", b->name, input);
+    struct stat st;
+    int64_t input_bytes = stat(path, &st) == 0 ? st.st_size : 0;
+    double* ms = malloc(runs * sizeof(*ms));
+    if (!ms)
+        return -1;
+    if (!b->run(path, work_dir)) {
+        fprintf(stderr, "%-40s FAILED\n", name);
+        free(ms);
+        return -1;
+    }
+    reset_peak_rss();
+    double total = 0;
+    for (int i = 0; i < runs; i++) {
+        int64_t start = av_gettime_relative();
+        if (!b->run(path, work_dir)) {
+            fprintf(stderr, "%-40s FAILED in run %d\n", name, i);
+            free(ms);
+            return -1;
+        }
+        ms[i] = (av_gettime_relative() - start) / 1000.0;
+        total += ms[i];
+    }
+    long rss = peak_rss_kb();
+    qsort(ms, runs, sizeof(*ms), compare_double);
+    double p50 = percentile(ms, runs, 50), p90 = percentile(ms, runs, 90), p99 = percentile(ms, runs, 99);
+    double ops = runs / (total / 1000);
+    double mbps = input_bytes * ops / (1024 * 1024);
+    fprintf(stderr, "%-40s %5d %9.2f %9.2f %9.2f %9.2f %9.1f %9.1f %9ld\n", name, runs, ms[0], p50, p90, p99, ops,
+            mbps, rss);
+    fprintf(out,
+            "{\"name\":\"%s\",\"runs\":%d,\"min_ms\":%.3f,\"mean_ms\":%.3f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,"
+            "\"p99_ms\":%.3f,\"max_ms\":%.3f,\"ops_per_s\":%.3f,\"mb_per_s\":%.3f,\"peak_rss_kb\":%ld,"
+            "\"input_bytes\":%lld,\"label\":\"%s\"}\n",
+            name, runs, ms[0], total / runs, p50, p90, p99, ms[runs - 1], ops, mbps, rss, (long long)input_bytes,
+            label);
+    fflush(out);
+    free(ms);
+    return 0;
+}
+
+typedef struct {
+    char name[256];
+    double p50_ms;
+    long peak_rss_kb;
+} BenchResult;
+
+// Reads the name, median and peak RSS of every line written by bench_one.
+static BenchResult* read_results(const char* filename, int* count) {
+    FILE* f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return NULL;
+    }
+    BenchResult* results = NULL;
+    int n = 0, capacity = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        BenchResult r;
+        const char* p50 = strstr(line, "\"p50_ms\":");
+        const char* rss = strstr(line, "\"peak_rss_kb\":");
+        if (sscanf(line, "{\"name\":\"%255[^\"]\"", r.name) != 1 || !p50 || !rss ||
+            sscanf(p50, "\"p50_ms\":%lf", &r.p50_ms) != 1 || sscanf(rss, "\"peak_rss_kb\":%ld", &r.peak_rss_kb) != 1)
+            continue;
+        if (n == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            BenchResult* grown = realloc(results, capacity * sizeof(*results));
+            if (!grown)
+                break;
+            results = grown;
+        }
+        results[n++] = r;
+    }
+    fclose(f);
+    *count = n;
+    return results;
+}
+
+// Prints the change of every benchmark in both files. Returns 1 if a median
+// grew by more than threshold percent.
+static int compare(const char* old_file, const char* new_file, double threshold) {
+    int nb_old = 0, nb_new = 0, regressed = 0;
+    BenchResult* old = read_results(old_file, &nb_old);
+    BenchResult* new = read_results(new_file, &nb_new);
+    if (!old || !new) {
+        free(old);
+        free(new);
+        return 2;
+    }
+    printf("%-40s %10s %10s %8s %10s %10s\n", "benchmark", "old p50", "new p50", "change", "old rss", "new rss");
+    for (int i = 0; i < nb_new; i++) {
+        for (int j = 0; j < nb_old; j++) {
+            if (strcmp(new[i].name, old[j].name))
+                continue;
+            double change = old[j].p50_ms > 0 ? (new[i].p50_ms / old[j].p50_ms - 1) * 100 : 0;
+            int worse = change > threshold;
+            regressed |= worse;
+            printf("%-40s %10.2f %10.2f %+7.1f%% %10ld %10ld%s\n", new[i].name, old[j].p50_ms, new[i].p50_ms, change,
+                   old[j].peak_rss_kb, new[i].peak_rss_kb, worse ? "  REGRESSION" : "");
+            break;
+        }
+    }
+    free(old);
+    free(new);
+    return regressed;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 4 && !strcmp(argv[1], "compare"))
+        return compare(argv[2], argv[3], argc > 4 ? atof(argv[4]) : 10);
+
+    const char* dir = "bench_media";
+    const char* label = "";
+    const char* filter = NULL;
+    FILE* out = stdout;
+    int runs = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-l") && i + 1 < argc) {
+            label = argv[++i];
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            if (!(out = fopen(argv[++i], "w"))) {
+                fprintf(stderr, "Could not open %s\n", argv[i]);
+                return 2;
+            }
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "usage: %s [-d media_dir] [-n runs] [-o results.jsonl] [-l label] [filter]\n"
+                            "       %s compare old.jsonl new.jsonl [threshold_percent]\n", argv[0], argv[0]);
+            return 2;
+        } else {
+            filter = argv[i];
+        }
+    }
+    av_log_set_level(AV_LOG_ERROR);
+    mkdir(dir, 0755);
+
+    int available[FF_ARRAY_ELEMS(media)];
+    char path[4096];
+    for (size_t i = 0; i < FF_ARRAY_ELEMS(media); i++)
+        available[i] = media_bench_generate(dir, media[i].name) == 0;
+
+    int failed = 0;
+    fprintf(stderr, "%-40s %5s %9s %9s %9s %9s %9s %9s %9s\n", "benchmark", "runs", "min ms", "p50 ms", "p90 ms",
+            "p99 ms", "ops/s", "MB/s", "rss kB");
+    for (size_t b = 0; b < FF_ARRAY_ELEMS(benchmarks); b++) {
+        const Benchmark* bench = &benchmarks[b];
+        for (size_t i = 0; i < FF_ARRAY_ELEMS(media); i++) {
+            const BenchMedia* m = &media[i];
+            char name[256];
+            snprintf(name, sizeof(name), "%s/%s", bench->name, m->name);
+            if (!available[i] || bench->video != (m->seconds > 0) || (bench->only && strcmp(bench->only, m->name)) ||
+                (filter && !strstr(name, filter)))
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", dir, m->name);
+            failed |= bench_one(bench, m->name, path, dir, runs > 0 ? runs : bench->runs, label, out) < 0;
+        }
+    }
+    if (out != stdout)
+        fclose(out);
+    return failed;
+}
+#endif
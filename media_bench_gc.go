@@ -0,0 +1,33 @@
+//go:build mediabench
+
+package avwrapper
+
+/*
+#cgo CFLAGS: -DMEDIA_BENCH_GENERATOR
+#cgo pkg-config: libavfilter
+#include <stdlib.h>
+#include <libavutil/error.h>
+
+int media_bench_generate(const char* dir, const char* name);
+*/
+import "C"
+import "unsafe"
+
+// generateBenchMedia writes the media_bench input name into dir unless it
+// is already there. It reports false when the local FFmpeg lacks the
+// encoder for it.
+func generateBenchMedia(dir, name string) (bool, error) {
+    cDir := C.CString(dir)
+    defer C.free(unsafe.Pointer(cDir))
+    cName := C.CString(name)
+    defer C.free(unsafe.Pointer(cName))
+
+    ret := C.media_bench_generate(cDir, cName)
+    if ret == C.AVERROR_ENCODER_NOT_FOUND {
+        return false, nil
+    }
+    if ret < 0 {
+        return false, AVError(ret)
+    }
+    return true, nil
+}
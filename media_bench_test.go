@@ -0,0 +1,124 @@
+//go:build mediabench
+
+package avwrapper
+
+import (
+    "os"
+    "path/filepath"
+    "testing"
+)
+
+// benchVideos are the generated videos of media_bench.c.
+var benchVideos = []string{"mpeg4_mp2.avi", "h264_aac.mp4", "mjpeg_pcm.mov", "mpeg2_mp2.ts"}
+
+// benchMedia returns the path of the generated input name, creating it on
+// first use in AVWRAPPER_BENCH_MEDIA, by default a directory in the temp
+// dir shared with later runs. It skips when the encoder is not available.
+func benchMedia(b *testing.B, name string) string {
+    b.Helper()
+    dir := os.Getenv("AVWRAPPER_BENCH_MEDIA")
+    if dir == "" {
+        dir = filepath.Join(os.TempDir(), "avwrapper_bench_media")
+    }
+    if err := os.MkdirAll(dir, 0o755); err != nil {
+        b.Fatal(err)
+    }
+    ok, err := generateBenchMedia(dir, name)
+    if err != nil {
+        b.Fatalf("generating %s: %v", name, err)
+    }
+    if !ok {
+        b.Skipf("no encoder for %s", name)
+    }
+    return filepath.Join(dir, name)
+}
+
+// benchVideo runs fn as one sub-benchmark per generated video, throughput
+// counted in input bytes.
+func benchVideo(b *testing.B, names []string, fn func(b *testing.B, path string)) {
+    for _, name := range names {
+        b.Run(name, func(b *testing.B) {
+            path := benchMedia(b, name)
+            fi, err := os.Stat(path)
+            if err != nil {
+                b.Fatal(err)
+            }
+            b.SetBytes(fi.Size())
+            b.ReportAllocs()
+            b.ResetTimer()
+            fn(b, path)
+        })
+    }
+}
+
+func BenchmarkProbe(b *testing.B) {
+    benchVideo(b, benchVideos, func(b *testing.B, path string) {
+        for i := 0; i < b.N; i++ {
+            if _, _, err := ProbeVideo(path, nil); err != nil {
+                b.Fatal(err)
+            }
+        }
+    })
+}
+
+func BenchmarkProbeHeader(b *testing.B) {
+    opts := &ProbeOptions{HeaderOnly: true}
+    benchVideo(b, benchVideos, func(b *testing.B, path string) {
+        for i := 0; i < b.N; i++ {
+            if _, _, err := ProbeVideo(path, opts); err != nil {
+                b.Fatal(err)
+            }
+        }
+    })
+}
+
+func BenchmarkVideoThumbnail(b *testing.B) {
+    opts := &ThumbnailOptions{Percent: 10, Width: 256, Height: 256}
+    benchVideo(b, benchVideos, func(b *testing.B, path string) {
+        for i := 0; i < b.N; i++ {
+            t, err := VideoThumbnail(path, opts)
+            if err != nil {
+                b.Fatal(err)
+            }
+            t.Release()
+        }
+    })
+}
+
+func BenchmarkVideoStoryboard(b *testing.B) {
+    benchVideo(b, benchVideos, func(b *testing.B, path string) {
+        for i := 0; i < b.N; i++ {
+            sb, err := VideoStoryboard(path, "", nil)
+            if err != nil {
+                b.Fatal(err)
+            }
+            sb.Release()
+        }
+    })
+}
+
+// BenchmarkTranscode re-encodes to H.264 and AAC in MP4.
+func BenchmarkTranscode(b *testing.B) {
+    params := &ConvertParams{CopyMode: CopyNever}
+    benchVideo(b, []string{"mpeg4_mp2.avi"}, func(b *testing.B, path string) {
+        output := filepath.Join(b.TempDir(), "transcode.mp4")
+        for i := 0; i < b.N; i++ {
+            if err := Convert(path, output, params); err != nil {
+                b.Fatal(err)
+            }
+        }
+    })
+}
+
+// BenchmarkRemux copies H.264 and AAC into a new MP4.
+func BenchmarkRemux(b *testing.B) {
+    params := &ConvertParams{CopyMode: CopyAuto}
+    benchVideo(b, []string{"h264_aac.mp4"}, func(b *testing.B, path string) {
+        output := filepath.Join(b.TempDir(), "remux.mp4")
+        for i := 0; i < b.N; i++ {
+            if err := Convert(path, output, params); err != nil {
+                b.Fatal(err)
+            }
+        }
+    })
+}
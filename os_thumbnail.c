@@ -18,8 +18,317 @@
 #else // Linux/Unix
 #include <glib.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include "os_thumbnail.h"
+#include "thumbnail_jpeg.h"
+#include "thumbnail_scale.h"
+#endif
+
+#if !defined(_WIN32) && !defined(__APPLE__)
+// --- Linux: freedesktop.org thumbnail cache ---
+//
+// Thumbnails live in $XDG_CACHE_HOME/thumbnails/<size>/<md5>.png, named
+// after the MD5 of the file:// URI of the original. A cached thumbnail is
+// only valid when its Thumb::MTime text chunk equals the mtime of the
+// original (and Thumb::URI, if present, its URI). A hit returns the PNG
+// bytes as stored; decoding happens only when another format is asked for.
+
+#define THUMB_PATH_CACHE_SIZE 256
+
+static const struct {
+    const char* dir;
+    int size;
+} thumb_buckets[] = {
+    {"normal", 128}, {"large", 256}, {"x-large", 512}, {"xx-large", 1024},
+};
+#define THUMB_NB_BUCKETS (int)(sizeof(thumb_buckets) / sizeof(thumb_buckets[0]))
+
+// Resolved URI and thumbnail name of recently asked absolute paths, so a
+// repeated lookup skips realpath, URI escaping and hashing. A linear scan of
+// the entries costs less than the realpath it saves.
+typedef struct {
+    char* path;       // absolute path as asked, NULL = free slot
+    char* uri;        // file:// URI of its real path
+    char md5[33];     // hex MD5 of uri, the thumbnail file name
+    uint64_t used;    // LRU clock
+} ThumbPathEntry;
+
+static ThumbPathEntry thumb_paths[THUMB_PATH_CACHE_SIZE];
+static uint64_t thumb_path_clock;
+static pthread_mutex_t thumb_path_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Sets *uri (g_free it) and md5 for filePath. Returns 1 on success.
+static int resolve_thumbnail_name(const char* filePath, char** uri, char md5[33]) {
+    int cacheable = filePath[0] == '/';
+    if (cacheable) {
+        pthread_mutex_lock(&thumb_path_lock);
+        for (int i = 0; i < THUMB_PATH_CACHE_SIZE; i++) {
+            ThumbPathEntry* e = &thumb_paths[i];
+            if (e->path && !strcmp(e->path, filePath)) {
+                e->used = ++thumb_path_clock;
+                *uri = g_strdup(e->uri);
+                memcpy(md5, e->md5, 33);
+                pthread_mutex_unlock(&thumb_path_lock);
+                return 1;
+            }
+        }
+        pthread_mutex_unlock(&thumb_path_lock);
+    }
+
+    char* abs_path = realpath(filePath, NULL);
+    if (!abs_path) {
+        fprintf(stderr, "Could not resolve absolute path for %s\n", filePath);
+        return 0;
+    }
+    *uri = g_filename_to_uri(abs_path, NULL, NULL);
+    free(abs_path);
+    if (!*uri)
+        return 0;
+    char* hex = g_compute_checksum_for_string(G_CHECKSUM_MD5, *uri, -1);
+    g_strlcpy(md5, hex, 33);
+    g_free(hex);
+
+    if (cacheable) {
+        pthread_mutex_lock(&thumb_path_lock);
+        ThumbPathEntry* victim = &thumb_paths[0];
+        for (int i = 0; i < THUMB_PATH_CACHE_SIZE && victim->path; i++) {
+            if (!thumb_paths[i].path || thumb_paths[i].used < victim->used)
+                victim = &thumb_paths[i];
+        }
+        g_free(victim->path);
+        g_free(victim->uri);
+        victim->path = g_strdup(filePath);
+        victim->uri = g_strdup(*uri);
+        memcpy(victim->md5, md5, 33);
+        victim->used = ++thumb_path_clock;
+        pthread_mutex_unlock(&thumb_path_lock);
+    }
+    return 1;
+}
+
+// Reads a whole file into a malloc'd buffer.
+static unsigned char* read_file(const char* path, size_t* size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    unsigned char* buf = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && (buf = malloc(st.st_size))) {
+        size_t n = 0;
+        while (n < (size_t)st.st_size) {
+            ssize_t r = read(fd, buf + n, st.st_size - n);
+            if (r <= 0)
+                break;
+            n += r;
+        }
+        if (n == (size_t)st.st_size) {
+            *size = n;
+        } else {
+            free(buf);
+            buf = NULL;
+        }
+    }
+    close(fd);
+    return buf;
+}
+
+static uint32_t get_be32(const unsigned char* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Checks the Thumb::MTime and Thumb::URI tEXt chunks of a cached PNG
+// against the original.
+static int thumbnail_is_current(const unsigned char* png, size_t size, const char* uri, time_t mtime) {
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    if (size < 8 || memcmp(png, signature, 8))
+        return 0;
+    int mtime_ok = 0;
+    size_t pos = 8;
+    while (pos + 12 <= size) {
+        uint32_t len = get_be32(png + pos);
+        const unsigned char* type = png + pos + 4;
+        const char* data = (const char*)png + pos + 8;
+        if (len > size - pos - 12)
+            return 0;
+        if (!memcmp(type, "IEND", 4))
+            break;
+        const char* nul = !memcmp(type, "tEXt", 4) ? memchr(data, '\0', len) : NULL;
+        if (nul) {
+            const char* value = nul + 1;
+            size_t value_len = data + len - value;
+            if (!strcmp(data, "Thumb::MTime")) {
+                char digits[32];
+                if (value_len >= sizeof(digits))
+                    return 0;
+                memcpy(digits, value, value_len);
+                digits[value_len] = '\0';
+                if (strtoll(digits, NULL, 10) != (long long)mtime)
+                    return 0;
+                mtime_ok = 1;
+            } else if (!strcmp(data, "Thumb::URI")) {
+                if (value_len != strlen(uri) || memcmp(value, uri, value_len))
+                    return 0;
+            }
+        }
+        pos += 12 + len;
+    }
+    return mtime_ok;
+}
+
+// Decodes a cached PNG, scales it down to fit width x height and encodes it
+// as JPEG into a malloc'd buffer.
+static int png_to_jpeg(const unsigned char* png, size_t size, int width, int height,
+                       unsigned char** jpegBuffer, size_t* jpegSize) {
+    GError* error = NULL;
+    GdkPixbufLoader* loader = gdk_pixbuf_loader_new_with_type("png", &error);
+    int loaded = loader && gdk_pixbuf_loader_write(loader, png, size, &error);
+    if (loader)
+        loaded = gdk_pixbuf_loader_close(loader, loaded ? &error : NULL) && loaded;
+    GdkPixbuf* pixbuf = loaded ? gdk_pixbuf_loader_get_pixbuf(loader) : NULL;
+    int ok = 0;
+    if (pixbuf) {
+        ThumbJpegOptions opts = {.quality = 85};
+        const uint8_t* pixels = gdk_pixbuf_read_pixels(pixbuf);
+        uint8_t* scaled = NULL;
+        int w = gdk_pixbuf_get_width(pixbuf), h = gdk_pixbuf_get_height(pixbuf);
+        int stride = gdk_pixbuf_get_rowstride(pixbuf), channels = gdk_pixbuf_get_n_channels(pixbuf);
+        int tw, th, fits = 1;
+        // A larger bucket than the box holds a larger thumbnail
+        thumbnail_fit(w, h, width, height, &tw, &th);
+        if (tw < w || th < h) {
+            fits = (scaled = malloc((size_t)tw * th * channels)) &&
+                   thumb_scale_image(pixels, stride, w, h, scaled, tw * channels, tw, th, channels) == 0;
+            pixels = scaled;
+            stride = tw * channels;
+            w = tw;
+            h = th;
+        }
+        const uint8_t* jpeg;
+        size_t len;
+        if (fits && thumb_jpeg_encode_rgb(pixels, stride, w, h, channels, &opts, &jpeg, &len) == 0 &&
+            (*jpegBuffer = malloc(len))) {
+            memcpy(*jpegBuffer, jpeg, len);
+            *jpegSize = len;
+            ok = 1;
+        }
+        free(scaled);
+    } else {
+        fprintf(stderr, "Failed to load OS thumbnail: %s\n", error ? error->message : "Unknown error");
+    }
+    if (error)
+        g_error_free(error);
+    if (loader)
+        g_object_unref(loader);
+    return ok;
+}
+
+int StoreOSThumbnail(const char* filePath, int width, int height, const unsigned char* jpeg, size_t jpegSize) {
+    struct stat st;
+    if (stat(filePath, &st) != 0)
+        return 0;
+    char* uri;
+    char md5[33];
+    if (!resolve_thumbnail_name(filePath, &uri, md5))
+        return 0;
+
+    GError* error = NULL;
+    GdkPixbufLoader* loader = gdk_pixbuf_loader_new_with_type("jpeg", &error);
+    int loaded = loader && gdk_pixbuf_loader_write(loader, jpeg, jpegSize, &error);
+    if (loader)
+        loaded = gdk_pixbuf_loader_close(loader, loaded ? &error : NULL) && loaded;
+    GdkPixbuf* pixbuf = loaded ? gdk_pixbuf_loader_get_pixbuf(loader) : NULL;
+    int ok = 0;
+    if (pixbuf) {
+        // The smallest bucket the thumbnail fits in, none if it is larger than all
+        int w = gdk_pixbuf_get_width(pixbuf), h = gdk_pixbuf_get_height(pixbuf);
+        int side = w > h ? w : h;
+        int i = 0;
+        while (i < THUMB_NB_BUCKETS && thumb_buckets[i].size < side)
+            i++;
+        // The spec sizes a bucket's thumbnails to the bucket, or to the original when that is
+        // smaller. A thumbnail the box shrank to another size is neither.
+        int at_original = (width <= 0 || w < width) && (height <= 0 || h < height);
+        if (i < THUMB_NB_BUCKETS && thumb_buckets[i].size != side && !at_original)
+            i = THUMB_NB_BUCKETS;
+        char* png = NULL;
+        gsize png_size = 0;
+        char mtime[32];
+        snprintf(mtime, sizeof(mtime), "%lld", (long long)st.st_mtime);
+        if (i < THUMB_NB_BUCKETS &&
+            gdk_pixbuf_save_to_buffer(pixbuf, &png, &png_size, "png", &error,
+                                      "tEXt::Thumb::URI", uri, "tEXt::Thumb::MTime", mtime, NULL)) {
+            char* dir = g_build_filename(g_get_user_cache_dir(), "thumbnails", thumb_buckets[i].dir, NULL);
+            char* name = g_strconcat(md5, ".png", NULL);
+            char* path = g_build_filename(dir, name, NULL);
+            // Written to a temporary file and renamed, readers never see a partial thumbnail
+            ok = g_mkdir_with_parents(dir, 0700) == 0 &&
+                 g_file_set_contents_full(path, png, png_size, G_FILE_SET_CONTENTS_CONSISTENT, 0600, &error);
+            g_free(path);
+            g_free(name);
+            g_free(dir);
+            g_free(png);
+        }
+    }
+    if (error) {
+        fprintf(stderr, "Failed to store OS thumbnail: %s\n", error->message);
+        g_error_free(error);
+    }
+    if (loader)
+        g_object_unref(loader);
+    g_free(uri);
+    return ok;
+}
+
+int LoadOSThumbnailBuffer(const char* filePath, int width, int height, int format,
+                          unsigned char** buffer, size_t* size) {
+    *buffer = NULL;
+    *size = 0;
+    struct stat st;
+    if (stat(filePath, &st) != 0)
+        return 0;
+    char* uri;
+    char md5[33];
+    if (!resolve_thumbnail_name(filePath, &uri, md5))
+        return 0;
+
+    // The smallest bucket holding the requested size first, then the larger
+    // ones, then the smaller ones unless the box must be covered
+    int want = width > height ? width : height;
+    int first = 0;
+    while (first < THUMB_NB_BUCKETS - 1 && thumb_buckets[first].size < want)
+        first++;
+    int nb_buckets = format == OS_THUMB_JPEG_COVER ? THUMB_NB_BUCKETS - first : THUMB_NB_BUCKETS;
+    const char* cache_dir = g_get_user_cache_dir();
+    unsigned char* png = NULL;
+    size_t png_size = 0;
+    for (int k = 0; k < nb_buckets && !png; k++) {
+        int i = k < THUMB_NB_BUCKETS - first ? first + k : THUMB_NB_BUCKETS - 1 - k;
+        char thumb_path[PATH_MAX];
+        snprintf(thumb_path, sizeof(thumb_path), "%s/thumbnails/%s/%s.png", cache_dir, thumb_buckets[i].dir, md5);
+        if ((png = read_file(thumb_path, &png_size)) && !thumbnail_is_current(png, png_size, uri, st.st_mtime)) {
+            free(png);
+            png = NULL;
+        }
+    }
+    g_free(uri);
+    if (!png) {
+        fprintf(stderr, "OS thumbnail not found for %s\n", filePath);
+        return 0;
+    }
+
+    if (format == OS_THUMB_AS_STORED) {
+        *buffer = png;
+        *size = png_size;
+        return 1;
+    }
+    int ok = png_to_jpeg(png, png_size, width, height, buffer, size);
+    free(png);
+    return ok;
+}
 #endif
 
 int LoadOSThumbnailJPEGBuffer(const char* filePath, int width, int height, unsigned char** jpegBuffer, size_t* jpegSize) {
@@ -85,7 +394,8 @@ int LoadOSThumbnailJPEGBuffer(const char* filePath, int width, int height, unsig
     pStream->lpVtbl->Seek(pStream, zero, STREAM_SEEK_SET, &pos);
     pStream->lpVtbl->Stat(pStream, &stat, STATFLAG_NONAME);
     *jpegSize = (size_t)stat.cbSize.QuadPart;
-    *jpegBuffer = (unsigned char*)CoTaskMemAlloc(*jpegSize);
+    // malloc like the other platforms, so free_thumbnail_buffer fits all of them
+    *jpegBuffer = (unsigned char*)malloc(*jpegSize);
     pStream->lpVtbl->Read(pStream, *jpegBuffer, (ULONG)*jpegSize, &cbRead);
 
     // Cleanup
@@ -131,52 +441,7 @@ int LoadOSThumbnailJPEGBuffer(const char* filePath, int width, int height, unsig
 
 #else
     // --- Linux implementation ---
-    *jpegBuffer = NULL;
-    *jpegSize = 0;
-    char* abs_path = realpath(filePath, NULL);
-    if (!abs_path) {
-        fprintf(stderr, "Could not resolve absolute path for %s\n", filePath);
-        return 0;
-    }
-
-    // Compute md5 hash of the absolute file path
-    GChecksum* checksum = g_checksum_new(G_CHECKSUM_MD5);
-    g_checksum_update(checksum, (const guchar*)abs_path, strlen(abs_path));
-    const char* md5_hex = g_checksum_get_string(checksum);
-    g_checksum_free(checksum);
-    free(abs_path);
-
-    const char* thumb_dirs[] = { "normal", "large" };
-    char thumb_path[PATH_MAX];
-    for (int i = 0; i < 2; i++) {
-        snprintf(thumb_path, sizeof(thumb_path), "%s/.cache/thumbnails/%s/%s.jpg",
-                 g_get_home_dir(), thumb_dirs[i], md5_hex);
-
-        if (g_file_test(thumb_path, G_FILE_TEST_EXISTS)) {
-            // Load the thumbnail file into a pixbuf
-            GError* error = NULL;
-            GdkPixbuf* pixbuf = gdk_pixbuf_new_from_file(thumb_path, &error);
-            if (!pixbuf) {
-                fprintf(stderr, "Failed to load OS thumbnail: %s\n", error ? error->message : "Unknown error");
-                if (error) g_error_free(error);
-                return 0;
-            }
-            // Save to JPEG buffer
-            error = NULL;
-            gboolean ok = gdk_pixbuf_save_to_buffer(
-                pixbuf, (char**)jpegBuffer, (gsize*)jpegSize, "jpeg", &error, "quality", "85", NULL);
-            g_object_unref(pixbuf);
-
-            if (!ok) {
-                fprintf(stderr, "Failed to save thumbnail buffer: %s\n", error ? error->message : "Unknown error");
-                if (error) g_error_free(error);
-                return 0;
-            }
-            return 1;
-        }
-    }
-    fprintf(stderr, "OS thumbnail not found for %s\n", filePath);
-    return 0;
+    return LoadOSThumbnailBuffer(filePath, width, height, OS_THUMB_JPEG, jpegBuffer, jpegSize);
 #endif
 }
 
@@ -197,13 +462,7 @@ int main(int argc, char** argv) {
         FILE* f = fopen("thumbnail.jpg", "wb");
         fwrite(jpegBuffer, 1, jpegSize, f);
         fclose(f);
-#if defined(_WIN32)
-        CoTaskMemFree(jpegBuffer);
-#elif defined(__APPLE__)
-        free(jpegBuffer);
-#else
-        g_free(jpegBuffer);
-#endif
+        free_thumbnail_buffer(jpegBuffer);
         printf("Thumbnail saved to thumbnail.jpg\n");
     } else {
         printf("Failed to load OS thumbnail.\n");
@@ -1,37 +1,133 @@
-// thumbnail.go
-package mediafileinfo
+// os_thumbnail.go
+package avwrapper
 
 /*
-#cgo LDFLAGS: -L. -los_thumbnail   // Adjust if necessary
+#cgo linux pkg-config: glib-2.0 gdk-pixbuf-2.0 libjpeg
+#cgo darwin LDFLAGS: -framework CoreFoundation -framework CoreServices -framework QuickLook -framework ImageIO -framework CoreGraphics
+#cgo windows LDFLAGS: -lole32 -lwindowscodecs -lgdi32
 #include <stdint.h>
 #include <stdlib.h>
+#include "os_thumbnail.h"
 
-// Declare C functions
-int os_thumbnail(const char* input_filename, uint8_t** output_buf, size_t* output_size);
-void free_thumbnail_buffer(uint8_t* buf);
+// The freedesktop.org cache keeps files, the Windows and macOS APIs hand
+// out bitmaps, which are encoded as JPEG there.
+static int load_os_thumbnail_stored(const char* path, int width, int height, unsigned char** buf, size_t* size) {
+#if !defined(_WIN32) && !defined(__APPLE__)
+    return LoadOSThumbnailBuffer(path, width, height, OS_THUMB_AS_STORED, buf, size);
+#else
+    return LoadOSThumbnailJPEGBuffer(path, width, height, buf, size);
+#endif
+}
 */
 import "C"
 import (
-    "errors"
+    "sync"
+    "sync/atomic"
     "unsafe"
 )
 
-// GetJPEGThumbnail generates a JPEG thumbnail from the given file.
-// It returns the JPEG bytes as a Go slice.
-func GetJPEGThumbnail(filename string) ([]byte, error) {
+// Thumbnail is a JPEG (or, from OSThumbnailAsStored, the OS's own file)
+// handed over without copying. Bytes aliases either C memory or a pooled Go
+// buffer and is only valid until Release.
+type Thumbnail struct {
+    Bytes []byte
+    cbuf  *C.uint8_t  // C buffer to free, nil for a pooled buffer
+    pool  *bufferPool // pool of buf
+    buf   *[]byte
+}
+
+// Release returns the memory behind Bytes. The Thumbnail must not be used
+// afterwards; calling Release again is a no-op.
+func (t *Thumbnail) Release() {
+    if t.cbuf != nil {
+        C.free_thumbnail_buffer(t.cbuf)
+        t.cbuf = nil
+    }
+    if t.buf != nil {
+        t.pool.put(t.buf)
+        t.buf = nil
+    }
+    t.Bytes = nil
+}
+
+// cThumbnail wraps a malloc'd C buffer as a Thumbnail.
+func cThumbnail(buf *C.uint8_t, size C.size_t) *Thumbnail {
+    return &Thumbnail{Bytes: unsafe.Slice((*byte)(unsafe.Pointer(buf)), int(size)), cbuf: buf}
+}
+
+// bufferPool recycles thumbnail buffers across calls. New buffers get the
+// size of the largest thumbnail seen so far, so after a few calls every
+// thumbnail is written straight into one.
+type bufferPool struct {
+    pool sync.Pool
+    size int64
+}
+
+const minThumbnailBuffer = 64 << 10
+
+func (p *bufferPool) get() *[]byte {
+    size := int(atomic.LoadInt64(&p.size))
+    if size < minThumbnailBuffer {
+        size = minThumbnailBuffer
+    }
+    if b, ok := p.pool.Get().(*[]byte); ok && len(*b) >= size {
+        return b
+    }
+    b := make([]byte, size)
+    return &b
+}
+
+func (p *bufferPool) put(b *[]byte) {
+    p.pool.Put(b)
+}
+
+// grow raises the size of new buffers to hold n bytes.
+func (p *bufferPool) grow(n int) {
+    for {
+        size := atomic.LoadInt64(&p.size)
+        if int64(n) <= size || atomic.CompareAndSwapInt64(&p.size, size, int64(n)+int64(n)/4) {
+            return
+        }
+    }
+}
+
+// OSThumbnail returns the JPEG thumbnail the OS keeps for filename, sized
+// for width x height, without copying it.
+func OSThumbnail(filename string, width, height int) (*Thumbnail, error) {
     cFilename := C.CString(filename)
     defer C.free(unsafe.Pointer(cFilename))
 
-    var cBuf *C.uint8_t
-    var cSize C.size_t
+    var buf *C.uchar
+    var size C.size_t
+    if C.LoadOSThumbnailJPEGBuffer(cFilename, C.int(width), C.int(height), &buf, &size) == 0 {
+        return nil, ErrThumbnail
+    }
+    return cThumbnail((*C.uint8_t)(unsafe.Pointer(buf)), size), nil
+}
+
+// OSThumbnailAsStored returns the thumbnail the OS keeps for filename, sized
+// for width x height, byte for byte and without copying: on Linux the PNG of
+// the freedesktop.org cache, neither decoded nor scaled, so it may be larger
+// than the box. On Windows and macOS it is the JPEG of OSThumbnail.
+func OSThumbnailAsStored(filename string, width, height int) (*Thumbnail, error) {
+    cFilename := C.CString(filename)
+    defer C.free(unsafe.Pointer(cFilename))
 
-    res := C.os_thumbnail(cFilename, &cBuf, &cSize)
-    if res != 0 {
-        return nil, errors.New("failed to generate thumbnail")
+    var buf *C.uchar
+    var size C.size_t
+    if C.load_os_thumbnail_stored(cFilename, C.int(width), C.int(height), &buf, &size) == 0 {
+        return nil, ErrThumbnail
     }
-    defer C.free_thumbnail_buffer(cBuf)
+    return cThumbnail((*C.uint8_t)(unsafe.Pointer(buf)), size), nil
+}
 
-    // Copy JPEG data from C buffer to Go slice
-    buf := C.GoBytes(unsafe.Pointer(cBuf), C.int(cSize))
-    return buf, nil
+// GetJPEGThumbnail returns the 256x256 JPEG thumbnail the OS keeps for
+// filename as a Go slice. It copies; OSThumbnail does not.
+func GetJPEGThumbnail(filename string) ([]byte, error) {
+    t, err := OSThumbnail(filename, 256, 256)
+    if err != nil {
+        return nil, err
+    }
+    defer t.Release()
+    return append([]byte(nil), t.Bytes...), nil
 }
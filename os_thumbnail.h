@@ -2,7 +2,34 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-// Example signature: generates a JPEG thumbnail from input file, returns buffer and size
-int os_thumbnail(const char* input_filename, uint8_t** output_buf, size_t* output_size);
-
+// Releases every buffer returned by the functions below, they all use malloc.
 void free_thumbnail_buffer(uint8_t* buf);
+
+// Loads the thumbnail the OS keeps for filePath, sized for width x height,
+// as JPEG. Returns 1 on success, 0 on failure.
+int LoadOSThumbnailJPEGBuffer(const char* filePath, int width, int height, unsigned char** jpegBuffer, size_t* jpegSize);
+
+#if !defined(_WIN32) && !defined(__APPLE__)
+// Formats of LoadOSThumbnailBuffer
+enum {
+    OS_THUMB_AS_STORED = 0, // the cached file byte for byte, PNG in the freedesktop cache
+    OS_THUMB_JPEG,          // converted to JPEG, scaled down to fit width x height
+    OS_THUMB_JPEG_COVER,    // the same, skipping buckets smaller than the box
+};
+
+// Looks up filePath in the freedesktop.org thumbnail cache following the
+// spec: the MD5 of its file:// URI in the normal, large, x-large and
+// xx-large buckets, the one fitting width x height first, valid only while
+// Thumb::MTime matches the file. Returns 1 on success, 0 when there is no
+// current thumbnail. buffer is malloc'd, release it with free_thumbnail_buffer.
+int LoadOSThumbnailBuffer(const char* filePath, int width, int height, int format,
+                          unsigned char** buffer, size_t* size);
+
+// Stores a JPEG thumbnail of filePath, fitted into width x height, in the
+// freedesktop.org cache as the spec has it: a PNG with Thumb::URI and
+// Thumb::MTime in the smallest size bucket it fits, written atomically with
+// mode 0600. The spec only allows a thumbnail as large as its bucket or as
+// the original, so one the box shrank to another size is not stored.
+// Returns 1 on success.
+int StoreOSThumbnail(const char* filePath, int width, int height, const unsigned char* jpeg, size_t jpegSize);
+#endif
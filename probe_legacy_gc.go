@@ -0,0 +1,77 @@
+//go:build mediabench
+
+package avwrapper
+
+/*
+#include <stdlib.h>
+#include "avwrapper.h"
+*/
+import "C"
+import (
+    "errors"
+    "runtime"
+    "unsafe"
+)
+
+// codecparRef is a probe result the way the bindings returned it before
+// CodecParameters: the C AVCodecParameters itself, freed by a finalizer.
+// Only BenchmarkProbeVideoPerField uses it, to measure what the one-shot
+// snapshot saves.
+type codecparRef struct {
+    ptr *C.struct_AVCodecParameters
+}
+
+var errLegacyProbe = errors.New("avwrapper: probe failed")
+
+// probeVideoPerField probes filename through get_video_codec_parameters_ex
+// and reads every field through the C pointer, as the old accessors did,
+// plus the codec name through a cgo call per file.
+func probeVideoPerField(filename string, opts *ProbeOptions) (CodecParameters, string, error) {
+    cFilename := C.CString(filename)
+    defer C.free(unsafe.Pointer(cFilename))
+
+    var stats C.ProbeStats
+    copts := opts.toC()
+    ptr := C.get_video_codec_parameters_ex(cFilename, &copts, &stats)
+    if ptr == nil {
+        return CodecParameters{}, "", errLegacyProbe
+    }
+    ref := &codecparRef{ptr: ptr}
+    runtime.SetFinalizer(ref, func(r *codecparRef) {
+        C.free_codec_parameters(r.ptr)
+    })
+
+    p := CodecParameters{
+        BitRate:              int64(ref.ptr.bit_rate),
+        ChannelLayout:        uint64(ref.ptr.channel_layout),
+        CodecType:            int32(ref.ptr.codec_type),
+        CodecID:              int32(ref.ptr.codec_id),
+        CodecTag:             uint32(ref.ptr.codec_tag),
+        Format:               int32(ref.ptr.format),
+        BitsPerCodedSample:   int32(ref.ptr.bits_per_coded_sample),
+        BitsPerRawSample:     int32(ref.ptr.bits_per_raw_sample),
+        Profile:              int32(ref.ptr.profile),
+        Level:                int32(ref.ptr.level),
+        Width:                int32(ref.ptr.width),
+        Height:               int32(ref.ptr.height),
+        SampleAspectRatioNum: int32(ref.ptr.sample_aspect_ratio.num),
+        SampleAspectRatioDen: int32(ref.ptr.sample_aspect_ratio.den),
+        FieldOrder:           int32(ref.ptr.field_order),
+        ColorRange:           int32(ref.ptr.color_range),
+        ColorPrimaries:       int32(ref.ptr.color_primaries),
+        ColorTrc:             int32(ref.ptr.color_trc),
+        ColorSpace:           int32(ref.ptr.color_space),
+        ChromaLocation:       int32(ref.ptr.chroma_location),
+        VideoDelay:           int32(ref.ptr.video_delay),
+        Channels:             int32(ref.ptr.channels),
+        SampleRate:           int32(ref.ptr.sample_rate),
+        BlockAlign:           int32(ref.ptr.block_align),
+        FrameSize:            int32(ref.ptr.frame_size),
+        InitialPadding:       int32(ref.ptr.initial_padding),
+        TrailingPadding:      int32(ref.ptr.trailing_padding),
+        SeekPreroll:          int32(ref.ptr.seek_preroll),
+    }
+    name := C.GoString(C.get_codec_name(C.int32_t(ref.ptr.codec_id)))
+    runtime.KeepAlive(ref)
+    return p, name, nil
+}
@@ -0,0 +1,300 @@
+// thumbnail_cache.c
+//
+// Write-through thumbnail cache. Thumbnails are stored as <key>.jpg in one
+// directory, where key is the MD5 of the device, inode, size and mtime of
+// the original plus the requested box, so a changed file gets a new entry
+// and the old one ages out. Files are written to a temporary name and
+// renamed, so readers and other processes never see a partial thumbnail.
+//
+// A hit sets the file's mtime to now, eviction removes the oldest mtimes
+// first. The total size is counted in process and the directory is only
+// scanned on open and when the total passes max_bytes.
+//
+// Misses are single-flight: the first caller for a key generates it, later
+// callers for the same key wait for that result instead of decoding too.
+#include "thumbnail_cache.h"
+#include "os_thumbnail.h"
+#include "thumbnail_linux.h"
+#include "thumbnail_video.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define THUMB_CACHE_DEFAULT_MAX_BYTES (256 * 1024 * 1024)
+// Eviction trims to this share of max_bytes, so it does not run on every store
+#define THUMB_CACHE_LOW_WATER 0.9
+// Temporary files left by a crashed writer are removed after this many seconds
+#define THUMB_CACHE_TMP_AGE 3600
+
+// A thumbnail being generated, shared by every caller asking for its key.
+typedef struct ThumbFlight {
+    char key[33];
+    int waiters;         // callers waiting for the result
+    int done;
+    unsigned char* data; // copy of the result for the waiters, NULL on failure
+    size_t size;
+    struct ThumbFlight* next;
+} ThumbFlight;
+
+struct ThumbnailCache {
+    char* dir;
+    int64_t max_bytes;
+    int flags;
+    pthread_mutex_t lock;       // guards everything below
+    pthread_cond_t flight_done;
+    ThumbFlight* flights;
+    int64_t bytes;              // size of the cached thumbnails
+    int evicting;
+};
+
+typedef struct {
+    char* name;
+    time_t mtime;
+    off_t size;
+} CacheFile;
+
+static int compare_mtime(const void* a, const void* b) {
+    const CacheFile* x = a;
+    const CacheFile* y = b;
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+// Recounts the directory and removes the least recently used thumbnails
+// until it is below the low water mark, plus stale temporary files.
+static void evict(ThumbnailCache* cache) {
+    DIR* d = opendir(cache->dir);
+    if (!d)
+        return;
+    CacheFile* files = NULL;
+    size_t count = 0, capacity = 0;
+    int64_t total = 0;
+    time_t now = time(NULL);
+    struct dirent* entry;
+    while ((entry = readdir(d))) {
+        struct stat st;
+        size_t len = strlen(entry->d_name);
+        if (entry->d_name[0] == '.' || fstatat(dirfd(d), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (len < 4 || strcmp(entry->d_name + len - 4, ".jpg")) {
+            if (now - st.st_mtime > THUMB_CACHE_TMP_AGE)
+                unlinkat(dirfd(d), entry->d_name, 0);
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            CacheFile* grown = realloc(files, capacity * sizeof(*files));
+            if (!grown)
+                break;
+            files = grown;
+        }
+        files[count++] = (CacheFile){strdup(entry->d_name), st.st_mtime, st.st_size};
+        total += st.st_size;
+    }
+
+    if (total > cache->max_bytes) {
+        qsort(files, count, sizeof(*files), compare_mtime);
+        for (size_t i = 0; i < count && total > cache->max_bytes * THUMB_CACHE_LOW_WATER; i++) {
+            if (files[i].name && unlinkat(dirfd(d), files[i].name, 0) == 0)
+                total -= files[i].size;
+        }
+    }
+    for (size_t i = 0; i < count; i++)
+        free(files[i].name);
+    free(files);
+    closedir(d);
+
+    pthread_mutex_lock(&cache->lock);
+    cache->bytes = total;
+    cache->evicting = 0;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+ThumbnailCache* thumbnail_cache_open(const char* dir, int64_t maxBytes, int flags) {
+    ThumbnailCache* cache = calloc(1, sizeof(*cache));
+    if (!cache)
+        return NULL;
+    cache->dir = dir ? g_strdup(dir) : g_build_filename(g_get_user_cache_dir(), "mediafileinfo", "thumbnails", NULL);
+    cache->max_bytes = maxBytes > 0 ? maxBytes : THUMB_CACHE_DEFAULT_MAX_BYTES;
+    cache->flags = flags;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->flight_done, NULL);
+    if (g_mkdir_with_parents(cache->dir, 0700) != 0) {
+        fprintf(stderr, "Could not create thumbnail cache '%s'\n", cache->dir);
+        thumbnail_cache_close(cache);
+        return NULL;
+    }
+    evict(cache);
+    return cache;
+}
+
+void thumbnail_cache_close(ThumbnailCache* cache) {
+    if (!cache)
+        return;
+    pthread_cond_destroy(&cache->flight_done);
+    pthread_mutex_destroy(&cache->lock);
+    g_free(cache->dir);
+    free(cache);
+}
+
+// Key of the current version of the file at the requested size.
+static void cache_key(const struct stat* st, int width, int height, char key[33]) {
+    char id[128];
+    snprintf(id, sizeof(id), "%llu:%llu:%lld:%lld.%09ld:%dx%d", (unsigned long long)st->st_dev,
+             (unsigned long long)st->st_ino, (long long)st->st_size, (long long)st->st_mtim.tv_sec,
+             st->st_mtim.tv_nsec, width, height);
+    char* hex = g_compute_checksum_for_string(G_CHECKSUM_MD5, id, -1);
+    g_strlcpy(key, hex, 33);
+    g_free(hex);
+}
+
+// Fills the caller's buf when size fits in cap, else returns a malloc'd
+// *spill. Returns the buffer to fill, NULL when out of memory.
+static unsigned char* output_buffer(unsigned char* buf, size_t cap, size_t size, unsigned char** spill) {
+    if (buf && size <= cap)
+        return buf;
+    return *spill = malloc(size);
+}
+
+// Reads a cached thumbnail and marks it as used.
+static int read_cached(const char* path, unsigned char* buf, size_t cap, unsigned char** spill, size_t* size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    unsigned char* dst = NULL;
+    size_t n = 0;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && (dst = output_buffer(buf, cap, st.st_size, spill))) {
+        ssize_t r;
+        while (n < (size_t)st.st_size && (r = read(fd, dst + n, st.st_size - n)) > 0)
+            n += r;
+    }
+    int ok = dst && n == (size_t)st.st_size;
+    if (ok) {
+        futimens(fd, NULL);
+        *size = n;
+    } else {
+        free(*spill);
+        *spill = NULL;
+    }
+    close(fd);
+    return ok;
+}
+
+// Generates the thumbnail on a miss: the freedesktop.org cache if enabled,
+// scaled down to the box and only from a bucket covering it, then the image
+// decoders, then the video keyframe path.
+static int generate(ThumbnailCache* cache, const char* filePath, int width, int height, unsigned char* buf,
+                    size_t cap, unsigned char** spill, size_t* size, int* from_os) {
+    *from_os = 0;
+    if ((cache->flags & THUMB_CACHE_FREEDESKTOP) &&
+        LoadOSThumbnailBuffer(filePath, width, height, OS_THUMB_JPEG_COVER, spill, size)) {
+        *from_os = 1;
+        return 1;
+    }
+    if (GetImageThumbnailJPEGInto(filePath, width, height, buf, cap, spill, size))
+        return 1;
+    VideoThumbnailOptions opts = {.width = width, .height = height};
+    return GetVideoThumbnailJPEGInto(filePath, &opts, buf, cap, spill, size);
+}
+
+// Writes a thumbnail atomically and evicts if the cache grew too large.
+static void store(ThumbnailCache* cache, const char* path, const unsigned char* data, size_t size) {
+    GError* error = NULL;
+    if (!g_file_set_contents_full(path, (const char*)data, size, G_FILE_SET_CONTENTS_CONSISTENT, 0600, &error)) {
+        fprintf(stderr, "Failed to store thumbnail: %s\n", error ? error->message : "Unknown error");
+        if (error) g_error_free(error);
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    cache->bytes += size;
+    int over = cache->bytes > cache->max_bytes && !cache->evicting;
+    if (over)
+        cache->evicting = 1;
+    pthread_mutex_unlock(&cache->lock);
+    if (over)
+        evict(cache);
+}
+
+int thumbnail_cache_get(ThumbnailCache* cache, const char* filePath, int width, int height,
+                        unsigned char** jpegBuffer, size_t* jpegSize) {
+    return thumbnail_cache_get_into(cache, filePath, width, height, NULL, 0, jpegBuffer, jpegSize);
+}
+
+int thumbnail_cache_get_into(ThumbnailCache* cache, const char* filePath, int width, int height,
+                             unsigned char* buf, size_t cap, unsigned char** spill, size_t* jpegSize) {
+    *spill = NULL;
+    *jpegSize = 0;
+    struct stat st;
+    if (stat(filePath, &st) != 0)
+        return 0;
+    char key[33];
+    cache_key(&st, width, height, key);
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s.jpg", cache->dir, key);
+    if (read_cached(path, buf, cap, spill, jpegSize))
+        return 1;
+
+    pthread_mutex_lock(&cache->lock);
+    ThumbFlight* flight = cache->flights;
+    while (flight && strcmp(flight->key, key))
+        flight = flight->next;
+    if (flight) {
+        // Someone else is generating it, take a copy of their result
+        flight->waiters++;
+        while (!flight->done)
+            pthread_cond_wait(&cache->flight_done, &cache->lock);
+        unsigned char* dst = flight->data ? output_buffer(buf, cap, flight->size, spill) : NULL;
+        if (dst) {
+            memcpy(dst, flight->data, flight->size);
+            *jpegSize = flight->size;
+        }
+        if (--flight->waiters == 0) {
+            free(flight->data);
+            free(flight);
+        }
+        pthread_mutex_unlock(&cache->lock);
+        return dst != NULL;
+    }
+    flight = calloc(1, sizeof(*flight));
+    if (flight) {
+        memcpy(flight->key, key, sizeof(key));
+        flight->next = cache->flights;
+        cache->flights = flight;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    int from_os;
+    int ok = generate(cache, filePath, width, height, buf, cap, spill, jpegSize, &from_os);
+    const unsigned char* data = *spill ? *spill : buf;
+    if (ok) {
+        store(cache, path, data, *jpegSize);
+        if ((cache->flags & THUMB_CACHE_FREEDESKTOP) && !from_os)
+            StoreOSThumbnail(filePath, width, height, data, *jpegSize);
+    }
+    if (!flight)
+        return ok;
+
+    pthread_mutex_lock(&cache->lock);
+    ThumbFlight** link = &cache->flights;
+    while (*link != flight)
+        link = &(*link)->next;
+    *link = flight->next;
+    flight->done = 1;
+    if (ok && flight->waiters && (flight->data = malloc(*jpegSize))) {
+        memcpy(flight->data, data, *jpegSize);
+        flight->size = *jpegSize;
+    }
+    int waiters = flight->waiters;
+    pthread_cond_broadcast(&cache->flight_done);
+    pthread_mutex_unlock(&cache->lock);
+    if (!waiters)
+        free(flight);
+    return ok;
+}
@@ -0,0 +1,38 @@
+// thumbnail_cache.h
+#ifndef THUMBNAIL_CACHE_H
+#define THUMBNAIL_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Flags of thumbnail_cache_open
+enum {
+    THUMB_CACHE_FREEDESKTOP = 1, // also read and write the freedesktop.org thumbnail cache
+};
+
+// Write-through thumbnail cache, see thumbnail_cache.c. Linux only.
+typedef struct ThumbnailCache ThumbnailCache;
+
+// Opens the cache directory dir (NULL = $XDG_CACHE_HOME/mediafileinfo/thumbnails),
+// creating it if needed. Once its files take more than maxBytes (0 = 256 MiB)
+// the least recently used are removed. Returns NULL on error.
+ThumbnailCache* thumbnail_cache_open(const char* dir, int64_t maxBytes, int flags);
+
+// Returns a JPEG thumbnail of filePath fitting width x height: from the
+// cache, else from the freedesktop.org cache with THUMB_CACHE_FREEDESKTOP,
+// else generated from the image or video and stored for the next call.
+// Concurrent calls for the same file and size generate it once. Returns 1
+// on success, 0 on failure. jpegBuffer is allocated with malloc (use free
+// to release), size: jpegSize.
+int thumbnail_cache_get(ThumbnailCache* cache, const char* filePath, int width, int height,
+                        unsigned char** jpegBuffer, size_t* jpegSize);
+
+// The same, written straight into the caller's buf when it fits in cap:
+// read from the cache file or encoded there. *spill is NULL then, otherwise
+// a malloc'd buffer holding the JPEG. Nothing keeps buf after the call.
+int thumbnail_cache_get_into(ThumbnailCache* cache, const char* filePath, int width, int height,
+                             unsigned char* buf, size_t cap, unsigned char** spill, size_t* jpegSize);
+
+void thumbnail_cache_close(ThumbnailCache* cache);
+
+#endif // THUMBNAIL_CACHE_H
@@ -0,0 +1,103 @@
+//go:build linux
+
+package avwrapper
+
+/*
+#cgo linux pkg-config: glib-2.0 gdk-pixbuf-2.0 libjpeg libpng libwebp
+#include <stdlib.h>
+#include "thumbnail_cache.h"
+*/
+import "C"
+import (
+    "errors"
+    "unsafe"
+)
+
+// ThumbnailCache is the write-through thumbnail cache of thumbnail_cache.c.
+// It is safe for concurrent use; concurrent requests for the same file and
+// size generate the thumbnail once.
+type ThumbnailCache struct {
+    c       *C.ThumbnailCache
+    buffers bufferPool
+}
+
+// OpenThumbnailCache opens the cache directory dir ("" = the default under
+// $XDG_CACHE_HOME) holding at most maxBytes (0 = 256 MiB). With freedesktop
+// the freedesktop.org thumbnail cache is read and written as well.
+func OpenThumbnailCache(dir string, maxBytes int64, freedesktop bool) (*ThumbnailCache, error) {
+    var cDir *C.char
+    if dir != "" {
+        cDir = C.CString(dir)
+        defer C.free(unsafe.Pointer(cDir))
+    }
+    flags := C.int(0)
+    if freedesktop {
+        flags |= C.THUMB_CACHE_FREEDESKTOP
+    }
+    c := C.thumbnail_cache_open(cDir, C.int64_t(maxBytes), flags)
+    if c == nil {
+        return nil, errors.New("avwrapper: could not open thumbnail cache")
+    }
+    return &ThumbnailCache{c: c}, nil
+}
+
+// Close closes the cache. No call may be in progress.
+func (c *ThumbnailCache) Close() {
+    if c.c != nil {
+        C.thumbnail_cache_close(c.c)
+        c.c = nil
+    }
+}
+
+// get runs thumbnail_cache_get_into on buf. It returns a non-nil spill
+// when the thumbnail did not fit.
+func (c *ThumbnailCache) get(filename string, width, height int, buf []byte) (int, *C.uchar, error) {
+    cFilename := C.CString(filename)
+    defer C.free(unsafe.Pointer(cFilename))
+
+    var p *C.uchar
+    if len(buf) > 0 {
+        p = (*C.uchar)(unsafe.Pointer(&buf[0]))
+    }
+    var spill *C.uchar
+    var size C.size_t
+    if C.thumbnail_cache_get_into(c.c, cFilename, C.int(width), C.int(height), p, C.size_t(len(buf)),
+        &spill, &size) == 0 {
+        return 0, nil, ErrThumbnail
+    }
+    return int(size), spill, nil
+}
+
+// Thumbnail returns a JPEG thumbnail of filename fitting width x height,
+// read from the cache or generated and stored. It is written straight into
+// a pooled buffer, or handed over in C memory when it did not fit; either
+// way nothing is copied. Call Release when done with it.
+func (c *ThumbnailCache) Thumbnail(filename string, width, height int) (*Thumbnail, error) {
+    buf := c.buffers.get()
+    size, spill, err := c.get(filename, width, height, *buf)
+    if err != nil || spill != nil {
+        c.buffers.put(buf)
+        if err != nil {
+            return nil, err
+        }
+        c.buffers.grow(size)
+        return cThumbnail((*C.uint8_t)(unsafe.Pointer(spill)), C.size_t(size)), nil
+    }
+    return &Thumbnail{Bytes: (*buf)[:size], pool: &c.buffers, buf: buf}, nil
+}
+
+// AppendThumbnail appends the thumbnail to dst. It is written straight into
+// the spare capacity of dst when it fits; otherwise dst is grown, so reusing
+// the returned slice for the next call avoids further copies.
+func (c *ThumbnailCache) AppendThumbnail(dst []byte, filename string, width, height int) ([]byte, error) {
+    size, spill, err := c.get(filename, width, height, dst[len(dst):cap(dst)])
+    if err != nil {
+        return dst, err
+    }
+    if spill != nil {
+        dst = append(dst, unsafe.Slice((*byte)(unsafe.Pointer(spill)), size)...)
+        C.free(unsafe.Pointer(spill))
+        return dst, nil
+    }
+    return dst[:len(dst)+size], nil
+}
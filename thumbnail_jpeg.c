@@ -0,0 +1,279 @@
+// thumbnail_jpeg.c
+//
+// JPEG encoder for thumbnails on the libjpeg(-turbo) API. The compressor,
+// its output buffer and the scratch rows live in thread-specific storage and
+// are released when the thread exits. The destination manager writes into
+// the reused buffer and doubles it when a picture does not fit, so steady
+// state encoding allocates nothing.
+#include "thumbnail_jpeg.h"
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// jpeglib.h needs stdio.h first
+#include <jpeglib.h>
+#include <jerror.h>
+
+#define THUMB_JPEG_DEFAULT_QUALITY 85
+#define THUMB_JPEG_INITIAL_BUFFER (64 * 1024)
+
+typedef struct {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr err;
+    struct jpeg_destination_mgr dest;
+    jmp_buf jump;
+    uint8_t *buf;         // output, reused across calls
+    size_t cap;
+    uint8_t *out;         // caller's output of the current encode, NULL = buf
+    size_t out_size;
+    size_t size;          // bytes written by the last encode
+    JSAMPROW *rows;       // row pointers of the RGB path
+    int nb_rows;
+    uint8_t *scratch;     // one padded MCU row of Y, Cb and Cr for the YUV path
+    size_t scratch_size;
+} JpegEncoder;
+
+static pthread_key_t encoder_key;
+static pthread_once_t encoder_once = PTHREAD_ONCE_INIT;
+// Limited to full range expansion of luma and chroma samples
+static uint8_t luma_range[256], chroma_range[256];
+
+static uint8_t clip_u8(int v) {
+    return v < 0 ? 0 : v > 255 ? 255 : (uint8_t)v;
+}
+
+static void encoder_free(void *opaque) {
+    JpegEncoder *e = opaque;
+    jpeg_destroy_compress(&e->cinfo);
+    free(e->buf);
+    free(e->rows);
+    free(e->scratch);
+    free(e);
+}
+
+static void encoder_init_once(void) {
+    pthread_key_create(&encoder_key, encoder_free);
+    for (int v = 0; v < 256; v++) {
+        luma_range[v] = clip_u8(((v - 16) * 255 + 109) / 219);
+        chroma_range[v] = clip_u8(128 + ((v - 128) * 255 + (v >= 128 ? 112 : -112)) / 224);
+    }
+}
+
+static void encoder_error_exit(j_common_ptr cinfo) {
+    JpegEncoder *e = cinfo->client_data;
+    char msg[JMSG_LENGTH_MAX];
+    cinfo->err->format_message(cinfo, msg);
+    fprintf(stderr, "Failed to encode JPEG: %s\n", msg);
+    longjmp(e->jump, 1);
+}
+
+static void dest_init(j_compress_ptr cinfo) {
+    JpegEncoder *e = cinfo->client_data;
+    e->dest.next_output_byte = e->out ? e->out : e->buf;
+    e->dest.free_in_buffer = e->out ? e->out_size : e->cap;
+}
+
+// Called with the whole buffer full: double it and continue after the old
+// end. A full caller's buffer moves to the per-thread one.
+static boolean dest_empty(j_compress_ptr cinfo) {
+    JpegEncoder *e = cinfo->client_data;
+    if (e->out) {
+        size_t need = e->out_size * 2;
+        if (e->cap < need) {
+            uint8_t *buf = realloc(e->buf, need);
+            if (!buf)
+                ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+            e->buf = buf;
+            e->cap = need;
+        }
+        memcpy(e->buf, e->out, e->out_size);
+        e->dest.next_output_byte = e->buf + e->out_size;
+        e->dest.free_in_buffer = e->cap - e->out_size;
+        e->out = NULL;
+        return TRUE;
+    }
+    uint8_t *buf = realloc(e->buf, e->cap * 2);
+    if (!buf)
+        ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+    e->buf = buf;
+    e->dest.next_output_byte = buf + e->cap;
+    e->dest.free_in_buffer = e->cap;
+    e->cap *= 2;
+    return TRUE;
+}
+
+static void dest_term(j_compress_ptr cinfo) {
+    JpegEncoder *e = cinfo->client_data;
+    e->size = (e->out ? e->out_size : e->cap) - e->dest.free_in_buffer;
+}
+
+// Picks the output of an encode, the caller's buffer if there is one.
+static void set_output(JpegEncoder *e, const ThumbJpegOptions *opts) {
+    e->out = opts && opts->out && opts->out_size ? opts->out : NULL;
+    e->out_size = e->out ? opts->out_size : 0;
+}
+
+// The encoder of the calling thread, created on first use.
+static JpegEncoder* encoder_get(void) {
+    pthread_once(&encoder_once, encoder_init_once);
+    JpegEncoder *e = pthread_getspecific(encoder_key);
+    if (e)
+        return e;
+    if (!(e = calloc(1, sizeof(*e))))
+        return NULL;
+    if (!(e->buf = malloc(THUMB_JPEG_INITIAL_BUFFER))) {
+        free(e);
+        return NULL;
+    }
+    e->cap = THUMB_JPEG_INITIAL_BUFFER;
+    e->cinfo.err = jpeg_std_error(&e->err);
+    e->err.error_exit = encoder_error_exit;
+    e->cinfo.client_data = e;
+    if (setjmp(e->jump)) {
+        free(e->buf);
+        free(e);
+        return NULL;
+    }
+    jpeg_create_compress(&e->cinfo);
+    e->dest.init_destination = dest_init;
+    e->dest.empty_output_buffer = dest_empty;
+    e->dest.term_destination = dest_term;
+    e->cinfo.dest = &e->dest;
+    pthread_setspecific(encoder_key, e);
+    return e;
+}
+
+static void set_quality(j_compress_ptr cinfo, const ThumbJpegOptions *opts) {
+    int quality = opts && opts->quality > 0 && opts->quality <= 100 ? opts->quality : THUMB_JPEG_DEFAULT_QUALITY;
+    jpeg_set_quality(cinfo, quality, TRUE);
+}
+
+static void set_subsampling(j_compress_ptr cinfo, int subsampling) {
+    cinfo->comp_info[0].h_samp_factor = subsampling == THUMB_JPEG_444 ? 1 : 2;
+    cinfo->comp_info[0].v_samp_factor = subsampling == THUMB_JPEG_420 ? 2 : 1;
+    for (int i = 1; i < 3; i++)
+        cinfo->comp_info[i].h_samp_factor = cinfo->comp_info[i].v_samp_factor = 1;
+}
+
+int thumb_jpeg_encode_rgb(const uint8_t *pixels, int stride, int width, int height, int channels,
+                          const ThumbJpegOptions *opts, const uint8_t **jpeg, size_t *size) {
+    if ((channels != 3 && channels != 4) || width <= 0 || height <= 0)
+        return -1;
+    JpegEncoder *e = encoder_get();
+    if (!e)
+        return -1;
+    if (e->nb_rows < height) {
+        JSAMPROW *rows = realloc(e->rows, height * sizeof(*rows));
+        if (!rows)
+            return -1;
+        e->rows = rows;
+        e->nb_rows = height;
+    }
+    for (int y = 0; y < height; y++)
+        e->rows[y] = (JSAMPROW)(pixels + (size_t)y * stride);
+
+    j_compress_ptr cinfo = &e->cinfo;
+    if (setjmp(e->jump)) {
+        jpeg_abort_compress(cinfo);
+        return -1;
+    }
+    cinfo->image_width = width;
+    cinfo->image_height = height;
+    cinfo->input_components = channels;
+    cinfo->in_color_space = channels == 4 ? JCS_EXT_RGBX : JCS_RGB;
+    jpeg_set_defaults(cinfo);
+    set_quality(cinfo, opts);
+    set_subsampling(cinfo, opts ? opts->subsampling : THUMB_JPEG_420);
+    set_output(e, opts);
+    jpeg_start_compress(cinfo, TRUE);
+    while (cinfo->next_scanline < cinfo->image_height)
+        jpeg_write_scanlines(cinfo, e->rows + cinfo->next_scanline, cinfo->image_height - cinfo->next_scanline);
+    jpeg_finish_compress(cinfo);
+
+    *jpeg = e->out ? e->out : e->buf;
+    *size = e->size;
+    e->out = NULL;
+    return 0;
+}
+
+// Copies n samples to a row padded to padded samples by repeating the last
+// one, mapping them through range if set.
+static void copy_row(uint8_t *dst, const uint8_t *src, int n, int padded, const uint8_t *range) {
+    if (range) {
+        for (int i = 0; i < n; i++)
+            dst[i] = range[src[i]];
+    } else {
+        memcpy(dst, src, n);
+    }
+    memset(dst + n, dst[n - 1], padded - n);
+}
+
+int thumb_jpeg_encode_yuv420(const uint8_t *const planes[3], const int strides[3], int width, int height,
+                             int full_range, const ThumbJpegOptions *opts, const uint8_t **jpeg, size_t *size) {
+    if (width <= 0 || height <= 0)
+        return -1;
+    JpegEncoder *e = encoder_get();
+    if (!e)
+        return -1;
+
+    // libjpeg reads whole MCUs of 16x16 luma and 8x8 chroma samples, so the
+    // rows are copied with the right and bottom edges replicated
+    int padded = (width + 15) & ~15;
+    int cw = (width + 1) / 2, ch = (height + 1) / 2;
+    size_t need = (size_t)padded * 24;
+    if (e->scratch_size < need) {
+        uint8_t *scratch = realloc(e->scratch, need);
+        if (!scratch)
+            return -1;
+        e->scratch = scratch;
+        e->scratch_size = need;
+    }
+    JSAMPROW y_rows[16], cb_rows[8], cr_rows[8];
+    JSAMPARRAY data[3] = {y_rows, cb_rows, cr_rows};
+    for (int i = 0; i < 16; i++)
+        y_rows[i] = e->scratch + (size_t)i * padded;
+    for (int i = 0; i < 8; i++) {
+        cb_rows[i] = e->scratch + (size_t)padded * 16 + (size_t)i * (padded / 2);
+        cr_rows[i] = e->scratch + (size_t)padded * 20 + (size_t)i * (padded / 2);
+    }
+    const uint8_t *luma = full_range ? NULL : luma_range;
+    const uint8_t *chroma = full_range ? NULL : chroma_range;
+
+    j_compress_ptr cinfo = &e->cinfo;
+    if (setjmp(e->jump)) {
+        jpeg_abort_compress(cinfo);
+        return -1;
+    }
+    cinfo->image_width = width;
+    cinfo->image_height = height;
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(cinfo);
+    set_quality(cinfo, opts);
+    set_subsampling(cinfo, THUMB_JPEG_420);
+    cinfo->raw_data_in = TRUE;
+#if JPEG_LIB_VERSION >= 70
+    cinfo->do_fancy_downsampling = FALSE;
+#endif
+    set_output(e, opts);
+    jpeg_start_compress(cinfo, TRUE);
+    for (int y0 = 0; y0 < height; y0 += 16) {
+        for (int i = 0; i < 16; i++) {
+            int y = y0 + i < height ? y0 + i : height - 1;
+            copy_row(y_rows[i], planes[0] + (size_t)y * strides[0], width, padded, luma);
+        }
+        for (int i = 0; i < 8; i++) {
+            int y = y0 / 2 + i < ch ? y0 / 2 + i : ch - 1;
+            copy_row(cb_rows[i], planes[1] + (size_t)y * strides[1], cw, padded / 2, chroma);
+            copy_row(cr_rows[i], planes[2] + (size_t)y * strides[2], cw, padded / 2, chroma);
+        }
+        jpeg_write_raw_data(cinfo, data, 16);
+    }
+    jpeg_finish_compress(cinfo);
+
+    *jpeg = e->out ? e->out : e->buf;
+    *size = e->size;
+    e->out = NULL;
+    return 0;
+}
@@ -0,0 +1,43 @@
+// thumbnail_jpeg.h
+#ifndef THUMBNAIL_JPEG_H
+#define THUMBNAIL_JPEG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Chroma subsampling of ThumbJpegOptions.subsampling.
+enum {
+    THUMB_JPEG_420 = 0, // default, half resolution chroma both ways
+    THUMB_JPEG_422,     // half horizontal chroma resolution
+    THUMB_JPEG_444,     // full chroma resolution
+};
+
+// A zeroed struct encodes at quality 85 with 4:2:0 chroma.
+typedef struct {
+    int quality;      // 1-100, 0 = 85
+    int subsampling;  // THUMB_JPEG_*; YUV input is always 4:2:0
+    uint8_t *out;     // caller's buffer to encode into, NULL = the per-thread buffer
+    size_t out_size;
+} ThumbJpegOptions;
+
+// Thumbnail JPEG encoder on libjpeg-turbo. Each thread keeps one compressor
+// and one output buffer that are reused by every call, so encoding does not
+// allocate once the buffer has grown to the usual thumbnail size. *jpeg
+// points into that buffer and stays valid until the next encode on the same
+// thread; copy it to keep it. With opts->out the JPEG is written straight
+// into the caller's buffer and *jpeg == opts->out, unless it does not fit,
+// then it continues in the per-thread buffer. Functions return 0 on
+// success, -1 on error.
+
+// Encodes packed RGB (channels 3) or RGBX/RGBA with the 4th byte ignored
+// (channels 4).
+int thumb_jpeg_encode_rgb(const uint8_t *pixels, int stride, int width, int height, int channels,
+                          const ThumbJpegOptions *opts, const uint8_t **jpeg, size_t *size);
+
+// Encodes planar YUV 4:2:0 as is, without a round trip through RGB, e.g.
+// the data and linesize of a yuv420p or yuvj420p AVFrame. Limited range
+// (yuv420p) samples are expanded to the full range JPEG uses.
+int thumb_jpeg_encode_yuv420(const uint8_t *const planes[3], const int strides[3], int width, int height,
+                             int full_range, const ThumbJpegOptions *opts, const uint8_t **jpeg, size_t *size);
+
+#endif // THUMBNAIL_JPEG_H
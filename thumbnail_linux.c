@@ -1,38 +1,338 @@
 #include <gdk-pixbuf/gdk-pixbuf.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+// jpeglib.h needs stdio.h first
+#include <jpeglib.h>
+#include <png.h>
+#include <webp/decode.h>
+#include "exif_thumbnail.h"
+#include "thumbnail_linux.h"
+#include "thumbnail_jpeg.h"
+#include "thumbnail_scale.h"
+
+// Read size of the WebP incremental decoder
+#define WEBP_CHUNK_SIZE (64 * 1024)
+
+// Decoded thumbnail pixels, RGB, owned by the caller (free)
+typedef struct {
+    uint8_t* data;
+    int width;
+    int height;
+} ThumbImage;
+
+static void free_pixels(guchar* pixels, gpointer data) {
+    (void)data;
+    free(pixels);
+}
+
+static GdkPixbuf* pixbuf_from_image(ThumbImage* image) {
+    return gdk_pixbuf_new_from_data(image->data, GDK_COLORSPACE_RGB, FALSE, 8, image->width, image->height,
+                                    image->width * 3, free_pixels, NULL);
+}
+
+typedef struct {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+} JpegError;
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+    JpegError* err = (JpegError*)cinfo->err;
+    char msg[JMSG_LENGTH_MAX];
+    cinfo->err->format_message(cinfo, msg);
+    fprintf(stderr, "Failed to decode JPEG: %s\n", msg);
+    longjmp(err->jump, 1);
+}
 
 /**
- * Returns 1 on success, 0 on failure.
- * jpegBuffer: will be allocated (use g_free to release), size: jpegSize
+ * JPEG is decoded in the DCT domain at 1/2, 1/4 or 1/8 scale, the smallest
+ * that still covers the thumbnail, and the rest is area scaled row by row.
+ * Reads from f, or from data when f is NULL. Returns 1 on success, 0 on
+ * failure, -1 for CMYK images, which go through the generic loader.
  */
-int GetImageThumbnailJPEGBuffer(const char* filePath, int thumbWidth, int thumbHeight, unsigned char** jpegBuffer, gsize* jpegSize) {
-    *jpegBuffer = NULL;
-    *jpegSize = 0;
+static int load_jpeg_scaled(FILE* f, const unsigned char* data, size_t size, int boxWidth, int boxHeight, ThumbImage* out) {
+    struct jpeg_decompress_struct cinfo;
+    JpegError jerr;
+    ThumbScaler scaler = {0};
+    JSAMPROW row = NULL; // address taken by jpeg_read_scanlines, so it survives the longjmp
+
+    cinfo.err = jpeg_std_error(&jerr.mgr);
+    jerr.mgr.error_exit = jpeg_error_exit;
+    if (setjmp(jerr.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        thumb_scaler_free(&scaler);
+        free(row);
+        return 0;
+    }
+    jpeg_create_decompress(&cinfo);
+    if (f)
+        jpeg_stdio_src(&cinfo, f);
+    else
+        jpeg_mem_src(&cinfo, data, size);
+    jpeg_read_header(&cinfo, TRUE);
+    if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK) {
+        // libjpeg does not convert these to RGB, gdk-pixbuf does
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+
+    int tw, th;
+    thumbnail_fit(cinfo.image_width, cinfo.image_height, boxWidth, boxHeight, &tw, &th);
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 8;
+    while (cinfo.scale_denom > 1 && ((int)cinfo.image_width / (int)cinfo.scale_denom < tw ||
+                                     (int)cinfo.image_height / (int)cinfo.scale_denom < th))
+        cinfo.scale_denom /= 2;
+    // The area scaler averages anyway, so the cheap variants are good enough
+    cinfo.dct_method = JDCT_IFAST;
+    cinfo.do_fancy_upsampling = FALSE;
+    jpeg_start_decompress(&cinfo);
+
+    if (thumb_scaler_init(&scaler, cinfo.output_width, cinfo.output_height, tw, th, 3) < 0 ||
+        !(row = malloc((size_t)cinfo.output_width * cinfo.output_components))) {
+        jpeg_destroy_decompress(&cinfo);
+        thumb_scaler_free(&scaler);
+        free(row);
+        return 0;
+    }
+    while (cinfo.output_scanline < cinfo.output_height) {
+        jpeg_read_scanlines(&cinfo, &row, 1);
+        thumb_scaler_push_row(&scaler, row);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    free(row);
+
+    out->data = thumb_scaler_take(&scaler);
+    out->width = tw;
+    out->height = th;
+    thumb_scaler_free(&scaler);
+    return 1;
+}
+
+/**
+ * Non-interlaced PNG is read one row at a time into the area scaler, with
+ * palette, gray and 16-bit images expanded to 8-bit RGB and transparency
+ * composed on white. Returns 1 on success, 0 on failure, -1 if the image is
+ * interlaced and has to go through the generic loader.
+ */
+static int load_png_scaled(FILE* f, int boxWidth, int boxHeight, ThumbImage* out) {
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png) return 0;
+    png_infop info = png_create_info_struct(png);
+    ThumbScaler scaler = {0};
+    png_bytep volatile row = NULL;
+    int ret = 0;
+
+    if (!info || setjmp(png_jmpbuf(png))) {
+        fprintf(stderr, "Failed to decode PNG\n");
+        goto end;
+    }
+    png_init_io(png, f);
+    png_read_info(png, info);
+    if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE) {
+        ret = -1;
+        goto end;
+    }
+    int width = png_get_image_width(png, info);
+    int height = png_get_image_height(png, info);
+
+    png_color_16 white = {0, 255, 255, 255, 255};
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_gray_to_rgb(png);
+    png_set_background(png, &white, PNG_BACKGROUND_GAMMA_SCREEN, 0, 1.0);
+    png_read_update_info(png, info);
+    if (png_get_channels(png, info) != 3)
+        goto end;
+
+    int tw, th;
+    thumbnail_fit(width, height, boxWidth, boxHeight, &tw, &th);
+    if (thumb_scaler_init(&scaler, width, height, tw, th, 3) < 0 ||
+        !(row = malloc(png_get_rowbytes(png, info))))
+        goto end;
+    for (int y = 0; y < height; y++) {
+        png_read_row(png, row, NULL);
+        thumb_scaler_push_row(&scaler, row);
+    }
+    out->data = thumb_scaler_take(&scaler);
+    out->width = tw;
+    out->height = th;
+    ret = 1;
+
+end:
+    png_destroy_read_struct(&png, info ? &info : NULL, NULL);
+    thumb_scaler_free(&scaler);
+    free(row);
+    return ret;
+}
 
-    // Load image from file
+/**
+ * WebP is fed to the incremental decoder in chunks and scaled by libwebp
+ * while decoding, so neither the file nor the full image is held in memory.
+ * Returns 1 on success, 0 on failure, -1 for animations, which go through
+ * the generic loader.
+ */
+static int load_webp_scaled(FILE* f, int boxWidth, int boxHeight, ThumbImage* out) {
+    uint8_t* chunk = malloc(WEBP_CHUNK_SIZE);
+    WebPDecoderConfig config;
+    WebPIDecoder* idec = NULL;
+    int ret = 0;
+
+    if (!chunk || !WebPInitDecoderConfig(&config)) {
+        free(chunk);
+        return 0;
+    }
+    size_t n = fread(chunk, 1, WEBP_CHUNK_SIZE, f);
+    if (WebPGetFeatures(chunk, n, &config.input) != VP8_STATUS_OK)
+        goto end;
+    if (config.input.has_animation) {
+        ret = -1;
+        goto end;
+    }
+
+    int tw, th;
+    thumbnail_fit(config.input.width, config.input.height, boxWidth, boxHeight, &tw, &th);
+    config.options.use_scaling = 1;
+    config.options.scaled_width = tw;
+    config.options.scaled_height = th;
+    config.options.no_fancy_upsampling = 1;
+    config.output.colorspace = MODE_RGB;
+    if (!(idec = WebPIDecode(NULL, 0, &config)))
+        goto end;
+
+    VP8StatusCode status = VP8_STATUS_SUSPENDED;
+    while (n > 0 && (status = WebPIAppend(idec, chunk, n)) == VP8_STATUS_SUSPENDED)
+        n = fread(chunk, 1, WEBP_CHUNK_SIZE, f);
+    if (status != VP8_STATUS_OK) {
+        fprintf(stderr, "Failed to decode WebP: status %d\n", status);
+        goto end;
+    }
+
+    size_t stride = (size_t)tw * 3;
+    if (!(out->data = malloc(stride * th)))
+        goto end;
+    for (int y = 0; y < th; y++)
+        memcpy(out->data + y * stride, config.output.u.RGBA.rgba + y * config.output.u.RGBA.stride, stride);
+    out->width = tw;
+    out->height = th;
+    ret = 1;
+
+end:
+    if (idec) WebPIDelete(idec);
+    WebPFreeDecBuffer(&config.output);
+    free(chunk);
+    return ret;
+}
+
+/**
+ * Loads filePath scaled to fit boxWidth x boxHeight, decoding at reduced
+ * size where the format allows it. Formats without a streaming path go
+ * through gdk-pixbuf, whose loaders scale at decode time when they can.
+ */
+static GdkPixbuf* load_scaled(const char* filePath, int boxWidth, int boxHeight) {
+    FILE* f = fopen(filePath, "rb");
+    if (!f) {
+        fprintf(stderr, "Failed to open image: %s\n", filePath);
+        return NULL;
+    }
+    unsigned char magic[12] = {0};
+    size_t n = fread(magic, 1, sizeof(magic), f);
+    rewind(f);
+
+    ThumbImage image = {0};
+    int ret = -1;
+    if (n >= 3 && magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF)
+        ret = load_jpeg_scaled(f, NULL, 0, boxWidth, boxHeight, &image);
+    else if (n >= 8 && !png_sig_cmp(magic, 0, 8))
+        ret = load_png_scaled(f, boxWidth, boxHeight, &image);
+    else if (n >= 12 && !memcmp(magic, "RIFF", 4) && !memcmp(magic + 8, "WEBP", 4))
+        ret = load_webp_scaled(f, boxWidth, boxHeight, &image);
+    fclose(f);
+
+    if (ret > 0)
+        return pixbuf_from_image(&image);
+    if (ret == 0)
+        return NULL;
+
+    int width, height, tw, th;
+    if (!gdk_pixbuf_get_file_info(filePath, &width, &height)) {
+        fprintf(stderr, "Failed to load image: unknown format\n");
+        return NULL;
+    }
+    thumbnail_fit(width, height, boxWidth, boxHeight, &tw, &th);
     GError* error = NULL;
-    GdkPixbuf* pixbuf = gdk_pixbuf_new_from_file(filePath, &error);
+    GdkPixbuf* pixbuf = gdk_pixbuf_new_from_file_at_size(filePath, tw, th, &error);
     if (!pixbuf) {
         fprintf(stderr, "Failed to load image: %s\n", error ? error->message : "Unknown error");
         if (error) g_error_free(error);
-        return 0;
     }
+    return pixbuf;
+}
+
+/**
+ * Returns 1 on success, 0 on failure.
+ * The image is scaled to fit thumbWidth x thumbHeight keeping its aspect
+ * ratio, and is never enlarged. Peak memory is proportional to the
+ * thumbnail, not to the source image.
+ * The JPEG is encoded straight into buf when it fits in cap and *spill is
+ * NULL; otherwise *spill is allocated with malloc (use free to release).
+ * Its size is jpegSize either way.
+ */
+int GetImageThumbnailJPEGInto(const char* filePath, int thumbWidth, int thumbHeight, unsigned char* buf, size_t cap,
+                              unsigned char** spill, size_t* jpegSize) {
+    *spill = NULL;
+    *jpegSize = 0;
 
-    // Scale the image to thumbnail size
-    GdkPixbuf* scaled = gdk_pixbuf_scale_simple(pixbuf, thumbWidth, thumbHeight, GDK_INTERP_BILINEAR);
-    g_object_unref(pixbuf);
+    // Camera JPEGs and RAW files usually embed a preview large enough, which
+    // is handed over as stored if it has the requested size, and otherwise
+    // decoded instead of the full image
+    GdkPixbuf* scaled = NULL;
+    EmbeddedThumbnail embedded;
+    if (GetEmbeddedThumbnail(filePath, thumbWidth, thumbHeight, &embedded)) {
+        int tw, th;
+        thumbnail_fit(embedded.width, embedded.height, thumbWidth, thumbHeight, &tw, &th);
+        if (tw == embedded.width && th == embedded.height) {
+            *spill = embedded.data;
+            *jpegSize = embedded.size;
+            return 1;
+        }
+        ThumbImage image = {0};
+        if (load_jpeg_scaled(NULL, embedded.data, embedded.size, thumbWidth, thumbHeight, &image) > 0)
+            scaled = pixbuf_from_image(&image);
+        free(embedded.data);
+    }
+
+    // Load image from file, scaled while decoding
+    if (!scaled) scaled = load_scaled(filePath, thumbWidth, thumbHeight);
     if (!scaled) return 0;
 
-    // Save to JPEG buffer
-    error = NULL;
-    gboolean ok = gdk_pixbuf_save_to_buffer(scaled, (char**)jpegBuffer, jpegSize, "jpeg", &error, "quality", "85", NULL);
+    // Encode the pixels directly, the encoder keeps its state per thread
+    ThumbJpegOptions opts = {.quality = 85, .out = buf, .out_size = cap};
+    const uint8_t* jpeg;
+    size_t size;
+    int ok = thumb_jpeg_encode_rgb(gdk_pixbuf_read_pixels(scaled), gdk_pixbuf_get_rowstride(scaled),
+                                   gdk_pixbuf_get_width(scaled), gdk_pixbuf_get_height(scaled),
+                                   gdk_pixbuf_get_n_channels(scaled), &opts, &jpeg, &size) == 0;
     g_object_unref(scaled);
-
     if (!ok) {
-        fprintf(stderr, "Failed to save thumbnail: %s\n", error ? error->message : "Unknown error");
-        if (error) g_error_free(error);
+        fprintf(stderr, "Failed to save thumbnail of %s\n", filePath);
         return 0;
     }
+    if (jpeg != buf) {
+        if (!(*spill = malloc(size)))
+            return 0;
+        memcpy(*spill, jpeg, size);
+    }
+    *jpegSize = size;
     return 1;
 }
+
+int GetImageThumbnailJPEGBuffer(const char* filePath, int thumbWidth, int thumbHeight, unsigned char** jpegBuffer, gsize* jpegSize) {
+    size_t size;
+    int ok = GetImageThumbnailJPEGInto(filePath, thumbWidth, thumbHeight, NULL, 0, jpegBuffer, &size);
+    *jpegSize = size;
+    return ok;
+}
@@ -0,0 +1,17 @@
+// thumbnail_linux.h
+#ifndef THUMBNAIL_LINUX_H
+#define THUMBNAIL_LINUX_H
+
+#include <glib.h>
+
+// Generates a JPEG thumbnail of an image fitting thumbWidth x thumbHeight,
+// from an embedded preview where there is one. Returns 1 on success, 0 on
+// failure. jpegBuffer is allocated with malloc (use free to release).
+int GetImageThumbnailJPEGBuffer(const char* filePath, int thumbWidth, int thumbHeight, unsigned char** jpegBuffer, gsize* jpegSize);
+
+// The same, encoded straight into the caller's buf when it fits in cap.
+// *spill is NULL then, otherwise a malloc'd buffer holding the JPEG.
+int GetImageThumbnailJPEGInto(const char* filePath, int thumbWidth, int thumbHeight, unsigned char* buf, size_t cap,
+                              unsigned char** spill, size_t* jpegSize);
+
+#endif // THUMBNAIL_LINUX_H
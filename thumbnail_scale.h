@@ -0,0 +1,50 @@
+// thumbnail_scale.h
+#ifndef THUMBNAIL_SCALE_H
+#define THUMBNAIL_SCALE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming area (box) downscaler. Source rows are pushed one at a time as
+// a decoder produces them and every source pixel is weighted by how much of
+// each output pixel it covers, so the result matches a full-image area
+// resize without aliasing at any ratio. Memory is the output image plus two
+// accumulator rows of source width. Rows are accumulated vertically with
+// SSE2 or AVX2 where the CPU has it, picked at run time.
+typedef struct {
+    int src_w, src_h;
+    int dst_w, dst_h;
+    int channels;        // interleaved 8-bit channels, 1 to 4
+    int src_y;           // rows pushed so far
+    int dst_y;           // output row being accumulated
+    int *x_index;        // first output column covered by each source column
+    int *x_weight;       // its share of the source column, out of dst_w
+    uint32_t *acc[2];    // source rows summed into output rows dst_y and dst_y + 1
+    uint64_t *sum;       // output row dst_y while it is reduced horizontally
+    uint8_t *dst;        // dst_h rows of dst_w * channels bytes, owned by the scaler
+    void (*accumulate)(uint32_t *acc0, uint32_t *acc1, const uint8_t *row, size_t n, uint32_t w0, uint32_t w1);
+} ThumbScaler;
+
+// Prepares a scaler from src_w x src_h to dst_w x dst_h, which must not be
+// larger. Returns 0 on success, -1 on invalid sizes or allocation failure.
+int thumb_scaler_init(ThumbScaler *s, int src_w, int src_h, int dst_w, int dst_h, int channels);
+
+// Adds the next source row of src_w * channels bytes. Rows past src_h are ignored.
+void thumb_scaler_push_row(ThumbScaler *s, const uint8_t *row);
+
+// Takes the output image once all rows were pushed; free it with free().
+uint8_t* thumb_scaler_take(ThumbScaler *s);
+
+void thumb_scaler_free(ThumbScaler *s);
+
+// Area downscale of a whole image, e.g. one plane of an AVFrame
+// (data[i], linesize[i]) with channels 1, or packed RGB/RGBA with 3 or 4.
+// Returns 0 on success, -1 on error.
+int thumb_scale_image(const uint8_t *src, int src_stride, int src_w, int src_h,
+                      uint8_t *dst, int dst_stride, int dst_w, int dst_h, int channels);
+
+// Fits w x h into box_w x box_h keeping the aspect ratio, without enlarging.
+// A box side <= 0 is unconstrained.
+void thumbnail_fit(int w, int h, int box_w, int box_h, int *tw, int *th);
+
+#endif // THUMBNAIL_SCALE_H
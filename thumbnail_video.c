@@ -0,0 +1,545 @@
+// thumbnail_video.c
+//
+// Video thumbnails without running the converter: seek to the keyframe at
+// or before the target, decode that one frame with every non-keyframe
+// discarded, at reduced resolution where the decoder supports lowres, scale
+// it with swscale and encode its YUV planes with libjpeg-turbo in memory.
+// Storyboards read the keyframes in one forward pass instead of seeking.
+#include "thumbnail_video.h"
+#include "thumbnail_jpeg.h"
+#include "thumbnail_scale.h"
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/bprint.h>
+#include <libavutil/frame.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THUMB_DEFAULT_SIZE 256
+#define THUMB_DEFAULT_QUALITY 85
+// Packets read after the seek before giving up on finding a decodable keyframe
+#define THUMB_MAX_PACKETS 4096
+#define STORYBOARD_DEFAULT_COUNT 100
+#define STORYBOARD_DEFAULT_COLUMNS 10
+#define STORYBOARD_DEFAULT_TILE_WIDTH 160
+#define STORYBOARD_MAX_TILES 10000
+// Largest width and height of a JPEG
+#define STORYBOARD_MAX_SIZE 65500
+
+// Seek target in AV_TIME_BASE units from the start of the file.
+static int64_t thumbnail_target(const AVFormatContext *fmt_ctx, const VideoThumbnailOptions *opts) {
+    int64_t target = opts->timestamp_us;
+    if (opts->percent > 0 && fmt_ctx->duration > 0)
+        target = (int64_t)(fmt_ctx->duration * (opts->percent < 100 ? opts->percent : 100) / 100);
+    if (fmt_ctx->duration > 0 && target >= fmt_ctx->duration)
+        target = fmt_ctx->duration - 1;
+    return target > 0 ? target : 0;
+}
+
+// Fits the displayed frame size (w x h stretched by sar) into the box of
+// opts, keeping the aspect ratio. The frame is never enlarged.
+static void thumbnail_size(int w, int h, AVRational sar, const VideoThumbnailOptions *opts, int *tw, int *th) {
+    double dw = w;
+    if (sar.num > 0 && sar.den > 0)
+        dw = dw * sar.num / sar.den;
+    int box_w = opts->width, box_h = opts->height;
+    if (box_w <= 0 && box_h <= 0)
+        box_w = box_h = THUMB_DEFAULT_SIZE;
+    thumbnail_fit((int)(dw + 0.5), h, box_w, box_h, tw, th);
+}
+
+// Opens filePath and returns the index of its video stream, or -1 with
+// nothing left open. The other streams are discarded and the video stream
+// keeps only keyframes, which demuxers such as mov skip without reading.
+static int open_video_input(const char *filePath, int need_duration, AVFormatContext **fmt_ctx) {
+    if (avformat_open_input(fmt_ctx, filePath, NULL, NULL) < 0) {
+        fprintf(stderr, "Could not open input file '%s'\n", filePath);
+        return -1;
+    }
+    AVFormatContext *ctx = *fmt_ctx;
+    int index = av_find_best_stream(ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    // The header of MP4 or MKV has everything needed, MPEG-TS or a missing
+    // duration that is needed take the stream info pass
+    if (index < 0 || ctx->streams[index]->codecpar->width <= 0 || (need_duration && ctx->duration <= 0)) {
+        if (avformat_find_stream_info(ctx, NULL) >= 0)
+            index = av_find_best_stream(ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        else
+            index = -1;
+    }
+    if (index < 0) {
+        fprintf(stderr, "No video stream in '%s'\n", filePath);
+        avformat_close_input(fmt_ctx);
+        return -1;
+    }
+    for (unsigned int i = 0; i < ctx->nb_streams; i++)
+        ctx->streams[i]->discard = AVDISCARD_ALL;
+    ctx->streams[index]->discard = AVDISCARD_NONKEY;
+    return index;
+}
+
+// Opens a decoder that only outputs keyframes, decoded at the largest
+// lowres factor that still leaves at least tw x th pixels.
+static AVCodecContext* open_thumbnail_decoder(const AVStream *st, int tw, int th) {
+    const AVCodec *codec = avcodec_find_decoder(st->codecpar->codec_id);
+    if (!codec)
+        return NULL;
+    AVCodecContext *ctx = avcodec_alloc_context3(codec);
+    if (!ctx)
+        return NULL;
+    if (avcodec_parameters_to_context(ctx, st->codecpar) < 0) {
+        avcodec_free_context(&ctx);
+        return NULL;
+    }
+    ctx->pkt_timebase = st->time_base;
+    ctx->skip_frame = AVDISCARD_NONKEY;
+    // Deblocking artifacts do not survive the downscale
+    ctx->skip_loop_filter = AVDISCARD_ALL;
+    ctx->flags2 |= AV_CODEC_FLAG2_FAST;
+    // Frame threads hold frames back until each has one in flight, slices don't
+    ctx->thread_type = FF_THREAD_SLICE;
+    ctx->thread_count = 0;
+    int lowres = 0;
+    while (lowres < codec->max_lowres && (ctx->width >> (lowres + 1)) >= tw && (ctx->height >> (lowres + 1)) >= th)
+        lowres++;
+    ctx->lowres = lowres;
+
+    if (avcodec_open2(ctx, codec, NULL) < 0)
+        avcodec_free_context(&ctx);
+    return ctx;
+}
+
+// Decodes the keyframe pkt on its own. The drain makes a decoder with
+// reorder delay return it at once instead of waiting for the frames after
+// it, the flush readies the decoder for the next packet.
+static int decode_packet(AVCodecContext *dec, const AVPacket *pkt, AVFrame *frame) {
+    int ret;
+    if ((ret = avcodec_send_packet(dec, pkt)) >= 0 && (ret = avcodec_send_packet(dec, NULL)) >= 0)
+        ret = avcodec_receive_frame(dec, frame);
+    avcodec_flush_buffers(dec);
+    return ret;
+}
+
+// Decodes the first keyframe of stream index read from the current position.
+static int decode_keyframe(AVFormatContext *fmt_ctx, int index, AVCodecContext *dec, AVFrame *frame) {
+    AVPacket *pkt = av_packet_alloc();
+    if (!pkt)
+        return AVERROR(ENOMEM);
+
+    int ret = AVERROR_EOF;
+    for (int n = 0; n < THUMB_MAX_PACKETS; n++) {
+        if ((ret = av_read_frame(fmt_ctx, pkt)) < 0)
+            break;
+        if (pkt->stream_index != index || !(pkt->flags & AV_PKT_FLAG_KEY)) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        ret = decode_packet(dec, pkt, frame);
+        av_packet_unref(pkt);
+        // A broken or incomplete keyframe is skipped for the next one
+        if (ret >= 0)
+            break;
+    }
+    av_packet_free(&pkt);
+    return ret;
+}
+
+// Scales frame to tw x th full range YUV 4:2:0, the input of the JPEG encoder.
+static AVFrame* scale_thumbnail(const AVFrame *frame, int tw, int th) {
+    struct SwsContext *sws = sws_getContext(frame->width, frame->height, frame->format, tw, th,
+                                            AV_PIX_FMT_YUVJ420P, SWS_BILINEAR, NULL, NULL, NULL);
+    if (!sws)
+        return NULL;
+    AVFrame *out = av_frame_alloc();
+    if (out) {
+        out->width = tw;
+        out->height = th;
+        out->format = AV_PIX_FMT_YUVJ420P;
+        if (av_frame_get_buffer(out, 0) < 0 ||
+            sws_scale(sws, (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height,
+                      out->data, out->linesize) != th)
+            av_frame_free(&out);
+    }
+    sws_freeContext(sws);
+    return out;
+}
+
+// Encodes frame as a baseline JPEG straight from its YUV planes, with the
+// per-thread encoder of thumbnail_jpeg.c, into buf when it fits in cap and
+// otherwise into a malloc'd *spill.
+static int encode_jpeg(const AVFrame *frame, int quality, unsigned char *buf, size_t cap,
+                       unsigned char **spill, size_t *size) {
+    ThumbJpegOptions jpeg_opts = {.quality = quality, .out = buf, .out_size = cap};
+    int strides[3] = {frame->linesize[0], frame->linesize[1], frame->linesize[2]};
+    const uint8_t *jpeg;
+    size_t len;
+    *spill = NULL;
+    if (thumb_jpeg_encode_yuv420((const uint8_t * const *)frame->data, strides, frame->width, frame->height,
+                                 1, &jpeg_opts, &jpeg, &len) < 0)
+        return AVERROR_EXTERNAL;
+    if (jpeg != buf) {
+        if (!(*spill = malloc(len)))
+            return AVERROR(ENOMEM);
+        memcpy(*spill, jpeg, len);
+    }
+    *size = len;
+    return 0;
+}
+
+int GetVideoThumbnailJPEGBuffer(const char* filePath, const VideoThumbnailOptions* opts,
+                                unsigned char** jpegBuffer, size_t* jpegSize) {
+    return GetVideoThumbnailJPEGInto(filePath, opts, NULL, 0, jpegBuffer, jpegSize);
+}
+
+int GetVideoThumbnailJPEGInto(const char* filePath, const VideoThumbnailOptions* opts, unsigned char* buf, size_t cap,
+                              unsigned char** spill, size_t* jpegSize) {
+    static const VideoThumbnailOptions default_opts;
+    AVFormatContext *fmt_ctx = NULL;
+    AVCodecContext *dec = NULL;
+    AVFrame *frame = NULL, *thumb = NULL;
+    int ok = 0;
+
+    *spill = NULL;
+    *jpegSize = 0;
+    if (!opts)
+        opts = &default_opts;
+
+    int index = open_video_input(filePath, opts->percent > 0, &fmt_ctx);
+    if (index < 0)
+        return 0;
+    AVStream *st = fmt_ctx->streams[index];
+
+    int tw, th;
+    thumbnail_size(st->codecpar->width, st->codecpar->height, av_guess_sample_aspect_ratio(fmt_ctx, st, NULL),
+                   opts, &tw, &th);
+    if (!(dec = open_thumbnail_decoder(st, tw, th)) || !(frame = av_frame_alloc()))
+        goto end;
+
+    // Without an index or on a non-seekable input this fails, and the first keyframe is used
+    int64_t target = thumbnail_target(fmt_ctx, opts);
+    if (target > 0) {
+        if (fmt_ctx->start_time != AV_NOPTS_VALUE)
+            target += fmt_ctx->start_time;
+        avformat_seek_file(fmt_ctx, -1, INT64_MIN, target, target, 0);
+    }
+    if (decode_keyframe(fmt_ctx, index, dec, frame) < 0) {
+        fprintf(stderr, "Could not decode a keyframe of '%s'\n", filePath);
+        goto end;
+    }
+    if (!(thumb = scale_thumbnail(frame, tw, th)))
+        goto end;
+    int quality = opts->quality > 0 && opts->quality <= 100 ? opts->quality : THUMB_DEFAULT_QUALITY;
+    ok = encode_jpeg(thumb, quality, buf, cap, spill, jpegSize) >= 0;
+
+end:
+    av_frame_free(&thumb);
+    av_frame_free(&frame);
+    avcodec_free_context(&dec);
+    avformat_close_input(&fmt_ctx);
+    return ok;
+}
+
+// Time span of tile i: count equal parts of the duration, or interval long.
+static void tile_span(int i, int count, int64_t duration, int64_t interval, int64_t *start, int64_t *end) {
+    if (interval > 0) {
+        *start = i * interval;
+        *end = *start + interval;
+        if (duration > 0 && *end > duration)
+            *end = duration;
+    } else {
+        *start = av_rescale(duration, i, count);
+        *end = av_rescale(duration, i + 1, count);
+    }
+}
+
+// Top left of tile index in plane of the YUV 4:2:0 atlas.
+static uint8_t* tile_plane(const AVFrame *atlas, int plane, int index, int columns, int tw, int th) {
+    int shift = plane > 0;
+    int x = (index % columns) * tw >> shift, y = (index / columns) * th >> shift;
+    return atlas->data[plane] + (ptrdiff_t)y * atlas->linesize[plane] + x;
+}
+
+// Scales frame straight into tile index of the atlas.
+static int draw_tile(struct SwsContext **sws, const AVFrame *frame, AVFrame *atlas, int index, int columns, int tw, int th) {
+    *sws = sws_getCachedContext(*sws, frame->width, frame->height, frame->format, tw, th,
+                                AV_PIX_FMT_YUVJ420P, SWS_BILINEAR, NULL, NULL, NULL);
+    if (!*sws)
+        return AVERROR(EINVAL);
+    uint8_t *dst[4] = {tile_plane(atlas, 0, index, columns, tw, th), tile_plane(atlas, 1, index, columns, tw, th),
+                       tile_plane(atlas, 2, index, columns, tw, th), NULL};
+    if (sws_scale(*sws, (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height,
+                  dst, atlas->linesize) != th)
+        return AVERROR(EINVAL);
+    return 0;
+}
+
+// Repeats tile from at tile to, for sample points sharing a keyframe.
+static void copy_tile(AVFrame *atlas, int from, int to, int columns, int tw, int th) {
+    for (int plane = 0; plane < 3; plane++) {
+        int shift = plane > 0;
+        const uint8_t *src = tile_plane(atlas, plane, from, columns, tw, th);
+        uint8_t *dst = tile_plane(atlas, plane, to, columns, tw, th);
+        for (int y = 0; y < th >> shift; y++)
+            memcpy(dst + (ptrdiff_t)y * atlas->linesize[plane], src + (ptrdiff_t)y * atlas->linesize[plane], tw >> shift);
+    }
+}
+
+// Returns the printed text in a malloc'd string, NULL when out of memory.
+static char* bprint_finish(AVBPrint *bp) {
+    char *str = NULL, *out = NULL;
+    int complete = av_bprint_is_complete(bp);
+    if (av_bprint_finalize(bp, &str) >= 0 && complete)
+        out = strdup(str);
+    av_free(str);
+    return out;
+}
+
+static void bprint_vtt_time(AVBPrint *bp, int64_t us) {
+    int64_t ms = us / 1000;
+    av_bprintf(bp, "%02d:%02d:%02d.%03d", (int)(ms / 3600000), (int)(ms / 60000 % 60), (int)(ms / 1000 % 60),
+               (int)(ms % 1000));
+}
+
+static void bprint_json_string(AVBPrint *bp, const char *str) {
+    av_bprint_chars(bp, '"', 1);
+    for (; *str; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\')
+            av_bprintf(bp, "\\%c", c);
+        else if (c < 0x20)
+            av_bprintf(bp, "\\u%04x", c);
+        else
+            av_bprint_chars(bp, c, 1);
+    }
+    av_bprint_chars(bp, '"', 1);
+}
+
+static char* storyboard_vtt(const Storyboard *sb, const char *imageUrl) {
+    AVBPrint bp;
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprintf(&bp, "WEBVTT\n");
+    for (int i = 0; i < sb->count; i++) {
+        const StoryboardTile *t = &sb->tiles[i];
+        av_bprintf(&bp, "\n");
+        bprint_vtt_time(&bp, t->start_us);
+        av_bprintf(&bp, " --> ");
+        bprint_vtt_time(&bp, t->end_us);
+        av_bprintf(&bp, "\n%s#xywh=%d,%d,%d,%d\n", imageUrl, t->x, t->y, sb->tile_width, sb->tile_height);
+    }
+    return bprint_finish(&bp);
+}
+
+static char* storyboard_json(const Storyboard *sb, const char *imageUrl) {
+    AVBPrint bp;
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprintf(&bp, "{\"image\":");
+    bprint_json_string(&bp, imageUrl);
+    av_bprintf(&bp, ",\"width\":%d,\"height\":%d,\"tile_width\":%d,\"tile_height\":%d,\"columns\":%d,\"tiles\":[",
+               sb->width, sb->height, sb->tile_width, sb->tile_height, sb->columns);
+    for (int i = 0; i < sb->count; i++) {
+        const StoryboardTile *t = &sb->tiles[i];
+        av_bprintf(&bp, "%s{\"start\":%.3f,\"end\":%.3f,\"x\":%d,\"y\":%d}", i ? "," : "",
+                   t->start_us / 1e6, t->end_us / 1e6, t->x, t->y);
+    }
+    av_bprintf(&bp, "]}");
+    return bprint_finish(&bp);
+}
+
+int GetVideoStoryboard(const char* filePath, const char* imageUrl, const StoryboardOptions* opts, Storyboard* sb) {
+    static const StoryboardOptions default_opts;
+    AVFormatContext *fmt_ctx = NULL;
+    AVCodecContext *dec = NULL;
+    AVFrame *frame = NULL, *atlas = NULL;
+    AVPacket *pkt = NULL, *prev = NULL;
+    struct SwsContext *sws = NULL;
+    int ok = 0;
+
+    memset(sb, 0, sizeof(*sb));
+    if (!opts)
+        opts = &default_opts;
+    if (!imageUrl)
+        imageUrl = "storyboard.jpg";
+
+    int64_t interval = opts->interval_us > 0 ? opts->interval_us : 0;
+    int index = open_video_input(filePath, !interval, &fmt_ctx);
+    if (index < 0)
+        return 0;
+    AVStream *st = fmt_ctx->streams[index];
+    int64_t duration = fmt_ctx->duration > 0 ? fmt_ctx->duration : 0;
+    if (!interval && !duration) {
+        fprintf(stderr, "Unknown duration of '%s', its storyboard needs an interval\n", filePath);
+        goto end;
+    }
+    int count = opts->count > 0 ? FFMIN(opts->count, STORYBOARD_MAX_TILES) : STORYBOARD_DEFAULT_COUNT;
+    if (interval && duration)
+        count = FFMIN(count, (duration + interval - 1) / interval);
+    int columns = FFMIN(opts->columns > 0 ? opts->columns : STORYBOARD_DEFAULT_COLUMNS, count);
+    int rows = (count + columns - 1) / columns;
+
+    // Even tile sizes keep every tile aligned to the 4:2:0 chroma
+    VideoThumbnailOptions box = {.width = opts->tile_width, .height = opts->tile_height};
+    if (box.width <= 0 && box.height <= 0)
+        box.width = STORYBOARD_DEFAULT_TILE_WIDTH;
+    int tw, th;
+    thumbnail_size(st->codecpar->width, st->codecpar->height, av_guess_sample_aspect_ratio(fmt_ctx, st, NULL),
+                   &box, &tw, &th);
+    tw &= ~1;
+    th &= ~1;
+    if (tw < 2 || th < 2 || (int64_t)tw * columns > STORYBOARD_MAX_SIZE || (int64_t)th * rows > STORYBOARD_MAX_SIZE) {
+        fprintf(stderr, "Storyboard of %d x %d tiles of %dx%d is too large for a JPEG\n", columns, rows, tw, th);
+        goto end;
+    }
+
+    if (!(dec = open_thumbnail_decoder(st, tw, th)) || !(frame = av_frame_alloc()) || !(atlas = av_frame_alloc()) ||
+        !(pkt = av_packet_alloc()) || !(prev = av_packet_alloc()) || !(sb->tiles = calloc(count, sizeof(*sb->tiles))))
+        goto end;
+    atlas->width = columns * tw;
+    atlas->height = rows * th;
+    atlas->format = AV_PIX_FMT_YUVJ420P;
+    if (av_frame_get_buffer(atlas, 0) < 0)
+        goto end;
+    // Black where a tile gets no frame
+    for (int plane = 0; plane < 3; plane++)
+        memset(atlas->data[plane], plane ? 128 : 0, (size_t)atlas->linesize[plane] * (atlas->height >> (plane > 0)));
+
+    // Each tile samples the middle of its span. Keyframes arrive in order, so
+    // once one is past a sample point, either it or the previous keyframe,
+    // which is kept, is the nearest.
+    int64_t start_time = fmt_ctx->start_time != AV_NOPTS_VALUE ? fmt_ctx->start_time : 0;
+    int64_t prev_us = 0, drawn_us = AV_NOPTS_VALUE;
+    int have_prev = 0, drawn = -1, n = 0;
+    while (n < count) {
+        int eof = av_read_frame(fmt_ctx, pkt) < 0;
+        int64_t pts = INT64_MAX;
+        if (!eof) {
+            int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+            if (pkt->stream_index != index || !(pkt->flags & AV_PKT_FLAG_KEY) || ts == AV_NOPTS_VALUE) {
+                av_packet_unref(pkt);
+                continue;
+            }
+            pts = av_rescale_q(ts, st->time_base, AV_TIME_BASE_Q) - start_time;
+        }
+        for (; n < count; n++) {
+            int64_t start, end;
+            tile_span(n, count, duration, interval, &start, &end);
+            int64_t target = start + (end - start) / 2;
+            if (!eof && pts < target)
+                break;
+            // A stream of unknown length ends with the span of its last keyframe
+            if (eof && (!have_prev || (!duration && start > prev_us)))
+                break;
+            int use_prev = have_prev && (eof || target - prev_us <= pts - target);
+            int64_t key_us = use_prev ? prev_us : pts;
+            if (key_us == drawn_us) {
+                copy_tile(atlas, drawn, n, columns, tw, th);
+            } else if (decode_packet(dec, use_prev ? prev : pkt, frame) >= 0 &&
+                       draw_tile(&sws, frame, atlas, n, columns, tw, th) >= 0) {
+                drawn = n;
+                drawn_us = key_us;
+            }
+            av_frame_unref(frame);
+            sb->tiles[n] = (StoryboardTile){start, end, n % columns * tw, n / columns * th};
+        }
+        if (eof)
+            break;
+        av_packet_unref(prev);
+        av_packet_move_ref(prev, pkt);
+        prev_us = pts;
+        have_prev = 1;
+    }
+    if (drawn < 0) {
+        fprintf(stderr, "Could not decode a keyframe of '%s'\n", filePath);
+        goto end;
+    }
+
+    sb->count = n;
+    sb->tile_width = tw;
+    sb->tile_height = th;
+    sb->columns = columns;
+    sb->width = FFMIN(n, columns) * tw;
+    sb->height = (n + columns - 1) / columns * th;
+    // Only the filled part of the atlas is encoded
+    atlas->width = sb->width;
+    atlas->height = sb->height;
+    int quality = opts->quality > 0 && opts->quality <= 100 ? opts->quality : THUMB_DEFAULT_QUALITY;
+    if (encode_jpeg(atlas, quality, NULL, 0, &sb->jpeg, &sb->jpeg_size) < 0)
+        goto end;
+    sb->vtt = storyboard_vtt(sb, imageUrl);
+    sb->json = storyboard_json(sb, imageUrl);
+    ok = sb->vtt && sb->json;
+
+end:
+    if (!ok)
+        FreeStoryboard(sb);
+    sws_freeContext(sws);
+    av_packet_free(&prev);
+    av_packet_free(&pkt);
+    av_frame_free(&atlas);
+    av_frame_free(&frame);
+    avcodec_free_context(&dec);
+    avformat_close_input(&fmt_ctx);
+    return ok;
+}
+
+void FreeStoryboard(Storyboard* sb) {
+    free(sb->jpeg);
+    free(sb->tiles);
+    free(sb->vtt);
+    free(sb->json);
+    memset(sb, 0, sizeof(*sb));
+}
+
+#ifdef TEST_THUMBNAIL_VIDEO
+/*
+ * Latency check: grabs the thumbnail a few times and prints the time per
+ * call. With "storyboard" instead of a percentage it times one storyboard,
+ * writes its atlas and prints the WebVTT index.
+ *
+ *   cc -DTEST_THUMBNAIL_VIDEO -O2 thumbnail_video.c thumbnail_jpeg.c thumbnail_scale.c -o thumb_bench \
+ *      $(pkg-config --cflags --libs libavformat libavcodec libswscale libavutil libjpeg) -lpthread
+ *   ./thumb_bench input.mp4 [percent [output.jpg]]
+ *   ./thumb_bench input.mp4 storyboard [storyboard.jpg]
+ */
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s input [percent [output.jpg]]\n", argv[0]);
+        return 2;
+    }
+    if (argc > 2 && !strcmp(argv[2], "storyboard")) {
+        Storyboard sb;
+        int64_t start = av_gettime_relative();
+        if (!GetVideoStoryboard(argv[1], argc > 3 ? argv[3] : NULL, NULL, &sb))
+            return 1;
+        fprintf(stderr, "%d tiles, %dx%d, %zu bytes in %.1f ms\n", sb.count, sb.width, sb.height, sb.jpeg_size,
+                (av_gettime_relative() - start) / 1000.0);
+        FILE *f = fopen(argc > 3 ? argv[3] : "storyboard.jpg", "wb");
+        if (!f || fwrite(sb.jpeg, 1, sb.jpeg_size, f) != sb.jpeg_size)
+            return 1;
+        fclose(f);
+        fputs(sb.vtt, stdout);
+        FreeStoryboard(&sb);
+        return 0;
+    }
+    VideoThumbnailOptions opts = {.percent = argc > 2 ? atof(argv[2]) : 10};
+    unsigned char *jpeg = NULL;
+    size_t size = 0;
+
+    for (int run = 0; run < 5; run++) {
+        free(jpeg);
+        int64_t start = av_gettime_relative();
+        if (!GetVideoThumbnailJPEGBuffer(argv[1], &opts, &jpeg, &size))
+            return 1;
+        printf("run %d: %zu bytes in %.1f ms\n", run, size, (av_gettime_relative() - start) / 1000.0);
+    }
+    if (argc > 3) {
+        FILE *f = fopen(argv[3], "wb");
+        if (!f || fwrite(jpeg, 1, size, f) != size)
+            return 1;
+        fclose(f);
+    }
+    free(jpeg);
+    return 0;
+}
+#endif
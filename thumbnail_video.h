@@ -0,0 +1,76 @@
+// thumbnail_video.h
+#ifndef THUMBNAIL_VIDEO_H
+#define THUMBNAIL_VIDEO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Where and how large to grab a video thumbnail. A zeroed struct takes the
+// keyframe at the start of the file, scaled to fit 256x256.
+typedef struct {
+    int64_t timestamp_us; // seek target from the start of the file, used when percent is 0
+    double percent;       // seek target in percent of the duration, 0 = use timestamp_us
+    int width;            // bounding box, the aspect ratio is kept; 0 = derived from the other side
+    int height;           // both 0 = 256x256
+    int quality;          // JPEG quality 1-100, 0 = 85
+} VideoThumbnailOptions;
+
+// Seeks to the keyframe at or before the target and decodes only that frame,
+// at reduced resolution where the decoder supports it, then scales it and
+// encodes it as JPEG in memory. Returns 1 on success, 0 on failure.
+// jpegBuffer is allocated with malloc (use free to release), size: jpegSize.
+int GetVideoThumbnailJPEGBuffer(const char* filePath, const VideoThumbnailOptions* opts,
+                                unsigned char** jpegBuffer, size_t* jpegSize);
+
+// The same, encoded straight into the caller's buf when it fits in cap.
+// *spill is NULL then, otherwise a malloc'd buffer holding the JPEG.
+int GetVideoThumbnailJPEGInto(const char* filePath, const VideoThumbnailOptions* opts, unsigned char* buf, size_t cap,
+                              unsigned char** spill, size_t* jpegSize);
+
+// Layout of a storyboard, a grid of evenly spaced frames in one JPEG for
+// scrubbing previews. A zeroed struct takes 100 frames over the duration,
+// 10 per row, each fitted into 160 pixels width.
+typedef struct {
+    int count;            // frames, 0 = 100; with interval_us the maximum
+    int64_t interval_us;  // time between frames, 0 = duration / count
+    int columns;          // tiles per row, 0 = 10
+    int tile_width;       // bounding box of a tile, the aspect ratio is kept;
+    int tile_height;      // both 0 = 160 wide
+    int quality;          // JPEG quality 1-100, 0 = 85
+} StoryboardOptions;
+
+// Tile i covers [start_us, end_us) and sits at x, y in the atlas.
+typedef struct {
+    int64_t start_us;
+    int64_t end_us;
+    int x;
+    int y;
+} StoryboardTile;
+
+typedef struct {
+    unsigned char* jpeg;  // the atlas
+    size_t jpeg_size;
+    int width;            // atlas size
+    int height;
+    int tile_width;
+    int tile_height;
+    int columns;
+    int count;            // tiles filled, row major
+    StoryboardTile* tiles;
+    char* vtt;            // WebVTT index, one cue per tile: imageUrl#xywh=x,y,w,h
+    char* json;           // the same as JSON
+} Storyboard;
+
+// Builds a storyboard in one forward pass over the keyframes, without
+// seeking: each sample point takes the keyframe nearest to it, decoded at
+// reduced resolution where possible and scaled straight into its tile of an
+// atlas allocated once, which is encoded at the end. Memory depends on the
+// atlas size only, not on the length of the video. A duration is needed
+// unless opts->interval_us is set, then a stream of unknown length fills at
+// most count tiles. imageUrl is what the index refers to, NULL =
+// "storyboard.jpg". Returns 1 on success, 0 on failure; release the result
+// with FreeStoryboard.
+int GetVideoStoryboard(const char* filePath, const char* imageUrl, const StoryboardOptions* opts, Storyboard* sb);
+void FreeStoryboard(Storyboard* sb);
+
+#endif // THUMBNAIL_VIDEO_H
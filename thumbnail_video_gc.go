@@ -0,0 +1,152 @@
+package avwrapper
+
+/*
+#cgo pkg-config: libswscale libjpeg
+#include <stdlib.h>
+#include "thumbnail_video.h"
+*/
+import "C"
+import (
+    "errors"
+    "time"
+    "unsafe"
+)
+
+// ErrThumbnail is returned when no thumbnail could be extracted.
+var ErrThumbnail = errors.New("avwrapper: could not extract thumbnail")
+
+// ThumbnailOptions mirrors the C VideoThumbnailOptions. The zero value takes
+// the first keyframe, scaled to fit 256x256 at JPEG quality 85.
+type ThumbnailOptions struct {
+    TimestampUs int64   // seek target, used when Percent is 0
+    Percent     float64 // seek target in percent of the duration
+    Width       int     // bounding box, 0 = derived from Height
+    Height      int     // bounding box, 0 = derived from Width
+    Quality     int     // JPEG quality 1-100, 0 = 85
+}
+
+// videoThumbnails recycles the buffers VideoThumbnail encodes into.
+var videoThumbnails bufferPool
+
+// VideoThumbnail returns a JPEG of the keyframe at or before the target of
+// opts, decoding only that frame. The JPEG is encoded straight into a pooled
+// buffer, or handed over in C memory when it did not fit; either way nothing
+// is copied. Call Release when done with it.
+func VideoThumbnail(filename string, opts *ThumbnailOptions) (*Thumbnail, error) {
+    cFilename := C.CString(filename)
+    defer C.free(unsafe.Pointer(cFilename))
+
+    var copts C.VideoThumbnailOptions
+    if opts != nil {
+        copts.timestamp_us = C.int64_t(opts.TimestampUs)
+        copts.percent = C.double(opts.Percent)
+        copts.width = C.int(opts.Width)
+        copts.height = C.int(opts.Height)
+        copts.quality = C.int(opts.Quality)
+    }
+    buf := videoThumbnails.get()
+    var spill *C.uchar
+    var size C.size_t
+    if C.GetVideoThumbnailJPEGInto(cFilename, &copts, (*C.uchar)(unsafe.Pointer(&(*buf)[0])), C.size_t(len(*buf)),
+        &spill, &size) == 0 {
+        videoThumbnails.put(buf)
+        return nil, ErrThumbnail
+    }
+    if spill != nil {
+        videoThumbnails.put(buf)
+        videoThumbnails.grow(int(size))
+        return cThumbnail((*C.uint8_t)(unsafe.Pointer(spill)), size), nil
+    }
+    return &Thumbnail{Bytes: (*buf)[:size], pool: &videoThumbnails, buf: buf}, nil
+}
+
+// StoryboardOptions mirrors the C StoryboardOptions. The zero value takes
+// 100 frames over the duration, 10 per row, each 160 pixels wide.
+type StoryboardOptions struct {
+    Count      int           // frames, 0 = 100; with Interval the maximum
+    Interval   time.Duration // time between frames, 0 = duration / Count
+    Columns    int           // tiles per row, 0 = 10
+    TileWidth  int           // bounding box of a tile, 0 = derived from TileHeight
+    TileHeight int           // bounding box of a tile, 0 = derived from TileWidth
+    Quality    int           // JPEG quality 1-100, 0 = 85
+}
+
+// StoryboardTile is the span of the video a tile stands for and its
+// position in the atlas.
+type StoryboardTile struct {
+    Start time.Duration
+    End   time.Duration
+    X     int
+    Y     int
+}
+
+// Storyboard is a grid of evenly spaced frames in one JPEG with its index.
+// The atlas is handed over in C memory; call Release when done with it.
+type Storyboard struct {
+    JPEG       *Thumbnail // the atlas
+    Width      int
+    Height     int
+    TileWidth  int
+    TileHeight int
+    Columns    int
+    Tiles      []StoryboardTile
+    WebVTT     string // one cue per tile referring to imageURL#xywh=x,y,w,h
+    JSON       string // the same as JSON
+}
+
+// VideoStoryboard builds a storyboard in one forward pass over the
+// keyframes of filename, without seeking. imageURL is the name of the atlas
+// in the index, "" = "storyboard.jpg".
+func VideoStoryboard(filename, imageURL string, opts *StoryboardOptions) (*Storyboard, error) {
+    cFilename := C.CString(filename)
+    defer C.free(unsafe.Pointer(cFilename))
+    var cImageURL *C.char
+    if imageURL != "" {
+        cImageURL = C.CString(imageURL)
+        defer C.free(unsafe.Pointer(cImageURL))
+    }
+
+    var copts C.StoryboardOptions
+    if opts != nil {
+        copts.count = C.int(opts.Count)
+        copts.interval_us = C.int64_t(opts.Interval.Microseconds())
+        copts.columns = C.int(opts.Columns)
+        copts.tile_width = C.int(opts.TileWidth)
+        copts.tile_height = C.int(opts.TileHeight)
+        copts.quality = C.int(opts.Quality)
+    }
+    var csb C.Storyboard
+    if C.GetVideoStoryboard(cFilename, cImageURL, &copts, &csb) == 0 {
+        return nil, ErrThumbnail
+    }
+    // The atlas changes owner, FreeStoryboard releases the rest
+    atlas := cThumbnail((*C.uint8_t)(unsafe.Pointer(csb.jpeg)), csb.jpeg_size)
+    csb.jpeg = nil
+    defer C.FreeStoryboard(&csb)
+
+    sb := &Storyboard{
+        JPEG:       atlas,
+        Width:      int(csb.width),
+        Height:     int(csb.height),
+        TileWidth:  int(csb.tile_width),
+        TileHeight: int(csb.tile_height),
+        Columns:    int(csb.columns),
+        Tiles:      make([]StoryboardTile, int(csb.count)),
+        WebVTT:     C.GoString(csb.vtt),
+        JSON:       C.GoString(csb.json),
+    }
+    for i, t := range unsafe.Slice(csb.tiles, int(csb.count)) {
+        sb.Tiles[i] = StoryboardTile{
+            Start: time.Duration(t.start_us) * time.Microsecond,
+            End:   time.Duration(t.end_us) * time.Microsecond,
+            X:     int(t.x),
+            Y:     int(t.y),
+        }
+    }
+    return sb, nil
+}
+
+// Release frees the atlas. The Storyboard index stays valid.
+func (sb *Storyboard) Release() {
+    sb.JPEG.Release()
+}
@@ -1,3 +1,7 @@
+//go:build ignore
+
+// Standalone Windows C++ sample (Shell thumbnails through GDI+). It is kept
+// out of the cgo build, os_thumbnail.c holds the thumbnail code the package uses.
 #include <windows.h>
 #include <shobjidl.h>
 #include <gdiplus.h>